@@ -0,0 +1,139 @@
+
+// Two-view geometry for many pairs of images in one call, e.g. for all
+// the pairs matched by a PairMatcher, rather than one call from Ruby per
+// pair.  The pairs are spread over cv::parallel_for_ in a few stripes
+// per thread;  each stripe estimates its pairs in turn with a single
+// CvffiEstimatorWorkspace, so the buffers are allocated once per stripe
+// rather than once per pair.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+
+#include "cvffi_modelest.h"
+#include "cvffi_fundam.h"
+
+using namespace cv;
+
+// Enough stripes to even out pairs of different sizes, few enough that
+// each workspace is reused over several pairs
+static const int BATCH_STRIPES_PER_THREAD = 4;
+
+class BatchEstimateBody : public ParallelLoopBody {
+public:
+  BatchEstimateBody( bool homography, const CvMat** points1, const CvMat** points2,
+                     CvMat** models, int method, double param1, double param2, int maxIters,
+                     CvMat** masks, const CvMat** quality, int64 seed, CvFundamentalResult *results )
+    : _homography( homography ), _points1( points1 ), _points2( points2 ), _models( models ),
+      _method( method ), _param1( param1 ), _param2( param2 ), _maxIters( maxIters ),
+      _masks( masks ), _quality( quality ), _seed( seed ), _results( results )
+  {;}
+
+  virtual void operator()( const Range &range ) const
+  {
+    CvffiEstimatorWorkspace workspace;
+
+    for( int i = range.start; i < range.end; i++ ) {
+      CvMat *mask = _masks ? _masks[i] : NULL;
+      const CvMat *quality = _quality ? _quality[i] : NULL;
+
+      // Each pair's seed depends only on its index, not on the stripe
+      // it falls in
+      int64 seed = _seed ? _seed + i : 0;
+
+      // cvEstimateHomography asserts at least 4 points;  a pair with
+      // fewer just fails
+      if( _homography && MAX(_points1[i]->rows, _points1[i]->cols) < 4 ) {
+        _results[i].retval = 0;
+        _results[i].num_iters = 0;
+        _results[i].max_iters = false;
+        _results[i].num_rejected = 0;
+      }
+      else if( _homography )
+        cvEstimateHomographyWithQuality( _points1[i], _points2[i], _models[i], _method,
+            _param1, _maxIters, mask, quality, seed, &workspace, &_results[i] );
+      else
+        cvEstimateFundamentalWithQuality( _points1[i], _points2[i], _models[i], _method,
+            _param1, _param2, _maxIters, mask, quality, seed, &workspace, &_results[i] );
+    }
+  }
+
+private:
+  bool _homography;
+  const CvMat **_points1, **_points2;
+  CvMat **_models;
+  int _method;
+  double _param1, _param2;
+  int _maxIters;
+  CvMat **_masks;
+  const CvMat **_quality;
+  int64 _seed;
+  CvFundamentalResult *_results;
+};
+
+// Checks every pair up front, with the same tests the estimators and
+// runPROSAC make, so that a bad one fails the call here rather than
+// part way through on a worker thread
+static void checkBatch( int count, const CvMat** points1, const CvMat** points2,
+                        CvMat** models, CvMat** masks, const CvMat** quality )
+{
+  CV_Assert( count >= 0 && (count == 0 || (points1 && points2 && models)) );
+
+  for( int i = 0; i < count; i++ ) {
+    CV_Assert( CV_IS_MAT(points1[i]) && CV_IS_MAT(points2[i]) &&
+               CV_ARE_SIZES_EQ(points1[i], points2[i]) );
+    CV_Assert( CV_IS_MAT(models[i]) && models[i]->rows == 3 && models[i]->cols == 3 );
+
+    int n = MAX( points1[i]->rows, points1[i]->cols );
+    const CvMat *mask = masks ? masks[i] : NULL, *q = quality ? quality[i] : NULL;
+    CV_Assert( !mask || (CV_IS_MASK_ARR(mask) && CV_IS_MAT_CONT(mask->type) &&
+                         (mask->rows == 1 || mask->cols == 1) && mask->rows*mask->cols == n) );
+    CV_Assert( !q || (CV_IS_MAT(q) && CV_IS_MAT_CONT(q->type) && CV_MAT_CN(q->type) == 1 &&
+                      q->rows*q->cols == n) );
+  }
+}
+
+static void runBatch( bool homography, int count, const CvMat** points1, const CvMat** points2,
+                      CvMat** models, int method, double param1, double param2, int maxIters,
+                      CvMat** masks, const CvMat** quality, int64 seed, CvFundamentalResult *results )
+{
+  if( count == 0 )
+    return;
+
+  // The pairs already keep the threads busy
+  method &= ~CV_RANSAC_PARALLEL;
+
+  int stripes = MIN( count, getNumThreads()*BATCH_STRIPES_PER_THREAD );
+  parallel_for_( Range( 0, count ),
+                 BatchEstimateBody( homography, points1, points2, models, method, param1, param2,
+                                    maxIters, masks, quality, seed, results ),
+                 stripes );
+}
+
+extern "C" {
+
+  // Estimates a fundamental matrix for each of count pairs of point
+  // sets, points1[i] and points2[i], into the 3x3 fmatrices[i], with the
+  // arguments of cvEstimateFundamentalWithQuality.  masks and quality
+  // (or any of their entries) may be NULL.  Pair i is seeded with
+  // seed + i if seed is non-zero, and CV_RANSAC_PARALLEL is ignored.
+  CV_IMPL void cvEstimateFundamentalBatch( int count, const CvMat** points1, const CvMat** points2,
+      CvMat** fmatrices, int method, double param1, double param2, int max_iters,
+      CvMat** masks, const CvMat** quality, int64 seed, CvFundamentalResult *results )
+  {
+    checkBatch( count, points1, points2, fmatrices, masks, quality );
+    runBatch( false, count, points1, points2, fmatrices, method, param1, param2,
+              max_iters, masks, quality, seed, results );
+  }
+
+  // As cvEstimateFundamentalBatch, for homographies from objectPoints[i]
+  // to imagePoints[i]
+  CV_IMPL void cvEstimateHomographyBatch( int count, const CvMat** objectPoints, const CvMat** imagePoints,
+      CvMat** H, int method, double ransacReprojThreshold, int max_iters,
+      CvMat** masks, const CvMat** quality, int64 seed, CvFundamentalResult *results )
+  {
+    checkBatch( count, objectPoints, imagePoints, H, masks, quality );
+    runBatch( true, count, objectPoints, imagePoints, H, method, ransacReprojThreshold, 0,
+              max_iters, masks, quality, seed, results );
+  }
+
+}
@@ -48,6 +48,9 @@
 
 #define CV_DEGENSAC 9
 
+// Deliberately clear of the bits tested by (method & ~3) == CV_RANSAC
+#define CV_PROSAC 16
+
 #ifndef _CVFFI_FUNDAM_H
 #define _CVFFI_FUNDAM_H
 
@@ -76,7 +79,45 @@ namespace cv {
     protected:
       virtual void computeReprojError( const CvMat* m1, const CvMat* m2,
           const CvMat* model, CvMat* error );
+      virtual int findInliers( const CvMat* m1, const CvMat* m2,
+                               const CvMat* model, CvMat* error,
+                               CvMat* mask, double threshold );
+      virtual int runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* model );
+
+  };
+
+  /* DEGENSAC (Chum, Werner and Matas, "Two-view Geometry Estimation
+     Unaffected by a Dominant Plane", CVPR 2005), in degensac.cpp */
+  class DegensacEstimator : public FundamentalEstimator
+  {
+    public:
+      DegensacEstimator( int _max_iters = 0 );
+    protected:
+      virtual int checkDegeneracy( const CvMat* ms1, const CvMat* ms2,
+                                   const CvMat* m1, const CvMat* m2, CvMat* model,
+                                   CvMat* mask, int goodCount, double threshold );
+      virtual int runPlaneAndParallax( const CvMat* m1, const CvMat* m2, const double* H,
+                                       CvMat* model, CvMat* mask, int goodCount, double threshold );
+  };
 
+  /* Essential matrix from five points in normalized image coordinates
+     (Stewenius, Engels and Nister, "Recent Developments on Direct
+     Relative Orientation", ISPRS J. 2006), in essential.cpp */
+  class EssentialEstimator : public CvffiModelEstimator2
+  {
+    public:
+      EssentialEstimator( int _max_iters = 0 );
+
+      virtual int runKernel( const CvMat* m1, const CvMat* m2, CvMat* model );
+      virtual int run5Point( const CvMat* m1, const CvMat* m2, CvMat* model );
+      virtual int run8Point( const CvMat* m1, const CvMat* m2, CvMat* model );
+    protected:
+      virtual void computeReprojError( const CvMat* m1, const CvMat* m2,
+          const CvMat* model, CvMat* error );
+      virtual int findInliers( const CvMat* m1, const CvMat* m2,
+                               const CvMat* model, CvMat* error,
+                               CvMat* mask, double threshold );
+      virtual int runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* model );
   };
 
   class HomographyEstimator : public CvffiModelEstimator2
@@ -90,6 +131,10 @@ namespace cv {
     protected:
       virtual void computeReprojError( const CvMat* m1, const CvMat* m2,
                                        const CvMat* model, CvMat* error );
+      virtual int findInliers( const CvMat* m1, const CvMat* m2,
+                               const CvMat* model, CvMat* error,
+                               CvMat* mask, double threshold );
+      virtual int runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* model );
       virtual bool isMinimalSetConsistent( const CvMat* m1, const CvMat* m2 );
       virtual bool weakConstraint ( const CvMat* srcPoints, const CvMat* dstPoints, int t1, int t2, int t3 );
   };
@@ -101,6 +146,9 @@ extern "C" {
     int retval;
     int num_iters;
     bool max_iters;
+
+    // Hypotheses rejected early by CV_RANSAC_SPRT
+    int num_rejected;
   };
 
 
@@ -113,6 +161,51 @@ extern "C" {
   CV_IMPL void cvEstimateHomography( const CvMat* objectPoints, const CvMat* imagePoints,
       CvMat* __H, int method, double ransacReprojThreshold, int max_iters,
       CvMat* mask, CvFundamentalResult *result );
+
+  /* As above, with a quality score per correspondence (higher is
+     better) for CV_PROSAC to rank them by.  quality may be NULL.  A
+     non-zero seed makes the result repeatable, and a workspace from
+     cvCreateEstimatorWorkspace saves allocating buffers on each call
+     (NULL to allocate them). */
+  CV_IMPL void cvEstimateFundamentalWithQuality( const CvMat* points1, const CvMat* points2,
+      CvMat* fmatrix, int method,
+      double param1, double param2, int max_iters,  CvMat* mask,
+      const CvMat* quality, int64 seed, CvffiEstimatorWorkspace* workspace,
+      CvFundamentalResult *result );
+
+  CV_IMPL void cvEstimateHomographyWithQuality( const CvMat* objectPoints, const CvMat* imagePoints,
+      CvMat* __H, int method, double ransacReprojThreshold, int max_iters,
+      CvMat* mask, const CvMat* quality, int64 seed, CvffiEstimatorWorkspace* workspace,
+      CvFundamentalResult *result );
+
+  /* The essential matrix of two views from one camera, from points in
+     pixels and its 3x3 camera matrix, in essential.cpp.  param1 is the
+     inlier threshold in pixels.  With five points, ematrix may have 3*n
+     rows for up to n of the (at most 10) solutions. */
+  CV_IMPL void cvEstimateEssential( const CvMat* points1, const CvMat* points2,
+      const CvMat* cameraMatrix, CvMat* ematrix, int method,
+      double param1, double param2, int max_iters, CvMat* mask,
+      CvFundamentalResult *result );
+
+  CV_IMPL void cvEstimateEssentialWithQuality( const CvMat* points1, const CvMat* points2,
+      const CvMat* cameraMatrix, CvMat* ematrix, int method,
+      double param1, double param2, int max_iters, CvMat* mask,
+      const CvMat* quality, int64 seed, CvffiEstimatorWorkspace* workspace,
+      CvFundamentalResult *result );
+
+  /* Estimates a model for each of count pairs of point sets at once,
+     in parallel, in batch.cpp */
+  CV_IMPL void cvEstimateFundamentalBatch( int count, const CvMat** points1, const CvMat** points2,
+      CvMat** fmatrices, int method, double param1, double param2, int max_iters,
+      CvMat** masks, const CvMat** quality, int64 seed, CvFundamentalResult *results );
+
+  CV_IMPL void cvEstimateHomographyBatch( int count, const CvMat** objectPoints, const CvMat** imagePoints,
+      CvMat** H, int method, double ransacReprojThreshold, int max_iters,
+      CvMat** masks, const CvMat** quality, int64 seed, CvFundamentalResult *results );
+
+  /* Buffers for up to maxCount correspondences, for one thread at a time */
+  CV_IMPL CvffiEstimatorWorkspace* cvCreateEstimatorWorkspace( int maxCount );
+  CV_IMPL void cvReleaseEstimatorWorkspace( CvffiEstimatorWorkspace** workspace );
 }
 
 #endif /* _CVFFI_FUNDAM_H */
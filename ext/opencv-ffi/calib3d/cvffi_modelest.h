@@ -44,6 +44,56 @@
 #define _CV_FFI_EXT_MODEL_EST_H_
 
 #include <opencv2/core/core.hpp>
+#include <vector>
+
+// Options for the RANSAC-style methods, or'ed into the method passed
+// to cvEstimateFundamental and cvEstimateHomography:
+//
+//   CV_RANSAC_SPRT  verify hypotheses with Wald's sequential probability
+//                   ratio test, dropping bad ones after a few points
+//   CV_RANSAC_LO    locally optimise each new best model from its
+//                   inliers (LO-RANSAC)
+//   CV_RANSAC_PARALLEL
+//                   draw and score RANSAC hypotheses on cv::getNumThreads()
+//                   workers; the result depends only on the seed and the
+//                   number of threads.  Ignores CV_RANSAC_SPRT.
+#define CV_RANSAC_SPRT     0x100
+#define CV_RANSAC_LO       0x200
+#define CV_RANSAC_PARALLEL 0x400
+#define CV_RANSAC_OPTIONS  0xf00
+
+// In modelest.cpp, as declared in opencv2/calib3d/calib3d.hpp
+CVAPI(int) cvRANSACUpdateNumIters( double p, double err_prob,
+                                   int model_points, int max_iters );
+
+// Buffers for the estimators, each allocated when first used with room
+// for maxCount correspondences, and kept from one estimation to the
+// next, so that estimating many models in a row doesn't go through the
+// allocator each time.  Grows if given more correspondences.  Not to be
+// shared between threads.
+class CvffiEstimatorWorkspace
+{
+public:
+    enum { MASK, TMASK, ERR, MODELS, SAMPLE1, SAMPLE2,
+           POINTS1, POINTS2, POINTS_MASK, QUALITY, ORDER, INLIER_COUNTS, MIN_INLIERS,
+           SPRT_POINTS1, SPRT_POINTS2, SPRT_ERR, SPRT_ORDER,
+           LO_POINTS1, LO_POINTS2, LO_LSQ1, LO_LSQ2, LO_ERR, LO_MASK, LO_MODEL,
+           PARALLAX_ERR, PARALLAX_MASK, PARALLAX_POINTS,
+           SLOTS };
+
+    CvffiEstimatorWorkspace( int maxCount = 0 );
+    void reserve( int maxCount );
+
+    // A rows x cols matrix in the given slot, good until the slot is
+    // next asked for
+    CvMat* get( int slot, int rows, int cols, int type );
+
+    int maxCount;
+
+private:
+    std::vector<double> buffers[SLOTS];
+    CvMat headers[SLOTS];
+};
 
 class CvffiModelEstimator2
 {
@@ -58,18 +108,53 @@ public:
     virtual bool runRANSAC( const CvMat* m1, const CvMat* m2, CvMat* model,
                             CvMat* mask, int &totalIters,
                             double threshold, double confidence=0.99 );
+    virtual bool runPROSAC( const CvMat* m1, const CvMat* m2, CvMat* model,
+                            CvMat* mask, int &totalIters,
+                            double threshold, double confidence=0.99,
+                            const CvMat* quality=0 );
     virtual bool refine( const CvMat*, const CvMat*, CvMat*, int ) { return true; }
     virtual void setSeed( int64 seed );
+    virtual void setFlags( int flags );
+    virtual void setWorkspace( CvffiEstimatorWorkspace* workspace );
+
+    // Hypotheses the SPRT rejected early in the last runRANSAC or
+    // runPROSAC, 0 without CV_RANSAC_SPRT
+    int getSprtRejections() const { return sprtRejections; }
 
 protected:
+    struct SprtState;
+    struct RansacWorker;
+
+    CvffiEstimatorWorkspace& ws();
+
+    virtual bool runParallelRANSAC( const CvMat* m1, const CvMat* m2, CvMat* model,
+                                    CvMat* mask, int &totalIters,
+                                    double threshold, double confidence );
+
     virtual void computeReprojError( const CvMat* m1, const CvMat* m2,
                                      const CvMat* model, CvMat* error ) = 0;
     virtual int findInliers( const CvMat* m1, const CvMat* m2,
                              const CvMat* model, CvMat* error,
                              CvMat* mask, double threshold );
+    virtual int findInliersSPRT( const CvMat* model, double threshold,
+                                 CvMat* mask, SprtState& sprt );
+    virtual int runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* model );
+    virtual int localOptimize( const CvMat* m1, const CvMat* m2, CvMat* model,
+                               CvMat* mask, int goodCount, double threshold );
+    virtual int checkDegeneracy( const CvMat* ms1, const CvMat* ms2,
+                                 const CvMat* m1, const CvMat* m2, CvMat* model,
+                                 CvMat* mask, int goodCount, double threshold );
     virtual bool getSubset( const CvMat* m1, const CvMat* m2,
                             CvMat* ms1, CvMat* ms2, int maxAttempts=1000 );
+    bool getSubset( const CvMat* m1, const CvMat* m2,
+                    CvMat* ms1, CvMat* ms2, int maxAttempts, CvRNG& rng );
+    virtual bool getProsacSubset( const CvMat* m1, const CvMat* m2,
+                                  CvMat* ms1, CvMat* ms2, const int* order,
+                                  int n, bool includeLast, int maxAttempts=1000 );
     virtual bool checkSubset( const CvMat* ms1, int count );
+    int prosacNumIters( const int* inlierCounts, const int* minInliers,
+                        int n, int count, double confidence,
+                        const SprtState* sprt ) const;
 
     CvRNG rng;
     int modelPoints;
@@ -77,6 +162,11 @@ protected:
     int maxBasicSolutions;
     int maxIters;
     bool checkPartialSubsets;
+    int flags;
+    int sprtRejections;
+
+    CvffiEstimatorWorkspace* workspace;
+    cv::Ptr<CvffiEstimatorWorkspace> ownWorkspace;
 };
 
 #endif // _CV_MODEL_EST_H_
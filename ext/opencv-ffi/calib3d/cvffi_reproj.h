@@ -0,0 +1,29 @@
+
+#ifndef _CVFFI_REPROJ_H_
+#define _CVFFI_REPROJ_H_
+
+#include <opencv2/core/core_c.h>
+
+// Reprojection errors of count correspondences m1[i] <-> m2[i] under
+// one model, the inner loop of every RANSAC iteration, in
+// reproj_kernels.cpp.  err (if not NULL) gets each squared error as a
+// float, and mask (if not NULL) whether it is <= threshold, which is
+// already squared.  Each returns the number of inliers.
+//
+// The vector kernels do the same arithmetic in the same order as the
+// scalar ones, so they give the same errors to the bit.
+
+// max( d(x', Fx)^2, d(x, F^T x')^2 ), as FundamentalEstimator
+int cvffiEpipolarErrors( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                         const double* F, float* err, uchar* mask, double threshold );
+
+// d(x', Hx)^2 with H[8] taken to be 1, as HomographyEstimator
+int cvffiTransferErrors( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                         const double* H, float* err, uchar* mask, double threshold );
+
+// max( d(x', Hx)^2, d(x, H^-1 x')^2 ), as cvHMaxReprojError
+int cvffiSymmetricTransferErrors( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                                  const double* H, const double* Hinv,
+                                  float* err, uchar* mask, double threshold );
+
+#endif
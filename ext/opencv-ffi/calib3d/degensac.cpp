@@ -4,17 +4,220 @@
 
 using namespace cv;
 
-/************************************** 7-point algorithm *******************************/
-class DegensacEstimator : public FundamentalEstimator
+// DEGENSAC: when five or more of the seven points behind a new best F
+// lie on a plane, the 7-point solution is one of a family of matrices
+// consistent with the plane's homography, and RANSAC needs a sample
+// with two points off the plane to do better.  So each new best F is
+// checked for a homography, H = A - e'(M^-1 b)^T with A = [e']x F,
+// through each of five triplets of the sample (any five points include
+// one of them).  If five points fit H, F is recomputed from H and the
+// points off the plane, by plane-and-parallax: the epipole is where the
+// lines through x' and Hx of two such points meet, and F = [e']x H.
+
+static const int DEGENSAC_TRIPLETS[5][3] = { {0,1,2}, {3,4,5}, {0,1,6}, {3,4,6}, {2,5,6} };
+static const int DEGENSAC_PLANE_POINTS = 5;
+static const int DEGENSAC_PARALLAX_ITERS = 200;
+static const double DEGENSAC_CONFIDENCE = 0.99;
+
+static inline void cross3( const double* a, const double* b, double* c )
+{
+    c[0] = a[1]*b[2] - a[2]*b[1];
+    c[1] = a[2]*b[0] - a[0]*b[2];
+    c[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+// [e]x H
+static void crossMatrixTimes( const double* e, const double* H, double* F )
+{
+    for( int j = 0; j < 3; j++ )
+    {
+        F[j]   = e[1]*H[6+j] - e[2]*H[3+j];
+        F[3+j] = e[2]*H[j]   - e[0]*H[6+j];
+        F[6+j] = e[0]*H[3+j] - e[1]*H[j];
+    }
+}
+
+// Squared distance from m2 to H*m1, or DBL_MAX for a point at infinity
+static inline double transferError( const double* H, const CvPoint2D64f& m1, const CvPoint2D64f& m2 )
+{
+    double w = H[6]*m1.x + H[7]*m1.y + H[8];
+    if( fabs(w) < DBL_EPSILON )
+        return DBL_MAX;
+    w = 1./w;
+    double dx = (H[0]*m1.x + H[1]*m1.y + H[2])*w - m2.x;
+    double dy = (H[3]*m1.x + H[4]*m1.y + H[5])*w - m2.y;
+    return dx*dx + dy*dy;
+}
+
+// The epipole in the second image, the null vector of F^T, as the
+// largest cross product of two columns of F
+static bool leftEpipole( const double* F, double* e )
+{
+    double c[3][3], best = 0;
+    for( int j = 0; j < 3; j++ )
+        for( int i = 0; i < 3; i++ )
+            c[j][i] = F[i*3+j];
+
+    for( int j = 0; j < 3; j++ )
+    {
+        double t[3];
+        cross3( c[j], c[(j+1)%3], t );
+        double n = t[0]*t[0] + t[1]*t[1] + t[2]*t[2];
+        if( n > best )
+        {
+            best = n;
+            e[0] = t[0]; e[1] = t[1]; e[2] = t[2];
+        }
+    }
+    return best > DBL_EPSILON;
+}
+
+// The homography induced by F, through its epipole e and A = [e]x F,
+// and three correspondences
+static bool homographyFromTriplet( const double* e, const double* A,
+                                   const CvPoint2D64f* m1, const CvPoint2D64f* m2,
+                                   const int* idx, double* H )
 {
-  public:
-    DegensacEstimator( int _max_iters = 0 );
-  protected:
+    double M[9], b[3];
+    for( int k = 0; k < 3; k++ )
+    {
+        const CvPoint2D64f& p = m1[idx[k]];
+        const CvPoint2D64f& q = m2[idx[k]];
+        double x[3] = { p.x, p.y, 1. }, xp[3] = { q.x, q.y, 1. }, Ax[3], u[3], v[3];
+
+        for( int i = 0; i < 3; i++ )
+            Ax[i] = A[i*3]*x[0] + A[i*3+1]*x[1] + A[i*3+2]*x[2];
+        cross3( xp, Ax, u );
+        cross3( xp, e, v );
+
+        double vv = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+        if( vv < DBL_EPSILON )
+            return false;
+        b[k] = (u[0]*v[0] + u[1]*v[1] + u[2]*v[2])/vv;
+        M[k*3] = x[0]; M[k*3+1] = x[1]; M[k*3+2] = x[2];
+    }
+
+    // v = M^-1 b by Cramer's rule
+    double det = M[0]*(M[4]*M[8] - M[5]*M[7]) - M[1]*(M[3]*M[8] - M[5]*M[6]) + M[2]*(M[3]*M[7] - M[4]*M[6]);
+    if( fabs(det) < DBL_EPSILON )
+        return false;
+
+    double v[3];
+    for( int i = 0; i < 3; i++ )
+    {
+        double Mi[9];
+        memcpy( Mi, M, sizeof(Mi) );
+        Mi[i] = b[0]; Mi[3+i] = b[1]; Mi[6+i] = b[2];
+        v[i] = (Mi[0]*(Mi[4]*Mi[8] - Mi[5]*Mi[7]) - Mi[1]*(Mi[3]*Mi[8] - Mi[5]*Mi[6]) +
+                Mi[2]*(Mi[3]*Mi[7] - Mi[4]*Mi[6]))/det;
+    }
+
+    for( int i = 0; i < 3; i++ )
+        for( int j = 0; j < 3; j++ )
+            H[i*3+j] = A[i*3+j] - e[i]*v[j];
+    return true;
+}
 
-};
 
 DegensacEstimator::DegensacEstimator( int _max_iters )
     : FundamentalEstimator( 7, _max_iters )
 {
 }
 
+int DegensacEstimator::checkDegeneracy( const CvMat* ms1, const CvMat* ms2,
+                                        const CvMat* m1, const CvMat* m2, CvMat* model,
+                                        CvMat* mask, int goodCount, double threshold )
+{
+    if( ms1->rows*ms1->cols != 7 )
+        return goodCount;
+
+    const CvPoint2D64f* s1 = (const CvPoint2D64f*)ms1->data.ptr;
+    const CvPoint2D64f* s2 = (const CvPoint2D64f*)ms2->data.ptr;
+    const double* F = model->data.db;
+    double e[3], A[9], H[9];
+
+    if( !leftEpipole( F, e ) )
+        return goodCount;
+    crossMatrixTimes( e, F, A );
+
+    double t2 = threshold*threshold;
+    for( int t = 0; t < 5; t++ )
+    {
+        if( !homographyFromTriplet( e, A, s1, s2, DEGENSAC_TRIPLETS[t], H ) )
+            continue;
+
+        int onPlane = 0;
+        for( int i = 0; i < 7; i++ )
+            onPlane += transferError( H, s1[i], s2[i] ) <= t2;
+
+        if( onPlane >= DEGENSAC_PLANE_POINTS )
+            return runPlaneAndParallax( m1, m2, H, model, mask, goodCount, threshold );
+    }
+
+    return goodCount;
+}
+
+// RANSAC over pairs of the points off the plane of H, keeping F if
+// nothing does better than goodCount
+int DegensacEstimator::runPlaneAndParallax( const CvMat* _m1, const CvMat* _m2, const double* H,
+                                            CvMat* model, CvMat* mask, int goodCount, double threshold )
+{
+    int count = _m1->rows*_m1->cols;
+    const CvPoint2D64f* m1 = (const CvPoint2D64f*)_m1->data.ptr;
+    const CvPoint2D64f* m2 = (const CvPoint2D64f*)_m2->data.ptr;
+    double t2 = threshold*threshold;
+
+    CvffiEstimatorWorkspace& w = ws();
+    int* offPlane = w.get( CvffiEstimatorWorkspace::PARALLAX_POINTS, 1, count, CV_32SC1 )->data.i;
+    int n = 0;
+    for( int i = 0; i < count; i++ )
+        if( transferError( H, m1[i], m2[i] ) > t2 )
+            offPlane[n++] = i;
+
+    int planeCount = count - n;
+    if( n < 2 )
+        return goodCount;
+
+    CvMat* err = w.get( CvffiEstimatorWorkspace::PARALLAX_ERR, 1, count, CV_32FC1 );
+    CvMat* tmask = w.get( CvffiEstimatorWorkspace::PARALLAX_MASK, 1, count, CV_8UC1 );
+    double f[9];
+    CvMat _f = cvMat( 3, 3, CV_64FC1, f );
+
+    int niters = DEGENSAC_PARALLAX_ITERS;
+    for( int iter = 0; iter < niters; iter++ )
+    {
+        int i0 = offPlane[ cvRandInt(&rng) % n ], i1 = offPlane[ cvRandInt(&rng) % n ];
+        if( i0 == i1 )
+            continue;
+
+        double l[2][3], e[3];
+        for( int k = 0; k < 2; k++ )
+        {
+            const CvPoint2D64f& p = m1[k ? i1 : i0];
+            const CvPoint2D64f& q = m2[k ? i1 : i0];
+            double Hx[3], xp[3] = { q.x, q.y, 1. };
+            for( int i = 0; i < 3; i++ )
+                Hx[i] = H[i*3]*p.x + H[i*3+1]*p.y + H[i*3+2];
+            cross3( Hx, xp, l[k] );
+        }
+        cross3( l[0], l[1], e );
+        if( e[0]*e[0] + e[1]*e[1] + e[2]*e[2] < DBL_EPSILON )
+            continue;
+
+        crossMatrixTimes( e, H, f );
+        int c = findInliers( _m1, _m2, &_f, err, tmask, threshold );
+        if( c > goodCount )
+        {
+            cvCopy( &_f, model );
+            cvCopy( tmask, mask );
+            goodCount = c;
+
+            // Both points have to come from the inliers off the plane
+            double offInliers = MAX( goodCount - planeCount, 0 );
+            niters = cvRANSACUpdateNumIters( DEGENSAC_CONFIDENCE, 1. - offInliers/n,
+                                             2, DEGENSAC_PARALLAX_ITERS );
+        }
+    }
+
+    return goodCount;
+}
@@ -0,0 +1,370 @@
+
+// Essential matrix estimation for calibrated cameras, with the
+// five-point solver of Stewenius, Engels and Nister ("Recent
+// Developments on Direct Relative Orientation", ISPRS J. 2006) in the
+// cvffi RANSAC framework.  A minimal sample is five points rather than
+// seven, so far fewer samples are needed at a given outlier ratio.
+//
+// The points are taken to normalized image coordinates with the camera
+// matrix, where E plays the part of F.  Five correspondences leave a
+// four-dimensional null space, E = xX + yY + zZ + W;  the ten cubic
+// constraints det(E) = 0 and 2 E E^T E - trace(E E^T) E = 0 on (x,y,z)
+// are solved for their ten cubic monomials in terms of the ten of lower
+// degree, which gives the action of multiplication by x on those ten.
+// Its real eigenvectors are the solutions.
+
+#include "cvffi_modelest.h"
+#include "cvffi_fundam.h"
+#include "cvffi_reproj.h"
+
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/QR>
+#include <eigen3/Eigen/LU>
+#include <eigen3/Eigen/SVD>
+#include <eigen3/Eigen/Eigenvalues>
+
+using namespace cv;
+
+// Polynomials in x, y and z are kept as coefficients of monomials:
+//
+//   linear     x, y, z, 1
+//   quadratic  x^2, xy, xz, y^2, yz, z^2, x, y, z, 1
+//   cubic      x^3, x^2y, x^2z, xy^2, xyz, xz^2, y^3, y^2z, yz^2, z^3,
+//              then the ten quadratic monomials
+//
+// and these tables give the monomial of each product.
+static const int LINEAR_TIMES_LINEAR[4][4] = {
+    { 0, 1, 2, 6 }, { 1, 3, 4, 7 }, { 2, 4, 5, 8 }, { 6, 7, 8, 9 } };
+
+static const int QUADRATIC_TIMES_LINEAR[10][4] = {
+    { 0, 1, 2, 10 }, { 1, 3, 4, 11 }, { 2, 4, 5, 12 }, { 3, 6, 7, 13 }, { 4, 7, 8, 14 },
+    { 5, 8, 9, 15 }, { 10, 11, 12, 16 }, { 11, 13, 14, 17 }, { 12, 14, 15, 18 }, { 16, 17, 18, 19 } };
+
+// Imaginary parts of eigenvalues below this (relative) are rounding
+static const double FIVE_POINT_IMAG_EPS = 1e-8;
+
+static void linearTimesLinear( const double* a, const double* b, double* q )
+{
+    for( int i = 0; i < 10; i++ )
+        q[i] = 0;
+    for( int i = 0; i < 4; i++ )
+        for( int j = 0; j < 4; j++ )
+            q[ LINEAR_TIMES_LINEAR[i][j] ] += a[i]*b[j];
+}
+
+// c += q*l
+static void addQuadraticTimesLinear( const double* q, const double* l, double* c )
+{
+    for( int i = 0; i < 10; i++ )
+        for( int j = 0; j < 4; j++ )
+            c[ QUADRATIC_TIMES_LINEAR[i][j] ] += q[i]*l[j];
+}
+
+
+EssentialEstimator::EssentialEstimator( int _max_iters )
+    : CvffiModelEstimator2( 5, cvSize(3,3), 10, _max_iters )
+{
+}
+
+int EssentialEstimator::runKernel( const CvMat* m1, const CvMat* m2, CvMat* model )
+{
+    return run5Point( m1, m2, model );
+}
+
+int EssentialEstimator::run5Point( const CvMat* _m1, const CvMat* _m2, CvMat* _ematrix )
+{
+    Eigen::Matrix<double,9,5> At;
+    const CvPoint2D64f* m1 = (const CvPoint2D64f*)_m1->data.ptr;
+    const CvPoint2D64f* m2 = (const CvPoint2D64f*)_m2->data.ptr;
+    double* ematrix = _ematrix->data.db;
+    int i, j, k, n = 0;
+
+    // each point gives a column of At:  (m2[i], 1)'*E*(m1[i], 1) = 0
+    for( i = 0; i < 5; i++ )
+    {
+        double x0 = m1[i].x, y0 = m1[i].y;
+        double x1 = m2[i].x, y1 = m2[i].y;
+
+        At.col(i) << x1*x0, x1*y0, x1, y1*x0, y1*y0, y1, x0, y0, 1;
+    }
+
+    // the last four columns of Q in At = QR span the null space of A,
+    // E = x*X + y*Y + z*Z + W.  e[i] holds E[i] as a linear polynomial.
+    Eigen::Matrix<double,9,9> Q = Eigen::HouseholderQR< Eigen::Matrix<double,9,5> >( At ).householderQ();
+    double e[9][4];
+    for( i = 0; i < 9; i++ )
+        for( k = 0; k < 4; k++ )
+            e[i][k] = Q(i,5+k);
+
+    // the ten cubic constraints, one per row
+    Eigen::Matrix<double,10,20,Eigen::RowMajor> C = Eigen::Matrix<double,10,20,Eigen::RowMajor>::Zero();
+    double q[10];
+
+    // det(E)
+    static const int DET_TERMS[3][5] = { { 0, 4, 8, 5, 7 }, { 1, 5, 6, 3, 8 }, { 2, 3, 7, 4, 6 } };
+    for( i = 0; i < 3; i++ )
+    {
+        const int* t = DET_TERMS[i];
+        double minor[10], p[10];
+        linearTimesLinear( e[t[1]], e[t[2]], minor );
+        linearTimesLinear( e[t[3]], e[t[4]], p );
+        for( k = 0; k < 10; k++ )
+            minor[k] -= p[k];
+        addQuadraticTimesLinear( minor, e[t[0]], C.row(0).data() );
+    }
+
+    // 2 E E^T E - trace(E E^T) E = 2 (E E^T - trace(E E^T)/2 I) E
+    double EEt[3][3][10];
+    for( i = 0; i < 3; i++ )
+        for( j = 0; j <= i; j++ )
+        {
+            for( k = 0; k < 10; k++ )
+                EEt[i][j][k] = 0;
+            for( int l = 0; l < 3; l++ )
+            {
+                linearTimesLinear( e[i*3+l], e[j*3+l], q );
+                for( k = 0; k < 10; k++ )
+                    EEt[i][j][k] += q[k];
+            }
+            memcpy( EEt[j][i], EEt[i][j], sizeof(q) );
+        }
+
+    for( k = 0; k < 10; k++ )
+    {
+        double halfTrace = 0.5*(EEt[0][0][k] + EEt[1][1][k] + EEt[2][2][k]);
+        for( i = 0; i < 3; i++ )
+            EEt[i][i][k] -= halfTrace;
+    }
+
+    for( i = 0; i < 3; i++ )
+        for( j = 0; j < 3; j++ )
+            for( int l = 0; l < 3; l++ )
+                addQuadraticTimesLinear( EEt[i][l], e[l*3+j], C.row(1+i*3+j).data() );
+
+    // cubic monomials = -B * lower monomials
+    Eigen::FullPivLU< Eigen::Matrix<double,10,10> > lu( C.leftCols<10>() );
+    if( !lu.isInvertible() )
+        return 0;
+    Eigen::Matrix<double,10,10> B = lu.solve( C.rightCols<10>() );
+
+    // x times each lower monomial:  x^3, x^2y, x^2z, xy^2, xyz, xz^2 come
+    // from B, and x^2, xy, xz, x are lower monomials themselves
+    Eigen::Matrix<double,10,10> M = Eigen::Matrix<double,10,10>::Zero();
+    M.topRows<6>() = -B.topRows<6>();
+    M(6,0) = M(7,1) = M(8,2) = M(9,6) = 1;
+
+    Eigen::EigenSolver< Eigen::Matrix<double,10,10> > eigen( M );
+    if( eigen.info() != Eigen::Success )
+        return 0;
+
+    for( i = 0; i < 10; i++ )
+    {
+        std::complex<double> lambda = eigen.eigenvalues()(i);
+        if( fabs(lambda.imag()) > FIVE_POINT_IMAG_EPS*(1 + fabs(lambda.real())) )
+            continue;
+
+        // the eigenvector is the lower monomials at the solution, up to
+        // scale;  scale it so that its last entry, 1, is one
+        Eigen::Matrix<std::complex<double>,10,1> v = eigen.eigenvectors().col(i);
+        if( std::abs(v(9)) < DBL_EPSILON )
+            continue;
+        double x = (v(6)/v(9)).real(), y = (v(7)/v(9)).real(), z = (v(8)/v(9)).real();
+
+        double* E = ematrix + n*9, norm = 0;
+        for( k = 0; k < 9; k++ )
+        {
+            E[k] = x*e[k][0] + y*e[k][1] + z*e[k][2] + e[k][3];
+            norm += E[k]*E[k];
+        }
+        if( norm < DBL_EPSILON )
+            continue;
+
+        norm = 1./sqrt(norm);
+        for( k = 0; k < 9; k++ )
+            E[k] *= norm;
+        n++;
+    }
+
+    return n;
+}
+
+// Least squares over eight or more points:  the 8-point F of the
+// normalized points, with its two singular values made equal
+int EssentialEstimator::run8Point( const CvMat* m1, const CvMat* m2, CvMat* model )
+{
+    typedef Eigen::Matrix<double,3,3,Eigen::RowMajor> Matrix3;
+
+    if( m1->rows*m1->cols < 8 || FundamentalEstimator( 8 ).run8Point( m1, m2, model ) <= 0 )
+        return 0;
+
+    Eigen::Map<Matrix3> E( model->data.db );
+    Eigen::JacobiSVD<Matrix3> svd( E, Eigen::ComputeFullU | Eigen::ComputeFullV );
+    Eigen::Vector3d s( 1, 1, 0 );
+    E = svd.matrixU()*s.asDiagonal()*svd.matrixV().transpose();
+    return 1;
+}
+
+int EssentialEstimator::runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* model )
+{
+    return run8Point( m1, m2, model );
+}
+
+void EssentialEstimator::computeReprojError( const CvMat* m1, const CvMat* m2,
+                                             const CvMat* model, CvMat* err )
+{
+    cvffiEpipolarErrors( (const CvPoint2D64f*)m1->data.ptr, (const CvPoint2D64f*)m2->data.ptr,
+                         m1->rows*m1->cols, model->data.db, err->data.fl, 0, 0 );
+}
+
+int EssentialEstimator::findInliers( const CvMat* m1, const CvMat* m2,
+                                     const CvMat* model, CvMat* err,
+                                     CvMat* mask, double threshold )
+{
+    return cvffiEpipolarErrors( (const CvPoint2D64f*)m1->data.ptr, (const CvPoint2D64f*)m2->data.ptr,
+                                m1->rows*m1->cols, model->data.db, err ? err->data.fl : 0,
+                                mask->data.ptr, threshold*threshold );
+}
+
+
+/* Main C entry point */
+CV_IMPL void cvEstimateEssential( const CvMat* points1, const CvMat* points2,
+    const CvMat* cameraMatrix, CvMat* ematrix, int method,
+    double param1, double param2, int max_iters, CvMat* mask,
+    CvFundamentalResult *result )
+{
+  cvEstimateEssentialWithQuality( points1, points2, cameraMatrix, ematrix, method,
+      param1, param2, max_iters, mask, NULL, 0, NULL, result );
+}
+
+CV_IMPL void cvEstimateEssentialWithQuality( const CvMat* points1, const CvMat* points2,
+    const CvMat* cameraMatrix, CvMat* ematrix, int method,
+    double param1, double param2, int max_iters, CvMat* mask,
+    const CvMat* quality, int64 seed, CvffiEstimatorWorkspace* workspace,
+    CvFundamentalResult *result )
+{
+  int retval = 0;
+  CvMat *m1, *m2, *tempMask = 0;
+
+  result->max_iters = false;
+  result->num_iters = 0;
+  result->num_rejected = 0;
+
+  double E[3*3*10];
+  CvMat _E3x3 = cvMat( 3, 3, CV_64FC1, E );
+  int count;
+
+  int options = method & CV_RANSAC_OPTIONS;
+  method &= ~CV_RANSAC_OPTIONS;
+
+  CV_Assert( CV_IS_MAT(points1) && CV_IS_MAT(points2) && CV_ARE_SIZES_EQ(points1, points2) );
+  CV_Assert( CV_IS_MAT(cameraMatrix) && cameraMatrix->rows == 3 && cameraMatrix->cols == 3 );
+
+  count = MAX(points1->cols, points1->rows);
+  CV_Assert( CV_IS_MAT(ematrix) && ematrix->cols == 3 &&
+      (ematrix->rows == 3 || (count == 5 && ematrix->rows % 3 == 0 && ematrix->rows <= 30)) );
+  if( count < 5 ) {
+    result->retval = 0;
+    return;
+  }
+
+  double fx = cvmGet( cameraMatrix, 0, 0 ), fy = cvmGet( cameraMatrix, 1, 1 );
+  double cx = cvmGet( cameraMatrix, 0, 2 ), cy = cvmGet( cameraMatrix, 1, 2 );
+  double skew = cvmGet( cameraMatrix, 0, 1 );
+  CV_Assert( fabs(fx) > DBL_EPSILON && fabs(fy) > DBL_EPSILON );
+
+  // Without a workspace from the caller, buffers last for this call only
+  CvffiEstimatorWorkspace localWorkspace;
+  CvffiEstimatorWorkspace& ws = workspace ? *workspace : localWorkspace;
+
+  m1 = ws.get( CvffiEstimatorWorkspace::POINTS1, 1, count, CV_64FC2 );
+  cvConvertPointsHomogeneous( points1, m1 );
+
+  m2 = ws.get( CvffiEstimatorWorkspace::POINTS2, 1, count, CV_64FC2 );
+  cvConvertPointsHomogeneous( points2, m2 );
+
+  // to normalized image coordinates, K^-1 (u, v, 1)'
+  CvPoint2D64f* p[2] = { (CvPoint2D64f*)m1->data.ptr, (CvPoint2D64f*)m2->data.ptr };
+  for( int k = 0; k < 2; k++ )
+    for( int i = 0; i < count; i++ )
+    {
+      double y = (p[k][i].y - cy)/fy;
+      p[k][i].x = (p[k][i].x - cx - skew*y)/fx;
+      p[k][i].y = y;
+    }
+
+  if( mask )
+  {
+    CV_Assert( CV_IS_MASK_ARR(mask) && CV_IS_MAT_CONT(mask->type) &&
+        (mask->rows == 1 || mask->cols == 1) &&
+        mask->rows*mask->cols == count );
+  }
+  if( mask || count > 5 )
+  {
+    tempMask = ws.get( CvffiEstimatorWorkspace::POINTS_MASK, 1, count, CV_8U );
+    cvSet( tempMask, cvScalarAll(1.) );
+  }
+
+  EssentialEstimator estimator( max_iters );
+  estimator.setWorkspace( &ws );
+  estimator.setFlags( options );
+  if( seed != 0 )
+    estimator.setSeed( seed );
+
+  if( count == 5 )
+  {
+    retval = estimator.run5Point( m1, m2, &_E3x3 );
+    if( retval > 0 )
+    {
+      CvMat solutions = cvMat( MIN(retval*3, ematrix->rows), 3, CV_64FC1, E );
+      CvMat dst;
+      cvConvert( &solutions, cvGetRows( ematrix, &dst, 0, solutions.rows ) );
+    }
+  }
+  else
+  {
+    // the threshold is in pixels, the errors in normalized coordinates
+    if( param1 <= 0 )
+      param1 = 3;
+    param1 /= 0.5*(fabs(fx) + fabs(fy));
+    if( param2 < DBL_EPSILON || param2 > 1 - DBL_EPSILON )
+      param2 = 0.99;
+
+    if( method == CV_PROSAC && count >= 10 )
+      retval = estimator.runPROSAC( m1, m2, &_E3x3, tempMask, result->num_iters, param1, param2, quality );
+    else if( (method & ~3) == CV_RANSAC && count >= 10 )
+      retval = estimator.runRANSAC( m1, m2, &_E3x3, tempMask, result->num_iters, param1, param2 );
+    else
+      retval = estimator.runLMeDS( m1, m2, &_E3x3, tempMask, param2 );
+    result->num_rejected = estimator.getSprtRejections();
+
+    if( retval <= 0 ) {
+      result->retval = 0;
+      return;
+    }
+
+    // Refit to all the inliers when there are enough for the linear fit
+    int inliers = 0;
+    for( int i = 0; i < count; i++ )
+      if( tempMask->data.ptr[i] ) {
+        p[0][inliers] = p[0][i];
+        p[1][inliers] = p[1][i];
+        inliers++;
+      }
+    m1->cols = m2->cols = inliers;
+    if( inliers >= 8 )
+      estimator.run8Point( m1, m2, &_E3x3 );
+
+    cvConvert( &_E3x3, ematrix );
+  }
+
+  if( mask && tempMask )
+  {
+    if( CV_ARE_SIZES_EQ(mask, tempMask) )
+      cvCopy( tempMask, mask );
+    else
+      cvTranspose( tempMask, mask );
+  }
+
+  result->max_iters = (result->num_iters == max_iters ? true : false);
+  result->retval = retval;
+}
@@ -41,6 +41,12 @@
 
 #include "cvffi_modelest.h"
 #include "cvffi_fundam.h"
+#include "cvffi_reproj.h"
+
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/QR>
+#include <eigen3/Eigen/SVD>
+#include <eigen3/Eigen/Eigenvalues>
 
 using namespace cv;
 
@@ -69,46 +75,100 @@ int FundamentalEstimator::runKernel( const CvMat* m1, const CvMat* m2, CvMat* mo
     return modelPoints == 7 ? run7Point( m1, m2, model ) : run8Point( m1, m2, model );
 }
 
+// Least squares over eight or more points, for LO-RANSAC
+int FundamentalEstimator::runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* model )
+{
+    return run8Point( m1, m2, model );
+}
+
+// The real roots of c[0]*x^3 + c[1]*x^2 + c[2]*x + c[3] = 0, by the
+// method of cvSolveCubic but without its CvMat headers.  Returns the
+// number of roots, or -1 if every x is one.
+static int solveCubic( const double* c, double* roots )
+{
+    double a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+
+    if( a0 == 0 )
+    {
+        if( a1 == 0 )
+        {
+            if( a2 == 0 )
+                return a3 == 0 ? -1 : 0;
+            roots[0] = -a3/a2;
+            return 1;
+        }
+
+        double d = a2*a2 - 4*a1*a3;
+        if( d < 0 )
+            return 0;
+        d = sqrt(d);
+        double q = (-a2 + (a2 < 0 ? -d : d))*0.5;
+        roots[0] = q/a1;
+        roots[1] = a3/q;
+        return d > 0 ? 2 : 1;
+    }
+
+    a0 = 1./a0;
+    a1 *= a0;
+    a2 *= a0;
+    a3 *= a0;
+
+    double Q = (a1*a1 - 3*a2)*(1./9);
+    double R = (2*a1*a1*a1 - 9*a1*a2 + 27*a3)*(1./54);
+    double Qcubed = Q*Q*Q;
+    double d = Qcubed - R*R;
+
+    if( d >= 0 )
+    {
+        double theta = acos(R/sqrt(Qcubed));
+        double t0 = -2*sqrt(Q), t1 = theta*(1./3), t2 = a1*(1./3);
+        roots[0] = t0*cos(t1) - t2;
+        roots[1] = t0*cos(t1 + (2.*CV_PI/3)) - t2;
+        roots[2] = t0*cos(t1 + (4.*CV_PI/3)) - t2;
+        return 3;
+    }
+
+    d = sqrt(-d);
+    double e = pow(d + fabs(R), 1./3);
+    if( R > 0 )
+        e = -e;
+    roots[0] = (e + Q/e) - a1*(1./3);
+    return 1;
+}
+
+// The 7- and 8-point solvers run once per RANSAC iteration, on matrices
+// whose size is known at compile time, so they use Eigen's fixed-size
+// decompositions rather than cvSVD and cvEigenVV on CvMat headers.
 int FundamentalEstimator::run7Point( const CvMat* _m1, const CvMat* _m2, CvMat* _fmatrix )
 {
-    double a[7*9], w[7], v[9*9], c[4], r[3];
-    double* f1, *f2;
+    Eigen::Matrix<double,9,7> At;
+    double f1[9], f2[9], c[4], r[3];
     double t0, t1, t2;
-    CvMat A = cvMat( 7, 9, CV_64F, a );
-    CvMat V = cvMat( 9, 9, CV_64F, v );
-    CvMat W = cvMat( 7, 1, CV_64F, w );
-    CvMat coeffs = cvMat( 1, 4, CV_64F, c );
-    CvMat roots = cvMat( 1, 3, CV_64F, r );
     const CvPoint2D64f* m1 = (const CvPoint2D64f*)_m1->data.ptr;
     const CvPoint2D64f* m2 = (const CvPoint2D64f*)_m2->data.ptr;
     double* fmatrix = _fmatrix->data.db;
     int i, k, n;
 
-    // form a linear system: i-th row of A(=a) represents
+    // form a linear system: i-th row of A (i-th column of At) represents
     // the equation: (m2[i], 1)'*F*(m1[i], 1) = 0
     for( i = 0; i < 7; i++ )
     {
         double x0 = m1[i].x, y0 = m1[i].y;
         double x1 = m2[i].x, y1 = m2[i].y;
 
-        a[i*9+0] = x1*x0;
-        a[i*9+1] = x1*y0;
-        a[i*9+2] = x1;
-        a[i*9+3] = y1*x0;
-        a[i*9+4] = y1*y0;
-        a[i*9+5] = y1;
-        a[i*9+6] = x0;
-        a[i*9+7] = y0;
-        a[i*9+8] = 1;
+        At.col(i) << x1*x0, x1*y0, x1, y1*x0, y1*y0, y1, x0, y0, 1;
     }
 
     // A*(f11 f12 ... f33)' = 0 is singular (7 equations for 9 variables), so
     // the solution is linear subspace of dimensionality 2.
-    // => use the last two singular vectors as a basis of the space
-    // (according to SVD properties)
-    cvSVD( &A, &W, 0, &V, CV_SVD_MODIFY_A + CV_SVD_V_T );
-    f1 = v + 7*9;
-    f2 = v + 8*9;
+    // => use the last two columns of Q in At = QR, which are orthogonal
+    // to the rows of A, as a basis of the space
+    Eigen::Matrix<double,9,9> Q = Eigen::HouseholderQR< Eigen::Matrix<double,9,7> >( At ).householderQ();
+    for( i = 0; i < 9; i++ )
+    {
+        f1[i] = Q(i,7);
+        f2[i] = Q(i,8);
+    }
 
     // f1, f2 is a basis => lambda*f1 + mu*f2 is an arbitrary f. matrix.
     // as it is determined up to a scale, normalize lambda & mu (lambda + mu = 1),
@@ -148,7 +208,7 @@ int FundamentalEstimator::run7Point( const CvMat* _m1, const CvMat* _m2, CvMat*
     c[0] = f1[0]*t0 - f1[1]*t1 + f1[2]*t2;
 
     // solve the cubic equation; there can be 1 to 3 roots ...
-    n = cvSolveCubic( &coeffs, &roots );
+    n = solveCubic( c, r );
 
     if( n < 1 || n > 3 )
         return n;
@@ -179,11 +239,8 @@ int FundamentalEstimator::run7Point( const CvMat* _m1, const CvMat* _m2, CvMat*
 
 int FundamentalEstimator::run8Point( const CvMat* _m1, const CvMat* _m2, CvMat* _fmatrix )
 {
-    double a[9*9], w[9], v[9*9];
-    CvMat W = cvMat( 1, 9, CV_64F, w );
-    CvMat V = cvMat( 9, 9, CV_64F, v );
-    CvMat A = cvMat( 9, 9, CV_64F, a );
-    CvMat U, F0, TF;
+    typedef Eigen::Matrix<double,3,3,Eigen::RowMajor> Matrix3;
+    Eigen::Matrix<double,9,9> A = Eigen::Matrix<double,9,9>::Zero();
 
     CvPoint2D64f m0c = {0,0}, m1c = {0,0};
     double t, scale0 = 0, scale1 = 0;
@@ -228,8 +285,6 @@ int FundamentalEstimator::run8Point( const CvMat* _m1, const CvMat* _m2, CvMat*
 
     scale0 = sqrt(2.)/scale0;
     scale1 = sqrt(2.)/scale1;
-    
-    cvZero( &A );
 
     // form a linear system Ax=0: for each selected pair of points m1 & m2,
     // the row of A(=a) represents the coefficients of equation: (m2, 1)'*F*(m1, 1) = 0
@@ -242,58 +297,51 @@ int FundamentalEstimator::run8Point( const CvMat* _m1, const CvMat* _m2, CvMat*
         double y1 = (m2[i].y - m1c.y)*scale1;
         double r[9] = { x1*x0, x1*y0, x1, y1*x0, y1*y0, y1, x0, y0, 1 };
         for( j = 0; j < 9; j++ )
-            for( k = 0; k < 9; k++ )
-                a[j*9+k] += r[j]*r[k];
+            for( k = 0; k <= j; k++ )
+                A(j,k) += r[j]*r[k];
     }
 
-    cvEigenVV(&A, &V, &W);
+    // Only the lower triangle is filled in, and only it is read;
+    // eigenvalues come in increasing order
+    Eigen::SelfAdjointEigenSolver< Eigen::Matrix<double,9,9> > eigen( A );
+    const Eigen::Matrix<double,9,1>& w = eigen.eigenvalues();
 
-    for( i = 0; i < 9; i++ )
+    for( i = 0; i < 8; i++ )
     {
-        if( fabs(w[i]) < DBL_EPSILON )
+        if( fabs(w(8-i)) < DBL_EPSILON )
             break;
     }
 
     if( i < 8 )
         return 0;
 
-    F0 = cvMat( 3, 3, CV_64F, v + 9*8 ); // take the last column of v as a solution of Af = 0
+    // take the eigenvector of the smallest eigenvalue as a solution of Af = 0
+    Matrix3 F0 = Eigen::Map<const Matrix3>( eigen.eigenvectors().col(0).data() );
 
     // make F0 singular (of rank 2) by decomposing it with SVD,
-    // zeroing the last diagonal element of W and then composing the matrices back.
-
-    // use v as a temporary storage for different 3x3 matrices
-    W = U = V = TF = F0;
-    W.data.db = v;
-    U.data.db = v + 9;
-    V.data.db = v + 18;
-    TF.data.db = v + 27;
-
-    cvSVD( &F0, &W, &U, &V, CV_SVD_MODIFY_A + CV_SVD_U_T + CV_SVD_V_T );
-    W.data.db[8] = 0.;
+    // zeroing the last singular value and then composing the matrices back.
+    Eigen::JacobiSVD<Matrix3> svd( F0, Eigen::ComputeFullU | Eigen::ComputeFullV );
+    Eigen::Vector3d W = svd.singularValues();
+    W(2) = 0.;
 
     // F0 <- U*diag([W(1), W(2), 0])*V'
-    cvGEMM( &U, &W, 1., 0, 0., &TF, CV_GEMM_A_T );
-    cvGEMM( &TF, &V, 1., 0, 0., &F0, 0/*CV_GEMM_B_T*/ );
+    F0 = svd.matrixU()*W.asDiagonal()*svd.matrixV().transpose();
 
     // apply the transformation that is inverse
     // to what we used to normalize the point coordinates
     {
-        double tt0[] = { scale0, 0, -scale0*m0c.x, 0, scale0, -scale0*m0c.y, 0, 0, 1 };
-        double tt1[] = { scale1, 0, -scale1*m1c.x, 0, scale1, -scale1*m1c.y, 0, 0, 1 };
-        CvMat T0, T1;
-        T0 = T1 = F0;
-        T0.data.db = tt0;
-        T1.data.db = tt1;
+        Matrix3 T0, T1;
+        T0 << scale0, 0, -scale0*m0c.x, 0, scale0, -scale0*m0c.y, 0, 0, 1;
+        T1 << scale1, 0, -scale1*m1c.x, 0, scale1, -scale1*m1c.y, 0, 0, 1;
 
         // F0 <- T1'*F0*T0
-        cvGEMM( &T1, &F0, 1., 0, 0., &TF, CV_GEMM_A_T );
-        F0.data.db = fmatrix;
-        cvGEMM( &TF, &T0, 1., 0, 0., &F0, 0 );
+        Eigen::Map<Matrix3> F( fmatrix );
+        F = T1.transpose()*F0*T0;
 
         // make F(3,3) = 1
-        if( fabs(F0.data.db[8]) > FLT_EPSILON )
-            cvScale( &F0, &F0, 1./F0.data.db[8] );
+        double f33 = F(2,2);
+        if( fabs(f33) > FLT_EPSILON )
+            F /= f33;
     }
 
     return 1;
@@ -305,35 +353,21 @@ int FundamentalEstimator::run8Point( const CvMat* _m1, const CvMat* _m2, CvMat*
 //
 // That is, the larger of the two squared distances between a point and the 
 // epipole corresponding to the matching point.
-void FundamentalEstimator::computeReprojError( const CvMat* _m1, const CvMat* _m2,
-                                        const CvMat* model, CvMat* _err )
+void FundamentalEstimator::computeReprojError( const CvMat* m1, const CvMat* m2,
+                                        const CvMat* model, CvMat* err )
 {
-    int i, count = _m1->rows*_m1->cols;
-    const CvPoint2D64f* m1 = (const CvPoint2D64f*)_m1->data.ptr;
-    const CvPoint2D64f* m2 = (const CvPoint2D64f*)_m2->data.ptr;
-    const double* F = model->data.db;
-    float* err = _err->data.fl;
-    
-    for( i = 0; i < count; i++ )
-    {
-        double a, b, c, d1, d2, s1, s2;
-
-        a = F[0]*m1[i].x + F[1]*m1[i].y + F[2];
-        b = F[3]*m1[i].x + F[4]*m1[i].y + F[5];
-        c = F[6]*m1[i].x + F[7]*m1[i].y + F[8];
-
-        s2 = 1./(a*a + b*b);
-        d2 = m2[i].x*a + m2[i].y*b + c;
-
-        a = F[0]*m2[i].x + F[3]*m2[i].y + F[6];
-        b = F[1]*m2[i].x + F[4]*m2[i].y + F[7];
-        c = F[2]*m2[i].x + F[5]*m2[i].y + F[8];
-
-        s1 = 1./(a*a + b*b);
-        d1 = m1[i].x*a + m1[i].y*b + c;
+    cvffiEpipolarErrors( (const CvPoint2D64f*)m1->data.ptr, (const CvPoint2D64f*)m2->data.ptr,
+                         m1->rows*m1->cols, model->data.db, err->data.fl, 0, 0 );
+}
 
-        err[i] = (float)std::max(d1*d1*s1, d2*d2*s2);
-    }
+// The same errors with the inlier test fused in;  err may be NULL
+int FundamentalEstimator::findInliers( const CvMat* m1, const CvMat* m2,
+                                       const CvMat* model, CvMat* err,
+                                       CvMat* mask, double threshold )
+{
+    return cvffiEpipolarErrors( (const CvPoint2D64f*)m1->data.ptr, (const CvPoint2D64f*)m2->data.ptr,
+                                m1->rows*m1->cols, model->data.db, err ? err->data.fl : 0,
+                                mask->data.ptr, threshold*threshold );
 }
 
 
@@ -342,18 +376,32 @@ CV_IMPL void cvEstimateFundamental( const CvMat* points1, const CvMat* points2,
     CvMat* fmatrix, int method,
     double param1, double param2, int max_iters,  CvMat* mask,
     CvFundamentalResult *result )
+{
+  cvEstimateFundamentalWithQuality( points1, points2, fmatrix, method,
+      param1, param2, max_iters, mask, NULL, 0, NULL, result );
+}
+
+CV_IMPL void cvEstimateFundamentalWithQuality( const CvMat* points1, const CvMat* points2,
+    CvMat* fmatrix, int method,
+    double param1, double param2, int max_iters,  CvMat* mask,
+    const CvMat* quality, int64 seed, CvffiEstimatorWorkspace* workspace,
+    CvFundamentalResult *result )
 {
   int retval = 0;
-  Ptr<CvMat> m1, m2, tempMask;
+  CvMat *m1, *m2, *tempMask = 0;
 
   // Set some reasonable default values for the 7- and 8-points cases
   result->max_iters = false;
   result->num_iters = 0;
+  result->num_rejected = 0;
 
   double F[3*9];
   CvMat _F3x3 = cvMat( 3, 3, CV_64FC1, F ), _F9x3 = cvMat( 9, 3, CV_64FC1, F );
   int count;
 
+  int options = method & CV_RANSAC_OPTIONS;
+  method &= ~CV_RANSAC_OPTIONS;
+
   CV_Assert( CV_IS_MAT(points1) && CV_IS_MAT(points2) && CV_ARE_SIZES_EQ(points1, points2) );
   CV_Assert( CV_IS_MAT(fmatrix) && fmatrix->cols == 3 &&
       (fmatrix->rows == 3 || (fmatrix->rows == 9 && method == CV_FM_7POINT)) );
@@ -364,10 +412,14 @@ CV_IMPL void cvEstimateFundamental( const CvMat* points1, const CvMat* points2,
     return;
   }
 
-  m1 = cvCreateMat( 1, count, CV_64FC2 );
+  // Without a workspace from the caller, buffers last for this call only
+  CvffiEstimatorWorkspace localWorkspace;
+  CvffiEstimatorWorkspace& ws = workspace ? *workspace : localWorkspace;
+
+  m1 = ws.get( CvffiEstimatorWorkspace::POINTS1, 1, count, CV_64FC2 );
   cvConvertPointsHomogeneous( points1, m1 );
 
-  m2 = cvCreateMat( 1, count, CV_64FC2 );
+  m2 = ws.get( CvffiEstimatorWorkspace::POINTS2, 1, count, CV_64FC2 );
   cvConvertPointsHomogeneous( points2, m2 );
 
   if( mask )
@@ -377,11 +429,19 @@ CV_IMPL void cvEstimateFundamental( const CvMat* points1, const CvMat* points2,
         mask->rows*mask->cols == count );
   }
   if( mask || count >= 8 )
-    tempMask = cvCreateMat( 1, count, CV_8U );
-  if( !tempMask.empty() )
+  {
+    tempMask = ws.get( CvffiEstimatorWorkspace::POINTS_MASK, 1, count, CV_8U );
     cvSet( tempMask, cvScalarAll(1.) );
+  }
 
-  FundamentalEstimator estimator(7, max_iters );
+  // CV_DEGENSAC is RANSAC with checks for a dominant plane
+  FundamentalEstimator fundamental( 7, max_iters );
+  DegensacEstimator degensac( max_iters );
+  FundamentalEstimator& estimator = (method == CV_DEGENSAC) ? degensac : fundamental;
+  estimator.setWorkspace( &ws );
+  estimator.setFlags( options );
+  if( seed != 0 )
+    estimator.setSeed( seed );
   if( count == 7 )
     retval = estimator.run7Point(m1, m2, &_F9x3);
   else if( method == CV_FM_8POINT )
@@ -394,10 +454,13 @@ CV_IMPL void cvEstimateFundamental( const CvMat* points1, const CvMat* points2,
     if( param2 < DBL_EPSILON || param2 > 1 - DBL_EPSILON )
       param2 = 0.99;
 
-    if( (method & ~3) == CV_RANSAC && count >= 15 )
+    if( method == CV_PROSAC && count >= 15 )
+      retval = estimator.runPROSAC(m1, m2, &_F3x3, tempMask, result->num_iters, param1, param2, quality );
+    else if( (method & ~3) == CV_RANSAC && count >= 15 )
       retval = estimator.runRANSAC(m1, m2, &_F3x3, tempMask, result->num_iters, param1, param2 );
     else
       retval = estimator.runLMeDS(m1, m2, &_F3x3, tempMask, param2 );
+    result->num_rejected = estimator.getSprtRejections();
 
     if( retval <= 0 ) {
       result->retval = 0;
@@ -428,6 +491,21 @@ CV_IMPL void cvEstimateFundamental( const CvMat* points1, const CvMat* points2,
   result->retval = retval;
 }
 
+CV_IMPL CvffiEstimatorWorkspace* cvCreateEstimatorWorkspace( int maxCount )
+{
+  CV_Assert( maxCount >= 0 );
+  return new CvffiEstimatorWorkspace( maxCount );
+}
+
+CV_IMPL void cvReleaseEstimatorWorkspace( CvffiEstimatorWorkspace** workspace )
+{
+  if( !workspace )
+    CV_Error( CV_StsNullPtr, "" );
+
+  delete *workspace;
+  *workspace = 0;
+}
+
 
 
 // Below lie functions I _didn't_ touch, and so we use the stock OpenCV 
@@ -41,6 +41,7 @@
 
 #include "cvffi_modelest.h"
 #include "cvffi_fundam.h"
+#include "cvffi_reproj.h"
 
 using namespace cv;
 
@@ -130,23 +131,28 @@ int HomographyEstimator::runKernel( const CvMat* m1, const CvMat* m2, CvMat* H )
     return 1;
 }
 
+// The DLT already takes any number of points, for LO-RANSAC
+int HomographyEstimator::runNonMinimalKernel( const CvMat* m1, const CvMat* m2, CvMat* H )
+{
+    return runKernel( m1, m2, H );
+}
+
 
 void HomographyEstimator::computeReprojError( const CvMat* m1, const CvMat* m2,
-                                                const CvMat* model, CvMat* _err )
+                                                const CvMat* model, CvMat* err )
 {
-    int i, count = m1->rows*m1->cols;
-    const CvPoint2D64f* M = (const CvPoint2D64f*)m1->data.ptr;
-    const CvPoint2D64f* m = (const CvPoint2D64f*)m2->data.ptr;
-    const double* H = model->data.db;
-    float* err = _err->data.fl;
+    cvffiTransferErrors( (const CvPoint2D64f*)m1->data.ptr, (const CvPoint2D64f*)m2->data.ptr,
+                         m1->rows*m1->cols, model->data.db, err->data.fl, 0, 0 );
+}
 
-    for( i = 0; i < count; i++ )
-    {
-        double ww = 1./(H[6]*M[i].x + H[7]*M[i].y + 1.);
-        double dx = (H[0]*M[i].x + H[1]*M[i].y + H[2])*ww - m[i].x;
-        double dy = (H[3]*M[i].x + H[4]*M[i].y + H[5])*ww - m[i].y;
-        err[i] = (float)(dx*dx + dy*dy);
-    }
+// The same errors with the inlier test fused in;  err may be NULL
+int HomographyEstimator::findInliers( const CvMat* m1, const CvMat* m2,
+                                      const CvMat* model, CvMat* err,
+                                      CvMat* mask, double threshold )
+{
+    return cvffiTransferErrors( (const CvPoint2D64f*)m1->data.ptr, (const CvPoint2D64f*)m2->data.ptr,
+                                m1->rows*m1->cols, model->data.db, err ? err->data.fl : 0,
+                                mask->data.ptr, threshold*threshold );
 }
 
 bool HomographyEstimator::refine( const CvMat* m1, const CvMat* m2, CvMat* model, int maxIters )
@@ -205,20 +211,34 @@ CV_IMPL void
 cvEstimateHomography( const CvMat* objectPoints, const CvMat* imagePoints,
     CvMat* __H, int method, double ransacReprojThreshold, int maxIters,
     CvMat* mask, CvFundamentalResult *result )
+{
+    cvEstimateHomographyWithQuality( objectPoints, imagePoints, __H, method,
+        ransacReprojThreshold, maxIters, mask, NULL, 0, NULL, result );
+}
+
+CV_IMPL void
+cvEstimateHomographyWithQuality( const CvMat* objectPoints, const CvMat* imagePoints,
+    CvMat* __H, int method, double ransacReprojThreshold, int maxIters,
+    CvMat* mask, const CvMat* quality, int64 seed, CvffiEstimatorWorkspace* workspace,
+    CvFundamentalResult *result )
 {
     const double confidence = 0.995;
     const double defaultRANSACReprojThreshold = 3;
     bool retval = false;
-    Ptr<CvMat> m, M, tempMask;
+    CvMat *m, *M, *tempMask = 0;
 
     // Set some reasonable default values for the 7- and 8-points cases
     result->max_iters = false;
     result->num_iters = 0;
+    result->num_rejected = 0;
 
     double H[9];
     CvMat matH = cvMat( 3, 3, CV_64FC1, H );
     int count;
 
+    int options = method & CV_RANSAC_OPTIONS;
+    method &= ~CV_RANSAC_OPTIONS;
+
     CV_Assert( CV_IS_MAT(imagePoints) && CV_IS_MAT(objectPoints) );
 
     count = MAX(imagePoints->cols, imagePoints->rows);
@@ -226,10 +246,14 @@ cvEstimateHomography( const CvMat* objectPoints, const CvMat* imagePoints,
     if( ransacReprojThreshold <= 0 )
         ransacReprojThreshold = defaultRANSACReprojThreshold;
 
-    m = cvCreateMat( 1, count, CV_64FC2 );
+    // Without a workspace from the caller, buffers last for this call only
+    CvffiEstimatorWorkspace localWorkspace;
+    CvffiEstimatorWorkspace& ws = workspace ? *workspace : localWorkspace;
+
+    m = ws.get( CvffiEstimatorWorkspace::POINTS1, 1, count, CV_64FC2 );
     cvConvertPointsHomogeneous( imagePoints, m );
 
-    M = cvCreateMat( 1, count, CV_64FC2 );
+    M = ws.get( CvffiEstimatorWorkspace::POINTS2, 1, count, CV_64FC2 );
     cvConvertPointsHomogeneous( objectPoints, M );
 
     if( mask )
@@ -239,26 +263,34 @@ cvEstimateHomography( const CvMat* objectPoints, const CvMat* imagePoints,
             mask->rows*mask->cols == count );
     }
     if( mask || count > 4 )
-        tempMask = cvCreateMat( 1, count, CV_8U );
-    if( !tempMask.empty() )
+    {
+        tempMask = ws.get( CvffiEstimatorWorkspace::POINTS_MASK, 1, count, CV_8U );
         cvSet( tempMask, cvScalarAll(1.) );
+    }
 
     HomographyEstimator estimator(4, maxIters);
+    estimator.setWorkspace( &ws );
+    estimator.setFlags( options );
+    if( seed != 0 )
+        estimator.setSeed( seed );
     if( count == 4 )
         method = 0;
     if( method == CV_LMEDS )
         retval = estimator.runLMeDS( M, m, &matH, tempMask, confidence );
     else if( method == CV_RANSAC )
         retval = estimator.runRANSAC( M, m, &matH, tempMask, result->num_iters, ransacReprojThreshold, confidence );
+    else if( method == CV_PROSAC )
+        retval = estimator.runPROSAC( M, m, &matH, tempMask, result->num_iters, ransacReprojThreshold, confidence, quality );
     else
         retval = estimator.runKernel( M, m, &matH ) > 0;
+    result->num_rejected = estimator.getSprtRejections();
 
     if( retval && count > 4 )
     {
         icvCompressPoints( (CvPoint2D64f*)M->data.ptr, tempMask->data.ptr, 1, count );
         count = icvCompressPoints( (CvPoint2D64f*)m->data.ptr, tempMask->data.ptr, 1, count );
         M->cols = m->cols = count;
-        if( method == CV_RANSAC )
+        if( method == CV_RANSAC || method == CV_PROSAC )
             estimator.runKernel( M, m, &matH );
         estimator.refine( M, m, &matH, 10 );
     }
@@ -294,8 +326,10 @@ HomographyEstimator::weakConstraint ( const CvMat* srcPoints, const CvMat* dstPo
   const CvPoint2D64f* src = (const CvPoint2D64f*)srcPoints->data.ptr;
   const CvPoint2D64f* dst = (const CvPoint2D64f*)dstPoints->data.ptr;
 
-  CvMat* A = cvCreateMat( 3, 3, CV_64F );
-  CvMat* B = cvCreateMat( 3, 3, CV_64F );
+  // Called for every sample, so kept off the heap
+  double a[9], b[9];
+  CvMat _A = cvMat( 3, 3, CV_64F, a ), _B = cvMat( 3, 3, CV_64F, b );
+  CvMat *A = &_A, *B = &_B;
 
   double detA;
   double detB;
@@ -323,9 +357,6 @@ HomographyEstimator::weakConstraint ( const CvMat* srcPoints, const CvMat* dstPo
   detA = cvDet(A);
   detB = cvDet(B);
 
-  cvReleaseMat(&A);
-  cvReleaseMat(&B);
-
   return (detA*detB >= 0);
 };
 
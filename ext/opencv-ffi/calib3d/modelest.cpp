@@ -43,12 +43,14 @@
 #include <algorithm>
 #include <iterator>
 #include <limits>
+#include <vector>
 
 #include <opencv2/core/operations.hpp>
 #include <opencv2/core/internal.hpp>
 #include <opencv2/core/core_c.h>
 
 #include <stdio.h>
+#include <limits.h>
 #include <sys/time.h>
 
 using namespace std;
@@ -61,6 +63,9 @@ CvffiModelEstimator2::CvffiModelEstimator2(int _modelPoints, CvSize _modelSize,
     modelSize = _modelSize;
     maxBasicSolutions = _maxBasicSolutions;
     checkPartialSubsets = true;
+    flags = 0;
+    workspace = 0;
+    sprtRejections = 0;
 
     // was rng = cvRNG(time(null))
     // This would result in rng having the same seed if
@@ -83,6 +88,70 @@ void CvffiModelEstimator2::setSeed( int64 seed )
     rng = cvRNG(seed);
 }
 
+// Any of the CV_RANSAC_* options
+void CvffiModelEstimator2::setFlags( int _flags )
+{
+    flags = _flags & CV_RANSAC_OPTIONS;
+}
+
+// Buffers to use instead of the estimator's own;  NULL for its own
+void CvffiModelEstimator2::setWorkspace( CvffiEstimatorWorkspace* _workspace )
+{
+    workspace = _workspace;
+}
+
+CvffiEstimatorWorkspace& CvffiModelEstimator2::ws()
+{
+    if( workspace )
+        return *workspace;
+    if( ownWorkspace.empty() )
+        ownWorkspace = new CvffiEstimatorWorkspace();
+    return *ownWorkspace;
+}
+
+
+// Type of each slot's elements, one per correspondence, or -1 for
+// those sized by the model
+static const int WORKSPACE_SLOT_TYPES[CvffiEstimatorWorkspace::SLOTS] = {
+    CV_8UC1, CV_8UC1, CV_32FC1, -1, -1, -1,
+    CV_64FC2, CV_64FC2, CV_8UC1, CV_64FC1, CV_32SC1, CV_32SC1, CV_32SC1,
+    CV_64FC2, CV_64FC2, CV_32FC1, CV_32SC1,
+    CV_64FC2, CV_64FC2, CV_64FC2, CV_64FC2, CV_32FC1, CV_8UC1, -1,
+    CV_32FC1, CV_8UC1, CV_32SC1 };
+
+CvffiEstimatorWorkspace::CvffiEstimatorWorkspace( int _maxCount )
+{
+    maxCount = 0;
+    reserve( _maxCount );
+}
+
+// Only notes the count:  each slot is allocated the first time it's
+// asked for, so those a method never uses take no memory
+void CvffiEstimatorWorkspace::reserve( int _maxCount )
+{
+    maxCount = MAX( maxCount, _maxCount );
+}
+
+CvMat* CvffiEstimatorWorkspace::get( int slot, int rows, int cols, int type )
+{
+    CV_Assert( slot >= 0 && slot < SLOTS );
+
+    size_t bytes = (size_t)rows*cols*CV_ELEM_SIZE(type);
+    std::vector<double>& buffer = buffers[slot];
+    if( buffer.size()*sizeof(double) < bytes )
+    {
+        // A slot with one element per correspondence gets room for
+        // maxCount of them (one more, for INLIER_COUNTS), so that it
+        // grows once rather than call by call
+        if( WORKSPACE_SLOT_TYPES[slot] >= 0 )
+            bytes = MAX( bytes, (size_t)(maxCount + 1)*CV_ELEM_SIZE(WORKSPACE_SLOT_TYPES[slot]) );
+        buffer.resize( (bytes + sizeof(double) - 1)/sizeof(double) );
+    }
+
+    headers[slot] = cvMat( rows, cols, type, buffer.empty() ? 0 : &buffer[0] );
+    return &headers[slot];
+}
+
 
 int CvffiModelEstimator2::findInliers( const CvMat* m1, const CvMat* m2,
                                     const CvMat* model, CvMat* _err,
@@ -125,6 +194,480 @@ cvRANSACUpdateNumIters( double p, double ep,
         max_iters : cvRound(num/denom);
 }
 
+// Randomized verification with Wald's sequential probability ratio
+// test (Matas and Chum, "Randomized RANSAC with Sequential Probability
+// Ratio Test", ICCV 2005; Chum and Matas, "Optimal Randomized RANSAC",
+// PAMI 2008).
+//
+// Correspondences are checked against a hypothesis one at a time, and
+// it's dropped as soon as the likelihood ratio of "bad model" to "good
+// model" passes A.  A good model sees a correspondence as an inlier
+// with probability epsilon, a bad one with probability delta.  Epsilon
+// comes from the best model so far and delta from the rejected ones,
+// and A is redesigned whenever either changes.
+//
+// The correspondences are shuffled once per run, and each hypothesis is
+// checked from a random point in that order.  Errors are computed
+// SPRT_BLOCK at a time.
+
+static const int SPRT_BLOCK = 16;
+
+// Time to make a hypothesis, in units of the time to check one point
+static const double SPRT_MODEL_TIME = 200;
+
+static const double SPRT_EPSILON0 = 0.1;
+static const double SPRT_DELTA0 = 0.01;
+
+struct CvffiModelEstimator2::SprtState
+{
+    void init( const CvMat* _m1, const CvMat* _m2, CvRNG& rng, CvffiEstimatorWorkspace& ws )
+    {
+        int count = _m1->rows*_m1->cols;
+        int elemSize1 = CV_ELEM_SIZE(_m1->type), elemSize2 = CV_ELEM_SIZE(_m2->type);
+
+        order = ws.get( CvffiEstimatorWorkspace::SPRT_ORDER, 1, count, CV_32SC1 )->data.i;
+        for( int i = 0; i < count; i++ )
+            order[i] = i;
+        for( int i = count-1; i > 0; i-- )
+            std::swap( order[i], order[ cvRandInt(&rng) % (i+1) ] );
+
+        m1 = ws.get( CvffiEstimatorWorkspace::SPRT_POINTS1, 1, count, CV_MAT_TYPE(_m1->type) );
+        m2 = ws.get( CvffiEstimatorWorkspace::SPRT_POINTS2, 1, count, CV_MAT_TYPE(_m2->type) );
+        err = ws.get( CvffiEstimatorWorkspace::SPRT_ERR, 1, count, CV_32FC1 );
+        for( int i = 0; i < count; i++ )
+        {
+            memcpy( m1->data.ptr + i*elemSize1, _m1->data.ptr + order[i]*elemSize1, elemSize1 );
+            memcpy( m2->data.ptr + i*elemSize2, _m2->data.ptr + order[i]*elemSize2, elemSize2 );
+        }
+
+        epsilon = SPRT_EPSILON0;
+        delta = SPRT_DELTA0;
+        samples = models = 0;
+        rejectedTested = rejectedInliers = 0;
+        rejections = 0;
+        tested = 0;
+        design();
+    }
+
+    // Solves A = K + 1 + log(A) for the threshold which minimises the
+    // expected verification time
+    void design()
+    {
+        delta = MIN( MAX( delta, DBL_EPSILON ), 0.9*epsilon );
+
+        double C = (1 - delta)*log( (1 - delta)/(1 - epsilon) ) + delta*log( delta/epsilon );
+        double modelsPerSample = samples > 0 ? MAX( (double)models/samples, 1. ) : 1.;
+        double K = SPRT_MODEL_TIME*C/modelsPerSample;
+
+        A = K + 1;
+        for( int i = 0; i < 10; i++ )
+            A = K + 1 + log(A);
+    }
+
+    void accepted( int goodCount, int count )
+    {
+        epsilon = MAX( (double)goodCount/count, SPRT_EPSILON0 );
+        design();
+    }
+
+    void rejected( int n, int inliers )
+    {
+        rejections++;
+        rejectedTested += n;
+        rejectedInliers += inliers;
+
+        double estimate = rejectedInliers/rejectedTested;
+        if( fabs( estimate - delta ) > 0.05*delta )
+        {
+            delta = estimate;
+            design();
+        }
+    }
+
+    // As cvRANSACUpdateNumIters, allowing for good models which the
+    // test rejects (a fraction 1/A at most)
+    int updateNumIters( double p, int goodCount, int count, int modelPoints, int maxIters ) const
+    {
+        double num = log( MAX(1. - p, DBL_MIN) );
+        double good = pow( (double)goodCount/count, modelPoints )*(1. - 1./A);
+        double denom = log( MAX(1. - good, DBL_MIN) );
+
+        if( good < DBL_MIN || denom >= 0 || -num >= maxIters*(-denom) )
+            return maxIters;
+        return cvRound( num/denom );
+    }
+
+    // The correspondences in a random order, order[i] being the index of
+    // the i'th
+    CvMat *m1, *m2, *err;
+    int* order;
+
+    double epsilon, delta, A;
+    int samples, models;
+    double rejectedTested, rejectedInliers;
+    int rejections;
+
+    // Total points checked, for the curious
+    int64 tested;
+};
+
+// Returns the number of inliers, with the mask filled in, or -1 if the
+// test rejected the model
+int CvffiModelEstimator2::findInliersSPRT( const CvMat* model, double threshold,
+                                         CvMat* _mask, SprtState& sprt )
+{
+    int count = sprt.m1->cols, goodCount = 0, tested = 0;
+    int elemSize1 = CV_ELEM_SIZE(sprt.m1->type), elemSize2 = CV_ELEM_SIZE(sprt.m2->type);
+    int start = cvRandInt(&rng) % count;
+    const float* err = sprt.err->data.fl;
+    double lambda = 1.;
+    double inlierStep = sprt.delta/sprt.epsilon, outlierStep = (1 - sprt.delta)/(1 - sprt.epsilon);
+
+    threshold *= threshold;
+    while( tested < count )
+    {
+        int j0 = (start + tested) % count;
+        int n = MIN( SPRT_BLOCK, MIN( count - tested, count - j0 ) );
+
+        CvMat s1 = cvMat( 1, n, CV_MAT_TYPE(sprt.m1->type), sprt.m1->data.ptr + j0*elemSize1 );
+        CvMat s2 = cvMat( 1, n, CV_MAT_TYPE(sprt.m2->type), sprt.m2->data.ptr + j0*elemSize2 );
+        CvMat e = cvMat( 1, n, CV_32FC1, sprt.err->data.fl + j0 );
+        computeReprojError( &s1, &s2, model, &e );
+
+        for( int j = j0; j < j0 + n; j++ )
+        {
+            bool inlier = err[j] <= threshold;
+            goodCount += inlier;
+            lambda *= inlier ? inlierStep : outlierStep;
+            tested++;
+
+            if( lambda > sprt.A )
+            {
+                sprt.tested += tested;
+                sprt.rejected( tested, goodCount );
+                return -1;
+            }
+        }
+    }
+
+    sprt.tested += tested;
+
+    uchar* mask = _mask->data.ptr;
+    for( int j = 0; j < count; j++ )
+        mask[ sprt.order[j] ] = err[j] <= threshold;
+    return goodCount;
+}
+
+
+// Called with each new best model and the sample ms1, ms2 it came from,
+// so that an estimator can replace a model fitted to a degenerate sample.
+// Returns the number of inliers to the model left in model and mask.
+int CvffiModelEstimator2::checkDegeneracy( const CvMat*, const CvMat*,
+                                         const CvMat*, const CvMat*, CvMat*,
+                                         CvMat*, int goodCount, double )
+{
+    return goodCount;
+}
+
+
+// Local optimisation of the best model so far (Chum, Matas and Kittler,
+// "Locally Optimized RANSAC", DAGM 2003; Lebeda, Matas and Chum, "Fixing
+// the Locally Optimized RANSAC", BMVC 2012).
+//
+// A minimal sample of inliers seldom gives the best model the inliers
+// themselves support.  So whenever RANSAC finds a new best, an inner
+// RANSAC draws non-minimal samples from its inliers, and each model from
+// those is refined by least squares over the points within a threshold
+// shrinking from LO_THRESHOLD_FACTOR times the final one.  Needs an
+// estimator with runNonMinimalKernel.
+
+static const int LO_INNER_ITERS = 10;
+static const int LO_SAMPLE_FACTOR = 4;
+static const int LO_LSQ_ITERS = 4;
+static const double LO_THRESHOLD_FACTOR = 3;
+
+// Copies the points of m whose mask is set to the start of dst
+static int selectPoints( const CvMat* m, const uchar* mask, CvMat* dst )
+{
+    int count = m->rows*m->cols, elemSize = CV_ELEM_SIZE(m->type), n = 0;
+    for( int i = 0; i < count; i++ )
+        if( mask[i] )
+            memcpy( dst->data.ptr + (n++)*elemSize, m->data.ptr + i*elemSize, elemSize );
+    return n;
+}
+
+// Fits the model to all of m1 and m2, by default not supported
+int CvffiModelEstimator2::runNonMinimalKernel( const CvMat*, const CvMat*, CvMat* )
+{
+    return 0;
+}
+
+// Returns the number of inliers to the improved model, which is left in
+// model with its mask, or goodCount if nothing improved on it.
+int CvffiModelEstimator2::localOptimize( const CvMat* m1, const CvMat* m2, CvMat* model,
+                                       CvMat* mask, int goodCount, double threshold )
+{
+    int count = m1->rows*m1->cols, minPoints = modelPoints + 1;
+    int type1 = CV_MAT_TYPE(m1->type), type2 = CV_MAT_TYPE(m2->type);
+    int elemSize1 = CV_ELEM_SIZE(type1), elemSize2 = CV_ELEM_SIZE(type2);
+
+    if( goodCount < minPoints )
+        return goodCount;
+
+    CvffiEstimatorWorkspace& w = ws();
+    CvMat* in1 = w.get( CvffiEstimatorWorkspace::LO_POINTS1, 1, count, type1 );
+    CvMat* in2 = w.get( CvffiEstimatorWorkspace::LO_POINTS2, 1, count, type2 );
+    CvMat* ls1 = w.get( CvffiEstimatorWorkspace::LO_LSQ1, 1, count, type1 );
+    CvMat* ls2 = w.get( CvffiEstimatorWorkspace::LO_LSQ2, 1, count, type2 );
+    CvMat* err = w.get( CvffiEstimatorWorkspace::LO_ERR, 1, count, CV_32FC1 );
+    CvMat* tmask = w.get( CvffiEstimatorWorkspace::LO_MASK, 1, count, CV_8UC1 );
+    CvMat* candidate = w.get( CvffiEstimatorWorkspace::LO_MODEL, modelSize.height, modelSize.width, CV_MAT_TYPE(model->type) );
+
+    int n = selectPoints( m1, mask->data.ptr, in1 );
+    selectPoints( m2, mask->data.ptr, in2 );
+
+    // With too few inliers to sample from, just refine on all of them
+    int sampleSize = MIN( n/2, LO_SAMPLE_FACTOR*modelPoints ), innerIters = LO_INNER_ITERS;
+    if( sampleSize < minPoints )
+    {
+        sampleSize = n;
+        innerIters = 1;
+    }
+
+    for( int iter = 0; iter < innerIters; iter++ )
+    {
+        // Shuffle a random sample to the front of the inliers
+        for( int i = 0; i < sampleSize && sampleSize < n; i++ )
+        {
+            int j = i + cvRandInt(&rng) % (n - i);
+            std::swap_ranges( in1->data.ptr + i*elemSize1, in1->data.ptr + (i+1)*elemSize1,
+                              in1->data.ptr + j*elemSize1 );
+            std::swap_ranges( in2->data.ptr + i*elemSize2, in2->data.ptr + (i+1)*elemSize2,
+                              in2->data.ptr + j*elemSize2 );
+        }
+
+        CvMat s1 = cvMat( 1, sampleSize, type1, in1->data.ptr );
+        CvMat s2 = cvMat( 1, sampleSize, type2, in2->data.ptr );
+        if( runNonMinimalKernel( &s1, &s2, candidate ) <= 0 )
+            continue;
+
+        int candidateCount = 0;
+        for( int k = 0; k < LO_LSQ_ITERS; k++ )
+        {
+            double t = threshold*(LO_THRESHOLD_FACTOR - (LO_THRESHOLD_FACTOR - 1)*k/(LO_LSQ_ITERS - 1));
+            int m = findInliers( m1, m2, candidate, err, tmask, t );
+            if( m < minPoints )
+                break;
+
+            selectPoints( m1, tmask->data.ptr, ls1 );
+            selectPoints( m2, tmask->data.ptr, ls2 );
+            CvMat l1 = cvMat( 1, m, type1, ls1->data.ptr );
+            CvMat l2 = cvMat( 1, m, type2, ls2->data.ptr );
+            if( runNonMinimalKernel( &l1, &l2, candidate ) <= 0 )
+                break;
+
+            if( k == LO_LSQ_ITERS - 1 )
+                candidateCount = findInliers( m1, m2, candidate, err, tmask, threshold );
+        }
+
+        if( candidateCount > goodCount )
+        {
+            cvCopy( candidate, model );
+            cvCopy( tmask, mask );
+            goodCount = candidateCount;
+        }
+    }
+
+    return goodCount;
+}
+
+
+// Parallel RANSAC.  Hypothesis j is drawn by worker j % T from its own
+// RNG stream, seeded from rng and the worker's index.  The workers share
+// the best inlier count so far, packed with the index of its hypothesis
+// into one int64 so that it can be updated atomically, and a worker
+// stops at hypothesis j once a hypothesis before j has a count whose
+// iteration bound is j or less.
+//
+// The hypotheses are then replayed in order as the sequential loop would
+// see them, which by that rule never reaches one that wasn't drawn, so
+// the result depends only on the seed and T.  Degeneracy checks and
+// local optimisation run in the replay, redrawing the new best's sample
+// from the saved RNG state.
+
+static const int PARALLEL_SUBSET_ATTEMPTS = 300;
+
+enum { HYPOTHESIS_UNSEEN = -2, HYPOTHESIS_FAILED = -1 };
+
+struct RansacHypothesis
+{
+    uint64 rng;     // the worker's RNG before drawing the sample
+    int count;      // inliers to the sample's best model, or HYPOTHESIS_*
+    int model;      // which of the sample's models that was
+};
+
+// Larger for more inliers, then for an earlier hypothesis
+static inline int64 packBest( int count, int index )
+{
+    return ((int64)count << 32) | (unsigned)(INT_MAX - index);
+}
+
+static inline int bestCount( int64 best ) { return (int)(best >> 32); }
+static inline int bestIndex( int64 best ) { return INT_MAX - (int)(best & 0xffffffff); }
+
+static void updateBest( volatile int64* best, int64 candidate )
+{
+    int64 current = __sync_fetch_and_add( best, 0 );
+    while( candidate > current )
+    {
+        int64 seen = __sync_val_compare_and_swap( best, current, candidate );
+        if( seen == current )
+            break;
+        current = seen;
+    }
+}
+
+// splitmix64, so that neighbouring workers get unrelated streams
+static uint64 streamSeed( uint64 base, int worker )
+{
+    uint64 z = base + (uint64)(worker + 1)*0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+struct CvffiModelEstimator2::RansacWorker : public cv::ParallelLoopBody
+{
+    RansacWorker( CvffiModelEstimator2& _estimator, const CvMat* _m1, const CvMat* _m2,
+                  double _threshold, double _confidence, uint64 _seed, int _workers,
+                  std::vector<RansacHypothesis>& _hypotheses, volatile int64* _best )
+        : estimator( _estimator ), m1( _m1 ), m2( _m2 ),
+          threshold( _threshold ), confidence( _confidence ), seed( _seed ), workers( _workers ),
+          hypotheses( _hypotheses ), best( _best )
+    {}
+
+    virtual void operator()( const cv::Range& range ) const
+    {
+        for( int w = range.start; w < range.end; w++ )
+            run( w );
+    }
+
+    void run( int w ) const
+    {
+        CvffiModelEstimator2& e = estimator;
+        int count = m1->rows*m1->cols, maxIters = e.maxIters;
+        cv::Ptr<CvMat> ms1 = cvCreateMat( 1, e.modelPoints, m1->type );
+        cv::Ptr<CvMat> ms2 = cvCreateMat( 1, e.modelPoints, m2->type );
+        cv::Ptr<CvMat> models = cvCreateMat( e.modelSize.height*e.maxBasicSolutions, e.modelSize.width, CV_64FC1 );
+        cv::Ptr<CvMat> err = cvCreateMat( 1, count, CV_32FC1 );
+        cv::Ptr<CvMat> tmask = cvCreateMat( 1, count, CV_8UC1 );
+        CvRNG rng = cvRNG( streamSeed( seed, w ) );
+
+        for( int j = w; j < maxIters; j += workers )
+        {
+            int64 b = __sync_fetch_and_add( best, 0 );
+            if( bestIndex(b) < j && j >= cvRANSACUpdateNumIters( confidence,
+                    (double)(count - bestCount(b))/count, e.modelPoints, maxIters ) )
+                break;
+
+            RansacHypothesis& h = hypotheses[j];
+            h.rng = rng;
+            if( !e.getSubset( m1, m2, ms1, ms2, PARALLEL_SUBSET_ATTEMPTS, rng ) )
+            {
+                h.count = HYPOTHESIS_FAILED;
+                break;
+            }
+
+            int nmodels = e.runKernel( ms1, ms2, models );
+            h.count = 0;
+            h.model = 0;
+            for( int i = 0; i < nmodels; i++ )
+            {
+                CvMat model_i;
+                cvGetRows( models, &model_i, i*e.modelSize.height, (i+1)*e.modelSize.height );
+                int goodCount = e.findInliers( m1, m2, &model_i, err, tmask, threshold );
+                if( goodCount > h.count )
+                {
+                    h.count = goodCount;
+                    h.model = i;
+                }
+            }
+            updateBest( best, packBest( h.count, j ) );
+        }
+    }
+
+    CvffiModelEstimator2& estimator;
+    const CvMat *m1, *m2;
+    double threshold, confidence;
+    uint64 seed;
+    int workers;
+    std::vector<RansacHypothesis>& hypotheses;
+    volatile int64* best;
+};
+
+bool CvffiModelEstimator2::runParallelRANSAC( const CvMat* m1, const CvMat* m2, CvMat* model,
+                                            CvMat* mask0, int &totalIters,
+                                            double reprojThreshold, double confidence )
+{
+    int count = m1->rows*m1->cols, maxGoodCount = 0;
+    int workers = MAX( cv::getNumThreads(), 1 );
+
+    RansacHypothesis unseen = { 0, HYPOTHESIS_UNSEEN, 0 };
+    std::vector<RansacHypothesis> hypotheses( maxIters, unseen );
+    volatile int64 best = packBest( 0, INT_MAX );
+
+    uint64 seed = rng;
+    cvRandInt( &rng );
+    cv::parallel_for_( cv::Range( 0, workers ),
+                       RansacWorker( *this, m1, m2, reprojThreshold, confidence, seed, workers, hypotheses, &best ) );
+
+    CvffiEstimatorWorkspace& w = ws();
+    CvMat* mask = w.get( CvffiEstimatorWorkspace::MASK, mask0->rows, mask0->cols, CV_8UC1 );
+    CvMat* models = w.get( CvffiEstimatorWorkspace::MODELS, modelSize.height*maxBasicSolutions, modelSize.width, CV_64FC1 );
+    CvMat* err = w.get( CvffiEstimatorWorkspace::ERR, 1, count, CV_32FC1 );
+    CvMat* ms1 = w.get( CvffiEstimatorWorkspace::SAMPLE1, 1, modelPoints, CV_MAT_TYPE(m1->type) );
+    CvMat* ms2 = w.get( CvffiEstimatorWorkspace::SAMPLE2, 1, modelPoints, CV_MAT_TYPE(m2->type) );
+    cvCopy( mask0, mask );
+
+    int iter, niters = maxIters;
+    for( iter = 0; iter < niters; iter++ )
+    {
+        const RansacHypothesis& h = hypotheses[iter];
+        CV_Assert( h.count != HYPOTHESIS_UNSEEN );
+        if( h.count == HYPOTHESIS_FAILED )
+        {
+            if( iter == 0 )
+                return false;
+            break;
+        }
+        if( h.count <= MAX(maxGoodCount, modelPoints-1) )
+            continue;
+
+        CvRNG r = h.rng;
+        CvMat model_i;
+        getSubset( m1, m2, ms1, ms2, PARALLEL_SUBSET_ATTEMPTS, r );
+        runKernel( ms1, ms2, models );
+        cvGetRows( models, &model_i, h.model*modelSize.height, (h.model+1)*modelSize.height );
+
+        int goodCount = findInliers( m1, m2, &model_i, err, mask, reprojThreshold );
+        cvCopy( &model_i, model );
+        goodCount = checkDegeneracy( ms1, ms2, m1, m2, model, mask, goodCount, reprojThreshold );
+        if( flags & CV_RANSAC_LO )
+            goodCount = localOptimize( m1, m2, model, mask, goodCount, reprojThreshold );
+        maxGoodCount = goodCount;
+        niters = cvRANSACUpdateNumIters( confidence,
+            (double)(count - goodCount)/count, modelPoints, niters );
+    }
+
+    totalIters = iter;
+    if( maxGoodCount == 0 )
+        return false;
+
+    cvCopy( mask, mask0 );
+    return true;
+}
+
+
 bool CvffiModelEstimator2::runRANSAC( const CvMat* m1, const CvMat* m2, CvMat* model,
                                     CvMat* mask0, int &totalIters,
                                     double reprojThreshold, 
@@ -132,32 +675,47 @@ bool CvffiModelEstimator2::runRANSAC( const CvMat* m1, const CvMat* m2, CvMat* m
 {
 
     bool result = false;
-    cv::Ptr<CvMat> mask = cvCloneMat(mask0);
-    cv::Ptr<CvMat> models, err, tmask;
-    cv::Ptr<CvMat> ms1, ms2;
+    CvMat *mask, *models, *err, *tmask;
+    CvMat *ms1, *ms2;
 
     int count = m1->rows*m1->cols, maxGoodCount = 0;
-    CV_Assert( CV_ARE_SIZES_EQ(m1, m2) && CV_ARE_SIZES_EQ(m1, mask) );
+    CV_Assert( CV_ARE_SIZES_EQ(m1, m2) && CV_ARE_SIZES_EQ(m1, mask0) );
 
     int iter, niters = maxIters;
+    sprtRejections = 0;
 
     if( count < modelPoints )
       return false;
 
-    models = cvCreateMat( modelSize.height*maxBasicSolutions, modelSize.width, CV_64FC1 );
-    err = cvCreateMat( 1, count, CV_32FC1 );
-    tmask = cvCreateMat( 1, count, CV_8UC1 );
+    if( (flags & CV_RANSAC_PARALLEL) && count > modelPoints )
+      return runParallelRANSAC( m1, m2, model, mask0, totalIters, reprojThreshold, confidence );
+
+    CvffiEstimatorWorkspace& w = ws();
+    mask = w.get( CvffiEstimatorWorkspace::MASK, mask0->rows, mask0->cols, CV_8UC1 );
+    cvCopy( mask0, mask );
+    models = w.get( CvffiEstimatorWorkspace::MODELS, modelSize.height*maxBasicSolutions, modelSize.width, CV_64FC1 );
+    err = w.get( CvffiEstimatorWorkspace::ERR, 1, count, CV_32FC1 );
+    tmask = w.get( CvffiEstimatorWorkspace::TMASK, 1, count, CV_8UC1 );
     
     if( count > modelPoints )
     {
-        ms1 = cvCreateMat( 1, modelPoints, m1->type );
-        ms2 = cvCreateMat( 1, modelPoints, m2->type );
+        ms1 = w.get( CvffiEstimatorWorkspace::SAMPLE1, 1, modelPoints, CV_MAT_TYPE(m1->type) );
+        ms2 = w.get( CvffiEstimatorWorkspace::SAMPLE2, 1, modelPoints, CV_MAT_TYPE(m2->type) );
     }
     else
     {
         niters = 1;
-        ms1 = cvCloneMat(m1);
-        ms2 = cvCloneMat(m2);
+        ms1 = w.get( CvffiEstimatorWorkspace::SAMPLE1, m1->rows, m1->cols, CV_MAT_TYPE(m1->type) );
+        ms2 = w.get( CvffiEstimatorWorkspace::SAMPLE2, m2->rows, m2->cols, CV_MAT_TYPE(m2->type) );
+        cvCopy( m1, ms1 );
+        cvCopy( m2, ms2 );
+    }
+
+    SprtState sprtState, *sprt = 0;
+    if( (flags & CV_RANSAC_SPRT) && count > modelPoints )
+    {
+        sprtState.init( m1, m2, rng, w );
+        sprt = &sprtState;
     }
 
     for( iter = 0; iter < niters; iter++ )
@@ -175,21 +733,38 @@ bool CvffiModelEstimator2::runRANSAC( const CvMat* m1, const CvMat* m2, CvMat* m
         }
 
         nmodels = runKernel( ms1, ms2, models );
+        if( sprt )
+        {
+            sprt->samples++;
+            sprt->models += MAX( nmodels, 0 );
+        }
         if( nmodels <= 0 )
             continue;
         for( i = 0; i < nmodels; i++ )
         {
             CvMat model_i;
             cvGetRows( models, &model_i, i*modelSize.height, (i+1)*modelSize.height );
-            goodCount = findInliers( m1, m2, &model_i, err, tmask, reprojThreshold );
+            if( !sprt )
+                goodCount = findInliers( m1, m2, &model_i, err, tmask, reprojThreshold );
+            else
+                goodCount = findInliersSPRT( &model_i, reprojThreshold, tmask, *sprt );
 
             if( goodCount > MAX(maxGoodCount, modelPoints-1) )
             {
                 std::swap(tmask, mask);
                 cvCopy( &model_i, model );
+                goodCount = checkDegeneracy( ms1, ms2, m1, m2, model, mask, goodCount, reprojThreshold );
+                if( flags & CV_RANSAC_LO )
+                    goodCount = localOptimize( m1, m2, model, mask, goodCount, reprojThreshold );
                 maxGoodCount = goodCount;
-                niters = cvRANSACUpdateNumIters( confidence,
-                    (double)(count - goodCount)/count, modelPoints, niters );
+                if( !sprt )
+                    niters = cvRANSACUpdateNumIters( confidence,
+                        (double)(count - goodCount)/count, modelPoints, niters );
+                else
+                {
+                    sprt->accepted( goodCount, count );
+                    niters = sprt->updateNumIters( confidence, goodCount, count, modelPoints, niters );
+                }
             }
         }
     }
@@ -197,6 +772,255 @@ bool CvffiModelEstimator2::runRANSAC( const CvMat* m1, const CvMat* m2, CvMat* m
     if( iter == maxIters )
       printf( "Ran to max iters %d\n", iter );
 
+    if( sprt )
+        sprtRejections = sprt->rejections;
+
+    if( maxGoodCount > 0 )
+    {
+        if( mask != mask0 )
+            cvCopy( mask, mask0 );
+        result = true;
+    }
+
+    totalIters = iter;
+
+    return result;
+}
+
+
+// PROSAC (Chum and Matas, "Matching with PROSAC -- Progressive Sample
+// Consensus", CVPR 2005).  Samples are drawn from a pool of the
+// best-ranked correspondences which grows as sampling goes on, so good
+// hypotheses turn up long before uniform sampling would find them.
+// After PROSAC_MAX_SAMPLES samples the pool is the whole set and this
+// is plain RANSAC.
+//
+// quality has one score per correspondence, higher being better (a
+// match's ratio, or its negated distance).  If NULL the correspondences
+// are taken to be sorted best first already.
+
+static const double PROSAC_MAX_SAMPLES = 200000;
+
+// Probability that a correspondence is consistent with a wrong model,
+// and how likely an inlier count may be to have come from one and
+// still count as non-random
+static const double PROSAC_BETA = 0.05;
+static const double PROSAC_PSI = 0.05;
+
+// Smallest pool which may end sampling early:  a handful of top-ranked
+// correspondences all agreeing with a model says little about it, and
+// would let a rough one stop PROSAC after a sample or two
+static const int PROSAC_MIN_STOP_POOL = 20;
+
+struct QualityGreater
+{
+    QualityGreater( const double* _q ) : q(_q) {}
+    bool operator()( int a, int b ) const { return q[a] > q[b]; }
+    const double* q;
+};
+
+// Probability that a wrong model finds k of the trials other
+// correspondences consistent with it
+static double prosacBinomial( int k, int trials )
+{
+    return exp( lgamma( trials + 1. ) - lgamma( k + 1. ) - lgamma( trials - k + 1. ) +
+                k*log( PROSAC_BETA ) + (trials - k)*log( 1 - PROSAC_BETA ) );
+}
+
+// I_n^min for each pool of the first n correspondences, n from
+// modelPoints to count:  the smallest inlier count which a wrong model
+// reaches with probability under PROSAC_PSI, its sample's modelPoints
+// plus a binomial number of the other n - modelPoints.  Greater than n
+// for the smallest pools, which can never be told from chance.  The
+// binomial quantile never falls as n grows, so each n starts from the
+// last and sums only the upper tail.
+static void prosacMinInliers( int count, int modelPoints, int* minInliers )
+{
+    double odds = PROSAC_BETA/(1 - PROSAC_BETA);
+    int k = 0;
+    for( int n = modelPoints; n <= count; n++ )
+    {
+        int trials = n - modelPoints;
+        double p = prosacBinomial( k, trials ), tail = 0;
+        for( int i = k; i <= trials && p > tail*DBL_EPSILON; i++ )
+        {
+            tail += p;
+            p *= (double)(trials - i)/(i + 1)*odds;
+        }
+        for( ; k <= trials && tail >= PROSAC_PSI; k++ )
+            tail -= prosacBinomial( k, trials );
+        minInliers[n] = modelPoints + k;
+    }
+}
+
+// Samples needed from the first n correspondences, which hold
+// inlierCounts[n] inliers, for one to have been all inliers with the
+// given confidence:  maxIters unless sampling has gone far enough for
+// the pool to end it early.  Pools short of PROSAC_MIN_STOP_POOL, or
+// whose inlier counts could be down to chance, don't.
+int CvffiModelEstimator2::prosacNumIters( const int* inlierCounts, const int* minInliers,
+                                          int n, int count, double confidence,
+                                          const SprtState* sprt ) const
+{
+    if( (n < PROSAC_MIN_STOP_POOL && n < count) || inlierCounts[n] < minInliers[n] )
+        return maxIters;
+
+    return !sprt ?
+        cvRANSACUpdateNumIters( confidence, (double)(n - inlierCounts[n])/n, modelPoints, maxIters ) :
+        sprt->updateNumIters( confidence, inlierCounts[n], n, modelPoints, maxIters );
+}
+
+bool CvffiModelEstimator2::runPROSAC( const CvMat* m1, const CvMat* m2, CvMat* model,
+                                    CvMat* mask0, int &totalIters,
+                                    double reprojThreshold,
+                                    double confidence, const CvMat* quality )
+{
+    bool result = false;
+    CvMat *mask, *models, *err, *tmask;
+    CvMat *ms1, *ms2;
+
+    int count = m1->rows*m1->cols, maxGoodCount = 0;
+    CV_Assert( CV_ARE_SIZES_EQ(m1, m2) && CV_ARE_SIZES_EQ(m1, mask0) );
+
+    if( count <= modelPoints )
+        return runRANSAC( m1, m2, model, mask0, totalIters, reprojThreshold, confidence );
+
+    sprtRejections = 0;
+    CvffiEstimatorWorkspace& w = ws();
+
+    // order[i] is the index of the i'th best correspondence
+    int* order = w.get( CvffiEstimatorWorkspace::ORDER, 1, count, CV_32SC1 )->data.i;
+    for( int i = 0; i < count; i++ )
+        order[i] = i;
+
+    if( quality )
+    {
+        CV_Assert( CV_IS_MAT_CONT(quality->type) && CV_MAT_CN(quality->type) == 1 &&
+                   quality->rows*quality->cols == count );
+
+        CvMat* q = w.get( CvffiEstimatorWorkspace::QUALITY, 1, count, CV_64FC1 );
+        CvMat qrow;
+        cvConvert( cvReshape( quality, &qrow, 1, 1 ), q );
+        std::stable_sort( order, order + count, QualityGreater( q->data.db ) );
+    }
+
+    mask = w.get( CvffiEstimatorWorkspace::MASK, mask0->rows, mask0->cols, CV_8UC1 );
+    cvCopy( mask0, mask );
+    models = w.get( CvffiEstimatorWorkspace::MODELS, modelSize.height*maxBasicSolutions, modelSize.width, CV_64FC1 );
+    err = w.get( CvffiEstimatorWorkspace::ERR, 1, count, CV_32FC1 );
+    tmask = w.get( CvffiEstimatorWorkspace::TMASK, 1, count, CV_8UC1 );
+    ms1 = w.get( CvffiEstimatorWorkspace::SAMPLE1, 1, modelPoints, CV_MAT_TYPE(m1->type) );
+    ms2 = w.get( CvffiEstimatorWorkspace::SAMPLE2, 1, modelPoints, CV_MAT_TYPE(m2->type) );
+
+    // Tn is the expected number of samples drawn only from the first n
+    // correspondences in PROSAC_MAX_SAMPLES uniform ones, Tn1 its integer
+    // counterpart T'n.  The pool grows to n+1 once that many are drawn.
+    int n = modelPoints, nStar = count;
+    double Tn = PROSAC_MAX_SAMPLES;
+    for( int i = 0; i < modelPoints; i++ )
+        Tn *= (double)(modelPoints - i)/(count - i);
+    int Tn1 = 1;
+
+    int iter, niters = maxIters;
+    int* inlierCounts = w.get( CvffiEstimatorWorkspace::INLIER_COUNTS, 1, count+1, CV_32SC1 )->data.i;
+    int* minInliers = w.get( CvffiEstimatorWorkspace::MIN_INLIERS, 1, count+1, CV_32SC1 )->data.i;
+    prosacMinInliers( count, modelPoints, minInliers );
+
+    SprtState sprtState, *sprt = 0;
+    if( flags & CV_RANSAC_SPRT )
+    {
+        sprtState.init( m1, m2, rng, w );
+        sprt = &sprtState;
+    }
+
+    for( iter = 0; iter < niters; iter++ )
+    {
+        int i, goodCount, nmodels;
+
+        if( iter+1 == Tn1 && n < nStar )
+        {
+            double TnNext = Tn*(n + 1)/(n + 1 - modelPoints);
+            Tn1 += cvCeil( TnNext - Tn );
+            Tn = TnNext;
+            n++;
+
+            // The pool just reached may be pure enough to stop on
+            if( maxGoodCount > 0 )
+            {
+                int k = prosacNumIters( inlierCounts, minInliers, n, count, confidence, sprt );
+                if( k < niters )
+                {
+                    niters = k;
+                    nStar = n;
+                }
+                if( iter >= niters )
+                    break;
+            }
+        }
+
+        // Up to and including the T'n'th sample, each includes the n'th
+        // correspondence
+        bool found = getProsacSubset( m1, m2, ms1, ms2, order, n, Tn1 >= iter+1, 300 );
+        if( !found )
+        {
+            if( iter == 0 )
+                return false;
+            break;
+        }
+
+        nmodels = runKernel( ms1, ms2, models );
+        if( sprt )
+        {
+            sprt->samples++;
+            sprt->models += MAX( nmodels, 0 );
+        }
+        if( nmodels <= 0 )
+            continue;
+        for( i = 0; i < nmodels; i++ )
+        {
+            CvMat model_i;
+            cvGetRows( models, &model_i, i*modelSize.height, (i+1)*modelSize.height );
+            if( !sprt )
+                goodCount = findInliers( m1, m2, &model_i, err, tmask, reprojThreshold );
+            else
+                goodCount = findInliersSPRT( &model_i, reprojThreshold, tmask, *sprt );
+
+            if( goodCount > MAX(maxGoodCount, modelPoints-1) )
+            {
+                std::swap(tmask, mask);
+                cvCopy( &model_i, model );
+                goodCount = checkDegeneracy( ms1, ms2, m1, m2, model, mask, goodCount, reprojThreshold );
+                if( flags & CV_RANSAC_LO )
+                    goodCount = localOptimize( m1, m2, model, mask, goodCount, reprojThreshold );
+                maxGoodCount = goodCount;
+                if( sprt )
+                    sprt->accepted( goodCount, count );
+
+                // Stop once a sample from the first nStar correspondences
+                // would have been all inliers with the given confidence,
+                // choosing nStar to need as few samples as possible among
+                // the pools sampling has reached
+                const uchar* inliers = mask->data.ptr;
+                inlierCounts[0] = 0;
+                for( int j = 0; j < count; j++ )
+                    inlierCounts[j+1] = inlierCounts[j] + (inliers[order[j]] != 0);
+
+                for( int j = count; j > modelPoints; j = (j == count ? MIN( n, count-1 ) : j-1) )
+                {
+                    int k = prosacNumIters( inlierCounts, minInliers, j, count, confidence, sprt );
+                    if( k < niters )
+                    {
+                        niters = k;
+                        nStar = j;
+                    }
+                }
+            }
+        }
+    }
+
+    if( sprt )
+        sprtRejections = sprt->rejections;
+
     if( maxGoodCount > 0 )
     {
         if( mask != mask0 )
@@ -217,9 +1041,7 @@ bool CvffiModelEstimator2::runLMeDS( const CvMat* m1, const CvMat* m2, CvMat* mo
 {
     const double outlierRatio = 0.45;
     bool result = false;
-    cv::Ptr<CvMat> models;
-    cv::Ptr<CvMat> ms1, ms2;
-    cv::Ptr<CvMat> err;
+    CvMat *models, *ms1, *ms2, *err;
 
     int count = m1->rows*m1->cols;
     double minMedian = DBL_MAX, sigma;
@@ -238,19 +1060,22 @@ bool CvffiModelEstimator2::runLMeDS( const CvMat* m1, const CvMat* m2, CvMat* mo
     if( count < modelPoints )
         return false;
 
-    models = cvCreateMat( modelSize.height*maxBasicSolutions, modelSize.width, CV_64FC1 );
-    err = cvCreateMat( 1, count, CV_32FC1 );
+    CvffiEstimatorWorkspace& w = ws();
+    models = w.get( CvffiEstimatorWorkspace::MODELS, modelSize.height*maxBasicSolutions, modelSize.width, CV_64FC1 );
+    err = w.get( CvffiEstimatorWorkspace::ERR, 1, count, CV_32FC1 );
     
     if( count > modelPoints )
     {
-        ms1 = cvCreateMat( 1, modelPoints, m1->type );
-        ms2 = cvCreateMat( 1, modelPoints, m2->type );
+        ms1 = w.get( CvffiEstimatorWorkspace::SAMPLE1, 1, modelPoints, CV_MAT_TYPE(m1->type) );
+        ms2 = w.get( CvffiEstimatorWorkspace::SAMPLE2, 1, modelPoints, CV_MAT_TYPE(m2->type) );
     }
     else
     {
         niters = 1;
-        ms1 = cvCloneMat(m1);
-        ms2 = cvCloneMat(m2);
+        ms1 = w.get( CvffiEstimatorWorkspace::SAMPLE1, m1->rows, m1->cols, CV_MAT_TYPE(m1->type) );
+        ms2 = w.get( CvffiEstimatorWorkspace::SAMPLE2, m2->rows, m2->cols, CV_MAT_TYPE(m2->type) );
+        cvCopy( m1, ms1 );
+        cvCopy( m2, ms2 );
     }
 
     niters = cvRound(log(1-confidence)/log(1-pow(1-outlierRatio,(double)modelPoints)));
@@ -306,6 +1131,14 @@ bool CvffiModelEstimator2::runLMeDS( const CvMat* m1, const CvMat* m2, CvMat* mo
 
 bool CvffiModelEstimator2::getSubset( const CvMat* m1, const CvMat* m2,
                                    CvMat* ms1, CvMat* ms2, int maxAttempts )
+{
+    return getSubset( m1, m2, ms1, ms2, maxAttempts, rng );
+}
+
+// As getSubset, drawing from the given RNG
+bool CvffiModelEstimator2::getSubset( const CvMat* m1, const CvMat* m2,
+                                   CvMat* ms1, CvMat* ms2, int maxAttempts,
+                                   CvRNG& rng )
 {
     cv::AutoBuffer<int> _idx(modelPoints);
     int* idx = _idx;
@@ -350,6 +1183,61 @@ bool CvffiModelEstimator2::getSubset( const CvMat* m1, const CvMat* m2,
 }
 
 
+// As getSubset, but drawing from the first n correspondences in order.
+// If includeLast, the n'th is always in the subset and the rest come
+// from the first n-1.
+bool CvffiModelEstimator2::getProsacSubset( const CvMat* m1, const CvMat* m2,
+                                         CvMat* ms1, CvMat* ms2, const int* order,
+                                         int n, bool includeLast, int maxAttempts )
+{
+    cv::AutoBuffer<int> _idx(modelPoints);
+    int* idx = _idx;
+    int i = 0, j, k, idx_i, iters = 0;
+    int type = CV_MAT_TYPE(m1->type), elemSize = CV_ELEM_SIZE(type);
+    const int *m1ptr = m1->data.i, *m2ptr = m2->data.i;
+    int *ms1ptr = ms1->data.i, *ms2ptr = ms2->data.i;
+    int pool = includeLast ? n-1 : n;
+
+    assert( CV_IS_MAT_CONT(m1->type & m2->type) && (elemSize % sizeof(int) == 0) );
+    assert( n >= modelPoints && n <= m1->cols*m1->rows );
+    elemSize /= sizeof(int);
+
+    for(; iters < maxAttempts; iters++)
+    {
+        for( i = 0; i < modelPoints && iters < maxAttempts; )
+        {
+            if( includeLast && i == 0 )
+                idx_i = order[n-1];
+            else
+                idx_i = order[ cvRandInt(&rng) % pool ];
+            idx[i] = idx_i;
+            for( j = 0; j < i; j++ )
+                if( idx_i == idx[j] )
+                    break;
+            if( j < i )
+                continue;
+            for( k = 0; k < elemSize; k++ )
+            {
+                ms1ptr[i*elemSize + k] = m1ptr[idx_i*elemSize + k];
+                ms2ptr[i*elemSize + k] = m2ptr[idx_i*elemSize + k];
+            }
+            if( checkPartialSubsets && (!checkSubset( ms1, i+1 ) || !checkSubset( ms2, i+1 )))
+            {
+                iters++;
+                continue;
+            }
+            i++;
+        }
+        if( !checkPartialSubsets && i == modelPoints &&
+            (!checkSubset( ms1, i ) || !checkSubset( ms2, i )))
+            continue;
+        break;
+    }
+
+    return i == modelPoints && iters < maxAttempts;
+}
+
+
 bool CvffiModelEstimator2::checkSubset( const CvMat* m, int count )
 {
     int j, k, i, i0, i1;
@@ -6,6 +6,8 @@
 
 #include <stdio.h>
 
+#include "cvffi_reproj.h"
+
 // n.b. I've changed the API.  It now assumes _m1 is an  N x 2 1-channel matrix, 
 // not a N x 1 2-channel matrix.  As such, count = _m1->rows, 
 // not _m1->rows * _m1->cols as before
@@ -14,81 +16,19 @@
 //
 CV_IMPL void cvFMaxReprojError( const CvMat* _m1, const CvMat* _m2, const CvMat* model, CvMat* _err )
 {
-    int i, count = _m1->rows;
-    const CvPoint2D64f* m1 = (const CvPoint2D64f*)_m1->data.ptr;
-    const CvPoint2D64f* m2 = (const CvPoint2D64f*)_m2->data.ptr;
-    const double* F = model->data.db;
-    float* err = _err->data.fl;
-    
-    for( i = 0; i < count; i++ )
-    {
-        double a, b, c, d1, d2, s1, s2;
-
-        a = F[0]*m1[i].x + F[1]*m1[i].y + F[2];
-        b = F[3]*m1[i].x + F[4]*m1[i].y + F[5];
-        c = F[6]*m1[i].x + F[7]*m1[i].y + F[8];
-
-        s2 = 1./(a*a + b*b);
-        d2 = m2[i].x*a + m2[i].y*b + c;
-
-        a = F[0]*m2[i].x + F[3]*m2[i].y + F[6];
-        b = F[1]*m2[i].x + F[4]*m2[i].y + F[7];
-        c = F[2]*m2[i].x + F[5]*m2[i].y + F[8];
-
-        s1 = 1./(a*a + b*b);
-        d1 = m1[i].x*a + m1[i].y*b + c;
-
-        err[i] = (float)std::max(d1*d1*s1, d2*d2*s2);
-    }
+    cvffiEpipolarErrors( (const CvPoint2D64f*)_m1->data.ptr, (const CvPoint2D64f*)_m2->data.ptr,
+                         _m1->rows, model->data.db, _err->data.fl, 0, 0 );
 }
 
 CV_IMPL void cvHMaxReprojError( const CvMat* _m1, const CvMat* _m2, const CvMat* model, CvMat* _err )
 {
-    int i, count = _m1->rows;
-    const CvPoint2D64f* m1 = (const CvPoint2D64f*)_m1->data.ptr;
-    const CvPoint2D64f* m2 = (const CvPoint2D64f*)_m2->data.ptr;
-
-    CvMat *h = cvCreateMat( 3, 3, CV_64FC1 );
-    cvCopy( model, h );
-    const double* H = h->data.db;
-
-    float* err = _err->data.fl;
+    double h[9], hinv[9];
+    CvMat _h = cvMat( 3, 3, CV_64FC1, h ), _hinv = cvMat( 3, 3, CV_64FC1, hinv );
+    cvCopy( model, &_h );
 
     // Need to invert H
-    CvMat *hinv = cvCreateMat( 3, 3, CV_64FC1 );
-    cvInvert( model, hinv );
-    const double* Hi = hinv->data.db;
-
-    for( i = 0; i < count; i++ )
-    {
-        double a, b, c, d1, d2;
-
-        // This is H m1 
-        a = H[0]*m1[i].x + H[1]*m1[i].y + H[2];
-        b = H[3]*m1[i].x + H[4]*m1[i].y + H[5];
-        c = H[6]*m1[i].x + H[7]*m1[i].y + H[8];
+    cvInvert( model, &_hinv );
 
-        a /= c;
-        b /= c;
-        d1 = (m2[i].x - a)*(m2[i].x - a) + (m2[i].y - b)*(m2[i].y - b);
-
-        // This is H^(-1) m2
-        a = Hi[0]*m2[i].x + Hi[1]*m2[i].y + Hi[2];
-        b = Hi[3]*m2[i].x + Hi[4]*m2[i].y + Hi[5];
-        c = Hi[6]*m2[i].x + Hi[7]*m2[i].y + Hi[8];
-
-
-        a /= c;
-        b /= c;
-        d2 = (m1[i].x - a)*(m1[i].x - a) + (m1[i].y - b)*(m1[i].y - b);
-
-        err[i] = (float)std::max(d1, d2);
-    }
-
-
-    cvReleaseMat( &hinv );
-    cvReleaseMat( &h );
+    cvffiSymmetricTransferErrors( (const CvPoint2D64f*)_m1->data.ptr, (const CvPoint2D64f*)_m2->data.ptr,
+                                  _m1->rows, h, hinv, _err->data.fl, 0, 0 );
 }
-
-
-
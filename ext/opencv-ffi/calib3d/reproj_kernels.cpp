@@ -0,0 +1,292 @@
+
+// Reprojection error kernels for the estimators and reproj.cpp, with
+// the inlier test fused in so the errors needn't be written out.  Each
+// has a portable version and an AVX2 version which does four points at
+// a time in double precision;  the best the CPU supports is picked when
+// the library is loaded.
+//
+// The points stay interleaved (x,y) in memory, as CvPoint2D64f, since
+// every caller hands them over that way and a separate x/y copy would
+// have to be redone whenever the points move (SPRT's shuffle, LO's
+// inlier sets, the workspace's next call).  Instead the AVX2 kernels
+// split four points into x and y registers with two shuffles per load.
+//
+// No FMA:  the vector kernels round exactly as the scalar ones do, so
+// inlier sets (and seeded runs) don't depend on the CPU.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REPROJ_X86
+#endif
+
+#include "cvffi_reproj.h"
+
+typedef int (*ReprojKernel)( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                             const double* model, float* err, uchar* mask, double threshold );
+
+// Stores one error and its inlier flag, returning the flag
+static inline int storeError( int i, double e, float* err, uchar* mask, double threshold )
+{
+    float ef = (float)e;
+    int inlier = ef <= threshold;
+    if( err )
+        err[i] = ef;
+    if( mask )
+        mask[i] = (uchar)inlier;
+    return inlier;
+}
+
+//##### Portable kernels #######
+//
+// These also finish off the points left over by the vector kernels.
+
+static int epipolarScalar( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                           const double* F, float* err, uchar* mask, double threshold )
+{
+    int goodCount = 0;
+    for( int i = 0; i < count; i++ )
+    {
+        double a, b, c, d1, d2, s1, s2;
+
+        a = F[0]*m1[i].x + F[1]*m1[i].y + F[2];
+        b = F[3]*m1[i].x + F[4]*m1[i].y + F[5];
+        c = F[6]*m1[i].x + F[7]*m1[i].y + F[8];
+
+        s2 = 1./(a*a + b*b);
+        d2 = m2[i].x*a + m2[i].y*b + c;
+
+        a = F[0]*m2[i].x + F[3]*m2[i].y + F[6];
+        b = F[1]*m2[i].x + F[4]*m2[i].y + F[7];
+        c = F[2]*m2[i].x + F[5]*m2[i].y + F[8];
+
+        s1 = 1./(a*a + b*b);
+        d1 = m1[i].x*a + m1[i].y*b + c;
+
+        goodCount += storeError( i, std::max(d1*d1*s1, d2*d2*s2), err, mask, threshold );
+    }
+    return goodCount;
+}
+
+static int transferScalar( const CvPoint2D64f* M, const CvPoint2D64f* m, int count,
+                           const double* H, float* err, uchar* mask, double threshold )
+{
+    int goodCount = 0;
+    for( int i = 0; i < count; i++ )
+    {
+        double ww = 1./(H[6]*M[i].x + H[7]*M[i].y + 1.);
+        double dx = (H[0]*M[i].x + H[1]*M[i].y + H[2])*ww - m[i].x;
+        double dy = (H[3]*M[i].x + H[4]*M[i].y + H[5])*ww - m[i].y;
+        goodCount += storeError( i, dx*dx + dy*dy, err, mask, threshold );
+    }
+    return goodCount;
+}
+
+// H then H^-1 in model[0..17]
+static int symmetricTransferScalar( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                                    const double* model, float* err, uchar* mask, double threshold )
+{
+    const double *H = model, *Hi = model + 9;
+    int goodCount = 0;
+    for( int i = 0; i < count; i++ )
+    {
+        double a, b, c, d1, d2;
+
+        // This is H m1
+        a = H[0]*m1[i].x + H[1]*m1[i].y + H[2];
+        b = H[3]*m1[i].x + H[4]*m1[i].y + H[5];
+        c = H[6]*m1[i].x + H[7]*m1[i].y + H[8];
+
+        a /= c;
+        b /= c;
+        d1 = (m2[i].x - a)*(m2[i].x - a) + (m2[i].y - b)*(m2[i].y - b);
+
+        // This is H^(-1) m2
+        a = Hi[0]*m2[i].x + Hi[1]*m2[i].y + Hi[2];
+        b = Hi[3]*m2[i].x + Hi[4]*m2[i].y + Hi[5];
+        c = Hi[6]*m2[i].x + Hi[7]*m2[i].y + Hi[8];
+
+        a /= c;
+        b /= c;
+        d2 = (m1[i].x - a)*(m1[i].x - a) + (m1[i].y - b)*(m1[i].y - b);
+
+        goodCount += storeError( i, std::max(d1, d2), err, mask, threshold );
+    }
+    return goodCount;
+}
+
+//##### AVX2 kernels #######
+
+#ifdef REPROJ_X86
+
+// Four interleaved points into their x's and y's, in order
+__attribute__((target("avx2")))
+static inline void loadPointsAVX2( const CvPoint2D64f* p, __m256d& x, __m256d& y )
+{
+    __m256d a = _mm256_loadu_pd( &p[0].x ), b = _mm256_loadu_pd( &p[2].x );
+    x = _mm256_permute4x64_pd( _mm256_unpacklo_pd( a, b ), 0xd8 );
+    y = _mm256_permute4x64_pd( _mm256_unpackhi_pd( a, b ), 0xd8 );
+}
+
+// a*x + b*y + c, rounded as the scalar code rounds it
+__attribute__((target("avx2")))
+static inline __m256d lineAVX2( double a, double b, double c, __m256d x, __m256d y )
+{
+    return _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( _mm256_set1_pd( a ), x ),
+                                         _mm256_mul_pd( _mm256_set1_pd( b ), y ) ),
+                          _mm256_set1_pd( c ) );
+}
+
+// The vector version of storeError, for points i..i+3
+__attribute__((target("avx2")))
+static inline int storeErrorsAVX2( int i, __m256d e, float* err, uchar* mask, __m256d threshold )
+{
+    __m128 ef = _mm256_cvtpd_ps( e );
+    if( err )
+        _mm_storeu_ps( err + i, ef );
+
+    int inliers = _mm256_movemask_pd( _mm256_cmp_pd( _mm256_cvtps_pd( ef ), threshold, _CMP_LE_OQ ) );
+    if( mask )
+        for( int k = 0; k < 4; k++ )
+            mask[i+k] = (uchar)((inliers >> k) & 1);
+    return __builtin_popcount( inliers );
+}
+
+__attribute__((target("avx2")))
+static int epipolarAVX2( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                         const double* F, float* err, uchar* mask, double threshold )
+{
+    const __m256d one = _mm256_set1_pd( 1. ), t = _mm256_set1_pd( threshold );
+    int i = 0, goodCount = 0;
+
+    for( ; i + 4 <= count; i += 4 )
+    {
+        __m256d x1, y1, x2, y2;
+        loadPointsAVX2( m1 + i, x1, y1 );
+        loadPointsAVX2( m2 + i, x2, y2 );
+
+        __m256d a = lineAVX2( F[0], F[1], F[2], x1, y1 );
+        __m256d b = lineAVX2( F[3], F[4], F[5], x1, y1 );
+        __m256d c = lineAVX2( F[6], F[7], F[8], x1, y1 );
+        __m256d s2 = _mm256_div_pd( one, _mm256_add_pd( _mm256_mul_pd( a, a ), _mm256_mul_pd( b, b ) ) );
+        __m256d d2 = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( x2, a ), _mm256_mul_pd( y2, b ) ), c );
+
+        a = lineAVX2( F[0], F[3], F[6], x2, y2 );
+        b = lineAVX2( F[1], F[4], F[7], x2, y2 );
+        c = lineAVX2( F[2], F[5], F[8], x2, y2 );
+        __m256d s1 = _mm256_div_pd( one, _mm256_add_pd( _mm256_mul_pd( a, a ), _mm256_mul_pd( b, b ) ) );
+        __m256d d1 = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( x1, a ), _mm256_mul_pd( y1, b ) ), c );
+
+        // max_pd(p, q) is p > q ? p : q, as std::max(q, p)
+        __m256d e = _mm256_max_pd( _mm256_mul_pd( _mm256_mul_pd( d2, d2 ), s2 ),
+                                   _mm256_mul_pd( _mm256_mul_pd( d1, d1 ), s1 ) );
+        goodCount += storeErrorsAVX2( i, e, err, mask, t );
+    }
+
+    return goodCount + epipolarScalar( m1 + i, m2 + i, count - i, F,
+                                       err ? err + i : 0, mask ? mask + i : 0, threshold );
+}
+
+__attribute__((target("avx2")))
+static int transferAVX2( const CvPoint2D64f* M, const CvPoint2D64f* m, int count,
+                         const double* H, float* err, uchar* mask, double threshold )
+{
+    const __m256d one = _mm256_set1_pd( 1. ), t = _mm256_set1_pd( threshold );
+    int i = 0, goodCount = 0;
+
+    for( ; i + 4 <= count; i += 4 )
+    {
+        __m256d X, Y, x, y;
+        loadPointsAVX2( M + i, X, Y );
+        loadPointsAVX2( m + i, x, y );
+
+        __m256d ww = _mm256_div_pd( one, lineAVX2( H[6], H[7], 1., X, Y ) );
+        __m256d dx = _mm256_sub_pd( _mm256_mul_pd( lineAVX2( H[0], H[1], H[2], X, Y ), ww ), x );
+        __m256d dy = _mm256_sub_pd( _mm256_mul_pd( lineAVX2( H[3], H[4], H[5], X, Y ), ww ), y );
+        __m256d e = _mm256_add_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) );
+        goodCount += storeErrorsAVX2( i, e, err, mask, t );
+    }
+
+    return goodCount + transferScalar( M + i, m + i, count - i, H,
+                                       err ? err + i : 0, mask ? mask + i : 0, threshold );
+}
+
+// Squared distance from (x,y) to the image of (X,Y) under H
+__attribute__((target("avx2")))
+static inline __m256d transferDistanceAVX2( const double* H, __m256d X, __m256d Y, __m256d x, __m256d y )
+{
+    __m256d c = lineAVX2( H[6], H[7], H[8], X, Y );
+    __m256d dx = _mm256_sub_pd( x, _mm256_div_pd( lineAVX2( H[0], H[1], H[2], X, Y ), c ) );
+    __m256d dy = _mm256_sub_pd( y, _mm256_div_pd( lineAVX2( H[3], H[4], H[5], X, Y ), c ) );
+    return _mm256_add_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) );
+}
+
+__attribute__((target("avx2")))
+static int symmetricTransferAVX2( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                                  const double* model, float* err, uchar* mask, double threshold )
+{
+    const __m256d t = _mm256_set1_pd( threshold );
+    int i = 0, goodCount = 0;
+
+    for( ; i + 4 <= count; i += 4 )
+    {
+        __m256d x1, y1, x2, y2;
+        loadPointsAVX2( m1 + i, x1, y1 );
+        loadPointsAVX2( m2 + i, x2, y2 );
+
+        __m256d d1 = transferDistanceAVX2( model, x1, y1, x2, y2 );
+        __m256d d2 = transferDistanceAVX2( model + 9, x2, y2, x1, y1 );
+        goodCount += storeErrorsAVX2( i, _mm256_max_pd( d2, d1 ), err, mask, t );
+    }
+
+    return goodCount + symmetricTransferScalar( m1 + i, m2 + i, count - i, model,
+                                                err ? err + i : 0, mask ? mask + i : 0, threshold );
+}
+
+#endif
+
+//##### Dispatch #######
+
+static ReprojKernel epipolarKernel = epipolarScalar;
+static ReprojKernel transferKernel = transferScalar;
+static ReprojKernel symmetricTransferKernel = symmetricTransferScalar;
+
+__attribute__((constructor))
+static void initReprojKernels( void )
+{
+#ifdef REPROJ_X86
+    __builtin_cpu_init();
+
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        epipolarKernel = epipolarAVX2;
+        transferKernel = transferAVX2;
+        symmetricTransferKernel = symmetricTransferAVX2;
+    }
+#endif
+}
+
+int cvffiEpipolarErrors( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                         const double* F, float* err, uchar* mask, double threshold )
+{
+    return epipolarKernel( m1, m2, count, F, err, mask, threshold );
+}
+
+int cvffiTransferErrors( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                         const double* H, float* err, uchar* mask, double threshold )
+{
+    return transferKernel( m1, m2, count, H, err, mask, threshold );
+}
+
+int cvffiSymmetricTransferErrors( const CvPoint2D64f* m1, const CvPoint2D64f* m2, int count,
+                                  const double* H, const double* Hinv,
+                                  float* err, uchar* mask, double threshold )
+{
+    double model[18];
+    memcpy( model, H, 9*sizeof(double) );
+    memcpy( model + 9, Hinv, 9*sizeof(double) );
+    return symmetricTransferKernel( m1, m2, count, model, err, mask, threshold );
+}
@@ -0,0 +1,257 @@
+
+// Writing and memory-mapping the on-disk descriptor database described
+// in descriptor_db.h.
+//
+// The database is mapped read-only and shared, so several processes
+// opening the same file share one copy of its pages in the page cache,
+// and nothing is read from disk until it's touched.
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/core/core.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "descriptor_db.h"
+
+static const uint64_t DB_ARRAY_ALIGN = 64;
+static const uint64_t DB_BLOCK_ALIGN = 4096;
+
+// Number of float/int32 arrays in the keypoint block
+static const int DB_KEYPOINT_FIELDS = 6;
+
+struct CvffiDescriptorDB {
+  void *base;
+  size_t length;
+
+  const CvDescriptorDbHeader_t *header;
+  const float *x, *y, *size, *angle, *response;
+  const int32_t *octave;
+
+  CvMat descriptors;
+};
+
+static uint64_t alignUp( uint64_t value, uint64_t align )
+{
+  return (value + align - 1) / align * align;
+}
+
+static uint64_t keypointArrayBytes( uint64_t count )
+{
+  return alignUp( count * 4, DB_ARRAY_ALIGN );
+}
+
+static bool writePadding( FILE *fp, uint64_t from, uint64_t to )
+{
+  static const char zeros[DB_ARRAY_ALIGN] = { 0 };
+  while( from < to ) {
+    size_t n = (size_t)MIN( to - from, DB_ARRAY_ALIGN );
+    if( fwrite( zeros, 1, n, fp ) != n ) return false;
+    from += n;
+  }
+  return true;
+}
+
+extern "C" {
+
+  // Writes descriptors (N x D, CV_32F or CV_8U) and, optionally, their
+  // N keypoints to filename.  keypoints may be NULL.  Returns false if
+  // the file can't be written.
+  bool descriptorDbWrite( const char *filename, CvMat *descriptors, const CvKeyPoint_t *keypoints )
+  {
+    int type = CV_MAT_TYPE( descriptors->type );
+    CV_Assert( type == CV_32FC1 || type == CV_8UC1 );
+
+    uint64_t count = descriptors->rows;
+    size_t rowBytes = descriptors->cols * CV_ELEM_SIZE( type );
+
+    CvDescriptorDbHeader_t header;
+    memset( &header, 0, sizeof(header) );
+    strncpy( header.magic, DESCRIPTOR_DB_MAGIC, sizeof(header.magic) );
+    header.version = DESCRIPTOR_DB_VERSION;
+    header.headerSize = sizeof( header );
+    header.type = type;
+    header.dim = descriptors->cols;
+    header.count = count;
+
+    uint64_t offset = sizeof( header );
+    if( keypoints ) {
+      header.keypointOffset = alignUp( offset, DB_ARRAY_ALIGN );
+      offset = header.keypointOffset + DB_KEYPOINT_FIELDS * keypointArrayBytes( count );
+    }
+
+    header.descriptorOffset = alignUp( offset, DB_BLOCK_ALIGN );
+    header.descriptorStep = alignUp( rowBytes, DB_ARRAY_ALIGN );
+    header.fileSize = header.descriptorOffset + count * header.descriptorStep;
+
+    FILE *fp = fopen( filename, "wb" );
+    if( fp == NULL ) return false;
+
+    bool ok = fwrite( &header, sizeof(header), 1, fp ) == 1;
+    offset = sizeof( header );
+
+    if( ok && keypoints ) {
+      ok = writePadding( fp, offset, header.keypointOffset );
+      offset = header.keypointOffset;
+
+      for( int field = 0; ok && field < DB_KEYPOINT_FIELDS; field++ ) {
+        for( uint64_t i = 0; ok && i < count; i++ ) {
+          const CvKeyPoint_t &kp = keypoints[i];
+          float f;
+          int32_t octave;
+          const void *value = &f;
+
+          switch( field ) {
+            case 0: f = kp.x; break;
+            case 1: f = kp.y; break;
+            case 2: f = kp.size; break;
+            case 3: f = kp.angle; break;
+            case 4: f = kp.response; break;
+            default: octave = kp.octave; value = &octave; break;
+          }
+          ok = fwrite( value, 4, 1, fp ) == 1;
+        }
+
+        ok = ok && writePadding( fp, offset + count*4, offset + keypointArrayBytes( count ) );
+        offset += keypointArrayBytes( count );
+      }
+    }
+
+    ok = ok && writePadding( fp, offset, header.descriptorOffset );
+
+    for( int i = 0; ok && i < descriptors->rows; i++ ) {
+      ok = fwrite( descriptors->data.ptr + i*descriptors->step, 1, rowBytes, fp ) == rowBytes &&
+        writePadding( fp, rowBytes, header.descriptorStep );
+    }
+
+    return (fclose( fp ) == 0) && ok;
+  }
+
+  // Maps filename read-only.  Returns NULL if it can't be opened or
+  // isn't a valid descriptor database.
+  CvffiDescriptorDB *descriptorDbOpen( const char *filename )
+  {
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 ) return NULL;
+
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || (uint64_t)st.st_size < sizeof(CvDescriptorDbHeader_t) ) {
+      close( fd );
+      return NULL;
+    }
+
+    void *base = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( base == MAP_FAILED ) return NULL;
+
+    const CvDescriptorDbHeader_t *header = (const CvDescriptorDbHeader_t *)base;
+    uint64_t elemSize = (header->type == CV_32FC1) ? 4 : 1;
+
+    bool ok = memcmp( header->magic, DESCRIPTOR_DB_MAGIC, sizeof(DESCRIPTOR_DB_MAGIC) ) == 0 &&
+      header->version == DESCRIPTOR_DB_VERSION &&
+      header->headerSize == sizeof(CvDescriptorDbHeader_t) &&
+      (header->type == CV_32FC1 || header->type == CV_8UC1) &&
+      header->dim > 0 && header->dim <= INT_MAX &&
+      header->count <= INT_MAX &&
+      header->fileSize == (uint64_t)st.st_size &&
+      header->descriptorStep >= header->dim * elemSize && header->descriptorStep <= INT_MAX &&
+      header->descriptorOffset % DB_ARRAY_ALIGN == 0 &&
+      header->descriptorOffset + header->count * header->descriptorStep <= header->fileSize;
+
+    if( ok && header->keypointOffset != 0 )
+      ok = header->keypointOffset % DB_ARRAY_ALIGN == 0 &&
+        header->keypointOffset + DB_KEYPOINT_FIELDS * keypointArrayBytes( header->count ) <= header->descriptorOffset;
+
+    if( !ok ) {
+      munmap( base, st.st_size );
+      return NULL;
+    }
+
+    CvffiDescriptorDB *db = new CvffiDescriptorDB;
+    db->base = base;
+    db->length = st.st_size;
+    db->header = header;
+
+    if( header->keypointOffset != 0 ) {
+      const uchar *kp = (const uchar *)base + header->keypointOffset;
+      uint64_t stride = keypointArrayBytes( header->count );
+      db->x        = (const float *)(kp);
+      db->y        = (const float *)(kp + stride);
+      db->size     = (const float *)(kp + 2*stride);
+      db->angle    = (const float *)(kp + 3*stride);
+      db->response = (const float *)(kp + 4*stride);
+      db->octave   = (const int32_t *)(kp + 5*stride);
+    } else {
+      db->x = db->y = db->size = db->angle = db->response = NULL;
+      db->octave = NULL;
+    }
+
+    // The matchers take non-const CvMat's but never write to them;  the
+    // mapping is read-only, so anything that tries will fault.
+    cvInitMatHeader( &(db->descriptors), (int)header->count, (int)header->dim, header->type,
+                     (uchar *)base + header->descriptorOffset, (int)header->descriptorStep );
+
+    return db;
+  }
+
+  void descriptorDbClose( CvffiDescriptorDB **db )
+  {
+    if( db && *db ) {
+      munmap( (*db)->base, (*db)->length );
+      delete *db;
+      *db = NULL;
+    }
+  }
+
+  int descriptorDbSize( CvffiDescriptorDB *db )
+  {
+    return (int)db->header->count;
+  }
+
+  // Header onto the mapped descriptors;  valid until the database is closed.
+  CvMat *descriptorDbDescriptors( CvffiDescriptorDB *db )
+  {
+    return &(db->descriptors);
+  }
+
+  // Returns false if there are no keypoints or i is out of range
+  bool descriptorDbKeypoint( CvffiDescriptorDB *db, int i, CvKeyPoint_t *kp )
+  {
+    if( db->x == NULL || i < 0 || (uint64_t)i >= db->header->count ) return false;
+
+    kp->x = db->x[i];
+    kp->y = db->y[i];
+    kp->size = db->size[i];
+    kp->angle = db->angle[i];
+    kp->response = db->response[i];
+    kp->octave = db->octave[i];
+    return true;
+  }
+
+  // Copies the keypoints into a CvSeq of CvKeyPoint_t, as returned by
+  // the feature detectors.  NULL if there are no keypoints.
+  CvSeq *descriptorDbKeypoints( CvffiDescriptorDB *db, CvMemStorage *storage )
+  {
+    if( db->x == NULL ) return NULL;
+
+    CvSeq *seq = cvCreateSeq( 0, sizeof( CvSeq ), sizeof( CvKeyPoint_t ), storage );
+    CvSeqWriter writer;
+    cvStartAppendToSeq( seq, &writer );
+
+    for( int i = 0; i < (int)db->header->count; i++ ) {
+      CvKeyPoint_t kp;
+      descriptorDbKeypoint( db, i, &kp );
+      CV_WRITE_SEQ_ELEM( kp, writer );
+    }
+
+    cvEndWriteSeq( &writer );
+    return seq;
+  }
+
+}
@@ -0,0 +1,52 @@
+
+#ifndef _DESCRIPTOR_DB_H
+#define _DESCRIPTOR_DB_H
+
+#include <opencv2/core/core_c.h>
+#include <stdint.h>
+
+#include "keypoint.h"
+
+// On-disk descriptor database.  Native byte order, laid out as:
+//
+//   header            CvDescriptorDbHeader_t, 64 bytes
+//   keypoints         (optional) structure-of-arrays:  x[N], y[N], size[N],
+//                     angle[N], response[N] as float, octave[N] as int32,
+//                     each array starting on a 64-byte boundary
+//   descriptors       N rows of D float32 or uint8, starting on a page
+//                     boundary, each row padded to a multiple of 64 bytes
+//
+// so the descriptor block can be mapped read-only and used as a CvMat
+// without copying.
+
+#define DESCRIPTOR_DB_MAGIC "CVFFIDB"
+#define DESCRIPTOR_DB_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t type;              // CV_32F or CV_8U
+  uint32_t dim;
+  uint64_t count;
+  uint64_t keypointOffset;    // 0 if there are no keypoints
+  uint64_t descriptorOffset;
+  uint64_t descriptorStep;    // bytes per descriptor row
+  uint64_t fileSize;
+} CvDescriptorDbHeader_t;
+
+struct CvffiDescriptorDB;
+
+extern "C" {
+  bool descriptorDbWrite( const char *filename, CvMat *descriptors, const CvKeyPoint_t *keypoints );
+
+  CvffiDescriptorDB *descriptorDbOpen( const char *filename );
+  void descriptorDbClose( CvffiDescriptorDB **db );
+
+  int descriptorDbSize( CvffiDescriptorDB *db );
+  CvMat *descriptorDbDescriptors( CvffiDescriptorDB *db );
+  bool descriptorDbKeypoint( CvffiDescriptorDB *db, int i, CvKeyPoint_t *kp );
+  CvSeq *descriptorDbKeypoints( CvffiDescriptorDB *db, CvMemStorage *storage );
+}
+
+#endif
@@ -0,0 +1,110 @@
+
+#ifndef _CVFFI_MATCHER_H
+#define _CVFFI_MATCHER_H
+
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+
+// The enumeration of the different types of Norms comes from OpenCV 2.4.x
+// Backported here for convience.
+//enum { NORM_INF=1, NORM_L1=2, NORM_L2=4, NORM_L2SQR=5, NORM_HAMMING=6, NORM_HAMMING2=7, NORM_TYPE_MASK=7, NORM_RELATIVE=8, NORM_MINMAX=32 };
+enum { NORM_L2SQR = 5, NORM_HAMMING=6 };
+
+struct CvDMatch_t {
+  int queryIdx;
+  int trainIdx;
+  int imgIdx;
+
+  float distance;
+  float ratio;
+  unsigned int rank;
+};
+
+struct CvMatcherParams_t {
+  int normType;
+  int knn;
+  bool calculateRatios;
+  float minRatio;
+  float minRadius;
+  bool crossCheck;
+};
+
+enum { CONVERT_ALL = 0, TAKE_JUST_FIRST = 1 };
+
+// Maintains the k best matches for one query, sorted by increasing
+// distance, as the native kNN matchers find candidates.  Insertion into
+// a short sorted list beats a heap for the small k used in practice.
+inline void insertKnnMatch( std::vector<cv::DMatch> &best, int k, const cv::DMatch &match )
+{
+  if( k <= 0 ) return;
+  if( (int)best.size() == k && match.distance >= best.back().distance ) return;
+
+  std::vector<cv::DMatch>::iterator pos = best.end();
+  while( pos != best.begin() && (pos-1)->distance > match.distance ) --pos;
+  best.insert( pos, match );
+  if( (int)best.size() > k ) best.pop_back();
+}
+
+// Checks that query and train descriptors can be compared with
+// descriptorDistance:  CV_32F with NORM_L1, NORM_L2 or NORM_L2SQR, or
+// CV_8U with NORM_HAMMING.
+inline void checkDescriptorNorm( const CvMat *query, const CvMat *train, int normType )
+{
+  int type = CV_MAT_TYPE( query->type );
+  CV_Assert( type == CV_MAT_TYPE( train->type ) && query->cols == train->cols );
+  CV_Assert( (type == CV_32FC1 && (normType == cv::NORM_L1 || normType == cv::NORM_L2 || normType == ::NORM_L2SQR)) ||
+             (type == CV_8UC1 && normType == ::NORM_HAMMING) );
+}
+
+// Distance between two descriptors of n elements (uchar for
+// NORM_HAMMING, float otherwise), as reported by BFMatcher for the same
+// norm.
+inline float descriptorDistance( const uchar *a, const uchar *b, int n, int normType )
+{
+  switch( normType ) {
+    case ::NORM_HAMMING:
+      return (float)cv::normHamming( a, b, n );
+    case cv::NORM_L1:
+      return cv::normL1_( (const float *)a, (const float *)b, n );
+    case cv::NORM_L2:
+      return sqrt( cv::normL2Sqr_( (const float *)a, (const float *)b, n ) );
+    default:
+      return cv::normL2Sqr_( (const float *)a, (const float *)b, n );
+  }
+}
+
+// Distance between a single query and train descriptor, for matchers
+// which compare only a few candidate pairs rather than whole sets.
+inline float descriptorDistance( const CvMat *query, int q, const CvMat *train, int t, int normType )
+{
+  return descriptorDistance( query->data.ptr + q*query->step, train->data.ptr + t*train->step,
+                             query->cols, normType );
+}
+
+// Brute-force L2 matching which abandons each distance once it can't
+// beat the current bound (early_abandon.cpp).  Applies to CV_32F
+// descriptors with NORM_L2 or NORM_L2SQR, without cross checking.
+bool earlyAbandonApplies( const CvMat *query, const CvMat *train, int normType, bool crossCheck );
+void earlyAbandonKnnMatch( const CvMat *query, const CvMat *train,
+                           std::vector< std::vector<cv::DMatch> > &matches, int normType, int knn );
+void earlyAbandonRadiusMatch( const CvMat *query, const CvMat *train,
+                              std::vector< std::vector<cv::DMatch> > &matches, int normType, float maxDistance );
+
+extern "C" {
+
+  // Conversion from OpenCV's nested DMatch vectors to a CvSeq of CvDMatch_t
+  CvSeq *DMatchToCvSeq( const std::vector< std::vector<cv::DMatch> > &matches, CvMemStorage *storage, int doTakeFirst, bool calculateRatios CV_DEFAULT(false) );
+  CvSeq *DMatchToCvSeqRatioTest( const std::vector< std::vector<cv::DMatch> > &matches, CvMemStorage *storage, float minRatio );
+
+  // As above, but writes the CvDMatch_t's into a flat, caller-allocated
+  // buffer.  At most "capacity" records are written, but the return value
+  // is always the total number of matches.  If it's larger than capacity,
+  // the caller should grow the buffer and ask again.  buffer may be NULL
+  // (with capacity 0) to just query the number of matches.
+  int DMatchToBuffer( const std::vector< std::vector<cv::DMatch> > &matches, CvDMatch_t *buffer, int capacity, int doTakeFirst, bool calculateRatios CV_DEFAULT(false) );
+  int DMatchToBufferRatioTest( const std::vector< std::vector<cv::DMatch> > &matches, CvDMatch_t *buffer, int capacity, float minRatio );
+
+}
+
+#endif
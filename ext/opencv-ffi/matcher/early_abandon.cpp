@@ -0,0 +1,206 @@
+
+// Brute-force L2 matching with early abandoning.  The ratio test only
+// needs each query's best two matches, and radius matching only the
+// train descriptors within maxDistance, so a candidate's squared
+// distance can be abandoned as soon as its partial sum passes the
+// current bound.  The sum is checked every ABANDON_CHUNK dimensions.
+//
+// Dimensions are visited in decreasing order of their variance over
+// the train set, so that the partial sums grow as fast as possible and
+// poor candidates are dropped early.  Both sets are copied into that
+// order, padded with zeros to a whole number of chunks.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <functional>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EARLY_ABANDON_X86
+#endif
+#include <float.h>
+
+#include "cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+static const int ABANDON_CHUNK = 32;
+static const int ABANDON_QUERY_BLOCK = 16;
+
+// Squared L2 distance between a and b (n a multiple of ABANDON_CHUNK),
+// or some partial sum greater than bound.
+typedef float (*BoundedL2Kernel)( const float *a, const float *b, int n, float bound );
+
+static float boundedL2Scalar( const float *a, const float *b, int n, float bound )
+{
+  float acc = 0.0;
+  for( int i = 0; i < n; i += ABANDON_CHUNK ) {
+    for( int j = i; j < i + ABANDON_CHUNK; j++ ) {
+      float d = a[j] - b[j];
+      acc += d*d;
+    }
+    if( acc > bound ) break;
+  }
+  return acc;
+}
+
+#ifdef EARLY_ABANDON_X86
+__attribute__((target("avx2,fma")))
+static float boundedL2AVX2( const float *a, const float *b, int n, float bound )
+{
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  float total = 0.0;
+
+  for( int i = 0; i < n; i += ABANDON_CHUNK ) {
+    for( int j = i; j < i + ABANDON_CHUNK; j += 16 ) {
+      __m256 d0 = _mm256_sub_ps( _mm256_loadu_ps( a+j ), _mm256_loadu_ps( b+j ) );
+      __m256 d1 = _mm256_sub_ps( _mm256_loadu_ps( a+j+8 ), _mm256_loadu_ps( b+j+8 ) );
+      acc0 = _mm256_fmadd_ps( d0, d0, acc0 );
+      acc1 = _mm256_fmadd_ps( d1, d1, acc1 );
+    }
+
+    __m256 s = _mm256_add_ps( acc0, acc1 );
+    __m128 h = _mm_add_ps( _mm256_castps256_ps128( s ), _mm256_extractf128_ps( s, 1 ) );
+    h = _mm_add_ps( h, _mm_movehl_ps( h, h ) );
+    h = _mm_add_ss( h, _mm_shuffle_ps( h, h, 1 ) );
+    total = _mm_cvtss_f32( h );
+
+    if( total > bound ) break;
+  }
+  return total;
+}
+
+#endif
+
+static BoundedL2Kernel selectBoundedL2Kernel( void )
+{
+#ifdef EARLY_ABANDON_X86
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+    return boundedL2AVX2;
+#endif
+  return boundedL2Scalar;
+}
+
+// Copies of the query and train descriptors with their columns in
+// decreasing order of train variance, each row padded to "cols" floats
+struct AbandonSets {
+  int cols;
+  vector<float> query, train;
+};
+
+static void copyPermuted( const CvMat *src, const vector<int> &order, int cols, vector<float> &dst )
+{
+  dst.assign( (size_t)src->rows * cols, 0.0f );
+  for( int i = 0; i < src->rows; i++ ) {
+    const float *row = (const float *)(src->data.ptr + i*src->step);
+    float *out = &(dst[ (size_t)i*cols ]);
+    for( size_t j = 0; j < order.size(); j++ ) out[j] = row[ order[j] ];
+  }
+}
+
+static void prepareAbandonSets( const CvMat *query, const CvMat *train, AbandonSets &sets )
+{
+  int n = train->cols;
+  vector<double> sum( n, 0.0 ), sumSq( n, 0.0 );
+  for( int i = 0; i < train->rows; i++ ) {
+    const float *row = (const float *)(train->data.ptr + i*train->step);
+    for( int j = 0; j < n; j++ ) {
+      sum[j] += row[j];
+      sumSq[j] += (double)row[j]*row[j];
+    }
+  }
+
+  vector< pair<double,int> > variance( n );
+  for( int j = 0; j < n; j++ )
+    variance[j] = make_pair( sumSq[j] - sum[j]*sum[j]/MAX( train->rows, 1 ), j );
+  std::sort( variance.begin(), variance.end(), greater< pair<double,int> >() );
+
+  vector<int> order( n );
+  for( int j = 0; j < n; j++ ) order[j] = variance[j].second;
+
+  sets.cols = (n + ABANDON_CHUNK - 1) / ABANDON_CHUNK * ABANDON_CHUNK;
+  copyPermuted( query, order, sets.cols, sets.query );
+  copyPermuted( train, order, sets.cols, sets.train );
+}
+
+bool earlyAbandonApplies( const CvMat *query, const CvMat *train, int normType, bool crossCheck )
+{
+  return !crossCheck &&
+         CV_MAT_TYPE( query->type ) == CV_32FC1 && CV_MAT_TYPE( train->type ) == CV_32FC1 &&
+         query->cols == train->cols &&
+         (normType == NORM_L2 || normType == ::NORM_L2SQR);
+}
+
+void earlyAbandonKnnMatch( const CvMat *query, const CvMat *train,
+                           vector< vector<DMatch> > &matches, int normType, int knn )
+{
+  CV_Assert( earlyAbandonApplies( query, train, normType, false ) && knn > 0 );
+
+  matches.clear();
+  matches.resize( query->rows );
+  if( query->rows == 0 || train->rows == 0 ) return;
+
+  AbandonSets sets;
+  prepareAbandonSets( query, train, sets );
+  BoundedL2Kernel kernel = selectBoundedL2Kernel();
+
+  for( int q0 = 0; q0 < query->rows; q0 += ABANDON_QUERY_BLOCK ) {
+    int q1 = MIN( q0 + ABANDON_QUERY_BLOCK, query->rows );
+
+    for( int t = 0; t < train->rows; t++ ) {
+      const float *tr = &(sets.train[ (size_t)t*sets.cols ]);
+
+      for( int q = q0; q < q1; q++ ) {
+        vector<DMatch> &best = matches[q];
+        float bound = ((int)best.size() == knn) ? best.back().distance : FLT_MAX;
+
+        float d = kernel( &(sets.query[ (size_t)q*sets.cols ]), tr, sets.cols, bound );
+        if( d < bound ) insertKnnMatch( best, knn, DMatch( q, t, 0, d ) );
+      }
+    }
+
+    if( normType == NORM_L2 )
+      for( int q = q0; q < q1; q++ )
+        for( size_t i = 0; i < matches[q].size(); i++ )
+          matches[q][i].distance = sqrt( matches[q][i].distance );
+  }
+}
+
+void earlyAbandonRadiusMatch( const CvMat *query, const CvMat *train,
+                              vector< vector<DMatch> > &matches, int normType, float maxDistance )
+{
+  CV_Assert( earlyAbandonApplies( query, train, normType, false ) );
+
+  matches.clear();
+  matches.resize( query->rows );
+  if( query->rows == 0 || train->rows == 0 ) return;
+
+  AbandonSets sets;
+  prepareAbandonSets( query, train, sets );
+  BoundedL2Kernel kernel = selectBoundedL2Kernel();
+
+  float bound = (normType == NORM_L2) ? maxDistance*maxDistance : maxDistance;
+
+  for( int q0 = 0; q0 < query->rows; q0 += ABANDON_QUERY_BLOCK ) {
+    int q1 = MIN( q0 + ABANDON_QUERY_BLOCK, query->rows );
+
+    for( int t = 0; t < train->rows; t++ ) {
+      const float *tr = &(sets.train[ (size_t)t*sets.cols ]);
+
+      for( int q = q0; q < q1; q++ ) {
+        float d = kernel( &(sets.query[ (size_t)q*sets.cols ]), tr, sets.cols, bound );
+        if( d <= bound )
+          matches[q].push_back( DMatch( q, t, 0, (normType == NORM_L2) ? sqrt( d ) : d ) );
+      }
+    }
+  }
+
+  // As BFMatcher, each query's matches are sorted by distance
+  for( size_t q = 0; q < matches.size(); q++ )
+    std::sort( matches[q].begin(), matches[q].end() );
+}
@@ -0,0 +1,182 @@
+
+// Grid-based motion statistics (GMS) filtering of putative matches.
+//
+// Bian et al., "GMS: Grid-based Motion Statistics for Fast,
+// Ultra-robust Feature Correspondence", CVPR 2017.
+//
+// True matches are spatially coherent:  the neighbours of a correct
+// match in one image tend to match to the neighbours of its partner in
+// the other.  Both images are divided into a grid, matches are counted
+// per (query cell, train cell) pair, and each query cell's most popular
+// train cell is scored by the number of matches supporting it from the
+// surrounding 3x3 block of cell pairs.  Matches in a well-supported cell
+// pair are kept.  The whole process is linear in the number of matches,
+// so it's a cheap way of cleaning up input for RANSAC.
+//
+// As in the paper, the test is repeated with the grids shifted by half
+// a cell in x, y and both, and a match is kept if any grid accepts it.
+// Only the unrotated, single-scale form of the test is implemented.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+
+#include <math.h>
+
+#include "cvffi_matcher.h"
+#include "spatial_grid.h"
+
+using namespace cv;
+using namespace std;
+
+static const int GMS_DEFAULT_GRID = 20;
+static const float GMS_DEFAULT_ALPHA = 6.0;
+
+// Cell index of a point in an n x n grid over an image of the given
+// size, with the grid shifted left/up by half a cell if requested.
+// Returns -1 for points that fall outside the shifted grid.
+static int gmsCell( const Point2f &pt, const CvSize &size, int n, bool shiftX, bool shiftY )
+{
+  float cw = (float)size.width / n, ch = (float)size.height / n;
+  float x = pt.x + (shiftX ? 0.5f*cw : 0.0f), y = pt.y + (shiftY ? 0.5f*ch : 0.0f);
+
+  int cx = (int)floor( x / cw ), cy = (int)floor( y / ch );
+  if( cx < 0 || cy < 0 || cx >= n || cy >= n ) return -1;
+  return cy*n + cx;
+}
+
+// Number of matches in bucket qc (the matches from query cell qc)
+// going to train cell tc
+static int gmsPairCount( const vector<int> &start, const vector<int> &bucket,
+                         const vector<int> &tcell, int qc, int tc )
+{
+  int count = 0;
+  for( int i = start[qc]; i < start[qc+1]; i++ )
+    if( tcell[ bucket[i] ] == tc ) count++;
+  return count;
+}
+
+static void gmsRun( const vector<CvDMatch_t> &matches,
+                    const vector<Point2f> &qpts, const CvSize &qsize,
+                    const vector<Point2f> &tpts, const CvSize &tsize,
+                    int n, float alpha, bool shiftX, bool shiftY,
+                    vector<uchar> &inlier )
+{
+  int cells = n*n;
+  vector<int> qcell( matches.size() ), tcell( matches.size() );
+
+  // Bucket the matches by query cell;  bucket[ start[c] .. start[c+1]-1 ]
+  // are the matches from cell c.
+  vector<int> start( cells+1, 0 );
+  for( size_t i = 0; i < matches.size(); i++ ) {
+    qcell[i] = gmsCell( qpts[ matches[i].queryIdx ], qsize, n, shiftX, shiftY );
+    tcell[i] = gmsCell( tpts[ matches[i].trainIdx ], tsize, n, shiftX, shiftY );
+    if( qcell[i] < 0 || tcell[i] < 0 ) qcell[i] = -1;
+    else start[ qcell[i]+1 ]++;
+  }
+  for( int c = 0; c < cells; c++ ) start[c+1] += start[c];
+
+  vector<int> bucket( start[cells] ), fill( start.begin(), start.end()-1 );
+  for( size_t i = 0; i < matches.size(); i++ )
+    if( qcell[i] >= 0 ) bucket[ fill[ qcell[i] ]++ ] = (int)i;
+
+  // The most popular train cell for each query cell
+  vector<int> bestCell( cells, -1 ), votes( cells, 0 );
+  for( int c = 0; c < cells; c++ ) {
+    int best = -1;
+    for( int i = start[c]; i < start[c+1]; i++ ) {
+      int t = tcell[ bucket[i] ];
+      votes[t]++;
+      if( best < 0 || votes[t] > votes[best] ) best = t;
+    }
+    bestCell[c] = best;
+
+    for( int i = start[c]; i < start[c+1]; i++ ) votes[ tcell[ bucket[i] ] ] = 0;
+  }
+
+  // Score each query cell by the support from the 3x3 block of cell
+  // pairs around (c, bestCell[c]), moving the same way in both grids.
+  // Each bucket is scanned at most nine times, so this is linear too.
+  vector<bool> accepted( cells, false );
+  for( int c = 0; c < cells; c++ ) {
+    if( bestCell[c] < 0 ) continue;
+
+    int qx = c % n, qy = c / n;
+    int tx = bestCell[c] % n, ty = bestCell[c] / n;
+
+    int score = 0, features = 0, neighbours = 0;
+    for( int dy = -1; dy <= 1; dy++ )
+      for( int dx = -1; dx <= 1; dx++ ) {
+        int qnx = qx+dx, qny = qy+dy, tnx = tx+dx, tny = ty+dy;
+        if( qnx < 0 || qny < 0 || qnx >= n || qny >= n ) continue;
+
+        int qn = qny*n + qnx;
+        features += start[qn+1] - start[qn];
+        neighbours++;
+
+        if( tnx < 0 || tny < 0 || tnx >= n || tny >= n ) continue;
+        score += gmsPairCount( start, bucket, tcell, qn, tny*n + tnx );
+      }
+
+    float threshold = alpha * sqrt( (float)features / neighbours );
+    accepted[c] = score > threshold;
+  }
+
+  for( size_t i = 0; i < matches.size(); i++ )
+    if( qcell[i] >= 0 && accepted[ qcell[i] ] && tcell[i] == bestCell[ qcell[i] ] )
+      inlier[i] = 1;
+}
+
+extern "C" {
+
+  // matches is a CvSeq of CvDMatch_t, as returned by the matchers.
+  // queryPoints and trainPoints are the keypoint coordinates (N x 2,
+  // CV_32F or CV_64F) indexed by queryIdx and trainIdx, and querySize
+  // and trainSize the image sizes.  Sets mask[i] to 1 for matches which
+  // pass, 0 otherwise;  mask is CV_8U with one element per match, as for
+  // cvEstimateFundamental.  Returns the number which pass.
+  //
+  // gridSize is the number of cells along each side of the grid (20 if
+  // <= 0) and alpha the threshold scale (6 if <= 0);  higher alpha
+  // rejects more.
+  int gmsFilter( CvSeq *matches,
+                 CvMat *queryPoints, CvSize querySize,
+                 CvMat *trainPoints, CvSize trainSize,
+                 CvMat *mask, int gridSize, float alpha )
+  {
+    CV_Assert( matches->elem_size == sizeof(CvDMatch_t) );
+    CV_Assert( CV_MAT_TYPE( mask->type ) == CV_8UC1 && CV_IS_MAT_CONT( mask->type ) &&
+               mask->rows * mask->cols == matches->total );
+    CV_Assert( querySize.width > 0 && querySize.height > 0 && trainSize.width > 0 && trainSize.height > 0 );
+
+    if( gridSize <= 0 ) gridSize = GMS_DEFAULT_GRID;
+    if( alpha <= 0 ) alpha = GMS_DEFAULT_ALPHA;
+
+    vector<Point2f> qpts, tpts;
+    cvMatToPoints( queryPoints, qpts );
+    cvMatToPoints( trainPoints, tpts );
+
+    vector<CvDMatch_t> m( matches->total );
+    CvSeqReader reader;
+    cvStartReadSeq( matches, &reader, 0 );
+    for( int i = 0; i < matches->total; i++ )
+      CV_READ_SEQ_ELEM( m[i], reader );
+
+    for( size_t i = 0; i < m.size(); i++ )
+      CV_Assert( m[i].queryIdx >= 0 && m[i].queryIdx < (int)qpts.size() &&
+                 m[i].trainIdx >= 0 && m[i].trainIdx < (int)tpts.size() );
+
+    vector<uchar> inlier( m.size(), 0 );
+    for( int shift = 0; shift < 4; shift++ )
+      gmsRun( m, qpts, querySize, tpts, trainSize, gridSize, alpha,
+              (shift & 1) != 0, (shift & 2) != 0, inlier );
+
+    int count = 0;
+    for( size_t i = 0; i < inlier.size(); i++ ) {
+      mask->data.ptr[i] = inlier[i];
+      count += inlier[i];
+    }
+    return count;
+  }
+
+}
@@ -0,0 +1,102 @@
+
+// Guided matching:  once a fundamental matrix or homography relating
+// the two images is known, each query descriptor need only be compared
+// with the train descriptors whose keypoints are consistent with it --
+// those within "tolerance" pixels of its epipolar line (F) or of its
+// predicted position (H).  Train keypoints are bucketed in a uniform
+// grid so only the cells the band or neighbourhood touches are visited.
+//
+// Follows the convention of cvEstimateFundamental / cvEstimateHomography
+// with the query as the first image and the train as the second:
+// x_train' F x_query = 0, and x_train ~ H x_query.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+
+#include "cvffi_matcher.h"
+#include "spatial_grid.h"
+
+using namespace cv;
+using namespace std;
+
+enum { GUIDED_FUNDAMENTAL = 0, GUIDED_HOMOGRAPHY = 1 };
+
+static void guidedMatcherActual( const CvMat *query, const CvMat *queryPoints,
+                                 const CvMat *train, const CvMat *trainPoints,
+                                 const CvMat *model, int modelType, float tolerance,
+                                 vector< vector<DMatch> > &matches, int normType, int knn )
+{
+  checkDescriptorNorm( query, train, normType );
+  CV_Assert( model->rows == 3 && model->cols == 3 && CV_MAT_CN( model->type ) == 1 );
+  CV_Assert( modelType == GUIDED_FUNDAMENTAL || modelType == GUIDED_HOMOGRAPHY );
+  CV_Assert( tolerance > 0 );
+
+  vector<Point2f> qpts, tpts;
+  cvMatToPoints( queryPoints, qpts );
+  cvMatToPoints( trainPoints, tpts );
+  CV_Assert( (int)qpts.size() == query->rows && (int)tpts.size() == train->rows );
+
+  double M[3][3];
+  for( int i = 0; i < 3; i++ )
+    for( int j = 0; j < 3; j++ )
+      M[i][j] = cvmGet( model, i, j );
+
+  SpatialGrid grid( tpts, SpatialGrid::suggestCellSize( tpts, 4, 2*tolerance ) );
+  vector<int> candidates;
+
+  matches.clear();
+  matches.resize( query->rows );
+
+  for( int q = 0; q < query->rows; q++ ) {
+    double x = qpts[q].x, y = qpts[q].y;
+    double l0 = M[0][0]*x + M[0][1]*y + M[0][2],
+           l1 = M[1][0]*x + M[1][1]*y + M[1][2],
+           l2 = M[2][0]*x + M[2][1]*y + M[2][2];
+
+    candidates.clear();
+    if( modelType == GUIDED_FUNDAMENTAL ) {
+      // (l0,l1,l2) is the epipolar line in the train image
+      grid.queryLine( l0, l1, l2, tolerance, candidates );
+    } else {
+      if( fabs( l2 ) < DBL_EPSILON ) continue;
+      grid.queryRadius( (float)(l0/l2), (float)(l1/l2), tolerance, candidates );
+    }
+
+    for( size_t i = 0; i < candidates.size(); i++ )
+      insertKnnMatch( matches[q], knn,
+          DMatch( q, candidates[i], 0, descriptorDistance( query, q, train, candidates[i], normType ) ) );
+  }
+}
+
+extern "C" {
+
+  // queryPoints and trainPoints are the keypoint coordinates for each
+  // descriptor row, N x 2 CV_32F or CV_64F.  model is a 3x3 fundamental
+  // matrix or homography (modelType GUIDED_FUNDAMENTAL / GUIDED_HOMOGRAPHY),
+  // and tolerance the maximum distance in pixels from the epipolar line
+  // or predicted point.  Queries with no consistent train keypoints get
+  // no matches.
+  CvSeq *guidedMatcherKnn( CvMat *query, CvMat *queryPoints,
+                           CvMat *train, CvMat *trainPoints,
+                           CvMat *model, int modelType, float tolerance,
+                           CvMemStorage *storage, int normType, int knn )
+  {
+    vector< vector<DMatch> > matches;
+    guidedMatcherActual( query, queryPoints, train, trainPoints, model, modelType, tolerance,
+                         matches, normType, knn );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  CvSeq *guidedMatcherRatioTest( CvMat *query, CvMat *queryPoints,
+                                 CvMat *train, CvMat *trainPoints,
+                                 CvMat *model, int modelType, float tolerance,
+                                 CvMemStorage *storage, int normType, float minRatio )
+  {
+    vector< vector<DMatch> > matches;
+    guidedMatcherActual( query, queryPoints, train, trainPoints, model, modelType, tolerance,
+                         matches, normType, 2 );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+}
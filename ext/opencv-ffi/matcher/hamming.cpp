@@ -0,0 +1,315 @@
+
+// Binary descriptor matching.
+//
+// None of the detectors in this extension produce binary descriptors, so
+// this file provides both halves:  a binarization stage which turns float
+// descriptors (SIFT, OpenSURF, ...) into packed bit codes, and a
+// Hamming-distance brute force matcher over those codes.
+//
+// Bit codes are stored one per row in a CV_8U CvMat, with a multiple of
+// 64 bits per code so they can be treated as packed uint64_t words.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+// The kernels below use 64-bit popcnt, so x86-64 only
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAMMING_X86
+#endif
+
+#include "cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+//##### Popcount kernels #######
+//
+// Each computes the Hamming distance from one query code to each of
+// "count" train codes.  The fastest ones the CPU supports are chosen
+// once, when the library is loaded.
+typedef void (*HammingKernel)( const uint64_t *query, const uchar *train, size_t trainStep,
+                               int count, int words, int *distances );
+
+static void hammingKernelPortable( const uint64_t *query, const uchar *train, size_t trainStep,
+                                   int count, int words, int *distances )
+{
+  for( int i = 0; i < count; i++ ) {
+    const uint64_t *t = (const uint64_t *)(train + i*trainStep);
+    int d = 0;
+    for( int w = 0; w < words; w++ ) {
+      uint64_t x = query[w] ^ t[w];
+      // SWAR popcount
+      x = x - ((x >> 1) & 0x5555555555555555ULL);
+      x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+      x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+      d += (int)((x * 0x0101010101010101ULL) >> 56);
+    }
+    distances[i] = d;
+  }
+}
+
+#ifdef HAMMING_X86
+__attribute__((target("popcnt")))
+static void hammingKernelPopcnt( const uint64_t *query, const uchar *train, size_t trainStep,
+                                 int count, int words, int *distances )
+{
+  for( int i = 0; i < count; i++ ) {
+    const uint64_t *t = (const uint64_t *)(train + i*trainStep);
+    int d = 0;
+    for( int w = 0; w < words; w++ )
+      d += (int)_mm_popcnt_u64( query[w] ^ t[w] );
+    distances[i] = d;
+  }
+}
+
+// AVX2 has no popcount instruction, use the nibble lookup (Mula et al.)
+// and sum the bytes with SAD.  Handles the 256-bit chunks of each code,
+// falls back to popcnt for any trailing 64-bit words.
+__attribute__((target("avx2,popcnt")))
+static void hammingKernelAVX2( const uint64_t *query, const uchar *train, size_t trainStep,
+                               int count, int words, int *distances )
+{
+  const __m256i lookup = _mm256_setr_epi8( 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                           0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 );
+  const __m256i lowMask = _mm256_set1_epi8( 0x0f );
+  const int chunks = words / 4;
+
+  for( int i = 0; i < count; i++ ) {
+    const uint64_t *t = (const uint64_t *)(train + i*trainStep);
+    __m256i acc = _mm256_setzero_si256();
+
+    for( int c = 0; c < chunks; c++ ) {
+      __m256i x = _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(query + 4*c) ),
+                                    _mm256_loadu_si256( (const __m256i *)(t + 4*c) ) );
+      __m256i lo = _mm256_shuffle_epi8( lookup, _mm256_and_si256( x, lowMask ) );
+      __m256i hi = _mm256_shuffle_epi8( lookup, _mm256_and_si256( _mm256_srli_epi16( x, 4 ), lowMask ) );
+      acc = _mm256_add_epi64( acc, _mm256_sad_epu8( _mm256_add_epi8( lo, hi ), _mm256_setzero_si256() ) );
+    }
+
+    int d = (int)( _mm256_extract_epi64( acc, 0 ) + _mm256_extract_epi64( acc, 1 ) +
+                   _mm256_extract_epi64( acc, 2 ) + _mm256_extract_epi64( acc, 3 ) );
+    for( int w = 4*chunks; w < words; w++ )
+      d += (int)_mm_popcnt_u64( query[w] ^ t[w] );
+
+    distances[i] = d;
+  }
+}
+
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq,popcnt")))
+static void hammingKernelVPOPCNTDQ( const uint64_t *query, const uchar *train, size_t trainStep,
+                                    int count, int words, int *distances )
+{
+  const int chunks = words / 4;
+
+  for( int i = 0; i < count; i++ ) {
+    const uint64_t *t = (const uint64_t *)(train + i*trainStep);
+    __m256i acc = _mm256_setzero_si256();
+
+    for( int c = 0; c < chunks; c++ ) {
+      __m256i x = _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(query + 4*c) ),
+                                    _mm256_loadu_si256( (const __m256i *)(t + 4*c) ) );
+      acc = _mm256_add_epi64( acc, _mm256_popcnt_epi64( x ) );
+    }
+
+    int d = (int)( _mm256_extract_epi64( acc, 0 ) + _mm256_extract_epi64( acc, 1 ) +
+                   _mm256_extract_epi64( acc, 2 ) + _mm256_extract_epi64( acc, 3 ) );
+    for( int w = 4*chunks; w < words; w++ )
+      d += (int)_mm_popcnt_u64( query[w] ^ t[w] );
+
+    distances[i] = d;
+  }
+}
+
+#endif
+
+//##### Dispatch #######
+
+// For codes of at least 256 bits, and for shorter ones, which the
+// vector kernels have nothing to work on
+static HammingKernel longHammingKernel = hammingKernelPortable;
+static HammingKernel shortHammingKernel = hammingKernelPortable;
+
+__attribute__((constructor))
+static void initHammingKernels( void )
+{
+#ifdef HAMMING_X86
+  __builtin_cpu_init();
+
+  // Scalar popcnt is the best we can do for short codes
+  if( __builtin_cpu_supports( "popcnt" ) )
+    longHammingKernel = shortHammingKernel = hammingKernelPopcnt;
+
+  if( __builtin_cpu_supports( "avx512vpopcntdq" ) && __builtin_cpu_supports( "avx512vl" ) )
+    longHammingKernel = hammingKernelVPOPCNTDQ;
+  else if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "popcnt" ) )
+    longHammingKernel = hammingKernelAVX2;
+#endif
+
+  // Elsewhere (e.g. ARM) the SWAR popcount
+}
+
+static HammingKernel selectHammingKernel( int words )
+{
+  return words >= 4 ? longHammingKernel : shortHammingKernel;
+}
+
+//##### kNN on bit codes #######
+
+static int codeWords( const CvMat *codes )
+{
+  CV_Assert( CV_MAT_TYPE(codes->type) == CV_8UC1 && (codes->cols % sizeof(uint64_t)) == 0 &&
+             (codes->step % sizeof(uint64_t)) == 0 );
+  return codes->cols / sizeof(uint64_t);
+}
+
+// Matches are returned in the same form as BFMatcher::knnMatch / radiusMatch:
+// per query, sorted by increasing distance.   If maxDistance >= 0 it's a
+// radius match (knn is ignored), otherwise it's knn.
+static void hammingMatcherActual( const CvMat *query, const CvMat *train,
+                                  vector< vector<DMatch> > &matches,
+                                  int knn, float maxDistance )
+{
+  int words = codeWords( query );
+  CV_Assert( codeWords( train ) == words );
+
+  HammingKernel kernel = selectHammingKernel( words );
+  vector<int> distances( train->rows );
+
+  matches.clear();
+  matches.resize( query->rows );
+
+  for( int q = 0; q < query->rows; q++ ) {
+    const uint64_t *qcode = (const uint64_t *)(query->data.ptr + q*query->step);
+    kernel( qcode, train->data.ptr, train->step, train->rows, words, &(distances[0]) );
+
+    vector<DMatch> &out = matches[q];
+
+    if( maxDistance >= 0 ) {
+      for( int t = 0; t < train->rows; t++ )
+        if( distances[t] <= maxDistance )
+          out.push_back( DMatch( q, t, 0, (float)distances[t] ) );
+      std::stable_sort( out.begin(), out.end() );
+    } else {
+      int k = MIN( knn, train->rows );
+      for( int t = 0; t < train->rows; t++ )
+        insertKnnMatch( out, k, DMatch( q, t, 0, (float)distances[t] ) );
+    }
+  }
+}
+
+extern "C" {
+
+  //##### Binarization #######
+
+  // Fills projection (nbits x D, CV_32F) with a random Gaussian projection
+  // for use with binarizeDescriptorsTrain / binarizeDescriptors.
+  void binarizeRandomProjection( CvMat *projection, int64 seed )
+  {
+    CV_Assert( CV_MAT_TYPE(projection->type) == CV_32FC1 && (projection->rows % 64) == 0 );
+    CvRNG rng = cvRNG( seed );
+    cvRandArr( &rng, projection, CV_RAND_NORMAL, cvScalarAll(0.0), cvScalarAll(1.0) );
+  }
+
+  static float projectDescriptor( const CvMat *descriptors, int row, const CvMat *projection, int bit )
+  {
+    const float *d = (const float *)(descriptors->data.ptr + row*descriptors->step);
+    if( projection == NULL ) return d[bit];
+
+    const float *p = (const float *)(projection->data.ptr + bit*projection->step);
+    float acc = 0.0;
+    for( int j = 0; j < descriptors->cols; j++ ) acc += p[j]*d[j];
+    return acc;
+  }
+
+  // Learns the threshold for each bit as the median of that bit's
+  // projection over a training set of float descriptors.
+  //
+  // If projection is NULL, each descriptor dimension is thresholded
+  // directly and there is one bit per dimension.   Otherwise bit b is
+  // the b'th row of projection dotted with the descriptor.
+  //
+  // thresholds must be a 1 x nbits CV_32F, and nbits a multiple of 64.
+  void binarizeDescriptorsTrain( CvMat *descriptors, CvMat *projection, CvMat *thresholds )
+  {
+    CV_Assert( CV_MAT_TYPE(descriptors->type) == CV_32FC1 && descriptors->rows > 0 );
+    CV_Assert( CV_MAT_TYPE(thresholds->type) == CV_32FC1 );
+
+    int nbits = thresholds->rows*thresholds->cols;
+    CV_Assert( (nbits % 64) == 0 );
+    if( projection ) {
+      CV_Assert( CV_MAT_TYPE(projection->type) == CV_32FC1 && projection->rows == nbits &&
+                 projection->cols == descriptors->cols );
+    } else {
+      CV_Assert( nbits == descriptors->cols );
+    }
+
+    vector<float> values( descriptors->rows );
+    for( int b = 0; b < nbits; b++ ) {
+      for( int i = 0; i < descriptors->rows; i++ )
+        values[i] = projectDescriptor( descriptors, i, projection, b );
+
+      std::nth_element( values.begin(), values.begin() + values.size()/2, values.end() );
+      thresholds->data.fl[b] = values[ values.size()/2 ];
+    }
+  }
+
+  // Packs each row of descriptors into a bit code in codes (N x nbits/8, CV_8U).
+  // Bit b is set if the b'th projection exceeds thresholds[b].
+  void binarizeDescriptors( CvMat *descriptors, CvMat *projection, CvMat *thresholds, CvMat *codes )
+  {
+    CV_Assert( CV_MAT_TYPE(descriptors->type) == CV_32FC1 );
+    CV_Assert( CV_MAT_TYPE(thresholds->type) == CV_32FC1 );
+    int nbits = thresholds->rows*thresholds->cols;
+    int words = codeWords( codes );
+    CV_Assert( words*64 == nbits && codes->rows == descriptors->rows );
+    if( projection ) {
+      CV_Assert( CV_MAT_TYPE(projection->type) == CV_32FC1 && projection->rows == nbits &&
+                 projection->cols == descriptors->cols );
+    } else {
+      CV_Assert( nbits == descriptors->cols );
+    }
+
+    for( int i = 0; i < descriptors->rows; i++ ) {
+      uint64_t *code = (uint64_t *)(codes->data.ptr + i*codes->step);
+      for( int w = 0; w < words; w++ ) {
+        uint64_t word = 0;
+        for( int b = 0; b < 64; b++ ) {
+          int bit = w*64 + b;
+          if( projectDescriptor( descriptors, i, projection, bit ) > thresholds->data.fl[bit] )
+            word |= (1ULL << b);
+        }
+        code[w] = word;
+      }
+    }
+  }
+
+  //##### Hamming Matcher #######
+  //
+  // query and train are packed bit codes as produced by binarizeDescriptors.
+  // Distances are in bits.
+  CvSeq *hammingMatcherKnn( CvMat *query, CvMat *train, CvMemStorage *storage, int knn )
+  {
+    vector< vector<DMatch> > matches;
+    hammingMatcherActual( query, train, matches, knn, -1 );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  CvSeq *hammingMatcherRatioTest( CvMat *query, CvMat *train, CvMemStorage *storage, float minRatio )
+  {
+    vector< vector<DMatch> > matches;
+    hammingMatcherActual( query, train, matches, 2, -1 );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+  CvSeq *hammingMatcherRadius( CvMat *query, CvMat *train, CvMemStorage *storage, float maxDistance )
+  {
+    vector< vector<DMatch> > matches;
+    hammingMatcherActual( query, train, matches, 0, maxDistance );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+}
@@ -0,0 +1,436 @@
+
+// Hierarchical navigable small-world (HNSW) graph index for approximate
+// nearest-neighbour descriptor matching.
+//
+// Malkov, Yashunin, "Efficient and robust approximate nearest neighbor
+// search using Hierarchical Navigable Small World graphs", PAMI 2018.
+//
+// Descriptors are CV_32F (e.g. SIFT, SURF) or CV_8U (e.g. SIFT scaled to
+// bytes), compared with the L2 norm.  Each node is linked to at most M
+// neighbours on the upper layers and 2*M on layer 0;  efConstruction
+// and ef set the breadth of the search during insertion and at query
+// time.  Larger values give higher recall at the cost of speed.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+#include <queue>
+#include <algorithm>
+
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+static const char HNSW_MAGIC[4] = { 'H', 'N', 'S', 'W' };
+static const int HNSW_VERSION = 1;
+
+struct CvffiHNSWIndex {
+  int dim, type;
+  int M, M0, efConstruction, ef;
+  double levelMult;
+
+  int entry, maxLevel;
+  vector<uchar> data;                    // ntotal x dim, contiguous
+  vector< vector< vector<int> > > links; // per node, per level
+
+  vector<unsigned int> visited;          // visit tags for searchLayer
+  unsigned int visitTag;
+
+  RNG rng;
+
+  int size() const { return (int)links.size(); }
+  size_t rowBytes() const { return dim * CV_ELEM_SIZE(type); }
+  const uchar *row( int i ) const { return &(data[ i*rowBytes() ]); }
+};
+
+static float hnswDistance( const CvffiHNSWIndex *index, const uchar *a, const uchar *b )
+{
+  if( index->type == CV_32F ) {
+    const float *fa = (const float *)a, *fb = (const float *)b;
+    float acc = 0.0;
+    for( int i = 0; i < index->dim; i++ ) {
+      float d = fa[i] - fb[i];
+      acc += d*d;
+    }
+    return acc;
+  } else {
+    int acc = 0;
+    for( int i = 0; i < index->dim; i++ ) {
+      int d = (int)a[i] - (int)b[i];
+      acc += d*d;
+    }
+    return (float)acc;
+  }
+}
+
+typedef pair<float,int> Candidate;
+
+// Best-first search of one layer from the given entry points.  Returns
+// up to ef nodes, sorted by increasing (squared) distance.
+static vector<Candidate> searchLayer( CvffiHNSWIndex *index, const uchar *q,
+                                      const vector<Candidate> &entries, int ef, int level )
+{
+  if( index->visited.size() < index->links.size() ) index->visited.resize( index->links.size(), 0 );
+  if( ++index->visitTag == 0 ) {
+    std::fill( index->visited.begin(), index->visited.end(), 0 );
+    index->visitTag = 1;
+  }
+
+  // candidates is a min-heap (via negated distance), found a max-heap
+  priority_queue<Candidate> candidates, found;
+  for( size_t i = 0; i < entries.size(); i++ ) {
+    index->visited[ entries[i].second ] = index->visitTag;
+    candidates.push( Candidate( -entries[i].first, entries[i].second ) );
+    found.push( entries[i] );
+  }
+
+  while( !candidates.empty() ) {
+    Candidate c = candidates.top();
+    if( -c.first > found.top().first && (int)found.size() >= ef ) break;
+    candidates.pop();
+
+    const vector<int> &neighbours = index->links[c.second][level];
+    for( size_t i = 0; i < neighbours.size(); i++ ) {
+      int n = neighbours[i];
+      if( index->visited[n] == index->visitTag ) continue;
+      index->visited[n] = index->visitTag;
+
+      float d = hnswDistance( index, q, index->row(n) );
+      if( (int)found.size() < ef || d < found.top().first ) {
+        candidates.push( Candidate( -d, n ) );
+        found.push( Candidate( d, n ) );
+        if( (int)found.size() > ef ) found.pop();
+      }
+    }
+  }
+
+  vector<Candidate> result( found.size() );
+  for( int i = (int)result.size()-1; i >= 0; i-- ) {
+    result[i] = found.top();
+    found.pop();
+  }
+  return result;
+}
+
+// The neighbour selection heuristic from the paper:  take candidates
+// in order of distance, skipping any that is closer to an already
+// selected neighbour than to the base node.  Keeps links spread out
+// rather than all pointing into one cluster.
+static vector<int> selectNeighbours( const CvffiHNSWIndex *index,
+                                     const vector<Candidate> &candidates, int M )
+{
+  vector<int> selected;
+  for( size_t i = 0; i < candidates.size() && (int)selected.size() < M; i++ ) {
+    const uchar *c = index->row( candidates[i].second );
+
+    bool keep = true;
+    for( size_t j = 0; j < selected.size() && keep; j++ )
+      if( hnswDistance( index, c, index->row( selected[j] ) ) < candidates[i].first ) keep = false;
+
+    if( keep ) selected.push_back( candidates[i].second );
+  }
+  return selected;
+}
+
+static void shrinkLinks( CvffiHNSWIndex *index, int node, int level, int Mmax )
+{
+  vector<int> &links = index->links[node][level];
+  if( (int)links.size() <= Mmax ) return;
+
+  const uchar *base = index->row( node );
+  vector<Candidate> candidates( links.size() );
+  for( size_t i = 0; i < links.size(); i++ )
+    candidates[i] = Candidate( hnswDistance( index, base, index->row( links[i] ) ), links[i] );
+  std::sort( candidates.begin(), candidates.end() );
+
+  links = selectNeighbours( index, candidates, Mmax );
+}
+
+static int randomLevel( CvffiHNSWIndex *index )
+{
+  double u = index->rng.uniform( 0.0, 1.0 );
+  if( u <= 0.0 ) u = DBL_MIN;
+  return (int)floor( -log( u ) * index->levelMult );
+}
+
+static void hnswInsert( CvffiHNSWIndex *index, int node )
+{
+  int level = randomLevel( index );
+  index->links[node].resize( level+1 );
+
+  const uchar *q = index->row( node );
+
+  if( index->entry < 0 ) {
+    index->entry = node;
+    index->maxLevel = level;
+    return;
+  }
+
+  vector<Candidate> entries( 1, Candidate( hnswDistance( index, q, index->row( index->entry ) ), index->entry ) );
+
+  for( int l = index->maxLevel; l > level; l-- )
+    entries = vector<Candidate>( 1, searchLayer( index, q, entries, 1, l )[0] );
+
+  for( int l = MIN( level, index->maxLevel ); l >= 0; l-- ) {
+    vector<Candidate> found = searchLayer( index, q, entries, index->efConstruction, l );
+    int Mmax = (l == 0) ? index->M0 : index->M;
+
+    vector<int> neighbours = selectNeighbours( index, found, index->M );
+    index->links[node][l] = neighbours;
+    for( size_t i = 0; i < neighbours.size(); i++ ) {
+      index->links[ neighbours[i] ][l].push_back( node );
+      shrinkLinks( index, neighbours[i], l, Mmax );
+    }
+
+    entries = found;
+  }
+
+  if( level > index->maxLevel ) {
+    index->maxLevel = level;
+    index->entry = node;
+  }
+}
+
+// Matches are returned sorted by increasing L2 distance, as from
+// FlannBasedMatcher::knnMatch.  If maxDistance >= 0 it's a radius match,
+// limited to the best max(ef, knn) candidates found.
+static void hnswSearchActual( CvffiHNSWIndex *index, const CvMat *query,
+                              vector< vector<DMatch> > &matches, int knn, float maxDistance )
+{
+  CV_Assert( CV_MAT_TYPE(query->type) == index->type && query->cols == index->dim );
+
+  matches.clear();
+  matches.resize( query->rows );
+  if( index->entry < 0 ) return;
+
+  int ef = MAX( index->ef, knn );
+
+  for( int r = 0; r < query->rows; r++ ) {
+    const uchar *q = query->data.ptr + r*query->step;
+
+    vector<Candidate> entries( 1, Candidate( hnswDistance( index, q, index->row( index->entry ) ), index->entry ) );
+    for( int l = index->maxLevel; l > 0; l-- )
+      entries = vector<Candidate>( 1, searchLayer( index, q, entries, 1, l )[0] );
+
+    vector<Candidate> found = searchLayer( index, q, entries, ef, 0 );
+
+    vector<DMatch> &out = matches[r];
+    for( size_t i = 0; i < found.size(); i++ ) {
+      float distance = sqrt( found[i].first );
+      if( maxDistance >= 0 ) {
+        if( distance > maxDistance ) break;
+      } else if( (int)out.size() >= knn ) break;
+
+      out.push_back( DMatch( r, found[i].second, 0, distance ) );
+    }
+  }
+}
+
+template <typename T>
+static bool writeValue( FILE *fp, const T &value )
+{
+  return fwrite( &value, sizeof(T), 1, fp ) == 1;
+}
+
+template <typename T>
+static bool readValue( FILE *fp, T &value )
+{
+  return fread( &value, sizeof(T), 1, fp ) == 1;
+}
+
+extern "C" {
+
+  // type is CV_32F or CV_8U.  Sensible defaults are M = 16 and
+  // efConstruction = 200.
+  CvffiHNSWIndex *hnswCreate( int dim, int type, int M, int efConstruction )
+  {
+    CV_Assert( dim > 0 && (type == CV_32F || type == CV_8U) );
+    CV_Assert( M >= 2 && efConstruction > 0 );
+
+    CvffiHNSWIndex *index = new CvffiHNSWIndex;
+    index->dim = dim;
+    index->type = type;
+    index->M = M;
+    index->M0 = 2*M;
+    index->efConstruction = efConstruction;
+    index->ef = 50;
+    index->levelMult = 1.0 / log( (double)M );
+    index->entry = -1;
+    index->maxLevel = -1;
+    index->visitTag = 0;
+    index->rng = RNG( 0x12345678 );
+    return index;
+  }
+
+  void hnswRelease( CvffiHNSWIndex **index )
+  {
+    if( index && *index ) {
+      delete *index;
+      *index = NULL;
+    }
+  }
+
+  // Search breadth at query time.  Never less than knn.
+  void hnswSetEf( CvffiHNSWIndex *index, int ef )
+  {
+    CV_Assert( ef > 0 );
+    index->ef = ef;
+  }
+
+  // Inserts descriptors into the graph.  They are numbered consecutively
+  // in the order added;  returns the number (trainIdx) of the first one.
+  int hnswAdd( CvffiHNSWIndex *index, CvMat *descriptors )
+  {
+    CV_Assert( CV_MAT_TYPE(descriptors->type) == index->type && descriptors->cols == index->dim );
+
+    int first = index->size();
+    size_t bytes = index->rowBytes();
+
+    index->data.resize( (first + descriptors->rows) * bytes );
+    index->links.resize( first + descriptors->rows );
+
+    for( int i = 0; i < descriptors->rows; i++ ) {
+      memcpy( &(index->data[ (first+i)*bytes ]), descriptors->data.ptr + i*descriptors->step, bytes );
+      hnswInsert( index, first+i );
+    }
+
+    return first;
+  }
+
+  int hnswSize( CvffiHNSWIndex *index )
+  {
+    return index->size();
+  }
+
+  CvSeq *hnswSearchKnn( CvffiHNSWIndex *index, CvMat *query, CvMemStorage *storage, int knn )
+  {
+    vector< vector<DMatch> > matches;
+    hnswSearchActual( index, query, matches, knn, -1 );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  CvSeq *hnswSearchRatioTest( CvffiHNSWIndex *index, CvMat *query, CvMemStorage *storage, float minRatio )
+  {
+    vector< vector<DMatch> > matches;
+    hnswSearchActual( index, query, matches, 2, -1 );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+  CvSeq *hnswSearchRadius( CvffiHNSWIndex *index, CvMat *query, CvMemStorage *storage, float maxDistance )
+  {
+    vector< vector<DMatch> > matches;
+    hnswSearchActual( index, query, matches, 0, maxDistance );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  //##### Serialization #######
+  //
+  // Native byte order.  Returns false if the file can't be written.
+  bool hnswSave( CvffiHNSWIndex *index, const char *filename )
+  {
+    FILE *fp = fopen( filename, "wb" );
+    if( fp == NULL ) return false;
+
+    int count = index->size();
+    bool ok = fwrite( HNSW_MAGIC, 1, 4, fp ) == 4 &&
+      writeValue( fp, HNSW_VERSION ) &&
+      writeValue( fp, index->dim ) && writeValue( fp, index->type ) &&
+      writeValue( fp, index->M ) && writeValue( fp, index->M0 ) &&
+      writeValue( fp, index->efConstruction ) && writeValue( fp, index->ef ) &&
+      writeValue( fp, index->entry ) && writeValue( fp, index->maxLevel ) &&
+      writeValue( fp, count );
+
+    if( ok && count > 0 )
+      ok = fwrite( &(index->data[0]), index->rowBytes(), count, fp ) == (size_t)count;
+
+    for( int i = 0; ok && i < count; i++ ) {
+      int levels = (int)index->links[i].size();
+      ok = writeValue( fp, levels );
+
+      for( int l = 0; ok && l < levels; l++ ) {
+        const vector<int> &links = index->links[i][l];
+        int n = (int)links.size();
+        ok = writeValue( fp, n ) &&
+          (n == 0 || fwrite( &(links[0]), sizeof(int), n, fp ) == (size_t)n);
+      }
+    }
+
+    return (fclose( fp ) == 0) && ok;
+  }
+
+  // Returns NULL if the file can't be read or isn't an HNSW index.
+  CvffiHNSWIndex *hnswLoad( const char *filename )
+  {
+    FILE *fp = fopen( filename, "rb" );
+    if( fp == NULL ) return NULL;
+
+    char magic[4];
+    int version, dim, type, M, M0, efConstruction, ef, entry, maxLevel, count;
+    bool ok = fread( magic, 1, 4, fp ) == 4 && memcmp( magic, HNSW_MAGIC, 4 ) == 0 &&
+      readValue( fp, version ) && version == HNSW_VERSION &&
+      readValue( fp, dim ) && readValue( fp, type ) &&
+      readValue( fp, M ) && readValue( fp, M0 ) &&
+      readValue( fp, efConstruction ) && readValue( fp, ef ) &&
+      readValue( fp, entry ) && readValue( fp, maxLevel ) &&
+      readValue( fp, count ) &&
+      dim > 0 && (type == CV_32F || type == CV_8U) && M >= 2 && count >= 0 &&
+      entry < count;
+
+    if( !ok ) {
+      fclose( fp );
+      return NULL;
+    }
+
+    CvffiHNSWIndex *index = hnswCreate( dim, type, M, efConstruction );
+    index->M0 = M0;
+    index->ef = ef;
+    index->entry = entry;
+    index->maxLevel = maxLevel;
+
+    index->data.resize( count * index->rowBytes() );
+    index->links.resize( count );
+
+    if( count > 0 )
+      ok = fread( &(index->data[0]), index->rowBytes(), count, fp ) == (size_t)count;
+
+    for( int i = 0; ok && i < count; i++ ) {
+      int levels;
+      ok = readValue( fp, levels ) && levels > 0 && levels <= maxLevel+1;
+      if( ok ) index->links[i].resize( levels );
+
+      for( int l = 0; ok && l < levels; l++ ) {
+        int n;
+        ok = readValue( fp, n ) && n >= 0 && n <= count;
+        if( !ok ) break;
+
+        vector<int> &links = index->links[i][l];
+        links.resize( n );
+        ok = (n == 0 || fread( &(links[0]), sizeof(int), n, fp ) == (size_t)n);
+
+        for( int j = 0; ok && j < n; j++ )
+          ok = links[j] >= 0 && links[j] < count;
+      }
+    }
+
+    fclose( fp );
+
+    // Every link must point at a node which exists on that level
+    if( ok && count > 0 )
+      ok = entry >= 0 && (int)index->links[entry].size() == maxLevel+1;
+
+    for( int i = 0; ok && i < count; i++ )
+      for( size_t l = 0; ok && l < index->links[i].size(); l++ )
+        for( size_t j = 0; ok && j < index->links[i][l].size(); j++ )
+          ok = index->links[ index->links[i][l][j] ].size() > l;
+
+    if( !ok ) hnswRelease( &index );
+    return index;
+  }
+
+}
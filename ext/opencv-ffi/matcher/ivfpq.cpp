@@ -0,0 +1,310 @@
+
+// Inverted-file index with product quantization (IVF-PQ) for
+// approximate nearest-neighbour search over large descriptor sets.
+//
+// Jegou, Douze, Schmid, "Product quantization for nearest neighbor search",
+// PAMI 2011.
+//
+// A coarse k-means quantizer splits the database into "nlist" inverted
+// lists.  Within each list, the residual from the list centroid is split
+// into "m" sub-vectors, each quantized to one of 256 centroids, so each
+// descriptor is stored as m bytes.  At search time only the "nprobe"
+// lists nearest the query are visited, and distances are computed
+// asymmetrically (exact query vs. quantized database) from per-list
+// lookup tables.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <float.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IVFPQ_X86
+#endif
+
+#include "cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+static const int PQ_KSUB = 256;
+
+struct CvffiIVFPQIndex {
+  int dim, nlist, m, dsub, ksub;
+  bool trained;
+  int ntotal;
+
+  Mat coarse;                  // nlist x dim, CV_32F
+  vector<float> codebooks;     // m x ksub x dsub
+
+  vector< vector<int> > ids;        // per list
+  vector< vector<uchar> > codes;    // per list, m bytes per entry
+};
+
+static float l2sqr( const float *a, const float *b, int n )
+{
+  float acc = 0.0;
+  for( int i = 0; i < n; i++ ) {
+    float d = a[i] - b[i];
+    acc += d*d;
+  }
+  return acc;
+}
+
+static int nearestCoarse( const CvffiIVFPQIndex *index, const float *x )
+{
+  int best = 0;
+  float bestDist = FLT_MAX;
+  for( int l = 0; l < index->nlist; l++ ) {
+    float d = l2sqr( x, index->coarse.ptr<float>(l), index->dim );
+    if( d < bestDist ) { bestDist = d; best = l; }
+  }
+  return best;
+}
+
+static void encodeResidual( const CvffiIVFPQIndex *index, const float *residual, uchar *code )
+{
+  for( int j = 0; j < index->m; j++ ) {
+    const float *sub = residual + j*index->dsub;
+    const float *book = &(index->codebooks[ j*index->ksub*index->dsub ]);
+
+    int best = 0;
+    float bestDist = FLT_MAX;
+    for( int c = 0; c < index->ksub; c++ ) {
+      float d = l2sqr( sub, book + c*index->dsub, index->dsub );
+      if( d < bestDist ) { bestDist = d; best = c; }
+    }
+    code[j] = (uchar)best;
+  }
+}
+
+//##### ADC scan kernels #######
+//
+// Sum the lookup table entries selected by each code:
+//   dist[i] = sum_j lut[ j*ksub + codes[i*m + j] ]
+typedef void (*ADCKernel)( const float *lut, const uchar *codes, int count, int m, int ksub, float *dist );
+
+static void adcKernelScalar( const float *lut, const uchar *codes, int count, int m, int ksub, float *dist )
+{
+  for( int i = 0; i < count; i++ ) {
+    const uchar *code = codes + i*m;
+    float acc = 0.0;
+    for( int j = 0; j < m; j++ )
+      acc += lut[ j*ksub + code[j] ];
+    dist[i] = acc;
+  }
+}
+
+#ifdef IVFPQ_X86
+// Gathers eight table entries (one per sub-quantizer) at a time.
+__attribute__((target("avx2")))
+static void adcKernelAVX2( const float *lut, const uchar *codes, int count, int m, int ksub, float *dist )
+{
+  const __m256i offsets = _mm256_mullo_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ),
+                                              _mm256_set1_epi32( ksub ) );
+  const int blocks = m / 8;
+
+  for( int i = 0; i < count; i++ ) {
+    const uchar *code = codes + i*m;
+    __m256 acc = _mm256_setzero_ps();
+
+    for( int b = 0; b < blocks; b++ ) {
+      __m128i bytes = _mm_loadl_epi64( (const __m128i *)(code + 8*b) );
+      __m256i idx = _mm256_add_epi32( _mm256_cvtepu8_epi32( bytes ), offsets );
+      acc = _mm256_add_ps( acc, _mm256_i32gather_ps( lut + 8*b*ksub, idx, 4 ) );
+    }
+
+    __m128 s = _mm_add_ps( _mm256_castps256_ps128( acc ), _mm256_extractf128_ps( acc, 1 ) );
+    s = _mm_hadd_ps( s, s );
+    s = _mm_hadd_ps( s, s );
+    float total = _mm_cvtss_f32( s );
+
+    for( int j = 8*blocks; j < m; j++ )
+      total += lut[ j*ksub + code[j] ];
+
+    dist[i] = total;
+  }
+}
+
+#endif
+
+static ADCKernel selectADCKernel( int m )
+{
+#ifdef IVFPQ_X86
+  __builtin_cpu_init();
+  if( m >= 8 && __builtin_cpu_supports( "avx2" ) )
+    return adcKernelAVX2;
+#endif
+  return adcKernelScalar;
+}
+
+static void ivfpqSearchActual( const CvffiIVFPQIndex *index, const CvMat *query,
+                               vector< vector<DMatch> > &matches, int knn, int nprobe )
+{
+  CV_Assert( index->trained && CV_MAT_TYPE(query->type) == CV_32FC1 && query->cols == index->dim );
+  nprobe = MAX( 1, MIN( nprobe, index->nlist ) );
+
+  ADCKernel kernel = selectADCKernel( index->m );
+  vector< pair<float,int> > coarseDist( index->nlist );
+  vector<float> residual( index->dim ), lut( index->m*index->ksub ), dist;
+
+  matches.clear();
+  matches.resize( query->rows );
+
+  for( int q = 0; q < query->rows; q++ ) {
+    const float *x = (const float *)(query->data.ptr + q*query->step);
+
+    for( int l = 0; l < index->nlist; l++ )
+      coarseDist[l] = make_pair( l2sqr( x, index->coarse.ptr<float>(l), index->dim ), l );
+    std::partial_sort( coarseDist.begin(), coarseDist.begin() + nprobe, coarseDist.end() );
+
+    vector<DMatch> &best = matches[q];
+    best.reserve( knn+1 );
+
+    for( int p = 0; p < nprobe; p++ ) {
+      int list = coarseDist[p].second;
+      const vector<int> &ids = index->ids[list];
+      if( ids.empty() ) continue;
+
+      const float *c = index->coarse.ptr<float>(list);
+      for( int d = 0; d < index->dim; d++ ) residual[d] = x[d] - c[d];
+
+      for( int j = 0; j < index->m; j++ ) {
+        const float *sub = &(residual[ j*index->dsub ]);
+        const float *book = &(index->codebooks[ j*index->ksub*index->dsub ]);
+        for( int k = 0; k < index->ksub; k++ )
+          lut[ j*index->ksub + k ] = l2sqr( sub, book + k*index->dsub, index->dsub );
+      }
+
+      dist.resize( ids.size() );
+      kernel( &(lut[0]), &(index->codes[list][0]), (int)ids.size(), index->m, index->ksub, &(dist[0]) );
+
+      for( size_t i = 0; i < ids.size(); i++ )
+        insertKnnMatch( best, knn, DMatch( q, ids[i], 0, dist[i] ) );
+    }
+
+    // Report L2 distances, like the NORM_L2 brute force matcher
+    for( size_t i = 0; i < best.size(); i++ )
+      best[i].distance = sqrt( best[i].distance );
+  }
+}
+
+extern "C" {
+
+  // m must divide dim.  Each indexed descriptor costs m bytes plus an int id.
+  CvffiIVFPQIndex *ivfpqCreate( int dim, int nlist, int m )
+  {
+    CV_Assert( dim > 0 && nlist > 0 && m > 0 && (dim % m) == 0 );
+
+    CvffiIVFPQIndex *index = new CvffiIVFPQIndex;
+    index->dim = dim;
+    index->nlist = nlist;
+    index->m = m;
+    index->dsub = dim / m;
+    index->ksub = PQ_KSUB;
+    index->trained = false;
+    index->ntotal = 0;
+    index->ids.resize( nlist );
+    index->codes.resize( nlist );
+    return index;
+  }
+
+  void ivfpqRelease( CvffiIVFPQIndex **index )
+  {
+    if( index && *index ) {
+      delete *index;
+      *index = NULL;
+    }
+  }
+
+  // Learns the coarse quantizer and the PQ codebooks from a
+  // representative set of descriptors (N x dim, CV_32F).  Needs at
+  // least nlist descriptors;  with fewer than 256 the sub-quantizers
+  // are correspondingly smaller.  Must come before any ivfpqAdd, as
+  // codes already stored wouldn't decode against new centroids.
+  void ivfpqTrain( CvffiIVFPQIndex *index, CvMat *descriptors )
+  {
+    CV_Assert( index->ntotal == 0 );
+    CV_Assert( CV_MAT_TYPE(descriptors->type) == CV_32FC1 && descriptors->cols == index->dim );
+    CV_Assert( descriptors->rows >= index->nlist );
+
+    Mat data( descriptors );
+    Mat labels;
+    TermCriteria criteria( TermCriteria::COUNT + TermCriteria::EPS, 25, 1e-4 );
+
+    kmeans( data, index->nlist, labels, criteria, 1, KMEANS_PP_CENTERS, index->coarse );
+
+    Mat residuals( data.rows, data.cols, CV_32F );
+    for( int i = 0; i < data.rows; i++ ) {
+      const float *x = data.ptr<float>(i), *c = index->coarse.ptr<float>( labels.at<int>(i) );
+      float *r = residuals.ptr<float>(i);
+      for( int d = 0; d < index->dim; d++ ) r[d] = x[d] - c[d];
+    }
+
+    index->ksub = MIN( PQ_KSUB, data.rows );
+    index->codebooks.resize( index->m*index->ksub*index->dsub );
+
+    for( int j = 0; j < index->m; j++ ) {
+      Mat sub = residuals.colRange( j*index->dsub, (j+1)*index->dsub ).clone();
+      Mat subLabels, centers;
+      kmeans( sub, index->ksub, subLabels, criteria, 1, KMEANS_PP_CENTERS, centers );
+
+      for( int c = 0; c < index->ksub; c++ )
+        std::copy( centers.ptr<float>(c), centers.ptr<float>(c) + index->dsub,
+                   &(index->codebooks[ (j*index->ksub + c)*index->dsub ]) );
+    }
+
+    index->trained = true;
+  }
+
+  // Adds descriptors to the index.  They are numbered consecutively in
+  // the order added;  returns the number (trainIdx) of the first one.
+  int ivfpqAdd( CvffiIVFPQIndex *index, CvMat *descriptors )
+  {
+    CV_Assert( index->trained && CV_MAT_TYPE(descriptors->type) == CV_32FC1 &&
+               descriptors->cols == index->dim );
+
+    int first = index->ntotal;
+    vector<float> residual( index->dim );
+    vector<uchar> code( index->m );
+
+    for( int i = 0; i < descriptors->rows; i++ ) {
+      const float *x = (const float *)(descriptors->data.ptr + i*descriptors->step);
+      int list = nearestCoarse( index, x );
+
+      const float *c = index->coarse.ptr<float>(list);
+      for( int d = 0; d < index->dim; d++ ) residual[d] = x[d] - c[d];
+      encodeResidual( index, &(residual[0]), &(code[0]) );
+
+      index->ids[list].push_back( index->ntotal++ );
+      index->codes[list].insert( index->codes[list].end(), code.begin(), code.end() );
+    }
+
+    return first;
+  }
+
+  int ivfpqSize( CvffiIVFPQIndex *index )
+  {
+    return index->ntotal;
+  }
+
+  // Distances are approximate L2 distances.  nprobe is the number of
+  // inverted lists visited per query, trading speed for recall.
+  CvSeq *ivfpqSearchKnn( CvffiIVFPQIndex *index, CvMat *query, CvMemStorage *storage, int knn, int nprobe )
+  {
+    vector< vector<DMatch> > matches;
+    ivfpqSearchActual( index, query, matches, knn, nprobe );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  CvSeq *ivfpqSearchRatioTest( CvffiIVFPQIndex *index, CvMat *query, CvMemStorage *storage, float minRatio, int nprobe )
+  {
+    vector< vector<DMatch> > matches;
+    ivfpqSearchActual( index, query, matches, 2, nprobe );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+}
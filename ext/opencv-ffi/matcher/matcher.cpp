@@ -5,94 +5,129 @@
 
 #include <stdio.h>
 
-using namespace cv;
-
-// The enumeration of the different types of Norms comes from OpenCV 2.4.x
-// Backported here for convience.
-//enum { NORM_INF=1, NORM_L1=2, NORM_L2=4, NORM_L2SQR=5, NORM_HAMMING=6, NORM_HAMMING2=7, NORM_TYPE_MASK=7, NORM_RELATIVE=8, NORM_MINMAX=32 };
-enum { NORM_L2SQR = 5, NORM_HAMMING=6 };
-
-struct CvDMatch_t {
-  int queryIdx;
-  int trainIdx;
-  int imgIdx;
+#include "cvffi_matcher.h"
 
-  float distance;
-  float ratio;
-  unsigned int rank;
-};
+using namespace cv;
 
-struct CvMatcherParams_t {
-  int normType;
-  int knn;
-  bool calculateRatios;
-  float minRatio;
-  float minRadius;
-  bool crossCheck;
+// Sink for converted matches which writes into a caller-allocated array
+// rather than a CvSeq.  Keeps counting once the array is full so the
+// caller can learn how much space it needs.
+struct DMatchBufferWriter {
+  CvDMatch_t *buffer;
+  int capacity;
+  int count;
 };
 
+static void writeDmatch( CvSeqWriter &writer, const DMatch &dmatch, unsigned int rank = 0, float ratio = 0.0 )
+{
+  CvDMatch_t dm;
+  dm.queryIdx = dmatch.queryIdx;
+  dm.trainIdx = dmatch.trainIdx;
+  dm.imgIdx   = dmatch.imgIdx;
+  dm.distance = dmatch.distance;
+  dm.ratio    = ratio;
+  dm.rank     = rank;
+  CV_WRITE_SEQ_ELEM( dm, writer );
 
-enum { CONVERT_ALL = 0, TAKE_JUST_FIRST = 1 };
-
-extern "C" {
+}
 
-  static void writeDmatchToSeqWriter( CvSeqWriter &writer, const DMatch &dmatch, unsigned int rank = 0, float ratio = 0.0 )
-  {
-    CvDMatch_t dm;
+static void writeDmatch( DMatchBufferWriter &writer, const DMatch &dmatch, unsigned int rank = 0, float ratio = 0.0 )
+{
+  if( writer.buffer != NULL && writer.count < writer.capacity ) {
+    CvDMatch_t &dm = writer.buffer[ writer.count ];
     dm.queryIdx = dmatch.queryIdx;
     dm.trainIdx = dmatch.trainIdx;
     dm.imgIdx   = dmatch.imgIdx;
     dm.distance = dmatch.distance;
     dm.ratio    = ratio;
     dm.rank     = rank;
-    CV_WRITE_SEQ_ELEM( dm, writer );
-
   }
+  writer.count++;
+}
 
-  CvSeq *DMatchToCvSeq( const vector< vector<DMatch> > &matches, CvMemStorage *storage, int doTakeFirst, bool calculateRatios CV_DEFAULT(false) )
-  {
-    // TODO:  For now, Knn will return a flattened set of matches, 
-    // May want to change this behavior in the future
-    CvSeq *seq = cvCreateSeq( 0, sizeof( CvSeq ), sizeof( CvDMatch_t ), storage );
-    float ratio;
-
-    CvSeqWriter writer;
-    cvStartAppendToSeq( seq, &writer );
-    for( vector< vector<DMatch> >::const_iterator itr = matches.begin(); itr != matches.end(); itr++ ) {
+template <typename Writer>
+static void writeDMatches( const vector< vector<DMatch> > &matches, Writer &writer, int doTakeFirst, bool calculateRatios )
+{
+  // TODO:  For now, Knn will return a flattened set of matches, 
+  // May want to change this behavior in the future
+  float ratio;
 
-      if( doTakeFirst == TAKE_JUST_FIRST ) {
-        if( !(*itr).empty() ) {
+  for( vector< vector<DMatch> >::const_iterator itr = matches.begin(); itr != matches.end(); itr++ ) {
 
-          if( !calculateRatios  || (*itr).size() == 1 )
-            ratio = NAN;
-          else
-            ratio = (*itr)[1].distance/(*itr)[0].distance;
+    if( doTakeFirst == TAKE_JUST_FIRST ) {
+      if( !(*itr).empty() ) {
 
-          writeDmatchToSeqWriter( writer, (*itr)[0], 0, ratio );
-        }
-      } else {
+        if( !calculateRatios  || (*itr).size() == 1 )
+          ratio = NAN;
+        else
+          ratio = (*itr)[1].distance/(*itr)[0].distance;
 
-        unsigned int rank = 0;
+        writeDmatch( writer, (*itr)[0], 0, ratio );
+      }
+    } else {
 
-        for( vector<DMatch>::const_iterator itr2 = (*itr).begin();  itr2 != (*itr).end(); itr2++ ) {
-          if( calculateRatios ) {
-            vector<DMatch>::const_iterator next = itr2 + 1;
+      unsigned int rank = 0;
 
-            if( next != (*itr).end() ) {
-              ratio = (*next).distance / (*itr2).distance;
-              writeDmatchToSeqWriter( writer, (*itr2), rank, ratio );
-            } else {
-              writeDmatchToSeqWriter( writer, (*itr2), rank, NAN );
-            }
+      for( vector<DMatch>::const_iterator itr2 = (*itr).begin();  itr2 != (*itr).end(); itr2++ ) {
+        if( calculateRatios ) {
+          vector<DMatch>::const_iterator next = itr2 + 1;
 
+          if( next != (*itr).end() ) {
+            ratio = (*next).distance / (*itr2).distance;
+            writeDmatch( writer, (*itr2), rank, ratio );
           } else {
-            writeDmatchToSeqWriter( writer, (*itr2), rank );
+            writeDmatch( writer, (*itr2), rank, NAN );
           }
 
-          ++rank;
+        } else {
+          writeDmatch( writer, (*itr2), rank );
         }
+
+        ++rank;
       }
     }
+  }
+}
+
+template <typename Writer>
+static void writeDMatchesRatioTest( const vector< vector<DMatch> > &matches, Writer &writer, float minRatio )
+{
+  // TODO:  For now, Knn will return a flattened set of matches,
+  // may do this differently in the future
+  float ratio;
+
+  for( vector< vector<DMatch> >::const_iterator itr = matches.begin(); itr != matches.end(); itr++ ) {
+
+    switch( (*itr).size() ) {
+      case 1:
+        writeDmatch( writer, (*itr)[0] );
+        break;
+      default:
+        // Assumes the matches are sorted in increasing order of distance
+        if( (*itr).size() >= 2 ) {
+          ratio = (*itr)[1].distance/(*itr)[0].distance;
+          //printf("Comparing distaces %f and %f (%f)", (*itr)[0].distance, (*itr)[1].distance, (*itr)[1].distance/(*itr)[0].distance );
+          if( ratio > minRatio )  {
+            //printf(" accept\n");
+            writeDmatch( writer, (*itr)[0], 0, ratio );
+          } else {
+            //printf(" reject\n");
+          }
+        }
+        break;
+    }
+  }
+}
+
+extern "C" {
+
+  CvSeq *DMatchToCvSeq( const vector< vector<DMatch> > &matches, CvMemStorage *storage, int doTakeFirst, bool calculateRatios )
+  {
+    CvSeq *seq = cvCreateSeq( 0, sizeof( CvSeq ), sizeof( CvDMatch_t ), storage );
+
+    CvSeqWriter writer;
+    cvStartAppendToSeq( seq, &writer );
+    writeDMatches( matches, writer, doTakeFirst, calculateRatios );
     cvEndWriteSeq( &writer );
 
     //printf("After conversion, vector size = %d, CvSeq size = %d\n", 
@@ -105,35 +140,11 @@ extern "C" {
 
   CvSeq *DMatchToCvSeqRatioTest( const vector< vector<DMatch> > &matches, CvMemStorage *storage, float minRatio )
   {
-
-    // TODO:  For now, Knn will return a flattened set of matches,
-    // may do this differently in the future
     CvSeq *seq = cvCreateSeq( 0, sizeof( CvSeq ), sizeof( CvDMatch_t ), storage );
+
     CvSeqWriter writer;
     cvStartAppendToSeq( seq, &writer );
-    float ratio;
-
-    for( vector< vector<DMatch> >::const_iterator itr = matches.begin(); itr != matches.end(); itr++ ) {
-
-      switch( (*itr).size() ) {
-        case 1:
-          writeDmatchToSeqWriter( writer, (*itr)[0] );
-          break;
-        default:
-          // Assumes the matches are sorted in increasing order of distance
-          if( (*itr).size() >= 2 ) {
-            ratio = (*itr)[1].distance/(*itr)[0].distance;
-            //printf("Comparing distaces %f and %f (%f)", (*itr)[0].distance, (*itr)[1].distance, (*itr)[1].distance/(*itr)[0].distance );
-            if( ratio > minRatio )  {
-              //printf(" accept\n");
-              writeDmatchToSeqWriter( writer, (*itr)[0], 0, ratio );
-            } else {
-              //printf(" reject\n");
-            }
-          }
-          break;
-      }
-    }
+    writeDMatchesRatioTest( matches, writer, minRatio );
     cvEndWriteSeq( &writer );
 
     //printf("After conversion, vector size = %d, CvSeq size = %d\n", 
@@ -142,6 +153,28 @@ extern "C" {
     return seq; 
   }
 
+  int DMatchToBuffer( const vector< vector<DMatch> > &matches, CvDMatch_t *buffer, int capacity, int doTakeFirst, bool calculateRatios )
+  {
+    DMatchBufferWriter writer = { buffer, capacity, 0 };
+    writeDMatches( matches, writer, doTakeFirst, calculateRatios );
+    return writer.count;
+  }
+
+  int DMatchToBufferRatioTest( const vector< vector<DMatch> > &matches, CvDMatch_t *buffer, int capacity, float minRatio )
+  {
+    DMatchBufferWriter writer = { buffer, capacity, 0 };
+    writeDMatchesRatioTest( matches, writer, minRatio );
+    return writer.count;
+  }
+
+  // Upper bound on the number of CvDMatch_t's a knn match of query
+  // against train can produce.  Sufficient to size the buffer for the
+  // knn, ratio test and single-match *Buffer functions in one pass.
+  // Radius matches have no useful bound;  use the return value instead.
+  int matcherResultsBound( CvMat *query, CvMat *train, int knn )
+  {
+    return query->rows * MIN( knn, train->rows );
+  }
 
 
   //##### Brute Force Matcher #######
@@ -151,6 +184,17 @@ extern "C" {
     matcher.knnMatch( query, train, matches, knn );
   }
 
+  // The ratio test needs only the best two matches, so for L2 the
+  // distance to a candidate which can't beat the second best is
+  // abandoned part way through.
+  static void bruteForceMatcherRatioActual( CvMat *query, CvMat *train, vector< vector<DMatch> > &matches, int normType, bool crossCheck )
+  {
+    if( earlyAbandonApplies( query, train, normType, crossCheck ) )
+      earlyAbandonKnnMatch( query, train, matches, normType, 2 );
+    else
+      bruteForceMatcherKnnActual( query, train, matches, normType, 2, crossCheck );
+  }
+
   CvSeq *bruteForceMatcher( CvMat *query, CvMat *train, 
                                CvMemStorage *storage, int normType, 
                                bool crossCheck CV_DEFAULT(false) ) 
@@ -174,40 +218,58 @@ extern "C" {
                                      float minRatio, bool crossCheck CV_DEFAULT(false) ) 
   {
     vector< vector<DMatch> > matches;
-    bruteForceMatcherKnnActual( query, train, matches, normType, 2, crossCheck );
+    bruteForceMatcherRatioActual( query, train, matches, normType, crossCheck );
     return DMatchToCvSeqRatioTest( matches, storage, minRatio );
   }
 
+  void bruteForceMatcherRadiusActual( CvMat *query, CvMat *train, vector< vector<DMatch> > &matches, int normType, float maxDistance, bool crossCheck CV_DEFAULT(false) )
+  {
+    if( earlyAbandonApplies( query, train, normType, crossCheck ) ) {
+      earlyAbandonRadiusMatch( query, train, matches, normType, maxDistance );
+      return;
+    }
+
+    BFMatcher matcher( normType, crossCheck );
+    matcher.radiusMatch( query, train, matches, maxDistance );
+  }
+
   CvSeq *bruteForceMatcherRadius( CvMat *query, CvMat *train, 
                                   CvMemStorage *storage, int normType, 
                                   float maxDistance, bool crossCheck CV_DEFAULT(false) ) 
   {
     vector< vector<DMatch> > matches;
-
-    BFMatcher matcher( normType, crossCheck );
-    matcher.radiusMatch( query, train, matches, maxDistance );
-    
+    bruteForceMatcherRadiusActual( query, train, matches, normType, maxDistance, crossCheck );
     return DMatchToCvSeq( matches, storage, CONVERT_ALL );
   }
 
 
+  void bruteForceMatcherParamsActual( CvMat *query, CvMat *train, vector< vector<DMatch> > &matches, CvMatcherParams_t *params )
+  {
+    int knn = params->knn;
+    if( params->calculateRatios && params->knn == 1 ) knn++;
+
+    if( params->minRadius > 0.0 ) {
+      bruteForceMatcherRadiusActual( query, train, matches, params->normType, params->minRadius, params->crossCheck );
+      return;
+    }
+
+    if( params->minRatio > 0.0 && earlyAbandonApplies( query, train, params->normType, params->crossCheck ) ) {
+      earlyAbandonKnnMatch( query, train, matches, params->normType, knn );
+      return;
+    }
+
+    BFMatcher matcher( params->normType, params->crossCheck );
+    matcher.knnMatch( query, train, matches, knn );
+  }
+
   // This is the "universal" function parameterized through params.
   CvSeq *bruteForceMatcherParams( CvMat *query, 
                                   CvMat *train, 
                                   CvMemStorage *storage,
                                   CvMatcherParams_t *params )
   {
-    int knn = params->knn;
-    if( params->calculateRatios && params->knn == 1 ) knn++;
-
     vector< vector<DMatch> > matches;
-    BFMatcher matcher( params->normType, params->crossCheck );
-
-    if (params->minRadius > 0.0 ) 
-      matcher.radiusMatch( query, train, matches, params->minRadius ); 
-    else {
-      matcher.knnMatch( query, train, matches, knn );
-    }
+    bruteForceMatcherParamsActual( query, train, matches, params );
 
     if( params->minRatio > 0.0 ) {
       return DMatchToCvSeqRatioTest( matches, storage, params->minRatio );
@@ -218,6 +280,62 @@ extern "C" {
         params->calculateRatios );
   }
 
+  //##### Brute Force Matcher, flat output #######
+  //
+  // These write into a caller-allocated array of CvDMatch_t rather than
+  // a CvSeq, and return the total number of matches (see DMatchToBuffer).
+  int bruteForceMatcherBuffer( CvMat *query, CvMat *train,
+                               CvDMatch_t *results, int capacity,
+                               int normType, bool crossCheck CV_DEFAULT(false) )
+  {
+    vector< vector<DMatch> > matches;
+    bruteForceMatcherKnnActual( query, train, matches, normType, 1, crossCheck );
+    return DMatchToBuffer( matches, results, capacity, TAKE_JUST_FIRST );
+  }
+
+  int bruteForceMatcherKnnBuffer( CvMat *query, CvMat *train,
+                                  CvDMatch_t *results, int capacity,
+                                  int normType, int knn, bool crossCheck CV_DEFAULT(false) )
+  {
+    vector< vector<DMatch> > matches;
+    bruteForceMatcherKnnActual( query, train, matches, normType, knn, crossCheck );
+    return DMatchToBuffer( matches, results, capacity, CONVERT_ALL );
+  }
+
+  int bruteForceMatcherRatioTestBuffer( CvMat *query, CvMat *train,
+                                        CvDMatch_t *results, int capacity,
+                                        int normType, float minRatio, bool crossCheck CV_DEFAULT(false) )
+  {
+    vector< vector<DMatch> > matches;
+    bruteForceMatcherRatioActual( query, train, matches, normType, crossCheck );
+    return DMatchToBufferRatioTest( matches, results, capacity, minRatio );
+  }
+
+  int bruteForceMatcherRadiusBuffer( CvMat *query, CvMat *train,
+                                     CvDMatch_t *results, int capacity,
+                                     int normType, float maxDistance, bool crossCheck CV_DEFAULT(false) )
+  {
+    vector< vector<DMatch> > matches;
+    bruteForceMatcherRadiusActual( query, train, matches, normType, maxDistance, crossCheck );
+    return DMatchToBuffer( matches, results, capacity, CONVERT_ALL );
+  }
+
+  int bruteForceMatcherParamsBuffer( CvMat *query, CvMat *train,
+                                     CvDMatch_t *results, int capacity,
+                                     CvMatcherParams_t *params )
+  {
+    vector< vector<DMatch> > matches;
+    bruteForceMatcherParamsActual( query, train, matches, params );
+
+    if( params->minRatio > 0.0 ) {
+      return DMatchToBufferRatioTest( matches, results, capacity, params->minRatio );
+    }
+
+    return DMatchToBuffer( matches, results, capacity,
+        (params->knn == 1) ? TAKE_JUST_FIRST : CONVERT_ALL,
+        params->calculateRatios );
+  }
+
   //##### FLANN Matcher #######
   // TODO:  Expose flann parameters through API
   void flannMatcherKnnActual( CvMat *query, CvMat *train, vector< vector<DMatch> > &matches, int knn )
@@ -249,17 +367,44 @@ extern "C" {
    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
   }
 
-  CvSeq *flannBasedMatcherRadius( CvMat *query, CvMat *train, CvMemStorage *storage, float maxDistance )
+  void flannMatcherRadiusActual( CvMat *query, CvMat *train, vector< vector<DMatch> > &matches, float maxDistance )
   {
     Mat _train( train );
     Mat _query( query );
-    vector< vector<DMatch> > matches;
 
     FlannBasedMatcher matcher;
     matcher.radiusMatch( query, train, matches, maxDistance );
+  }
+
+  CvSeq *flannBasedMatcherRadius( CvMat *query, CvMat *train, CvMemStorage *storage, float maxDistance )
+  {
+    vector< vector<DMatch> > matches;
+    flannMatcherRadiusActual( query, train, matches, maxDistance );
     return DMatchToCvSeq( matches, storage, CONVERT_ALL );
   }
 
+  //##### FLANN Matcher, flat output #######
+  int flannBasedMatcherKnnBuffer( CvMat *query, CvMat *train, CvDMatch_t *results, int capacity, int knn )
+  {
+    vector< vector<DMatch> > matches;
+    flannMatcherKnnActual( query, train, matches, knn );
+    return DMatchToBuffer( matches, results, capacity, CONVERT_ALL );
+  }
+
+  int flannBasedMatcherRatioTestBuffer( CvMat *query, CvMat *train, CvDMatch_t *results, int capacity, float minRatio )
+  {
+    vector< vector<DMatch> > matches;
+    flannMatcherKnnActual( query, train, matches, 2 );
+    return DMatchToBufferRatioTest( matches, results, capacity, minRatio );
+  }
+
+  int flannBasedMatcherRadiusBuffer( CvMat *query, CvMat *train, CvDMatch_t *results, int capacity, float maxDistance )
+  {
+    vector< vector<DMatch> > matches;
+    flannMatcherRadiusActual( query, train, matches, maxDistance );
+    return DMatchToBuffer( matches, results, capacity, CONVERT_ALL );
+  }
+
 
 
 }
@@ -0,0 +1,230 @@
+
+// Matching every pair (or a list of pairs) of images in a collection,
+// as when building a match graph for structure from motion.  Each
+// image's descriptors are copied in once;  the pairs are then matched
+// natively and in parallel rather than with one call from Ruby per pair.
+//
+// Pairs are grouped by query image, and each group split into tasks of
+// a few train images.  Within a task, a block of query descriptors is
+// held in cache while the rows of each train image stream past it, so
+// the query block is read from memory once per task rather than once
+// per train descriptor.  Tasks are scheduled with cv::parallel_for_,
+// and each writes only its own pairs' results.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include "cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+// Query rows held in cache at once, and train images matched against
+// each block.  64 SIFT descriptors are 32kB.
+static const int PAIR_QUERY_BLOCK = 64;
+static const int PAIR_TRAIN_GROUP = 8;
+
+struct CvffiPairMatcher {
+  int normType;
+  int type, cols;
+  vector<Mat> images;
+
+  // Results of the last pairMatcherMatch, in the order the pairs were given
+  vector< pair<int,int> > pairs;
+  vector< vector<CvDMatch_t> > results;
+};
+
+// Converts one pair's knn lists to CvDMatch_t's, with the ratio test if
+// minRatio > 0.
+static void pairConvert( const vector< vector<DMatch> > &matches, float minRatio, vector<CvDMatch_t> &out )
+{
+  int count = (minRatio > 0) ? DMatchToBufferRatioTest( matches, NULL, 0, minRatio )
+                             : DMatchToBuffer( matches, NULL, 0, CONVERT_ALL );
+  out.resize( count );
+  if( count == 0 ) return;
+
+  if( minRatio > 0 )
+    DMatchToBufferRatioTest( matches, &(out[0]), count, minRatio );
+  else
+    DMatchToBuffer( matches, &(out[0]), count, CONVERT_ALL );
+}
+
+class PairMatchBody : public ParallelLoopBody {
+public:
+  // order holds indices into pm.pairs, sorted by query image;  task t
+  // covers order[ taskStart[t] ] .. order[ taskStart[t+1]-1 ], which all
+  // share a query image.
+  PairMatchBody( CvffiPairMatcher &pm, const vector<int> &order, const vector<int> &taskStart,
+                 int knn, float minRatio )
+    : _pm( pm ), _order( order ), _taskStart( taskStart ), _knn( knn ), _minRatio( minRatio )
+  {;}
+
+  virtual void operator()( const Range &range ) const
+  {
+    vector< vector< vector<DMatch> > > matches;
+
+    for( int t = range.start; t < range.end; t++ ) {
+      int first = _taskStart[t], count = _taskStart[t+1] - first;
+      int qimg = _pm.pairs[ _order[first] ].first;
+      const Mat &query = _pm.images[ qimg ];
+
+      matches.assign( count, vector< vector<DMatch> >( query.rows ) );
+
+      for( int q0 = 0; q0 < query.rows; q0 += PAIR_QUERY_BLOCK ) {
+        int q1 = MIN( q0 + PAIR_QUERY_BLOCK, query.rows );
+
+        for( int p = 0; p < count; p++ ) {
+          int timg = _pm.pairs[ _order[first+p] ].second;
+          const Mat &train = _pm.images[ timg ];
+
+          for( int j = 0; j < train.rows; j++ ) {
+            const uchar *trow = train.ptr( j );
+            for( int q = q0; q < q1; q++ ) {
+              float d = descriptorDistance( query.ptr( q ), trow, _pm.cols, _pm.normType );
+              insertKnnMatch( matches[p][q], _knn, DMatch( q, j, timg, d ) );
+            }
+          }
+        }
+      }
+
+      for( int p = 0; p < count; p++ )
+        pairConvert( matches[p], _minRatio, _pm.results[ _order[first+p] ] );
+    }
+  }
+
+private:
+  CvffiPairMatcher &_pm;
+  const vector<int> &_order, &_taskStart;
+  int _knn;
+  float _minRatio;
+};
+
+struct PairByQuery {
+  PairByQuery( const vector< pair<int,int> > &pairs ) : _pairs( pairs ) {;}
+  bool operator()( int a, int b ) const { return _pairs[a] < _pairs[b]; }
+  const vector< pair<int,int> > &_pairs;
+};
+
+extern "C" {
+
+  // normType is NORM_L1, NORM_L2 or NORM_L2SQR for CV_32F descriptors,
+  // or NORM_HAMMING for CV_8U.
+  CvffiPairMatcher *pairMatcherCreate( int normType )
+  {
+    CV_Assert( normType == NORM_L1 || normType == NORM_L2 || normType == ::NORM_L2SQR || normType == ::NORM_HAMMING );
+
+    CvffiPairMatcher *pm = new CvffiPairMatcher;
+    pm->normType = normType;
+    pm->type = -1;
+    pm->cols = 0;
+    return pm;
+  }
+
+  void pairMatcherRelease( CvffiPairMatcher **pm )
+  {
+    if( pm == NULL || *pm == NULL ) return;
+    delete *pm;
+    *pm = NULL;
+  }
+
+  // Copies in one image's descriptors and returns its index, which
+  // identifies the image in pairs and in the results' imgIdx.
+  int pairMatcherAddImage( CvffiPairMatcher *pm, CvMat *descriptors )
+  {
+    int type = CV_MAT_TYPE( descriptors->type );
+    CV_Assert( (type == CV_32FC1 && pm->normType != ::NORM_HAMMING) ||
+               (type == CV_8UC1 && pm->normType == ::NORM_HAMMING) );
+    CV_Assert( pm->images.empty() || (type == pm->type && descriptors->cols == pm->cols) );
+
+    pm->type = type;
+    pm->cols = descriptors->cols;
+    pm->images.push_back( Mat( descriptors, true ) );
+    return (int)pm->images.size() - 1;
+  }
+
+  int pairMatcherSize( CvffiPairMatcher *pm )
+  {
+    return (int)pm->images.size();
+  }
+
+  // Matches the pairs of images given as rows of pairs (N x 2, CV_32S,
+  // query image then train image), or if pairs is NULL every pair (i,j)
+  // with i < j, in order.  With minRatio > 0 only the best match for
+  // each query descriptor which passes the ratio test is kept, otherwise
+  // the knn best.  Returns the number of pairs;  their results are read
+  // with pairMatcherResults and replace those of any earlier call.
+  int pairMatcherMatch( CvffiPairMatcher *pm, CvMat *pairs, int knn, float minRatio )
+  {
+    int n = (int)pm->images.size();
+
+    pm->pairs.clear();
+    if( pairs == NULL ) {
+      for( int i = 0; i < n; i++ )
+        for( int j = i+1; j < n; j++ )
+          pm->pairs.push_back( make_pair( i, j ) );
+    } else {
+      CV_Assert( CV_MAT_TYPE( pairs->type ) == CV_32SC1 && pairs->cols == 2 );
+      for( int i = 0; i < pairs->rows; i++ ) {
+        const int *row = (const int *)(pairs->data.ptr + i*pairs->step);
+        CV_Assert( row[0] >= 0 && row[0] < n && row[1] >= 0 && row[1] < n );
+        pm->pairs.push_back( make_pair( row[0], row[1] ) );
+      }
+    }
+
+    if( minRatio > 0 ) knn = 2;
+    CV_Assert( knn > 0 );
+
+    pm->results.assign( pm->pairs.size(), vector<CvDMatch_t>() );
+
+    // Group the pairs by query image, and cut each group into tasks
+    vector<int> order( pm->pairs.size() ), taskStart;
+    for( size_t i = 0; i < order.size(); i++ ) order[i] = (int)i;
+    std::sort( order.begin(), order.end(), PairByQuery( pm->pairs ) );
+
+    for( size_t i = 0; i < order.size(); i++ ) {
+      bool newQuery = (i == 0) || pm->pairs[ order[i] ].first != pm->pairs[ order[i-1] ].first;
+      if( newQuery || (int)i - taskStart.back() == PAIR_TRAIN_GROUP ) taskStart.push_back( (int)i );
+    }
+    int tasks = (int)taskStart.size();
+    taskStart.push_back( (int)order.size() );
+
+    parallel_for_( Range( 0, tasks ), PairMatchBody( *pm, order, taskStart, knn, minRatio ) );
+
+    return (int)pm->pairs.size();
+  }
+
+  void pairMatcherPair( CvffiPairMatcher *pm, int i, int *query, int *train )
+  {
+    CV_Assert( i >= 0 && i < (int)pm->pairs.size() );
+    *query = pm->pairs[i].first;
+    *train = pm->pairs[i].second;
+  }
+
+  // The matches for the i'th pair of the last pairMatcherMatch.  imgIdx
+  // is the train image.
+  CvSeq *pairMatcherResults( CvffiPairMatcher *pm, int i, CvMemStorage *storage )
+  {
+    CV_Assert( i >= 0 && i < (int)pm->results.size() );
+    const vector<CvDMatch_t> &r = pm->results[i];
+
+    CvSeq *seq = cvCreateSeq( 0, sizeof( CvSeq ), sizeof( CvDMatch_t ), storage );
+    if( !r.empty() ) cvSeqPushMulti( seq, &(r[0]), (int)r.size() );
+    return seq;
+  }
+
+  // As pairMatcherResults, but into a caller-allocated buffer (see
+  // DMatchToBuffer).  Returns the number of matches for the pair.
+  int pairMatcherResultsBuffer( CvffiPairMatcher *pm, int i, CvDMatch_t *results, int capacity )
+  {
+    CV_Assert( i >= 0 && i < (int)pm->results.size() );
+    const vector<CvDMatch_t> &r = pm->results[i];
+
+    if( results != NULL )
+      std::copy( r.begin(), r.begin() + MIN( (int)r.size(), capacity ), results );
+    return (int)r.size();
+  }
+
+}
@@ -0,0 +1,350 @@
+
+// Quantized descriptor storage and L2 matching kernels.
+//
+// Float descriptors can be stored as:
+//
+//   CV_8U   uint8, scaled by a fixed factor.  The SIFT extractor here
+//           already scales by SIFT_INT_DESCR_FCTR and clamps to 255, so
+//           its descriptors convert exactly with a scale of 1;
+//           unit-normalized SIFT uses SIFT_INT_DESCR_FCTR.
+//   CV_8S   int8, scaled so the largest magnitude in a set maps to 127
+//           (for SURF, whose components are signed).  Sets which are
+//           to be matched against one another must share a scale.
+//   CV_16S  IEEE half-precision bit patterns (OpenCV 2.4 has no CV_16F).
+//
+// cutting the memory traffic of a brute-force match by 2-4x.  The
+// kernels widen to 16 bits and use multiply-add of the differences
+// (vpmaddwd), accumulating exactly in 32-bit integers;  the half-float
+// kernel converts with F16C.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZED_X86
+#endif
+
+#include "cvffi_matcher.h"
+#include "../sift/sift.h"
+
+using namespace cv;
+using namespace std;
+
+//##### Half-precision conversion #######
+
+static uint16_t floatToHalf( float f )
+{
+  uint32_t x;
+  memcpy( &x, &f, 4 );
+
+  uint32_t sign = (x >> 16) & 0x8000;
+  int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  if( ((x >> 23) & 0xff) == 0xff )                  // Inf / NaN
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  if( exponent >= 31 ) return sign | 0x7c00;         // overflow
+  if( exponent <= 0 ) {                              // subnormal or zero
+    if( exponent < -10 ) return sign;
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1), midpoint = 1u << (shift-1);
+    if( rest > midpoint || (rest == midpoint && (half & 1)) ) half++;
+    return sign | half;
+  }
+
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if( rest > 0x1000 || (rest == 0x1000 && (half & 1)) ) half++;   // round to nearest even
+  return half;
+}
+
+static float halfToFloat( uint16_t h )
+{
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  int exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+
+  if( exponent == 0 ) {
+    if( mantissa == 0 ) x = sign;
+    else {
+      exponent = 1;
+      while( !(mantissa & 0x400) ) { mantissa <<= 1; exponent--; }
+      mantissa &= 0x3ff;
+      x = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+  } else if( exponent == 31 )
+    x = sign | 0x7f800000 | (mantissa << 13);
+  else
+    x = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+
+  float f;
+  memcpy( &f, &x, 4 );
+  return f;
+}
+
+//##### Distance kernels #######
+//
+// Squared L2 distance between two quantized descriptors of length n.
+typedef float (*QuantizedKernel)( const uchar *a, const uchar *b, int n );
+
+static float l2sqrU8Scalar( const uchar *a, const uchar *b, int n )
+{
+  int acc = 0;
+  for( int i = 0; i < n; i++ ) {
+    int d = (int)a[i] - (int)b[i];
+    acc += d*d;
+  }
+  return (float)acc;
+}
+
+static float l2sqrS8Scalar( const uchar *a, const uchar *b, int n )
+{
+  const schar *sa = (const schar *)a, *sb = (const schar *)b;
+  int acc = 0;
+  for( int i = 0; i < n; i++ ) {
+    int d = (int)sa[i] - (int)sb[i];
+    acc += d*d;
+  }
+  return (float)acc;
+}
+
+static float l2sqrF16Scalar( const uchar *a, const uchar *b, int n )
+{
+  const uint16_t *ha = (const uint16_t *)a, *hb = (const uint16_t *)b;
+  float acc = 0.0;
+  for( int i = 0; i < n; i++ ) {
+    float d = halfToFloat( ha[i] ) - halfToFloat( hb[i] );
+    acc += d*d;
+  }
+  return acc;
+}
+
+#ifdef QUANTIZED_X86
+__attribute__((target("avx2")))
+static inline int hsumEpi32( __m256i v )
+{
+  __m128i s = _mm_add_epi32( _mm256_castsi256_si128( v ), _mm256_extracti128_si256( v, 1 ) );
+  s = _mm_add_epi32( s, _mm_shuffle_epi32( s, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+  s = _mm_add_epi32( s, _mm_shuffle_epi32( s, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+  return _mm_cvtsi128_si32( s );
+}
+
+// 16 bytes per step, widened to 16-bit lanes.  The differences fit in
+// 9 bits so the pairwise products summed by vpmaddwd can't overflow.
+__attribute__((target("avx2")))
+static float l2sqrU8AVX2( const uchar *a, const uchar *b, int n )
+{
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for( ; i+16 <= n; i += 16 ) {
+    __m256i va = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *)(a+i) ) );
+    __m256i vb = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *)(b+i) ) );
+    __m256i d = _mm256_sub_epi16( va, vb );
+    acc = _mm256_add_epi32( acc, _mm256_madd_epi16( d, d ) );
+  }
+
+  int total = hsumEpi32( acc );
+  for( ; i < n; i++ ) {
+    int d = (int)a[i] - (int)b[i];
+    total += d*d;
+  }
+  return (float)total;
+}
+
+__attribute__((target("avx2")))
+static float l2sqrS8AVX2( const uchar *a, const uchar *b, int n )
+{
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for( ; i+16 <= n; i += 16 ) {
+    __m256i va = _mm256_cvtepi8_epi16( _mm_loadu_si128( (const __m128i *)(a+i) ) );
+    __m256i vb = _mm256_cvtepi8_epi16( _mm_loadu_si128( (const __m128i *)(b+i) ) );
+    __m256i d = _mm256_sub_epi16( va, vb );
+    acc = _mm256_add_epi32( acc, _mm256_madd_epi16( d, d ) );
+  }
+
+  int total = hsumEpi32( acc );
+  const schar *sa = (const schar *)a, *sb = (const schar *)b;
+  for( ; i < n; i++ ) {
+    int d = (int)sa[i] - (int)sb[i];
+    total += d*d;
+  }
+  return (float)total;
+}
+
+__attribute__((target("avx2,f16c,fma")))
+static float l2sqrF16AVX2( const uchar *a, const uchar *b, int n )
+{
+  const uint16_t *ha = (const uint16_t *)a, *hb = (const uint16_t *)b;
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for( ; i+8 <= n; i += 8 ) {
+    __m256 va = _mm256_cvtph_ps( _mm_loadu_si128( (const __m128i *)(ha+i) ) );
+    __m256 vb = _mm256_cvtph_ps( _mm_loadu_si128( (const __m128i *)(hb+i) ) );
+    __m256 d = _mm256_sub_ps( va, vb );
+    acc = _mm256_fmadd_ps( d, d, acc );
+  }
+
+  __m128 s = _mm_add_ps( _mm256_castps256_ps128( acc ), _mm256_extractf128_ps( acc, 1 ) );
+  s = _mm_hadd_ps( s, s );
+  s = _mm_hadd_ps( s, s );
+  float total = _mm_cvtss_f32( s );
+
+  for( ; i < n; i++ ) {
+    float d = halfToFloat( ha[i] ) - halfToFloat( hb[i] );
+    total += d*d;
+  }
+  return total;
+}
+
+#endif
+
+static QuantizedKernel selectQuantizedKernel( int type )
+{
+#ifdef QUANTIZED_X86
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports( "avx2" );
+
+  switch( type ) {
+    case CV_8UC1:  return avx2 ? l2sqrU8AVX2 : l2sqrU8Scalar;
+    case CV_8SC1:  return avx2 ? l2sqrS8AVX2 : l2sqrS8Scalar;
+    case CV_16SC1: return (avx2 && __builtin_cpu_supports( "f16c" ) && __builtin_cpu_supports( "fma" )) ?
+                          l2sqrF16AVX2 : l2sqrF16Scalar;
+  }
+#else
+  switch( type ) {
+    case CV_8UC1:  return l2sqrU8Scalar;
+    case CV_8SC1:  return l2sqrS8Scalar;
+    case CV_16SC1: return l2sqrF16Scalar;
+  }
+#endif
+
+  CV_Error( CV_StsUnsupportedFormat, "Quantized descriptors must be CV_8U, CV_8S or CV_16S (half float)" );
+  return NULL;
+}
+
+// Queries are taken in blocks, and each train descriptor compared
+// against the whole block while it's in cache, so the train set is
+// streamed from memory once per block rather than once per query.
+static const int QUERY_BLOCK = 16;
+
+static void quantizedMatcherActual( const CvMat *query, const CvMat *train,
+                                    vector< vector<DMatch> > &matches, int knn, float scale )
+{
+  int type = CV_MAT_TYPE( query->type );
+  CV_Assert( type == CV_MAT_TYPE( train->type ) && query->cols == train->cols );
+
+  QuantizedKernel kernel = selectQuantizedKernel( type );
+  float inverseScale = (scale > 0) ? 1.0f/scale : 1.0f;
+
+  matches.clear();
+  matches.resize( query->rows );
+
+  for( int q0 = 0; q0 < query->rows; q0 += QUERY_BLOCK ) {
+    int q1 = MIN( q0 + QUERY_BLOCK, query->rows );
+
+    for( int t = 0; t < train->rows; t++ ) {
+      const uchar *tr = train->data.ptr + t*train->step;
+      for( int q = q0; q < q1; q++ )
+        insertKnnMatch( matches[q], knn,
+            DMatch( q, t, 0, kernel( query->data.ptr + q*query->step, tr, query->cols ) ) );
+    }
+
+    // Report L2 distances in the units of the original descriptors
+    for( int q = q0; q < q1; q++ )
+      for( size_t i = 0; i < matches[q].size(); i++ )
+        matches[q][i].distance = sqrt( matches[q][i].distance ) * inverseScale;
+  }
+}
+
+extern "C" {
+
+  // dst = saturate( round( scale * src ) ).  src is CV_32F or CV_64F,
+  // dst CV_8U of the same size.  Use scale = 1 for descriptors from
+  // cvSIFTDetectDescribe, or SIFT_INT_DESCR_FCTR for unit-normalized SIFT.
+  void quantizeDescriptorsU8( CvMat *src, CvMat *dst, float scale )
+  {
+    CV_Assert( CV_MAT_TYPE( dst->type ) == CV_8UC1 && src->rows == dst->rows && src->cols == dst->cols );
+
+    Mat _src( src ), _dst( dst );
+    _src.convertTo( _dst, CV_8U, scale );
+  }
+
+  // dst = saturate( round( scale * src ) ).  With scale <= 0, picks the
+  // scale which maps the largest magnitude in the set to 127;  pass the
+  // scale a train set was quantized with to quantize its queries, so
+  // the two are comparable.  Returns the scale used, which should be
+  // passed to the matchers to recover distances in the original units.
+  float quantizeDescriptorsS8( CvMat *src, CvMat *dst, float scale )
+  {
+    CV_Assert( CV_MAT_TYPE( dst->type ) == CV_8SC1 && src->rows == dst->rows && src->cols == dst->cols );
+
+    Mat _src( src ), _dst( dst );
+    if( scale <= 0 ) {
+      double minVal, maxVal;
+      minMaxLoc( _src, &minVal, &maxVal );
+
+      double range = MAX( fabs( minVal ), fabs( maxVal ) );
+      scale = (range > 0) ? (float)(127.0 / range) : 1.0f;
+    }
+
+    _src.convertTo( _dst, CV_8S, scale );
+    return scale;
+  }
+
+  // Stores half-precision bit patterns in a CV_16S matrix
+  void quantizeDescriptorsF16( CvMat *src, CvMat *dst )
+  {
+    CV_Assert( CV_MAT_TYPE( dst->type ) == CV_16SC1 && src->rows == dst->rows && src->cols == dst->cols );
+
+    Mat _src;
+    Mat( src ).convertTo( _src, CV_32F );
+
+    for( int i = 0; i < src->rows; i++ ) {
+      const float *s = _src.ptr<float>(i);
+      uint16_t *d = (uint16_t *)(dst->data.ptr + i*dst->step);
+      for( int j = 0; j < src->cols; j++ ) d[j] = floatToHalf( s[j] );
+    }
+  }
+
+  // The reverse of the above, for checking or for code which needs
+  // float descriptors back.  dst is CV_32F.
+  void dequantizeDescriptorsF16( CvMat *src, CvMat *dst )
+  {
+    CV_Assert( CV_MAT_TYPE( src->type ) == CV_16SC1 && CV_MAT_TYPE( dst->type ) == CV_32FC1 &&
+               src->rows == dst->rows && src->cols == dst->cols );
+
+    for( int i = 0; i < src->rows; i++ ) {
+      const uint16_t *s = (const uint16_t *)(src->data.ptr + i*src->step);
+      float *d = (float *)(dst->data.ptr + i*dst->step);
+      for( int j = 0; j < src->cols; j++ ) d[j] = halfToFloat( s[j] );
+    }
+  }
+
+  // L2 matching of quantized descriptors (both CV_8U, CV_8S or CV_16S,
+  // as produced above).  Distances are divided by scale, so they're
+  // comparable with the NORM_L2 float matchers;  use the scale the
+  // descriptors were quantized with (1 for half floats).
+  CvSeq *quantizedMatcherKnn( CvMat *query, CvMat *train, CvMemStorage *storage, int knn, float scale )
+  {
+    vector< vector<DMatch> > matches;
+    quantizedMatcherActual( query, train, matches, knn, scale );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  CvSeq *quantizedMatcherRatioTest( CvMat *query, CvMat *train, CvMemStorage *storage, float minRatio, float scale )
+  {
+    vector< vector<DMatch> > matches;
+    quantizedMatcherActual( query, train, matches, 2, scale );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+}
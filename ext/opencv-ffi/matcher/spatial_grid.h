@@ -0,0 +1,166 @@
+
+#ifndef _CVFFI_SPATIAL_GRID_H
+#define _CVFFI_SPATIAL_GRID_H
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+#include <algorithm>
+
+#include <math.h>
+#include <float.h>
+
+// Reads keypoint coordinates from an N x 2 (or N x 1, two-channel)
+// CV_32F or CV_64F matrix, as produced by Matches#to_CvMat.
+inline void cvMatToPoints( const CvMat *mat, std::vector<cv::Point2f> &points )
+{
+  int depth = CV_MAT_DEPTH( mat->type );
+  int cn = CV_MAT_CN( mat->type );
+  CV_Assert( (depth == CV_32F || depth == CV_64F) && mat->cols * cn == 2 );
+
+  points.resize( mat->rows );
+  for( int i = 0; i < mat->rows; i++ ) {
+    const uchar *row = mat->data.ptr + i*mat->step;
+    if( depth == CV_32F )
+      points[i] = cv::Point2f( ((const float *)row)[0], ((const float *)row)[1] );
+    else
+      points[i] = cv::Point2f( (float)((const double *)row)[0], (float)((const double *)row)[1] );
+  }
+}
+
+// A uniform grid over a set of points, for finding the points in a
+// region without scanning them all.  Point indices are stored sorted by
+// cell;  cell c holds index[ start[c] ] .. index[ start[c+1]-1 ].
+class SpatialGrid {
+public:
+  // Large enough to hold about "perCell" points per cell if they were
+  // spread evenly over their bounding box, and at least minSize.
+  static float suggestCellSize( const std::vector<cv::Point2f> &points, float perCell, float minSize )
+  {
+    if( points.empty() ) return MAX( minSize, 1.0f );
+
+    cv::Rect_<float> box = bounds( points );
+    float area = MAX( box.width * box.height, 1.0f );
+    return MAX( minSize, (float)sqrt( area * perCell / points.size() ) );
+  }
+
+  SpatialGrid( const std::vector<cv::Point2f> &points, float cellSize )
+    : _points( points )
+  {
+    cv::Rect_<float> box = bounds( points );
+    _x0 = box.x;  _y0 = box.y;
+
+    // Cap the grid size, for tiny cells over a large image
+    _cellSize = MAX( cellSize, MAX( box.width, box.height ) / MAX_CELLS );
+    _cellSize = MAX( _cellSize, 1e-3f );
+
+    _cols = (int)(box.width / _cellSize) + 1;
+    _rows = (int)(box.height / _cellSize) + 1;
+
+    std::vector<int> cells( points.size() );
+    _start.assign( _cols*_rows + 1, 0 );
+    for( size_t i = 0; i < points.size(); i++ ) {
+      cells[i] = cellY( points[i].y ) * _cols + cellX( points[i].x );
+      _start[ cells[i]+1 ]++;
+    }
+    for( size_t c = 1; c < _start.size(); c++ ) _start[c] += _start[c-1];
+
+    std::vector<int> fill( _start.begin(), _start.end()-1 );
+    _index.resize( points.size() );
+    for( size_t i = 0; i < points.size(); i++ )
+      _index[ fill[ cells[i] ]++ ] = (int)i;
+  }
+
+  int cols( void ) const { return _cols; }
+  int rows( void ) const { return _rows; }
+  float cellSize( void ) const { return _cellSize; }
+
+  int cellX( float x ) const { return clampCell( (x - _x0) / _cellSize, _cols ); }
+  int cellY( float y ) const { return clampCell( (y - _y0) / _cellSize, _rows ); }
+
+  const int *cellBegin( int cx, int cy ) const { return &(_index[0]) + _start[ cy*_cols + cx ]; }
+  const int *cellEnd( int cx, int cy ) const { return &(_index[0]) + _start[ cy*_cols + cx + 1 ]; }
+
+  // Appends the indices of the points within radius of (x,y)
+  void queryRadius( float x, float y, float radius, std::vector<int> &out ) const
+  {
+    if( _index.empty() ) return;
+    float r2 = radius*radius;
+
+    int cx0 = cellX( x - radius ), cx1 = cellX( x + radius );
+    int cy0 = cellY( y - radius ), cy1 = cellY( y + radius );
+
+    for( int cy = cy0; cy <= cy1; cy++ )
+      for( int cx = cx0; cx <= cx1; cx++ )
+        for( const int *i = cellBegin( cx, cy ); i != cellEnd( cx, cy ); i++ ) {
+          float dx = _points[*i].x - x, dy = _points[*i].y - y;
+          if( dx*dx + dy*dy <= r2 ) out.push_back( *i );
+        }
+  }
+
+  // Appends the indices of the points within "tolerance" of the line
+  // a*x + b*y + c = 0.  Walks along the line one cell column (or row,
+  // for steep lines) at a time, so only cells the band crosses are visited.
+  void queryLine( double a, double b, double c, float tolerance, std::vector<int> &out ) const
+  {
+    if( _index.empty() ) return;
+
+    double norm = sqrt( a*a + b*b );
+    if( norm < DBL_EPSILON ) return;
+    a /= norm;  b /= norm;  c /= norm;
+
+    bool steep = fabs( a ) > fabs( b );
+    int major = steep ? _rows : _cols, minor = steep ? _cols : _rows;
+    double origin = steep ? _y0 : _x0, minorOrigin = steep ? _x0 : _y0;
+
+    // Along the major axis, the line is minor = -(p*major + c)/q
+    double p = steep ? b : a, q = steep ? a : b;
+    double halfWidth = tolerance / fabs( q );
+
+    for( int m = 0; m < major; m++ ) {
+      double m0 = origin + m*_cellSize, m1 = m0 + _cellSize;
+      double n0 = -(p*m0 + c)/q, n1 = -(p*m1 + c)/q;
+
+      double lo = MIN( n0, n1 ) - halfWidth, hi = MAX( n0, n1 ) + halfWidth;
+      double first = floor( (lo - minorOrigin) / _cellSize ), last = floor( (hi - minorOrigin) / _cellSize );
+      if( last < 0 || first >= minor ) continue;
+
+      int n1c = (int)MIN( last, (double)(minor-1) );
+      for( int n = (int)MAX( first, 0.0 ); n <= n1c; n++ ) {
+        int cx = steep ? n : m, cy = steep ? m : n;
+
+        for( const int *i = cellBegin( cx, cy ); i != cellEnd( cx, cy ); i++ )
+          if( fabs( a*_points[*i].x + b*_points[*i].y + c ) <= tolerance ) out.push_back( *i );
+      }
+    }
+  }
+
+private:
+  static const int MAX_CELLS = 1024;
+
+  static cv::Rect_<float> bounds( const std::vector<cv::Point2f> &points )
+  {
+    if( points.empty() ) return cv::Rect_<float>( 0, 0, 0, 0 );
+
+    float xmin = points[0].x, xmax = xmin, ymin = points[0].y, ymax = ymin;
+    for( size_t i = 1; i < points.size(); i++ ) {
+      xmin = MIN( xmin, points[i].x );  xmax = MAX( xmax, points[i].x );
+      ymin = MIN( ymin, points[i].y );  ymax = MAX( ymax, points[i].y );
+    }
+    return cv::Rect_<float>( xmin, ymin, xmax - xmin, ymax - ymin );
+  }
+
+  static int clampCell( float c, int n )
+  {
+    if( !(c >= 0) ) return 0;
+    if( c >= n ) return n-1;
+    return (int)c;
+  }
+
+  const std::vector<cv::Point2f> &_points;
+  float _x0, _y0, _cellSize;
+  int _cols, _rows;
+  std::vector<int> _start, _index;
+};
+
+#endif
@@ -0,0 +1,98 @@
+
+// Spatial-prior matching for frame-to-frame tracking.  Between
+// consecutive frames a keypoint moves only a little, so each query is
+// compared only with train keypoints within "radius" pixels of its
+// predicted position (its own position, shifted by the expected motion
+// dx,dy).  Train keypoints are bucketed in a uniform grid, making the
+// cost proportional to the number of spatial neighbours rather than to
+// the size of the train set.
+//
+// For a per-keypoint motion prediction (e.g. from optical flow), pass
+// the predicted positions as queryPoints with dx = dy = 0.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+
+#include "cvffi_matcher.h"
+#include "spatial_grid.h"
+
+using namespace cv;
+using namespace std;
+
+static void spatialMatcherActual( const CvMat *query, const CvMat *queryPoints,
+                                  const CvMat *train, const CvMat *trainPoints,
+                                  vector< vector<DMatch> > &matches, int normType, int knn,
+                                  float radius, float dx, float dy )
+{
+  checkDescriptorNorm( query, train, normType );
+  CV_Assert( radius > 0 );
+
+  vector<Point2f> qpts, tpts;
+  cvMatToPoints( queryPoints, qpts );
+  cvMatToPoints( trainPoints, tpts );
+  CV_Assert( (int)qpts.size() == query->rows && (int)tpts.size() == train->rows );
+
+  SpatialGrid grid( tpts, radius );
+  vector<int> candidates;
+
+  matches.clear();
+  matches.resize( query->rows );
+
+  for( int q = 0; q < query->rows; q++ ) {
+    candidates.clear();
+    grid.queryRadius( qpts[q].x + dx, qpts[q].y + dy, radius, candidates );
+
+    for( size_t i = 0; i < candidates.size(); i++ )
+      insertKnnMatch( matches[q], knn,
+          DMatch( q, candidates[i], 0, descriptorDistance( query, q, train, candidates[i], normType ) ) );
+  }
+}
+
+extern "C" {
+
+  // queryPoints and trainPoints are the keypoint coordinates for each
+  // descriptor row, N x 2 CV_32F or CV_64F.  Queries with no train
+  // keypoints in range get no matches.
+  CvSeq *spatialMatcherKnn( CvMat *query, CvMat *queryPoints,
+                            CvMat *train, CvMat *trainPoints,
+                            CvMemStorage *storage, int normType, int knn,
+                            float radius, float dx, float dy )
+  {
+    vector< vector<DMatch> > matches;
+    spatialMatcherActual( query, queryPoints, train, trainPoints, matches, normType, knn, radius, dx, dy );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  CvSeq *spatialMatcherRatioTest( CvMat *query, CvMat *queryPoints,
+                                  CvMat *train, CvMat *trainPoints,
+                                  CvMemStorage *storage, int normType, float minRatio,
+                                  float radius, float dx, float dy )
+  {
+    vector< vector<DMatch> > matches;
+    spatialMatcherActual( query, queryPoints, train, trainPoints, matches, normType, 2, radius, dx, dy );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+  //##### Flat output, for the tracking loop #######
+  int spatialMatcherKnnBuffer( CvMat *query, CvMat *queryPoints,
+                               CvMat *train, CvMat *trainPoints,
+                               CvDMatch_t *results, int capacity, int normType, int knn,
+                               float radius, float dx, float dy )
+  {
+    vector< vector<DMatch> > matches;
+    spatialMatcherActual( query, queryPoints, train, trainPoints, matches, normType, knn, radius, dx, dy );
+    return DMatchToBuffer( matches, results, capacity, CONVERT_ALL );
+  }
+
+  int spatialMatcherRatioTestBuffer( CvMat *query, CvMat *queryPoints,
+                                     CvMat *train, CvMat *trainPoints,
+                                     CvDMatch_t *results, int capacity, int normType, float minRatio,
+                                     float radius, float dx, float dy )
+  {
+    vector< vector<DMatch> > matches;
+    spatialMatcherActual( query, queryPoints, train, trainPoints, matches, normType, 2, radius, dx, dy );
+    return DMatchToBufferRatioTest( matches, results, capacity, minRatio );
+  }
+
+}
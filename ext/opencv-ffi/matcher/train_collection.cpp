@@ -0,0 +1,167 @@
+
+// A train set made up of the descriptors from several images, so one
+// query can be matched against all of them (e.g. a window of recent
+// keyframes) in one call.  Matches report the image in imgIdx and the
+// row within that image in trainIdx.
+//
+// Descriptors live in one contiguous store, images being runs of rows
+// within it.  Each image gets an id when added, which doesn't change
+// as other images are removed.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <vector>
+
+#include "cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+// Query rows matched against the whole store at once
+static const int COLLECTION_QUERY_BLOCK = 64;
+
+struct CvffiTrainCollection {
+  int normType;
+  int type, cols;
+  size_t rowBytes;
+
+  vector<uchar> data;
+
+  // Per image, in the order added:  id, first row and number of rows
+  vector<int> ids, offsets, rows;
+  int nextId;
+};
+
+class CollectionMatchBody : public ParallelLoopBody {
+public:
+  CollectionMatchBody( const CvffiTrainCollection &tc, const CvMat *query,
+                       vector< vector<DMatch> > &matches, int knn )
+    : _tc( tc ), _query( query ), _matches( matches ), _knn( knn )
+  {;}
+
+  // range is in blocks of COLLECTION_QUERY_BLOCK query rows
+  virtual void operator()( const Range &range ) const
+  {
+    int q0 = range.start * COLLECTION_QUERY_BLOCK;
+    int q1 = MIN( range.end * COLLECTION_QUERY_BLOCK, _query->rows );
+
+    for( size_t i = 0; i < _tc.ids.size(); i++ ) {
+      const uchar *train = &(_tc.data[0]) + _tc.offsets[i] * _tc.rowBytes;
+
+      for( int j = 0; j < _tc.rows[i]; j++, train += _tc.rowBytes )
+        for( int q = q0; q < q1; q++ ) {
+          float d = descriptorDistance( _query->data.ptr + q*_query->step, train, _tc.cols, _tc.normType );
+          insertKnnMatch( _matches[q], _knn, DMatch( q, j, _tc.ids[i], d ) );
+        }
+    }
+  }
+
+private:
+  const CvffiTrainCollection &_tc;
+  const CvMat *_query;
+  vector< vector<DMatch> > &_matches;
+  int _knn;
+};
+
+static void trainCollectionMatchActual( const CvffiTrainCollection *tc, const CvMat *query,
+                                        vector< vector<DMatch> > &matches, int knn )
+{
+  CV_Assert( knn > 0 );
+  CV_Assert( CV_MAT_TYPE( query->type ) == tc->type && query->cols == tc->cols );
+
+  matches.clear();
+  matches.resize( query->rows );
+  if( tc->data.empty() ) return;
+
+  int blocks = (query->rows + COLLECTION_QUERY_BLOCK - 1) / COLLECTION_QUERY_BLOCK;
+  parallel_for_( Range( 0, blocks ), CollectionMatchBody( *tc, query, matches, knn ) );
+}
+
+extern "C" {
+
+  // type is CV_32F, with normType NORM_L1, NORM_L2 or NORM_L2SQR, or
+  // CV_8U with NORM_HAMMING.  cols is the descriptor length.
+  CvffiTrainCollection *trainCollectionCreate( int type, int cols, int normType )
+  {
+    CV_Assert( (type == CV_32FC1 && (normType == NORM_L1 || normType == NORM_L2 || normType == ::NORM_L2SQR)) ||
+               (type == CV_8UC1 && normType == ::NORM_HAMMING) );
+    CV_Assert( cols > 0 );
+
+    CvffiTrainCollection *tc = new CvffiTrainCollection;
+    tc->normType = normType;
+    tc->type = type;
+    tc->cols = cols;
+    tc->rowBytes = cols * CV_ELEM_SIZE( type );
+    tc->nextId = 0;
+    return tc;
+  }
+
+  void trainCollectionRelease( CvffiTrainCollection **tc )
+  {
+    if( tc == NULL || *tc == NULL ) return;
+    delete *tc;
+    *tc = NULL;
+  }
+
+  // Appends one image's descriptors and returns its id
+  int trainCollectionAdd( CvffiTrainCollection *tc, CvMat *descriptors )
+  {
+    CV_Assert( CV_MAT_TYPE( descriptors->type ) == tc->type && descriptors->cols == tc->cols );
+
+    size_t end = tc->data.size();
+    tc->data.resize( end + descriptors->rows * tc->rowBytes );
+    for( int i = 0; i < descriptors->rows; i++ )
+      memcpy( &(tc->data[ end + i*tc->rowBytes ]), descriptors->data.ptr + i*descriptors->step, tc->rowBytes );
+
+    tc->ids.push_back( tc->nextId );
+    tc->offsets.push_back( (int)(end / tc->rowBytes) );
+    tc->rows.push_back( descriptors->rows );
+    return tc->nextId++;
+  }
+
+  // Removes an image's descriptors.  Returns false if there's no image
+  // with that id.
+  bool trainCollectionRemove( CvffiTrainCollection *tc, int id )
+  {
+    size_t i = 0;
+    while( i < tc->ids.size() && tc->ids[i] != id ) i++;
+    if( i == tc->ids.size() ) return false;
+
+    vector<uchar>::iterator first = tc->data.begin() + tc->offsets[i] * tc->rowBytes;
+    tc->data.erase( first, first + tc->rows[i] * tc->rowBytes );
+
+    for( size_t j = i+1; j < tc->ids.size(); j++ ) tc->offsets[j] -= tc->rows[i];
+
+    tc->ids.erase( tc->ids.begin() + i );
+    tc->offsets.erase( tc->offsets.begin() + i );
+    tc->rows.erase( tc->rows.begin() + i );
+    return true;
+  }
+
+  // Number of images
+  int trainCollectionSize( CvffiTrainCollection *tc )
+  {
+    return (int)tc->ids.size();
+  }
+
+  int trainCollectionDescriptorCount( CvffiTrainCollection *tc )
+  {
+    return (int)(tc->data.size() / tc->rowBytes);
+  }
+
+  CvSeq *trainCollectionMatchKnn( CvffiTrainCollection *tc, CvMat *query, CvMemStorage *storage, int knn )
+  {
+    vector< vector<DMatch> > matches;
+    trainCollectionMatchActual( tc, query, matches, knn );
+    return DMatchToCvSeq( matches, storage, CONVERT_ALL );
+  }
+
+  // The ratio test is over the best two matches from any image
+  CvSeq *trainCollectionMatchRatioTest( CvffiTrainCollection *tc, CvMat *query, CvMemStorage *storage, float minRatio )
+  {
+    vector< vector<DMatch> > matches;
+    trainCollectionMatchActual( tc, query, matches, 2 );
+    return DMatchToCvSeqRatioTest( matches, storage, minRatio );
+  }
+
+}
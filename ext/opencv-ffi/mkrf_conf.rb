@@ -22,7 +22,8 @@ Mkrf::Generator.new('libcvffi', sources, { :compiler=>"g++"}) { |g|
 
   raise "Can't find 'opencv_nonfree'" unless g.include_library 'opencv_nonfree', 'main', "#{ENV['HOME']}/usr/opencv-2.4/lib"
   
-  #g.include_header  'eigen3/Eigen/Core', "#{ENV['HOME']}/usr/include"
+  # calib3d's fundamental matrix solvers use Eigen's fixed-size matrices
+  raise "Can't find #include<eigen3/Eigen/Core>" unless g.include_header  'eigen3/Eigen/Core', "#{ENV['HOME']}/usr/include"
   g.cflags += "-I#{ENV['HOME']}/usr/opencv-2.4/include "
 }
 
@@ -243,8 +243,8 @@ struct feature
 /* threshold on magnitude of elements of descriptor vector */
 #define SIFT_DESCR_MAG_THR 0.2
 
-/* factor used to convert floating-point descriptor to unsigned char */
-#define SIFT_INT_DESCR_FCTR 512.0
+/* SIFT_INT_DESCR_FCTR, the factor used to convert floating-point descriptor
+   to unsigned char, is defined in sift.h */
 
 /**************************************************************************/
 
@@ -6,6 +6,10 @@
 
 #include "../cv_sift_wrapped.h"
 
+/* factor used to convert floating-point descriptor to unsigned char.
+ * Descriptors from cvSIFTDetectDescribe have already been scaled by it. */
+#define SIFT_INT_DESCR_FCTR 512.0
+
 /* These are "pure C" versions of OpenCV's SIFT functions.
  * They aren't actually pure C, as they use some C++ functionality
  * internally ... courtesy of the original code.
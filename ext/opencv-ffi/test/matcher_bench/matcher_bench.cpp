@@ -0,0 +1,380 @@
+
+// Throughput benchmark for the matcher entry points.
+//
+// Generates synthetic descriptor sets -- SIFT-like (128-D float, non-
+// negative, clustered), SURF-like (64-D float, signed, unit length) and
+// binary (256 bits) -- with queries which are noisy copies of train
+// descriptors.  Each matcher is timed against each set, and its recall
+// measured against exact brute-force nearest neighbours.  Results go to
+// stdout as JSON, progress to stderr.
+//
+//   matcher_bench [-n 1000,10000,100000] [-q queries] [-t sift,surf,binary] [-r repeats]
+//
+// Train sizes up to 10M are fine, given the memory and the patience:
+// the brute-force matchers (and the ground truth) are O(queries x train).
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/core_c.h>
+#include <opencv2/features2d/features2d.hpp>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "matcher/cvffi_matcher.h"
+
+using namespace cv;
+using namespace std;
+
+extern "C" {
+  CvSeq *bruteForceMatcher( CvMat *query, CvMat *train, CvMemStorage *storage, int normType, bool crossCheck );
+  CvSeq *bruteForceMatcherKnn( CvMat *query, CvMat *train, CvMemStorage *storage, int normType, int knn, bool crossCheck );
+  CvSeq *bruteForceMatcherRatioTest( CvMat *query, CvMat *train, CvMemStorage *storage, int normType, float minRatio, bool crossCheck );
+  CvSeq *bruteForceMatcherRadius( CvMat *query, CvMat *train, CvMemStorage *storage, int normType, float maxDistance, bool crossCheck );
+
+  CvSeq *flannBasedMatcherKnn( CvMat *query, CvMat *train, CvMemStorage *storage, int knn );
+  CvSeq *flannBasedMatcherRatioTest( CvMat *query, CvMat *train, CvMemStorage *storage, float minRatio );
+  CvSeq *flannBasedMatcherRadius( CvMat *query, CvMat *train, CvMemStorage *storage, float maxDistance );
+
+  CvSeq *hammingMatcherKnn( CvMat *query, CvMat *train, CvMemStorage *storage, int knn );
+  CvSeq *hammingMatcherRatioTest( CvMat *query, CvMat *train, CvMemStorage *storage, float minRatio );
+}
+
+static const float BENCH_RATIO = 1.25;
+
+//===== Synthetic descriptors =====
+
+enum { BENCH_SIFT, BENCH_SURF, BENCH_BINARY };
+
+struct DescriptorSet {
+  int kind;
+  const char *name;
+  Mat train, query;
+
+  // Index of the train descriptor each query was made from, and the
+  // exact nearest neighbour
+  vector<int> source, truth;
+  float medianNN;
+};
+
+static void normalizeRow( float *row, int n )
+{
+  double sum = 0.0;
+  for( int i = 0; i < n; i++ ) sum += row[i]*row[i];
+  float scale = (sum > 0) ? 1.0/sqrt( sum ) : 0.0;
+  for( int i = 0; i < n; i++ ) row[i] *= scale;
+}
+
+// As the SIFT extractor:  normalized, clamped at 0.2, renormalized and
+// scaled to 0..255
+static void siftLike( RNG &rng, const float *center, float noise, float *out )
+{
+  for( int i = 0; i < 128; i++ ) out[i] = MAX( 0.0f, center[i] + (float)rng.gaussian( noise ) );
+  normalizeRow( out, 128 );
+  for( int i = 0; i < 128; i++ ) out[i] = MIN( out[i], 0.2f );
+  normalizeRow( out, 128 );
+  for( int i = 0; i < 128; i++ ) out[i] = MIN( 255.0f, floor( out[i] * 512.0f ) );
+}
+
+static void surfLike( RNG &rng, const float *center, float noise, float *out )
+{
+  for( int i = 0; i < 64; i++ ) out[i] = center[i] + (float)rng.gaussian( noise );
+  normalizeRow( out, 64 );
+}
+
+static void generateSet( int kind, int trainSize, int querySize, DescriptorSet &set )
+{
+  RNG rng( 0x12345678 + kind );
+  set.kind = kind;
+  set.source.resize( querySize );
+
+  if( kind == BENCH_BINARY ) {
+    set.name = "binary";
+    set.train.create( trainSize, 32, CV_8UC1 );
+    set.query.create( querySize, 32, CV_8UC1 );
+
+    for( int i = 0; i < trainSize; i++ )
+      for( int j = 0; j < 32; j++ ) set.train.at<uchar>( i, j ) = (uchar)rng.uniform( 0, 256 );
+
+    // Each query is a train descriptor with about 10% of its bits flipped
+    for( int i = 0; i < querySize; i++ ) {
+      set.source[i] = rng.uniform( 0, trainSize );
+      for( int j = 0; j < 32; j++ ) {
+        uchar flip = 0;
+        for( int b = 0; b < 8; b++ ) if( rng.uniform( 0, 10 ) == 0 ) flip |= (1 << b);
+        set.query.at<uchar>( i, j ) = set.train.at<uchar>( set.source[i], j ) ^ flip;
+      }
+    }
+    return;
+  }
+
+  int dim = (kind == BENCH_SIFT) ? 128 : 64;
+  set.name = (kind == BENCH_SIFT) ? "sift" : "surf";
+  set.train.create( trainSize, dim, CV_32FC1 );
+  set.query.create( querySize, dim, CV_32FC1 );
+
+  // Descriptors cluster around a few hundred "visual words", as real ones do
+  int clusters = MIN( 256, MAX( 1, trainSize / 16 ) );
+  Mat centers( clusters, dim, CV_32FC1 );
+  for( int c = 0; c < clusters; c++ )
+    for( int j = 0; j < dim; j++ )
+      centers.at<float>( c, j ) = (kind == BENCH_SIFT) ? (float)MAX( 0.0, rng.gaussian( 1.0 ) ) : (float)rng.gaussian( 1.0 );
+
+  vector<float> noisy( dim );
+  for( int i = 0; i < trainSize; i++ ) {
+    const float *center = centers.ptr<float>( rng.uniform( 0, clusters ) );
+    if( kind == BENCH_SIFT )
+      siftLike( rng, center, 0.5, set.train.ptr<float>( i ) );
+    else
+      surfLike( rng, center, 0.5, set.train.ptr<float>( i ) );
+  }
+
+  // Queries are train descriptors seen again, with a little noise
+  for( int i = 0; i < querySize; i++ ) {
+    set.source[i] = rng.uniform( 0, trainSize );
+    const float *src = set.train.ptr<float>( set.source[i] );
+
+    if( kind == BENCH_SIFT ) {
+      for( int j = 0; j < dim; j++ ) noisy[j] = src[j] / 512.0f;
+      siftLike( rng, &(noisy[0]), 0.01, set.query.ptr<float>( i ) );
+    } else {
+      surfLike( rng, src, 0.02, set.query.ptr<float>( i ) );
+    }
+  }
+}
+
+static void computeTruth( DescriptorSet &set )
+{
+  int normType = (set.kind == BENCH_BINARY) ? (int)::NORM_HAMMING : (int)NORM_L2;
+  BFMatcher matcher( normType );
+  vector<DMatch> matches;
+  matcher.match( set.query, set.train, matches );
+
+  set.truth.assign( set.query.rows, -1 );
+  vector<float> distances;
+  for( size_t i = 0; i < matches.size(); i++ ) {
+    set.truth[ matches[i].queryIdx ] = matches[i].trainIdx;
+    distances.push_back( matches[i].distance );
+  }
+
+  std::sort( distances.begin(), distances.end() );
+  set.medianNN = distances.empty() ? 0.0 : distances[ distances.size()/2 ];
+}
+
+//===== Measurement =====
+
+static double now( void )
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+// Resets the peak resident set size, so each benchmark's own peak can
+// be read back.  Only Linux supports this;  elsewhere peakMemoryKb
+// reports the peak for the whole process.
+static void resetPeakMemory( void )
+{
+  FILE *f = fopen( "/proc/self/clear_refs", "w" );
+  if( f == NULL ) return;
+  fputs( "5", f );
+  fclose( f );
+}
+
+static long peakMemoryKb( void )
+{
+  FILE *f = fopen( "/proc/self/status", "r" );
+  if( f != NULL ) {
+    char line[256];
+    long kb = -1;
+    while( fgets( line, sizeof(line), f ) )
+      if( strncmp( line, "VmHWM:", 6 ) == 0 ) kb = atol( line + 6 );
+    fclose( f );
+    if( kb >= 0 ) return kb;
+  }
+
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+  return usage.ru_maxrss;
+}
+
+struct BenchResult {
+  double seconds;
+  int matches;
+  int answered, correct;
+  long peakKb;
+};
+
+// Scores a CvSeq of CvDMatch_t against the ground truth, taking the
+// first (best) match reported for each query
+static void scoreMatches( CvSeq *seq, const DescriptorSet &set, BenchResult &result )
+{
+  vector<int> best( set.query.rows, -1 );
+
+  CvSeqReader reader;
+  cvStartReadSeq( seq, &reader, 0 );
+  for( int i = 0; i < seq->total; i++ ) {
+    CvDMatch_t m;
+    CV_READ_SEQ_ELEM( m, reader );
+    if( m.queryIdx >= 0 && m.queryIdx < set.query.rows && best[ m.queryIdx ] < 0 )
+      best[ m.queryIdx ] = m.trainIdx;
+  }
+
+  result.matches = seq->total;
+  result.answered = result.correct = 0;
+  for( size_t q = 0; q < best.size(); q++ ) {
+    if( best[q] < 0 ) continue;
+    result.answered++;
+    if( best[q] == set.truth[q] ) result.correct++;
+  }
+}
+
+enum { BF, BF_KNN, BF_RATIO, BF_RADIUS, BF_CROSSCHECK,
+       FLANN_KNN, FLANN_RATIO, FLANN_RADIUS,
+       HAMMING_KNN, HAMMING_RATIO, NUM_BENCHMARKS };
+
+static const char *benchmarkNames[ NUM_BENCHMARKS ] = {
+  "bruteForceMatcher", "bruteForceMatcherKnn", "bruteForceMatcherRatioTest",
+  "bruteForceMatcherRadius", "bruteForceMatcher (crossCheck)",
+  "flannBasedMatcherKnn", "flannBasedMatcherRatioTest", "flannBasedMatcherRadius",
+  "hammingMatcherKnn", "hammingMatcherRatioTest"
+};
+
+static bool benchmarkApplies( int b, const DescriptorSet &set )
+{
+  bool binary = (set.kind == BENCH_BINARY);
+  switch( b ) {
+    case FLANN_KNN: case FLANN_RATIO: case FLANN_RADIUS:
+      return !binary;
+    case HAMMING_KNN: case HAMMING_RATIO:
+      return binary;
+  }
+  return true;
+}
+
+static CvSeq *runBenchmark( int b, DescriptorSet &set, CvMemStorage *storage )
+{
+  CvMat query = set.query, train = set.train;
+  int normType = (set.kind == BENCH_BINARY) ? (int)::NORM_HAMMING : (int)NORM_L2;
+
+  // The radius is the median nearest-neighbour distance, so about half
+  // the queries have a match
+  float radius = set.medianNN * 1.0001f;
+
+  switch( b ) {
+    case BF:            return bruteForceMatcher( &query, &train, storage, normType, false );
+    case BF_KNN:        return bruteForceMatcherKnn( &query, &train, storage, normType, 2, false );
+    case BF_RATIO:      return bruteForceMatcherRatioTest( &query, &train, storage, normType, BENCH_RATIO, false );
+    case BF_RADIUS:     return bruteForceMatcherRadius( &query, &train, storage, normType, radius, false );
+    case BF_CROSSCHECK: return bruteForceMatcher( &query, &train, storage, normType, true );
+    case FLANN_KNN:     return flannBasedMatcherKnn( &query, &train, storage, 2 );
+    case FLANN_RATIO:   return flannBasedMatcherRatioTest( &query, &train, storage, BENCH_RATIO );
+    case FLANN_RADIUS:  return flannBasedMatcherRadius( &query, &train, storage, radius );
+    case HAMMING_KNN:   return hammingMatcherKnn( &query, &train, storage, 2 );
+    case HAMMING_RATIO: return hammingMatcherRatioTest( &query, &train, storage, BENCH_RATIO );
+  }
+  return NULL;
+}
+
+//===== Driver =====
+
+static vector<int> parseList( const char *arg )
+{
+  vector<int> values;
+  for( const char *p = arg; *p; ) {
+    values.push_back( atoi( p ) );
+    const char *comma = strchr( p, ',' );
+    if( comma == NULL ) break;
+    p = comma + 1;
+  }
+  return values;
+}
+
+static void usage( const char *name )
+{
+  fprintf( stderr, "Usage: %s [-n train sizes] [-q queries] [-t sift,surf,binary] [-r repeats]\n", name );
+  exit( 1 );
+}
+
+int main( int argc, char **argv )
+{
+  vector<int> sizes;
+  sizes.push_back( 1000 );  sizes.push_back( 10000 );  sizes.push_back( 100000 );
+  int queries = 1000, repeats = 3;
+  string types = "sift,surf,binary";
+
+  for( int i = 1; i < argc; i++ ) {
+    if( i+1 >= argc ) usage( argv[0] );
+    if( strcmp( argv[i], "-n" ) == 0 )      sizes = parseList( argv[++i] );
+    else if( strcmp( argv[i], "-q" ) == 0 ) queries = atoi( argv[++i] );
+    else if( strcmp( argv[i], "-t" ) == 0 ) types = argv[++i];
+    else if( strcmp( argv[i], "-r" ) == 0 ) repeats = atoi( argv[++i] );
+    else usage( argv[0] );
+  }
+  if( queries <= 0 || repeats <= 0 ) usage( argv[0] );
+
+  int kinds[3] = { BENCH_SIFT, BENCH_SURF, BENCH_BINARY };
+  const char *kindNames[3] = { "sift", "surf", "binary" };
+
+  printf( "{\n  \"queries\": %d,\n  \"repeats\": %d,\n  \"benchmarks\": [", queries, repeats );
+  bool first = true;
+
+  for( int k = 0; k < 3; k++ ) {
+    if( types.find( kindNames[k] ) == string::npos ) continue;
+
+    for( size_t s = 0; s < sizes.size(); s++ ) {
+      if( sizes[s] <= 0 ) continue;
+
+      DescriptorSet set;
+      fprintf( stderr, "Generating %d %s descriptors\n", sizes[s], kindNames[k] );
+      generateSet( kinds[k], sizes[s], queries, set );
+      computeTruth( set );
+
+      for( int b = 0; b < NUM_BENCHMARKS; b++ ) {
+        if( !benchmarkApplies( b, set ) ) continue;
+        fprintf( stderr, "  %s\n", benchmarkNames[b] );
+
+        // Best of "repeats" runs
+        BenchResult result;
+        result.seconds = -1;
+        for( int r = 0; r < repeats; r++ ) {
+          CvMemStorage *storage = cvCreateMemStorage( 0 );
+          resetPeakMemory();
+
+          double start = now();
+          CvSeq *seq = runBenchmark( b, set, storage );
+          double elapsed = now() - start;
+
+          if( result.seconds < 0 || elapsed < result.seconds ) {
+            result.seconds = elapsed;
+            result.peakKb = peakMemoryKb();
+            scoreMatches( seq, set, result );
+          }
+          cvReleaseMemStorage( &storage );
+        }
+
+        double seconds = MAX( result.seconds, 1e-9 );
+        printf( "%s\n    { \"matcher\": \"%s\", \"descriptors\": \"%s\", \"dim\": %d, \"train\": %d, \"queries\": %d,\n"
+                "      \"seconds\": %.6f, \"queries_per_sec\": %.1f, \"matches\": %d, \"matches_per_sec\": %.1f,\n"
+                "      \"recall\": %.4f, \"precision\": %.4f, \"peak_memory_kb\": %ld }",
+                first ? "" : ",", benchmarkNames[b], set.name, set.train.cols, set.train.rows, set.query.rows,
+                result.seconds, set.query.rows / seconds, result.matches, result.matches / seconds,
+                (double)result.correct / set.query.rows,
+                result.answered > 0 ? (double)result.correct / result.answered : 0.0,
+                result.peakKb );
+        fflush( stdout );
+        first = false;
+      }
+    }
+  }
+
+  printf( "\n  ]\n}\n" );
+  return 0;
+}
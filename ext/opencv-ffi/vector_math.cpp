@@ -1,5 +1,16 @@
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VECTOR_MATH_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define VECTOR_MATH_NEON
+#endif
 
 typedef struct {
   unsigned int len;
@@ -14,15 +25,991 @@ typedef struct {
   float d[128];
 } float128_t;
 
-extern "C"
-float L2distance_32f( const float *a, const float *b, int len )
+// Distances between vectors of float, uint8 or int8, under several
+// metrics.  Each (metric, type) pair has a kernel for every instruction
+// set;  the best the CPU supports is put in a dispatch table when the
+// library is loaded.
+//
+// Hamming distance counts differing bits in the raw representation, so
+// it applies to any element type.  Cosine distance is 1 - cos(angle),
+// or 1 if either vector is zero.
+
+enum { VECTOR_L2SQR = 0, VECTOR_L1 = 1, VECTOR_DOT = 2, VECTOR_COSINE = 3, VECTOR_HAMMING = 4, VECTOR_NUM_METRICS = 5 };
+enum { VECTOR_F32 = 0, VECTOR_U8 = 1, VECTOR_S8 = 2, VECTOR_NUM_TYPES = 3 };
+
+typedef float (*VectorKernel)( const void *a, const void *b, int len );
+
+static const size_t vectorElemSize[ VECTOR_NUM_TYPES ] = { sizeof(float), 1, 1 };
+
+// Integer kernels accumulate in 32-bit lanes, emptied into a 64-bit
+// total every VECTOR_INT_BLOCK vector iterations so long vectors can't
+// overflow them.
+static const int VECTOR_INT_BLOCK = 4096;
+
+// Sums needed for cosine distance
+struct DotNorms {
+  double dot, aa, bb;
+};
+
+static float cosineDistance( const DotNorms &s )
+{
+  if( s.aa <= 0 || s.bb <= 0 ) return 1.0;
+  return (float)(1.0 - s.dot / sqrt( s.aa * s.bb ));
+}
+
+//##### Portable kernels #######
+//
+// These also finish off the elements left over by the vector kernels.
+
+static float l2sqrF32Scalar( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float acc = 0.0;
+  for( int i = 0; i < len; i++ ) acc += (a[i] - b[i])*(a[i] - b[i]);
+  return acc;
+}
+
+static float l1F32Scalar( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float acc = 0.0;
+  for( int i = 0; i < len; i++ ) acc += fabsf( a[i] - b[i] );
+  return acc;
+}
+
+static float dotF32Scalar( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float acc = 0.0;
+  for( int i = 0; i < len; i++ ) acc += a[i]*b[i];
+  return acc;
+}
+
+static void dotNormsF32Scalar( const float *a, const float *b, int len, DotNorms &s )
+{
+  for( int i = 0; i < len; i++ ) {
+    s.dot += a[i]*b[i];
+    s.aa += a[i]*a[i];
+    s.bb += b[i]*b[i];
+  }
+}
+
+static float cosineF32Scalar( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsF32Scalar( (const float *)a, (const float *)b, len, s );
+  return cosineDistance( s );
+}
+
+template <typename T>
+static int64_t l2sqrIntScalar( const T *a, const T *b, int len )
+{
+  int64_t acc = 0;
+  for( int i = 0; i < len; i++ ) {
+    int d = (int)a[i] - (int)b[i];
+    acc += d*d;
+  }
+  return acc;
+}
+
+template <typename T>
+static int64_t l1IntScalar( const T *a, const T *b, int len )
+{
+  int64_t acc = 0;
+  for( int i = 0; i < len; i++ ) acc += abs( (int)a[i] - (int)b[i] );
+  return acc;
+}
+
+template <typename T>
+static int64_t dotIntScalar( const T *a, const T *b, int len )
 {
-  // Start with brute force algorithm
-  float distance = 0.0;
+  int64_t acc = 0;
+  for( int i = 0; i < len; i++ ) acc += (int)a[i] * (int)b[i];
+  return acc;
+}
+
+template <typename T>
+static void dotNormsIntScalar( const T *a, const T *b, int len, DotNorms &s )
+{
+  int64_t dot = 0, aa = 0, bb = 0;
   for( int i = 0; i < len; i++ ) {
-    distance += (a[i] - b[i])*(a[i] - b[i]);
+    dot += (int)a[i] * (int)b[i];
+    aa += (int)a[i] * (int)a[i];
+    bb += (int)b[i] * (int)b[i];
+  }
+  s.dot += dot;  s.aa += aa;  s.bb += bb;
+}
+
+template <typename T>
+static float l2sqrIntKernelScalar( const void *a, const void *b, int len )
+{ return (float)l2sqrIntScalar( (const T *)a, (const T *)b, len ); }
+
+template <typename T>
+static float l1IntKernelScalar( const void *a, const void *b, int len )
+{ return (float)l1IntScalar( (const T *)a, (const T *)b, len ); }
+
+template <typename T>
+static float dotIntKernelScalar( const void *a, const void *b, int len )
+{ return (float)dotIntScalar( (const T *)a, (const T *)b, len ); }
+
+template <typename T>
+static float cosineIntKernelScalar( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntScalar( (const T *)a, (const T *)b, len, s );
+  return cosineDistance( s );
+}
+
+static int64_t hammingBytesScalar( const uint8_t *a, const uint8_t *b, size_t n )
+{
+  int64_t acc = 0;
+  size_t i = 0;
+  for( ; i + 8 <= n; i += 8 ) {
+    uint64_t x, y;
+    memcpy( &x, a+i, 8 );
+    memcpy( &y, b+i, 8 );
+    acc += __builtin_popcountll( x ^ y );
+  }
+  for( ; i < n; i++ ) acc += __builtin_popcount( a[i] ^ b[i] );
+  return acc;
+}
+
+// Hamming kernels take the length in elements, so one is needed per
+// element size
+template <size_t ElemSize>
+static float hammingKernelScalar( const void *a, const void *b, int len )
+{ return (float)hammingBytesScalar( (const uint8_t *)a, (const uint8_t *)b, len * ElemSize ); }
+
+#ifdef VECTOR_MATH_X86
+
+//##### SSE2 kernels #######
+
+static inline float hsumSSE( __m128 v )
+{
+  v = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+  v = _mm_add_ss( v, _mm_shuffle_ps( v, v, 1 ) );
+  return _mm_cvtss_f32( v );
+}
+
+static inline int64_t hsumEpi32SSE( __m128i v )
+{
+  int32_t lanes[4];
+  _mm_storeu_si128( (__m128i *)lanes, v );
+  return (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static inline int64_t hsumEpi64SSE( __m128i v )
+{
+  int64_t lanes[2];
+  _mm_storeu_si128( (__m128i *)lanes, v );
+  return lanes[0] + lanes[1];
+}
+
+static float l2sqrF32SSE( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    __m128 d0 = _mm_sub_ps( _mm_loadu_ps( a+i ), _mm_loadu_ps( b+i ) );
+    __m128 d1 = _mm_sub_ps( _mm_loadu_ps( a+i+4 ), _mm_loadu_ps( b+i+4 ) );
+    acc0 = _mm_add_ps( acc0, _mm_mul_ps( d0, d0 ) );
+    acc1 = _mm_add_ps( acc1, _mm_mul_ps( d1, d1 ) );
+  }
+  return hsumSSE( _mm_add_ps( acc0, acc1 ) ) + l2sqrF32Scalar( a+i, b+i, len-i );
+}
+
+static float l1F32SSE( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  const __m128 sign = _mm_set1_ps( -0.0f );
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    acc0 = _mm_add_ps( acc0, _mm_andnot_ps( sign, _mm_sub_ps( _mm_loadu_ps( a+i ), _mm_loadu_ps( b+i ) ) ) );
+    acc1 = _mm_add_ps( acc1, _mm_andnot_ps( sign, _mm_sub_ps( _mm_loadu_ps( a+i+4 ), _mm_loadu_ps( b+i+4 ) ) ) );
+  }
+  return hsumSSE( _mm_add_ps( acc0, acc1 ) ) + l1F32Scalar( a+i, b+i, len-i );
+}
+
+static float dotF32SSE( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    acc0 = _mm_add_ps( acc0, _mm_mul_ps( _mm_loadu_ps( a+i ), _mm_loadu_ps( b+i ) ) );
+    acc1 = _mm_add_ps( acc1, _mm_mul_ps( _mm_loadu_ps( a+i+4 ), _mm_loadu_ps( b+i+4 ) ) );
+  }
+  return hsumSSE( _mm_add_ps( acc0, acc1 ) ) + dotF32Scalar( a+i, b+i, len-i );
+}
+
+static float cosineF32SSE( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m128 dot = _mm_setzero_ps(), aa = _mm_setzero_ps(), bb = _mm_setzero_ps();
+  int i = 0;
+  for( ; i + 4 <= len; i += 4 ) {
+    __m128 x = _mm_loadu_ps( a+i ), y = _mm_loadu_ps( b+i );
+    dot = _mm_add_ps( dot, _mm_mul_ps( x, y ) );
+    aa = _mm_add_ps( aa, _mm_mul_ps( x, x ) );
+    bb = _mm_add_ps( bb, _mm_mul_ps( y, y ) );
+  }
+  DotNorms s = { hsumSSE( dot ), hsumSSE( aa ), hsumSSE( bb ) };
+  dotNormsF32Scalar( a+i, b+i, len-i, s );
+  return cosineDistance( s );
+}
+
+// Widening of 16 bytes to two vectors of 16-bit lanes, unsigned or signed
+static inline void widenU8SSE( __m128i x, __m128i &lo, __m128i &hi )
+{
+  __m128i zero = _mm_setzero_si128();
+  lo = _mm_unpacklo_epi8( x, zero );
+  hi = _mm_unpackhi_epi8( x, zero );
+}
+
+static inline void widenS8SSE( __m128i x, __m128i &lo, __m128i &hi )
+{
+  lo = _mm_srai_epi16( _mm_unpacklo_epi8( x, x ), 8 );
+  hi = _mm_srai_epi16( _mm_unpackhi_epi8( x, x ), 8 );
+}
+
+// L2 and L1 on int8 are the same as on uint8 with the sign bits
+// flipped, which shifts both vectors by 128.
+template <bool Signed>
+static float l2sqrIntSSE( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m128i flip = _mm_set1_epi8( Signed ? (char)0x80 : 0 );
+  int64_t total = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    __m128i acc = _mm_setzero_si128();
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      __m128i alo, ahi, blo, bhi;
+      widenU8SSE( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(a+i) ), flip ), alo, ahi );
+      widenU8SSE( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(b+i) ), flip ), blo, bhi );
+      __m128i dlo = _mm_sub_epi16( alo, blo ), dhi = _mm_sub_epi16( ahi, bhi );
+      acc = _mm_add_epi32( acc, _mm_add_epi32( _mm_madd_epi16( dlo, dlo ), _mm_madd_epi16( dhi, dhi ) ) );
+    }
+    total += hsumEpi32SSE( acc );
+  }
+  if( Signed ) return (float)(total + l2sqrIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l2sqrIntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+static float l1IntSSE( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m128i flip = _mm_set1_epi8( Signed ? (char)0x80 : 0 );
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 )
+    acc = _mm_add_epi64( acc, _mm_sad_epu8( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(a+i) ), flip ),
+                                            _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(b+i) ), flip ) ) );
+  int64_t total = hsumEpi64SSE( acc );
+  if( Signed ) return (float)(total + l1IntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l1IntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+static void dotNormsIntSSE( const uint8_t *a, const uint8_t *b, int len, bool norms, DotNorms &s )
+{
+  int64_t dot = 0, aa = 0, bb = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    __m128i accDot = _mm_setzero_si128(), accA = _mm_setzero_si128(), accB = _mm_setzero_si128();
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      __m128i alo, ahi, blo, bhi;
+      __m128i x = _mm_loadu_si128( (const __m128i *)(a+i) ), y = _mm_loadu_si128( (const __m128i *)(b+i) );
+      if( Signed ) { widenS8SSE( x, alo, ahi );  widenS8SSE( y, blo, bhi ); }
+      else         { widenU8SSE( x, alo, ahi );  widenU8SSE( y, blo, bhi ); }
+
+      accDot = _mm_add_epi32( accDot, _mm_add_epi32( _mm_madd_epi16( alo, blo ), _mm_madd_epi16( ahi, bhi ) ) );
+      if( norms ) {
+        accA = _mm_add_epi32( accA, _mm_add_epi32( _mm_madd_epi16( alo, alo ), _mm_madd_epi16( ahi, ahi ) ) );
+        accB = _mm_add_epi32( accB, _mm_add_epi32( _mm_madd_epi16( blo, blo ), _mm_madd_epi16( bhi, bhi ) ) );
+      }
+    }
+    dot += hsumEpi32SSE( accDot );
+    aa += hsumEpi32SSE( accA );
+    bb += hsumEpi32SSE( accB );
+  }
+  s.dot += dot;  s.aa += aa;  s.bb += bb;
+
+  if( Signed ) dotNormsIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i, s );
+  else         dotNormsIntScalar( a+i, b+i, len-i, s );
+}
+
+template <bool Signed>
+static float dotIntSSE( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntSSE<Signed>( (const uint8_t *)a, (const uint8_t *)b, len, false, s );
+  return (float)s.dot;
+}
+
+template <bool Signed>
+static float cosineIntSSE( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntSSE<Signed>( (const uint8_t *)a, (const uint8_t *)b, len, true, s );
+  return cosineDistance( s );
+}
+
+template <size_t ElemSize>
+__attribute__((target("popcnt")))
+static float hammingKernelPopcnt( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  size_t n = len * ElemSize, i = 0;
+  int64_t acc = 0;
+  for( ; i + 8 <= n; i += 8 ) {
+    uint64_t x, y;
+    memcpy( &x, a+i, 8 );
+    memcpy( &y, b+i, 8 );
+    acc += __builtin_popcountll( x ^ y );
+  }
+  return (float)(acc + hammingBytesScalar( a+i, b+i, n-i ));
+}
+
+//##### AVX2 kernels #######
+
+__attribute__((target("avx2,fma")))
+static inline float hsumAVX2( __m256 v )
+{
+  return hsumSSE( _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) ) );
+}
+
+__attribute__((target("avx2")))
+static inline int64_t hsumEpi32AVX2( __m256i v )
+{
+  int32_t lanes[8];
+  _mm256_storeu_si256( (__m256i *)lanes, v );
+  int64_t sum = 0;
+  for( int i = 0; i < 8; i++ ) sum += lanes[i];
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static inline int64_t hsumEpi64AVX2( __m256i v )
+{
+  int64_t lanes[4];
+  _mm256_storeu_si256( (__m256i *)lanes, v );
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2,fma")))
+static float l2sqrF32AVX2( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 ) {
+    __m256 d0 = _mm256_sub_ps( _mm256_loadu_ps( a+i ), _mm256_loadu_ps( b+i ) );
+    __m256 d1 = _mm256_sub_ps( _mm256_loadu_ps( a+i+8 ), _mm256_loadu_ps( b+i+8 ) );
+    acc0 = _mm256_fmadd_ps( d0, d0, acc0 );
+    acc1 = _mm256_fmadd_ps( d1, d1, acc1 );
+  }
+  return hsumAVX2( _mm256_add_ps( acc0, acc1 ) ) + l2sqrF32Scalar( a+i, b+i, len-i );
+}
+
+__attribute__((target("avx2,fma")))
+static float l1F32AVX2( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  const __m256 sign = _mm256_set1_ps( -0.0f );
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 ) {
+    acc0 = _mm256_add_ps( acc0, _mm256_andnot_ps( sign, _mm256_sub_ps( _mm256_loadu_ps( a+i ), _mm256_loadu_ps( b+i ) ) ) );
+    acc1 = _mm256_add_ps( acc1, _mm256_andnot_ps( sign, _mm256_sub_ps( _mm256_loadu_ps( a+i+8 ), _mm256_loadu_ps( b+i+8 ) ) ) );
+  }
+  return hsumAVX2( _mm256_add_ps( acc0, acc1 ) ) + l1F32Scalar( a+i, b+i, len-i );
+}
+
+__attribute__((target("avx2,fma")))
+static float dotF32AVX2( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 ) {
+    acc0 = _mm256_fmadd_ps( _mm256_loadu_ps( a+i ), _mm256_loadu_ps( b+i ), acc0 );
+    acc1 = _mm256_fmadd_ps( _mm256_loadu_ps( a+i+8 ), _mm256_loadu_ps( b+i+8 ), acc1 );
+  }
+  return hsumAVX2( _mm256_add_ps( acc0, acc1 ) ) + dotF32Scalar( a+i, b+i, len-i );
+}
+
+__attribute__((target("avx2,fma")))
+static float cosineF32AVX2( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m256 dot = _mm256_setzero_ps(), aa = _mm256_setzero_ps(), bb = _mm256_setzero_ps();
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    __m256 x = _mm256_loadu_ps( a+i ), y = _mm256_loadu_ps( b+i );
+    dot = _mm256_fmadd_ps( x, y, dot );
+    aa = _mm256_fmadd_ps( x, x, aa );
+    bb = _mm256_fmadd_ps( y, y, bb );
+  }
+  DotNorms s = { hsumAVX2( dot ), hsumAVX2( aa ), hsumAVX2( bb ) };
+  dotNormsF32Scalar( a+i, b+i, len-i, s );
+  return cosineDistance( s );
+}
+
+template <bool Signed>
+__attribute__((target("avx2")))
+static inline __m256i widenAVX2( __m128i x )
+{
+  return Signed ? _mm256_cvtepi8_epi16( x ) : _mm256_cvtepu8_epi16( x );
+}
+
+template <bool Signed>
+__attribute__((target("avx2")))
+static float l2sqrIntAVX2( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m128i flip = _mm_set1_epi8( Signed ? (char)0x80 : 0 );
+  int64_t total = 0;
+  int i = 0;
+  while( i + 32 <= len ) {
+    __m256i acc = _mm256_setzero_si256();
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 32 <= len; n++, i += 32 ) {
+      __m256i d0 = _mm256_sub_epi16( widenAVX2<false>( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(a+i) ), flip ) ),
+                                     widenAVX2<false>( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(b+i) ), flip ) ) );
+      __m256i d1 = _mm256_sub_epi16( widenAVX2<false>( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(a+i+16) ), flip ) ),
+                                     widenAVX2<false>( _mm_xor_si128( _mm_loadu_si128( (const __m128i *)(b+i+16) ), flip ) ) );
+      acc = _mm256_add_epi32( acc, _mm256_add_epi32( _mm256_madd_epi16( d0, d0 ), _mm256_madd_epi16( d1, d1 ) ) );
+    }
+    total += hsumEpi32AVX2( acc );
+  }
+  if( Signed ) return (float)(total + l2sqrIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l2sqrIntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+__attribute__((target("avx2")))
+static float l1IntAVX2( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m256i flip = _mm256_set1_epi8( Signed ? (char)0x80 : 0 );
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for( ; i + 32 <= len; i += 32 )
+    acc = _mm256_add_epi64( acc, _mm256_sad_epu8( _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(a+i) ), flip ),
+                                                  _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(b+i) ), flip ) ) );
+  int64_t total = hsumEpi64AVX2( acc );
+  if( Signed ) return (float)(total + l1IntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l1IntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+__attribute__((target("avx2")))
+static void dotNormsIntAVX2( const uint8_t *a, const uint8_t *b, int len, bool norms, DotNorms &s )
+{
+  int64_t dot = 0, aa = 0, bb = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    __m256i accDot = _mm256_setzero_si256(), accA = _mm256_setzero_si256(), accB = _mm256_setzero_si256();
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      __m256i x = widenAVX2<Signed>( _mm_loadu_si128( (const __m128i *)(a+i) ) );
+      __m256i y = widenAVX2<Signed>( _mm_loadu_si128( (const __m128i *)(b+i) ) );
+      accDot = _mm256_add_epi32( accDot, _mm256_madd_epi16( x, y ) );
+      if( norms ) {
+        accA = _mm256_add_epi32( accA, _mm256_madd_epi16( x, x ) );
+        accB = _mm256_add_epi32( accB, _mm256_madd_epi16( y, y ) );
+      }
+    }
+    dot += hsumEpi32AVX2( accDot );
+    aa += hsumEpi32AVX2( accA );
+    bb += hsumEpi32AVX2( accB );
+  }
+  s.dot += dot;  s.aa += aa;  s.bb += bb;
+
+  if( Signed ) dotNormsIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i, s );
+  else         dotNormsIntScalar( a+i, b+i, len-i, s );
+}
+
+template <bool Signed>
+static float dotIntAVX2( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntAVX2<Signed>( (const uint8_t *)a, (const uint8_t *)b, len, false, s );
+  return (float)s.dot;
+}
+
+template <bool Signed>
+static float cosineIntAVX2( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntAVX2<Signed>( (const uint8_t *)a, (const uint8_t *)b, len, true, s );
+  return cosineDistance( s );
+}
+
+// Nibble lookup popcount, as in the Hamming matcher
+template <size_t ElemSize>
+__attribute__((target("avx2,popcnt")))
+static float hammingKernelAVX2( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m256i lookup = _mm256_setr_epi8( 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                           0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4 );
+  const __m256i lowMask = _mm256_set1_epi8( 0x0f );
+  __m256i acc = _mm256_setzero_si256();
+
+  size_t n = len * ElemSize, i = 0;
+  for( ; i + 32 <= n; i += 32 ) {
+    __m256i x = _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(a+i) ), _mm256_loadu_si256( (const __m256i *)(b+i) ) );
+    __m256i counts = _mm256_add_epi8( _mm256_shuffle_epi8( lookup, _mm256_and_si256( x, lowMask ) ),
+                                      _mm256_shuffle_epi8( lookup, _mm256_and_si256( _mm256_srli_epi16( x, 4 ), lowMask ) ) );
+    acc = _mm256_add_epi64( acc, _mm256_sad_epu8( counts, _mm256_setzero_si256() ) );
+  }
+  return (float)(hsumEpi64AVX2( acc ) + hammingBytesScalar( a+i, b+i, n-i ));
+}
+
+//##### AVX-512 kernels #######
+
+// The 32-bit lanes are summed in 64 bits, as their total may not fit
+__attribute__((target("avx512f,avx512bw")))
+static inline int64_t hsumEpi32AVX512( __m512i v )
+{
+  __m512i wide = _mm512_add_epi64( _mm512_cvtepi32_epi64( _mm512_castsi512_si256( v ) ),
+                                   _mm512_cvtepi32_epi64( _mm512_extracti64x4_epi64( v, 1 ) ) );
+  return _mm512_reduce_add_epi64( wide );
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float l2sqrF32AVX512( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  int i = 0;
+  for( ; i + 32 <= len; i += 32 ) {
+    __m512 d0 = _mm512_sub_ps( _mm512_loadu_ps( a+i ), _mm512_loadu_ps( b+i ) );
+    __m512 d1 = _mm512_sub_ps( _mm512_loadu_ps( a+i+16 ), _mm512_loadu_ps( b+i+16 ) );
+    acc0 = _mm512_fmadd_ps( d0, d0, acc0 );
+    acc1 = _mm512_fmadd_ps( d1, d1, acc1 );
+  }
+  for( ; i + 16 <= len; i += 16 ) {
+    __m512 d0 = _mm512_sub_ps( _mm512_loadu_ps( a+i ), _mm512_loadu_ps( b+i ) );
+    acc0 = _mm512_fmadd_ps( d0, d0, acc0 );
+  }
+  return _mm512_reduce_add_ps( _mm512_add_ps( acc0, acc1 ) ) + l2sqrF32Scalar( a+i, b+i, len-i );
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float l1F32AVX512( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 )
+    acc = _mm512_add_ps( acc, _mm512_abs_ps( _mm512_sub_ps( _mm512_loadu_ps( a+i ), _mm512_loadu_ps( b+i ) ) ) );
+  return _mm512_reduce_add_ps( acc ) + l1F32Scalar( a+i, b+i, len-i );
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float dotF32AVX512( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 )
+    acc = _mm512_fmadd_ps( _mm512_loadu_ps( a+i ), _mm512_loadu_ps( b+i ), acc );
+  return _mm512_reduce_add_ps( acc ) + dotF32Scalar( a+i, b+i, len-i );
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float cosineF32AVX512( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  __m512 dot = _mm512_setzero_ps(), aa = _mm512_setzero_ps(), bb = _mm512_setzero_ps();
+  int i = 0;
+  for( ; i + 16 <= len; i += 16 ) {
+    __m512 x = _mm512_loadu_ps( a+i ), y = _mm512_loadu_ps( b+i );
+    dot = _mm512_fmadd_ps( x, y, dot );
+    aa = _mm512_fmadd_ps( x, x, aa );
+    bb = _mm512_fmadd_ps( y, y, bb );
+  }
+  DotNorms s = { _mm512_reduce_add_ps( dot ), _mm512_reduce_add_ps( aa ), _mm512_reduce_add_ps( bb ) };
+  dotNormsF32Scalar( a+i, b+i, len-i, s );
+  return cosineDistance( s );
+}
+
+template <bool Signed>
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i widenAVX512( __m256i x )
+{
+  return Signed ? _mm512_cvtepi8_epi16( x ) : _mm512_cvtepu8_epi16( x );
+}
+
+template <bool Signed>
+__attribute__((target("avx512f,avx512bw")))
+static float l2sqrIntAVX512( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m256i flip = _mm256_set1_epi8( Signed ? (char)0x80 : 0 );
+  int64_t total = 0;
+  int i = 0;
+  while( i + 32 <= len ) {
+    __m512i acc = _mm512_setzero_si512();
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 32 <= len; n++, i += 32 ) {
+      __m512i d = _mm512_sub_epi16( widenAVX512<false>( _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(a+i) ), flip ) ),
+                                    widenAVX512<false>( _mm256_xor_si256( _mm256_loadu_si256( (const __m256i *)(b+i) ), flip ) ) );
+      acc = _mm512_add_epi32( acc, _mm512_madd_epi16( d, d ) );
+    }
+    total += hsumEpi32AVX512( acc );
+  }
+  if( Signed ) return (float)(total + l2sqrIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l2sqrIntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+__attribute__((target("avx512f,avx512bw")))
+static float l1IntAVX512( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const __m512i flip = _mm512_set1_epi8( Signed ? (char)0x80 : 0 );
+  __m512i acc = _mm512_setzero_si512();
+  int i = 0;
+  for( ; i + 64 <= len; i += 64 )
+    acc = _mm512_add_epi64( acc, _mm512_sad_epu8( _mm512_xor_si512( _mm512_loadu_si512( a+i ), flip ),
+                                                  _mm512_xor_si512( _mm512_loadu_si512( b+i ), flip ) ) );
+  int64_t total = _mm512_reduce_add_epi64( acc );
+  if( Signed ) return (float)(total + l1IntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l1IntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+__attribute__((target("avx512f,avx512bw")))
+static void dotNormsIntAVX512( const uint8_t *a, const uint8_t *b, int len, bool norms, DotNorms &s )
+{
+  int64_t dot = 0, aa = 0, bb = 0;
+  int i = 0;
+  while( i + 32 <= len ) {
+    __m512i accDot = _mm512_setzero_si512(), accA = _mm512_setzero_si512(), accB = _mm512_setzero_si512();
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 32 <= len; n++, i += 32 ) {
+      __m512i x = widenAVX512<Signed>( _mm256_loadu_si256( (const __m256i *)(a+i) ) );
+      __m512i y = widenAVX512<Signed>( _mm256_loadu_si256( (const __m256i *)(b+i) ) );
+      accDot = _mm512_add_epi32( accDot, _mm512_madd_epi16( x, y ) );
+      if( norms ) {
+        accA = _mm512_add_epi32( accA, _mm512_madd_epi16( x, x ) );
+        accB = _mm512_add_epi32( accB, _mm512_madd_epi16( y, y ) );
+      }
+    }
+    dot += hsumEpi32AVX512( accDot );
+    aa += hsumEpi32AVX512( accA );
+    bb += hsumEpi32AVX512( accB );
+  }
+  s.dot += dot;  s.aa += aa;  s.bb += bb;
+
+  if( Signed ) dotNormsIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i, s );
+  else         dotNormsIntScalar( a+i, b+i, len-i, s );
+}
+
+template <bool Signed>
+static float dotIntAVX512( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntAVX512<Signed>( (const uint8_t *)a, (const uint8_t *)b, len, false, s );
+  return (float)s.dot;
+}
+
+template <bool Signed>
+static float cosineIntAVX512( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsIntAVX512<Signed>( (const uint8_t *)a, (const uint8_t *)b, len, true, s );
+  return cosineDistance( s );
+}
+
+template <size_t ElemSize>
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static float hammingKernelVPOPCNTDQ( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  __m512i acc = _mm512_setzero_si512();
+
+  size_t n = len * ElemSize, i = 0;
+  for( ; i + 64 <= n; i += 64 )
+    acc = _mm512_add_epi64( acc, _mm512_popcnt_epi64( _mm512_xor_si512( _mm512_loadu_si512( a+i ), _mm512_loadu_si512( b+i ) ) ) );
+  return (float)(_mm512_reduce_add_epi64( acc ) + hammingBytesScalar( a+i, b+i, n-i ));
+}
+
+#endif
+
+#ifdef VECTOR_MATH_NEON
+
+//##### NEON kernels #######
+
+static float l2sqrF32NEON( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float32x4_t acc0 = vdupq_n_f32( 0 ), acc1 = vdupq_n_f32( 0 );
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    float32x4_t d0 = vsubq_f32( vld1q_f32( a+i ), vld1q_f32( b+i ) );
+    float32x4_t d1 = vsubq_f32( vld1q_f32( a+i+4 ), vld1q_f32( b+i+4 ) );
+    acc0 = vfmaq_f32( acc0, d0, d0 );
+    acc1 = vfmaq_f32( acc1, d1, d1 );
+  }
+  return vaddvq_f32( vaddq_f32( acc0, acc1 ) ) + l2sqrF32Scalar( a+i, b+i, len-i );
+}
+
+static float l1F32NEON( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float32x4_t acc0 = vdupq_n_f32( 0 ), acc1 = vdupq_n_f32( 0 );
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    acc0 = vaddq_f32( acc0, vabdq_f32( vld1q_f32( a+i ), vld1q_f32( b+i ) ) );
+    acc1 = vaddq_f32( acc1, vabdq_f32( vld1q_f32( a+i+4 ), vld1q_f32( b+i+4 ) ) );
+  }
+  return vaddvq_f32( vaddq_f32( acc0, acc1 ) ) + l1F32Scalar( a+i, b+i, len-i );
+}
+
+static float dotF32NEON( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float32x4_t acc0 = vdupq_n_f32( 0 ), acc1 = vdupq_n_f32( 0 );
+  int i = 0;
+  for( ; i + 8 <= len; i += 8 ) {
+    acc0 = vfmaq_f32( acc0, vld1q_f32( a+i ), vld1q_f32( b+i ) );
+    acc1 = vfmaq_f32( acc1, vld1q_f32( a+i+4 ), vld1q_f32( b+i+4 ) );
+  }
+  return vaddvq_f32( vaddq_f32( acc0, acc1 ) ) + dotF32Scalar( a+i, b+i, len-i );
+}
+
+static float cosineF32NEON( const void *va, const void *vb, int len )
+{
+  const float *a = (const float *)va, *b = (const float *)vb;
+  float32x4_t dot = vdupq_n_f32( 0 ), aa = vdupq_n_f32( 0 ), bb = vdupq_n_f32( 0 );
+  int i = 0;
+  for( ; i + 4 <= len; i += 4 ) {
+    float32x4_t x = vld1q_f32( a+i ), y = vld1q_f32( b+i );
+    dot = vfmaq_f32( dot, x, y );
+    aa = vfmaq_f32( aa, x, x );
+    bb = vfmaq_f32( bb, y, y );
+  }
+  DotNorms s = { vaddvq_f32( dot ), vaddvq_f32( aa ), vaddvq_f32( bb ) };
+  dotNormsF32Scalar( a+i, b+i, len-i, s );
+  return cosineDistance( s );
+}
+
+// |a-b| of two uint8 is exact in a uint8 lane, and so (with the sign
+// bits flipped) is that of two int8
+template <bool Signed>
+static float l2sqrIntNEON( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const uint8x16_t flip = vdupq_n_u8( Signed ? 0x80 : 0 );
+  int64_t total = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    uint32x4_t acc = vdupq_n_u32( 0 );
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      uint8x16_t d = vabdq_u8( veorq_u8( vld1q_u8( a+i ), flip ), veorq_u8( vld1q_u8( b+i ), flip ) );
+      acc = vpadalq_u16( acc, vmull_u8( vget_low_u8( d ), vget_low_u8( d ) ) );
+      acc = vpadalq_u16( acc, vmull_high_u8( d, d ) );
+    }
+    total += vaddlvq_u32( acc );
   }
-  return distance;
+  if( Signed ) return (float)(total + l2sqrIntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l2sqrIntScalar( a+i, b+i, len-i ));
+}
+
+template <bool Signed>
+static float l1IntNEON( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  const uint8x16_t flip = vdupq_n_u8( Signed ? 0x80 : 0 );
+  int64_t total = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    uint32x4_t acc = vdupq_n_u32( 0 );
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      uint8x16_t d = vabdq_u8( veorq_u8( vld1q_u8( a+i ), flip ), veorq_u8( vld1q_u8( b+i ), flip ) );
+      acc = vpadalq_u16( acc, vpaddlq_u8( d ) );
+    }
+    total += vaddlvq_u32( acc );
+  }
+  if( Signed ) return (float)(total + l1IntScalar( (const int8_t *)a+i, (const int8_t *)b+i, len-i ));
+  return (float)(total + l1IntScalar( a+i, b+i, len-i ));
+}
+
+static void dotNormsU8NEON( const uint8_t *a, const uint8_t *b, int len, bool norms, DotNorms &s )
+{
+  int64_t dot = 0, aa = 0, bb = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    uint32x4_t accDot = vdupq_n_u32( 0 ), accA = vdupq_n_u32( 0 ), accB = vdupq_n_u32( 0 );
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      uint8x16_t x = vld1q_u8( a+i ), y = vld1q_u8( b+i );
+      accDot = vpadalq_u16( accDot, vmull_u8( vget_low_u8( x ), vget_low_u8( y ) ) );
+      accDot = vpadalq_u16( accDot, vmull_high_u8( x, y ) );
+      if( norms ) {
+        accA = vpadalq_u16( accA, vmull_u8( vget_low_u8( x ), vget_low_u8( x ) ) );
+        accA = vpadalq_u16( accA, vmull_high_u8( x, x ) );
+        accB = vpadalq_u16( accB, vmull_u8( vget_low_u8( y ), vget_low_u8( y ) ) );
+        accB = vpadalq_u16( accB, vmull_high_u8( y, y ) );
+      }
+    }
+    dot += vaddlvq_u32( accDot );
+    aa += vaddlvq_u32( accA );
+    bb += vaddlvq_u32( accB );
+  }
+  s.dot += dot;  s.aa += aa;  s.bb += bb;
+  dotNormsIntScalar( a+i, b+i, len-i, s );
+}
+
+static void dotNormsS8NEON( const int8_t *a, const int8_t *b, int len, bool norms, DotNorms &s )
+{
+  int64_t dot = 0, aa = 0, bb = 0;
+  int i = 0;
+  while( i + 16 <= len ) {
+    int32x4_t accDot = vdupq_n_s32( 0 ), accA = vdupq_n_s32( 0 ), accB = vdupq_n_s32( 0 );
+    for( int n = 0; n < VECTOR_INT_BLOCK && i + 16 <= len; n++, i += 16 ) {
+      int8x16_t x = vld1q_s8( a+i ), y = vld1q_s8( b+i );
+      accDot = vpadalq_s16( accDot, vmull_s8( vget_low_s8( x ), vget_low_s8( y ) ) );
+      accDot = vpadalq_s16( accDot, vmull_high_s8( x, y ) );
+      if( norms ) {
+        accA = vpadalq_s16( accA, vmull_s8( vget_low_s8( x ), vget_low_s8( x ) ) );
+        accA = vpadalq_s16( accA, vmull_high_s8( x, x ) );
+        accB = vpadalq_s16( accB, vmull_s8( vget_low_s8( y ), vget_low_s8( y ) ) );
+        accB = vpadalq_s16( accB, vmull_high_s8( y, y ) );
+      }
+    }
+    dot += vaddlvq_s32( accDot );
+    aa += vaddlvq_s32( accA );
+    bb += vaddlvq_s32( accB );
+  }
+  s.dot += dot;  s.aa += aa;  s.bb += bb;
+  dotNormsIntScalar( a+i, b+i, len-i, s );
+}
+
+static float dotU8NEON( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsU8NEON( (const uint8_t *)a, (const uint8_t *)b, len, false, s );
+  return (float)s.dot;
+}
+
+static float cosineU8NEON( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsU8NEON( (const uint8_t *)a, (const uint8_t *)b, len, true, s );
+  return cosineDistance( s );
+}
+
+static float dotS8NEON( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsS8NEON( (const int8_t *)a, (const int8_t *)b, len, false, s );
+  return (float)s.dot;
+}
+
+static float cosineS8NEON( const void *a, const void *b, int len )
+{
+  DotNorms s = { 0, 0, 0 };
+  dotNormsS8NEON( (const int8_t *)a, (const int8_t *)b, len, true, s );
+  return cosineDistance( s );
+}
+
+template <size_t ElemSize>
+static float hammingKernelNEON( const void *va, const void *vb, int len )
+{
+  const uint8_t *a = (const uint8_t *)va, *b = (const uint8_t *)vb;
+  size_t n = len * ElemSize, i = 0;
+  int64_t total = 0;
+  while( i + 16 <= n ) {
+    uint32x4_t acc = vdupq_n_u32( 0 );
+    for( int k = 0; k < VECTOR_INT_BLOCK && i + 16 <= n; k++, i += 16 )
+      acc = vpadalq_u16( acc, vpaddlq_u8( vcntq_u8( veorq_u8( vld1q_u8( a+i ), vld1q_u8( b+i ) ) ) ) );
+    total += vaddlvq_u32( acc );
+  }
+  return (float)(total + hammingBytesScalar( a+i, b+i, n-i ));
+}
+
+#endif
+
+//##### Dispatch #######
+
+static VectorKernel vectorKernels[ VECTOR_NUM_METRICS ][ VECTOR_NUM_TYPES ];
+static const char *vectorKernelIsa = "scalar";
+
+static void setKernels( int metric, VectorKernel f32, VectorKernel u8, VectorKernel s8 )
+{
+  vectorKernels[metric][VECTOR_F32] = f32;
+  vectorKernels[metric][VECTOR_U8] = u8;
+  vectorKernels[metric][VECTOR_S8] = s8;
+}
+
+__attribute__((constructor))
+static void initVectorKernels( void )
+{
+  setKernels( VECTOR_L2SQR, l2sqrF32Scalar, l2sqrIntKernelScalar<uint8_t>, l2sqrIntKernelScalar<int8_t> );
+  setKernels( VECTOR_L1, l1F32Scalar, l1IntKernelScalar<uint8_t>, l1IntKernelScalar<int8_t> );
+  setKernels( VECTOR_DOT, dotF32Scalar, dotIntKernelScalar<uint8_t>, dotIntKernelScalar<int8_t> );
+  setKernels( VECTOR_COSINE, cosineF32Scalar, cosineIntKernelScalar<uint8_t>, cosineIntKernelScalar<int8_t> );
+  setKernels( VECTOR_HAMMING, hammingKernelScalar<4>, hammingKernelScalar<1>, hammingKernelScalar<1> );
+
+#ifdef VECTOR_MATH_X86
+  __builtin_cpu_init();
+
+  if( __builtin_cpu_supports( "sse2" ) ) {
+    vectorKernelIsa = "sse2";
+    setKernels( VECTOR_L2SQR, l2sqrF32SSE, l2sqrIntSSE<false>, l2sqrIntSSE<true> );
+    setKernels( VECTOR_L1, l1F32SSE, l1IntSSE<false>, l1IntSSE<true> );
+    setKernels( VECTOR_DOT, dotF32SSE, dotIntSSE<false>, dotIntSSE<true> );
+    setKernels( VECTOR_COSINE, cosineF32SSE, cosineIntSSE<false>, cosineIntSSE<true> );
+  }
+  if( __builtin_cpu_supports( "popcnt" ) )
+    setKernels( VECTOR_HAMMING, hammingKernelPopcnt<4>, hammingKernelPopcnt<1>, hammingKernelPopcnt<1> );
+
+  if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) && __builtin_cpu_supports( "popcnt" ) ) {
+    vectorKernelIsa = "avx2";
+    setKernels( VECTOR_L2SQR, l2sqrF32AVX2, l2sqrIntAVX2<false>, l2sqrIntAVX2<true> );
+    setKernels( VECTOR_L1, l1F32AVX2, l1IntAVX2<false>, l1IntAVX2<true> );
+    setKernels( VECTOR_DOT, dotF32AVX2, dotIntAVX2<false>, dotIntAVX2<true> );
+    setKernels( VECTOR_COSINE, cosineF32AVX2, cosineIntAVX2<false>, cosineIntAVX2<true> );
+    setKernels( VECTOR_HAMMING, hammingKernelAVX2<4>, hammingKernelAVX2<1>, hammingKernelAVX2<1> );
+  }
+
+  if( __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" ) ) {
+    vectorKernelIsa = "avx512";
+    setKernels( VECTOR_L2SQR, l2sqrF32AVX512, l2sqrIntAVX512<false>, l2sqrIntAVX512<true> );
+    setKernels( VECTOR_L1, l1F32AVX512, l1IntAVX512<false>, l1IntAVX512<true> );
+    setKernels( VECTOR_DOT, dotF32AVX512, dotIntAVX512<false>, dotIntAVX512<true> );
+    setKernels( VECTOR_COSINE, cosineF32AVX512, cosineIntAVX512<false>, cosineIntAVX512<true> );
+
+    if( __builtin_cpu_supports( "avx512vpopcntdq" ) )
+      setKernels( VECTOR_HAMMING, hammingKernelVPOPCNTDQ<4>, hammingKernelVPOPCNTDQ<1>, hammingKernelVPOPCNTDQ<1> );
+  }
+#endif
+
+#ifdef VECTOR_MATH_NEON
+  // NEON is always there on AArch64
+  vectorKernelIsa = "neon";
+  setKernels( VECTOR_L2SQR, l2sqrF32NEON, l2sqrIntNEON<false>, l2sqrIntNEON<true> );
+  setKernels( VECTOR_L1, l1F32NEON, l1IntNEON<false>, l1IntNEON<true> );
+  setKernels( VECTOR_DOT, dotF32NEON, dotU8NEON, dotS8NEON );
+  setKernels( VECTOR_COSINE, cosineF32NEON, cosineU8NEON, cosineS8NEON );
+  setKernels( VECTOR_HAMMING, hammingKernelNEON<4>, hammingKernelNEON<1>, hammingKernelNEON<1> );
+#endif
+}
+
+static VectorKernel vectorKernel( int metric, int type )
+{
+  if( metric < 0 || metric >= VECTOR_NUM_METRICS || type < 0 || type >= VECTOR_NUM_TYPES ) return NULL;
+  return vectorKernels[metric][type];
+}
+
+extern "C"
+float L2distance_32f( const float *a, const float *b, int len )
+{
+  return vectorKernels[VECTOR_L2SQR][VECTOR_F32]( a, b, len );
 }
 
 extern "C"
@@ -30,10 +1017,61 @@ float L2distance_8u( const uint8_array_t a, const uint8_array_t b )
 {
   if( a.len != b.len ) { return -1.0; }
 
-  float distance = 0.0;
-  for( unsigned int i = 0; i < a.len; i++ ) {
-    distance += (a.data[i] - b.data[i])*(a.data[i]-b.data[i]);
-  }
+  return vectorKernels[VECTOR_L2SQR][VECTOR_U8]( a.data, b.data, a.len );
+}
 
-  return distance;
+// Name of the instruction set the kernels were chosen for
+extern "C"
+const char *vectorMathIsa( void )
+{
+  return vectorKernelIsa;
+}
+
+// Distance between two vectors of len elements.  Returns -1 for an
+// unknown metric or type.
+extern "C"
+float vectorDistance( int metric, int type, const void *a, const void *b, int len )
+{
+  VectorKernel kernel = vectorKernel( metric, type );
+  if( kernel == NULL ) return -1.0;
+  return kernel( a, b, len );
+}
+
+// Distances from one vector to each of count vectors stored one after
+// another in "many".  Returns the number written to out, or -1 for an
+// unknown metric or type.
+extern "C"
+int vectorDistanceOneToMany( int metric, int type, const void *one, const void *many, int count, int len, float *out )
+{
+  VectorKernel kernel = vectorKernel( metric, type );
+  if( kernel == NULL ) return -1;
+
+  size_t stride = len * vectorElemSize[type];
+  const uint8_t *m = (const uint8_t *)many;
+  for( int i = 0; i < count; i++ )
+    out[i] = kernel( one, m + i*stride, len );
+  return count;
+}
+
+// Distances between every one of na vectors in a and nb in b, written
+// to out as an na x nb row-major matrix.  Blocked so a strip of b stays
+// in cache while a's rows pass over it.
+extern "C"
+int vectorDistanceManyToMany( int metric, int type, const void *a, int na, const void *b, int nb, int len, float *out )
+{
+  static const int BLOCK = 64;
+
+  VectorKernel kernel = vectorKernel( metric, type );
+  if( kernel == NULL ) return -1;
+
+  size_t stride = len * vectorElemSize[type];
+  const uint8_t *pa = (const uint8_t *)a, *pb = (const uint8_t *)b;
+
+  for( int j0 = 0; j0 < nb; j0 += BLOCK ) {
+    int j1 = (j0 + BLOCK < nb) ? j0 + BLOCK : nb;
+    for( int i = 0; i < na; i++ )
+      for( int j = j0; j < j1; j++ )
+        out[ (size_t)i*nb + j ] = kernel( pa + i*stride, pb + j*stride, len );
+  }
+  return na * nb;
 }
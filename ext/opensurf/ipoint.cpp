@@ -17,37 +17,64 @@
 
 using namespace cv;
 
-//! Populate IpPairVec with matched ipts 
-void getMatches(IpVec &ipts1, IpVec &ipts2, IpPairVec &matches)
+//! Split ipts into those with positive (parts[1]) and non-positive
+//! (parts[0]) sign of laplacian.  Points of different sign can't match.
+void partitionByLaplacian(const IpVec &ipts, std::vector<int> parts[2], bool useLaplacian)
 {
-  float dist, d1, d2;
-  Ipoint *match;
+  parts[0].clear();
+  parts[1].clear();
+  for(unsigned int j = 0; j < ipts.size(); j++)
+    parts[ (useLaplacian && ipts[j].laplacian > 0) ? 1 : 0 ].push_back(j);
+}
 
-  matches.clear();
+//! Find the nearest and second nearest of the candidates to ip.  Squared
+//! distances are returned in d1 and d2;  each comparison is abandoned
+//! as soon as it can't beat the current second best.
+void findNearestTwo(const Ipoint &ip, const IpVec &ipts, const std::vector<int> &candidates,
+                    int &best, float &d1, float &d2)
+{
+  best = -1;
+  d1 = d2 = FLT_MAX;
 
-  for(unsigned int i = 0; i < ipts1.size(); i++) 
+  for(unsigned int j = 0; j < candidates.size(); j++)
   {
-    d1 = d2 = FLT_MAX;
+    float dist = ip.distanceSquared(ipts[candidates[j]], d2);
 
-    for(unsigned int j = 0; j < ipts2.size(); j++) 
+    if(dist<d1) // if this feature matches better than current best
     {
-      dist = ipts1[i] - ipts2[j];  
-
-      if(dist<d1) // if this feature matches better than current best
-      {
-        d2 = d1;
-        d1 = dist;
-        match = &ipts2[j];
-      }
-      else if(dist<d2) // this feature matches better than second best
-      {
-        d2 = dist;
-      }
+      d2 = d1;
+      d1 = dist;
+      best = candidates[j];
     }
+    else if(dist<d2) // this feature matches better than second best
+    {
+      d2 = dist;
+    }
+  }
+}
+
+//! Populate IpPairVec with matched ipts.  If useLaplacian, only points
+//! with the same sign of laplacian are compared.
+void getMatches(IpVec &ipts1, IpVec &ipts2, IpPairVec &matches, bool useLaplacian)
+{
+  float d1, d2;
+  int best;
+  std::vector<int> parts[2];
+
+  matches.clear();
+  partitionByLaplacian(ipts2, parts, useLaplacian);
+
+  for(unsigned int i = 0; i < ipts1.size(); i++) 
+  {
+    const std::vector<int> &candidates = parts[ (useLaplacian && ipts1[i].laplacian > 0) ? 1 : 0 ];
+    findNearestTwo(ipts1[i], ipts2, candidates, best, d1, d2);
 
     // If match has a d1:d2 ratio < 0.65 ipoints are a match
-    if(d1/d2 < 0.65) 
+    // (compared squared, so 0.65^2)
+    if(best >= 0 && d1 < 0.4225f*d2) 
     { 
+      Ipoint *match = &ipts2[best];
+
       // Store the change in position
       ipts1[i].dx = match->x - ipts1[i].x; 
       ipts1[i].dy = match->y - ipts1[i].y;
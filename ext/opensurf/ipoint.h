@@ -14,6 +14,7 @@
 
 #include <vector>
 #include <math.h>
+#include <float.h>
 
 //-------------------------------------------------------
 
@@ -24,7 +25,10 @@ typedef std::vector<std::pair<Ipoint, Ipoint> > IpPairVec;
 //-------------------------------------------------------
 
 //! Ipoint operations
-void getMatches(IpVec &ipts1, IpVec &ipts2, IpPairVec &matches);
+void getMatches(IpVec &ipts1, IpVec &ipts2, IpPairVec &matches, bool useLaplacian = false);
+void partitionByLaplacian(const IpVec &ipts, std::vector<int> parts[2], bool useLaplacian = true);
+void findNearestTwo(const Ipoint &ip, const IpVec &ipts, const std::vector<int> &candidates,
+                    int &best, float &d1, float &d2);
 int translateCorners(IpPairVec &matches, const CvPoint src_corners[4], CvPoint dst_corners[4]);
 
 //-------------------------------------------------------
@@ -48,6 +52,21 @@ public:
     return sqrt(sum);
   };
 
+  //! Gets the squared distance in descriptor space between Ipoints,
+  //! giving up early (and returning some value >= bound) once the
+  //! partial sum reaches bound
+  float distanceSquared(const Ipoint &rhs, float bound = FLT_MAX) const
+  {
+    float sum=0.f;
+    for(int i=0; i < 64; i += 16)
+    {
+      for(int j=i; j < i+16; ++j)
+        sum += (this->descriptor[j] - rhs.descriptor[j])*(this->descriptor[j] - rhs.descriptor[j]);
+      if(sum >= bound) break;
+    }
+    return sum;
+  };
+
   //! Coordinates of the detected interest point
   float x, y;
 
@@ -96,3 +96,85 @@ CvSeq *createOpenSURFPointSequence( CvMemStorage *storage )
   return cvCreateSeq( 0, sizeof(CvSeq), sizeof(OpenSURFPoint_t), storage );
 }
 
+/* Must match CvDMatch_t in ext/opencv-ffi/matcher/cvffi_matcher.h, so
+ * results can be used as CVFFI::Matcher::MatchResults */
+typedef struct {
+  int queryIdx;
+  int trainIdx;
+  int imgIdx;
+
+  float distance;
+  float ratio;
+  unsigned int rank;
+} CvDMatch_t;
+
+static void openSurfPointsToIpoints( CvSeq *points, std::vector<Ipoint> &ipts )
+{
+  ipts.resize( points->total );
+
+  CvSeqReader reader;
+  cvStartReadSeq( points, &reader, 0 );
+  for( int i = 0; i < points->total; i++ ) {
+    OpenSURFPoint_t *point = (OpenSURFPoint_t *)reader.ptr;
+    Ipoint &ip = ipts[i];
+
+    ip.x = point->pt.x;
+    ip.y = point->pt.y;
+    ip.scale = point->scale;
+    ip.orientation = point->orientation;
+    ip.laplacian = point->laplacian;
+    memcpy( ip.descriptor, point->descriptor, sizeof(float)*64 );
+
+    CV_NEXT_SEQ_ELEM( points->elem_size, reader );
+  }
+}
+
+/* Nearest-neighbour matching of described OpenSURF points.  If
+ * useLaplacian, the train points are partitioned by sign of Laplacian
+ * and each query only compared with its own partition.  Distances are
+ * compared squared, and each comparison is abandoned once it can't beat
+ * the current second best.
+ *
+ * As with the ratio test matchers, ratio is second-best/best distance
+ * and only matches with ratio > minRatio are returned (all, if
+ * minRatio <= 0).  A query with only one candidate always matches, with
+ * ratio 0. */
+extern "C"
+CvSeq *openSurfMatch( CvSeq *query, CvSeq *train, CvMemStorage *storage,
+                      float minRatio, int useLaplacian )
+{
+  std::vector<Ipoint> qpts, tpts;
+  openSurfPointsToIpoints( query, qpts );
+  openSurfPointsToIpoints( train, tpts );
+
+  std::vector<int> parts[2];
+  partitionByLaplacian( tpts, parts, useLaplacian != 0 );
+
+  CvSeq *matches = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvDMatch_t), storage );
+  CvSeqWriter writer;
+  cvStartAppendToSeq( matches, &writer );
+
+  for( unsigned int i = 0; i < qpts.size(); i++ ) {
+    const std::vector<int> &candidates = parts[ (useLaplacian && qpts[i].laplacian > 0) ? 1 : 0 ];
+
+    int best;
+    float d1, d2;
+    findNearestTwo( qpts[i], tpts, candidates, best, d1, d2 );
+    if( best < 0 ) continue;
+
+    CvDMatch_t dm;
+    dm.queryIdx = i;
+    dm.trainIdx = best;
+    dm.imgIdx = 0;
+    dm.distance = sqrt( d1 );
+    dm.ratio = (d2 < FLT_MAX) ? sqrt( d2 ) / dm.distance : 0.0;
+    dm.rank = 0;
+
+    if( minRatio > 0.0 && d2 < FLT_MAX && !(dm.ratio > minRatio) ) continue;
+
+    CV_WRITE_SEQ_ELEM( dm, writer );
+  }
+
+  cvEndWriteSeq( &writer );
+  return matches;
+}
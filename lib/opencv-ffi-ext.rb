@@ -11,5 +11,6 @@ require 'opencv-ffi-ext/calib3d/reproj.rb'
 require 'opencv-ffi-ext/calib3d/pnp.rb'
 
 require 'opencv-ffi-ext/vector_math'
+require 'opencv-ffi-ext/descriptor_db'
 require 'opencv-ffi-ext/color_invariance'
 
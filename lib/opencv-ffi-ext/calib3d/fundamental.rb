@@ -17,6 +17,86 @@ module CVFFI
       param :outlier_threshold, 3
       param :confidence, 0.99
       param :method, :CV_FM_RANSAC
+
+      # For :CV_PROSAC, one score per correspondence, higher being
+      # better (e.g. match ratios).  Without it, the points are taken
+      # to be sorted best first.
+      param :quality, nil
+
+      # Verify hypotheses with the sequential probability ratio test,
+      # for :CV_RANSAC and :CV_PROSAC
+      param :sprt, false
+
+      # Locally optimise each new best model from its inliers (LO-RANSAC)
+      param :local_optimization, false
+
+      # Draw and score RANSAC hypotheses on several threads
+      param :parallel, false
+
+      # Seeds the estimator's RNG, for repeatable results;  0 seeds it
+      # from the clock
+      param :seed, 0
+
+      # An EstimatorWorkspace to reuse the buffers of earlier calls,
+      # when estimating many models in a row
+      param :workspace, nil
+    end
+
+    # Methods this library adds to those in CvRansacMethod
+    CvffiRansacMethod = { :CV_DEGENSAC => 9,
+                          :CV_PROSAC => 16 }
+
+    # Options or'ed into the method
+    CvffiRansacOptions = { :CV_RANSAC_SPRT => 0x100,
+                           :CV_RANSAC_LO => 0x200,
+                           :CV_RANSAC_PARALLEL => 0x400 }
+
+    def self.ransac_method( method )
+      CvffiRansacMethod[method] || CvRansacMethod[method]
+    end
+
+    def self.ransac_method_with_options( params )
+      method = ransac_method( params.method )
+      method |= CvffiRansacOptions[:CV_RANSAC_SPRT] if params.sprt
+      method |= CvffiRansacOptions[:CV_RANSAC_LO] if params.local_optimization
+      method |= CvffiRansacOptions[:CV_RANSAC_PARALLEL] if params.parallel
+      method
+    end
+
+    attach_function :cvCreateEstimatorWorkspace, [:int], :pointer
+    attach_function :cvReleaseEstimatorWorkspace, [:pointer], :void
+
+    # Buffers for estimating models from up to max_count correspondences
+    # (growing if given more), kept from one call to the next.  Use
+    # each from one thread at a time.
+    class EstimatorWorkspace
+      attr_reader :workspace
+
+      def initialize( max_count = 0 )
+        @workspace = Calib3d::cvCreateEstimatorWorkspace( max_count )
+      end
+
+      def release
+        ptr = FFI::MemoryPointer.new :pointer
+        ptr.put_pointer( 0, @workspace )
+        Calib3d::cvReleaseEstimatorWorkspace( ptr )
+        @workspace = nil
+      end
+    end
+
+    def self.workspace_pointer( workspace )
+      workspace ? workspace.workspace : nil
+    end
+
+    def self.quality_to_CvMat( quality )
+      case quality
+      when nil
+        nil
+      when Array
+        Matrix.column_vector( quality ).to_CvMat
+      else
+        quality.to_CvMat
+      end
     end
 
     # Wraps the standard Fundamental but includes add'l fields
@@ -25,9 +105,20 @@ module CVFFI
 
       def initialize( f, status, results )
         @results = results
+        @model, @mask = f.to_Mat, status.to_Mat
         super f, status, results.retval
       end
 
+      # The estimated matrix as a Ruby Matrix
+      def model_matrix
+        Matrix.build( 3, 3 ) { |i,j| @model.at(i,j) }
+      end
+
+      # Whether each correspondence is an inlier, as an Array
+      def inlier_mask
+        Array.new( @mask.height ) { |i| @mask.at(i,0) != 0 }
+      end
+
       def num_iters
         @results.num_iters
       end
@@ -35,12 +126,18 @@ module CVFFI
       def max_iters?
         @results.max_iters
       end
+
+      # Hypotheses the SPRT rejected early, with :sprt
+      def num_rejected
+        @results.num_rejected
+      end
     end
 
     class CvFundamentalResult < NiceFFI::Struct
       layout :retval, :int,
              :num_iters, :int,
-             :max_iters, :bool
+             :max_iters, :bool,
+             :num_rejected, :int
     end
 
     #
@@ -51,6 +148,10 @@ module CVFFI
     attach_function :cvEstimateFundamental, [ :pointer, :pointer, :pointer, 
                                               :int, :double, :double, :int, 
                                               :pointer, CvFundamentalResult.by_ref ], :int
+    attach_function :cvEstimateFundamentalWithQuality, [ :pointer, :pointer, :pointer,
+                                                         :int, :double, :double, :int,
+                                                         :pointer, :pointer, :int64, :pointer,
+                                                         CvFundamentalResult.by_ref ], :void
 
     def self.estimateFundamental( points1, points2, params = {})
 
@@ -71,8 +172,10 @@ module CVFFI
       status = CVFFI::cvCreateMat( points1.height, 1, :CV_8U )
       result = CvFundamentalResult.new
 
-      cvEstimateFundamental( points1, points2, fundamental, 
-                                  CvRansacMethod[ params.method ], params.outlier_threshold, params.confidence, params.max_iters, status, result )
+      cvEstimateFundamentalWithQuality( points1, points2, fundamental,
+                                        ransac_method_with_options( params ), params.outlier_threshold, params.confidence, params.max_iters, status,
+                                        quality_to_CvMat( params.quality ), params.seed,
+                                        workspace_pointer( params.workspace ), result )
 
       if result.retval > 0
         case count
@@ -104,13 +207,68 @@ module CVFFI
     end
 
 
+    # An essential matrix is a fundamental matrix in normalized image
+    # coordinates
+    class EnhancedEssential < EnhancedFundamental
+    end
+
+    attach_function :cvEstimateEssentialWithQuality, [ :pointer, :pointer, :pointer, :pointer,
+                                                       :int, :double, :double, :int,
+                                                       :pointer, :pointer, :int64, :pointer,
+                                                       CvFundamentalResult.by_ref ], :void
+
+    # The essential matrix of two views from one calibrated camera, from
+    # points in pixels and the camera's 3x3 matrix, with the five-point
+    # algorithm.  outlier_threshold is in pixels, as for
+    # estimateFundamental.  Given exactly 5 points, returns all (up to
+    # 10) solutions.
+    def self.estimateEssential( points1, points2, camera_matrix, params = {} )
+      params = FEstimatorParams.new( params )
+      count = [ points1.height, points1.width ].max
+      essential = CVFFI::cvCreateMat( count == 5 ? 30 : 3, 3, :CV_64F )
+      status = CVFFI::cvCreateMat( points1.height, 1, :CV_8U )
+      result = CvFundamentalResult.new
+      camera_matrix = camera_matrix.to_CvMat if camera_matrix.is_a? Matrix
+
+      cvEstimateEssentialWithQuality( points1, points2, camera_matrix, essential,
+                                      ransac_method_with_options( params ), params.outlier_threshold, params.confidence, params.max_iters, status,
+                                      quality_to_CvMat( params.quality ), params.seed,
+                                      workspace_pointer( params.workspace ), result )
+
+      if result.retval > 0
+        if count == 5
+          m = essential.to_Matrix.row_vectors
+          Array.new( result.retval ) { |i|
+            as_mat = Matrix.rows( m.shift(3) )
+            EnhancedEssential.new( as_mat.to_Mat( :type => :CV_64F ), status, result )
+          }
+        else
+          EnhancedEssential.new( Mat.new(essential), status, result )
+        end
+      else
+        nil
+      end
+    end
+
+
     class EnhancedHomography < Homography
 
       def initialize( f, status, results )
         @results = results
+        @model, @mask = f.to_Mat, status.to_Mat
         super f, status, results.retval
       end
 
+      # The estimated matrix as a Ruby Matrix
+      def model_matrix
+        Matrix.build( 3, 3 ) { |i,j| @model.at(i,j) }
+      end
+
+      # Whether each correspondence is an inlier, as an Array
+      def inlier_mask
+        Array.new( @mask.height ) { |i| @mask.at(i,0) != 0 }
+      end
+
       def num_iters
         @results.num_iters
       end
@@ -118,11 +276,19 @@ module CVFFI
       def max_iters?
         @results.max_iters
       end
+
+      # Hypotheses the SPRT rejected early, with :sprt
+      def num_rejected
+        @results.num_rejected
+      end
     end
 
 
     attach_function :cvEstimateHomography, [ CvMat.by_ref, CvMat.by_ref, CvMat.by_ref,
                                              :int, :double, :int, CvMat.by_ref, CvFundamentalResult.by_ref ], :void
+    attach_function :cvEstimateHomographyWithQuality, [ CvMat.by_ref, CvMat.by_ref, CvMat.by_ref,
+                                                        :int, :double, :int, CvMat.by_ref, :pointer, :int64,
+                                                        :pointer, CvFundamentalResult.by_ref ], :void
 
     def self.estimateHomography( points1, points2, params = {})
 
@@ -139,9 +305,10 @@ module CVFFI
       status = CVFFI::cvCreateMat( points1.height, 1, :CV_8U )
       result = CvFundamentalResult.new
 
-      cvEstimateHomography( points1, points2, homography,
-                           CvRansacMethod[ params.method ], params.outlier_threshold, params.max_iters,
-                           status, result )
+      cvEstimateHomographyWithQuality( points1, points2, homography,
+                                       ransac_method_with_options( params ), params.outlier_threshold, params.max_iters,
+                                       status, quality_to_CvMat( params.quality ), params.seed,
+                                       workspace_pointer( params.workspace ), result )
 
       if result.retval > 0
         EnhancedHomography.new( homography, status, result )
@@ -150,5 +317,64 @@ module CVFFI
       end
 
     end
+
+    attach_function :cvEstimateFundamentalBatch, [ :int, :pointer, :pointer, :pointer,
+                                                   :int, :double, :double, :int,
+                                                   :pointer, :pointer, :int64, :pointer ], :void
+    attach_function :cvEstimateHomographyBatch, [ :int, :pointer, :pointer, :pointer,
+                                                  :int, :double, :int,
+                                                  :pointer, :pointer, :int64, :pointer ], :void
+
+    # An array of pointers to the given CvMats, nil being NULL
+    def self.pointer_array( mats )
+      FFI::MemoryPointer.new( :pointer, [mats.length, 1].max ).tap { |p|
+        p.write_array_of_pointer( mats.map { |m| m ? m.to_ptr : FFI::Pointer::NULL } )
+      }
+    end
+
+    # Runs the batch function in the block over pairs of [points1,
+    # points2], returning the models and results of each
+    def self.estimate_batch( pairs, params )
+      quality = params.quality || []
+      models = pairs.map { CVFFI::cvCreateMat( 3, 3, :CV_64F ) }
+      statuses = pairs.map { |points1, _| CVFFI::cvCreateMat( points1.height, 1, :CV_8U ) }
+      qualities = Array.new( pairs.length ) { |i| quality_to_CvMat( quality[i] ) }
+      results = FFI::MemoryPointer.new( CvFundamentalResult, [pairs.length, 1].max )
+
+      yield pairs.length, pointer_array( pairs.map { |p| p[0] } ), pointer_array( pairs.map { |p| p[1] } ),
+            pointer_array( models ), ransac_method_with_options( params ),
+            pointer_array( statuses ), pointer_array( qualities ), results
+
+      Array.new( pairs.length ) { |i|
+        [ models[i], statuses[i], CvFundamentalResult.new( results[i] ) ]
+      }
+    end
+
+    # Estimates a fundamental matrix for each [points1, points2] in pairs,
+    # natively and in parallel, rather than one call per pair.  quality,
+    # if given, holds each pair's scores.  Pair i is seeded with seed + i.
+    # Returns an EnhancedFundamental, or nil, for each pair.
+    def self.estimateFundamentalBatch( pairs, params = {} )
+      params = FEstimatorParams.new( params )
+      estimate_batch( pairs, params ) { |count, points1, points2, models, method, statuses, qualities, results|
+        cvEstimateFundamentalBatch( count, points1, points2, models, method,
+                                    params.outlier_threshold, params.confidence, params.max_iters,
+                                    statuses, qualities, params.seed, results )
+      }.map { |f, status, result|
+        result.retval > 0 ? EnhancedFundamental.new( Mat.new(f), status, result ) : nil
+      }
+    end
+
+    # As estimateFundamentalBatch, for homographies
+    def self.estimateHomographyBatch( pairs, params = {} )
+      params = FEstimatorParams.new( params )
+      estimate_batch( pairs, params ) { |count, points1, points2, models, method, statuses, qualities, results|
+        cvEstimateHomographyBatch( count, points1, points2, models, method,
+                                   params.outlier_threshold, params.max_iters,
+                                   statuses, qualities, params.seed, results )
+      }.map { |h, status, result|
+        result.retval > 0 ? EnhancedHomography.new( h, status, result ) : nil
+      }
+    end
   end
 end
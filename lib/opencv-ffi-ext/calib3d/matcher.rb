@@ -70,6 +70,24 @@ module CVFFI
       MatchResults.new( seq, pool );
     end
 
+    attach_function :bruteForceMatcherParamsBuffer, [:pointer, :pointer, :pointer, :int, :pointer], :int
+    attach_function :bruteForceMatcherBuffer, [:pointer, :pointer, :pointer, :int, :int, :bool], :int
+    attach_function :bruteForceMatcherKnnBuffer, [:pointer, :pointer, :pointer, :int, :int, :int, :bool], :int
+    attach_function :bruteForceMatcherRadiusBuffer, [:pointer, :pointer, :pointer, :int, :int, :float, :bool], :int
+    attach_function :bruteForceMatcherRatioTestBuffer, [:pointer, :pointer, :pointer, :int, :int, :float, :bool], :int
+
+    # As brute_force_matcher, but returns a MatchBuffer
+    def self.brute_force_matcher_flat( query, train, opts = {} )
+      opts[:norm_type] = opts[:norm] if opts[:norm]
+      params = MatcherParams.new( opts )
+      query = query.to_CvMat
+      train = train.to_CvMat
+
+      match_into_buffer( matcherResultsBound( query, train, params.knn ) ) { |buffer, capacity|
+        bruteForceMatcherParamsBuffer( query, train, buffer, capacity, params.to_CvMatcherParams )
+      }
+    end
+
     # Flann-based matcher
     #
     attach_function :flannBasedMatcher, [:pointer, :pointer, :pointer], CvSeq.typed_pointer
@@ -91,6 +109,467 @@ module CVFFI
       MatchResults.new( seq, pool );
     end
 
+    attach_function :flannBasedMatcherKnnBuffer, [:pointer, :pointer, :pointer, :int, :int ], :int
+    attach_function :flannBasedMatcherRadiusBuffer, [:pointer, :pointer, :pointer, :int, :float ], :int
+    attach_function :flannBasedMatcherRatioTestBuffer, [:pointer, :pointer, :pointer, :int, :float ], :int
+
+    # As flann_based_matcher, but returns a MatchBuffer
+    def self.flann_based_matcher_flat( query, train, opts = {} )
+      knn = opts[:knn] || 1
+      radius = opts[:radius] || nil
+      query = query.to_CvMat
+      train = train.to_CvMat
+
+      match_into_buffer( matcherResultsBound( query, train, knn ) ) { |buffer, capacity|
+        if radius.nil?
+          flannBasedMatcherKnnBuffer( query, train, buffer, capacity, knn )
+        else
+          flannBasedMatcherRadiusBuffer( query, train, buffer, capacity, radius )
+        end
+      }
+    end
+
+    # Binarization of float descriptors into packed bit codes,
+    # and a Hamming matcher over those codes
+    #
+    attach_function :binarizeRandomProjection, [:pointer, :int64], :void
+    attach_function :binarizeDescriptorsTrain, [:pointer, :pointer, :pointer], :void
+    attach_function :binarizeDescriptors, [:pointer, :pointer, :pointer, :pointer], :void
+
+    attach_function :hammingMatcherKnn, [:pointer, :pointer, :pointer, :int], CvSeq.typed_pointer
+    attach_function :hammingMatcherRadius, [:pointer, :pointer, :pointer, :float], CvSeq.typed_pointer
+    attach_function :hammingMatcherRatioTest, [:pointer, :pointer, :pointer, :float], CvSeq.typed_pointer
+
+    class Binarizer
+      attr_reader :nbits, :projection, :thresholds
+
+      # With no :bits option, each descriptor dimension becomes one bit
+      # (the descriptor length must then be a multiple of 64).  Otherwise
+      # a random projection to :bits bits is used.
+      def initialize( descriptors, opts = {} )
+        descriptors = descriptors.to_CvMat
+        @nbits = opts[:bits] || descriptors.width
+
+        if opts[:bits]
+          @projection = CVFFI::cvCreateMat( @nbits, descriptors.width, :CV_32F )
+          Matcher::binarizeRandomProjection( @projection, opts[:seed] || 0x12345678 )
+        end
+
+        @thresholds = CVFFI::cvCreateMat( 1, @nbits, :CV_32F )
+        Matcher::binarizeDescriptorsTrain( descriptors, @projection, @thresholds )
+      end
+
+      def binarize( descriptors )
+        descriptors = descriptors.to_CvMat
+        codes = CVFFI::cvCreateMat( descriptors.height, @nbits/8, :CV_8U )
+        Matcher::binarizeDescriptors( descriptors, @projection, @thresholds, codes )
+        codes
+      end
+    end
+
+    def self.hamming_matcher( query, train, opts = {} )
+      knn = opts[:knn] || 1
+
+      pool = CVFFI::cvCreateMemStorage(0);
+      seq = if opts[:radius]
+              hammingMatcherRadius( query.to_CvMat, train.to_CvMat, pool, opts[:radius] )
+            elsif opts[:ratio]
+              hammingMatcherRatioTest( query.to_CvMat, train.to_CvMat, pool, opts[:ratio] )
+            else
+              hammingMatcherKnn( query.to_CvMat, train.to_CvMat, pool, knn )
+            end
+
+      MatchResults.new( seq, pool );
+    end
+
+    # Quantized descriptors
+    #
+    attach_function :quantizeDescriptorsU8, [CvMat.typed_pointer, CvMat.typed_pointer, :float], :void
+    attach_function :quantizeDescriptorsS8, [CvMat.typed_pointer, CvMat.typed_pointer, :float], :float
+    attach_function :quantizeDescriptorsF16, [CvMat.typed_pointer, CvMat.typed_pointer], :void
+    attach_function :dequantizeDescriptorsF16, [CvMat.typed_pointer, CvMat.typed_pointer], :void
+    attach_function :quantizedMatcherKnn, [:pointer, :pointer, :pointer, :int, :float], CvSeq.typed_pointer
+    attach_function :quantizedMatcherRatioTest, [:pointer, :pointer, :pointer, :float, :float], CvSeq.typed_pointer
+
+    # Quantizes float descriptors to :uint8 (with :scale, default 1 which
+    # suits the SIFT extractor), :int8 (scaled per set, or by :scale) or
+    # :fp16.  Returns the quantized matrix and the scale to pass to
+    # quantized_matcher.  Query and train sets quantized separately to
+    # :int8 must share a scale:  quantize the queries with the train
+    # set's.
+    def self.quantize( descriptors, format, opts = {} )
+      descriptors = descriptors.to_CvMat
+
+      case format
+      when :uint8
+        scale = opts[:scale] || 1.0
+        out = CVFFI::cvCreateMat( descriptors.height, descriptors.width, :CV_8U )
+        quantizeDescriptorsU8( descriptors, out, scale )
+      when :int8
+        out = CVFFI::cvCreateMat( descriptors.height, descriptors.width, :CV_8S )
+        scale = quantizeDescriptorsS8( descriptors, out, opts[:scale] || 0.0 )
+      when :fp16
+        scale = 1.0
+        out = CVFFI::cvCreateMat( descriptors.height, descriptors.width, :CV_16S )
+        quantizeDescriptorsF16( descriptors, out )
+      else
+        raise "Unknown quantized descriptor format #{format}"
+      end
+
+      [ out, scale ]
+    end
+
+    # L2 matcher for quantized descriptors.  Query and train must be in
+    # the same format, and :scale the scale they were quantized with.
+    def self.quantized_matcher( query, train, opts = {} )
+      scale = opts[:scale] || 1.0
+
+      pool = CVFFI::cvCreateMemStorage(0);
+      seq = if opts[:ratio]
+              quantizedMatcherRatioTest( query.to_CvMat, train.to_CvMat, pool, opts[:ratio], scale )
+            else
+              quantizedMatcherKnn( query.to_CvMat, train.to_CvMat, pool, opts[:knn] || 1, scale )
+            end
+
+      MatchResults.new( seq, pool );
+    end
+
+    # Guided matcher
+    #
+    GuidedModelTypes = enum :guided_model_types, [ :GUIDED_FUNDAMENTAL, 0,
+                                                   :GUIDED_HOMOGRAPHY, 1 ]
+
+    attach_function :guidedMatcherKnn, [:pointer, :pointer, :pointer, :pointer, :pointer, :guided_model_types, :float, :pointer, :int, :int], CvSeq.typed_pointer
+    attach_function :guidedMatcherRatioTest, [:pointer, :pointer, :pointer, :pointer, :pointer, :guided_model_types, :float, :pointer, :int, :float], CvSeq.typed_pointer
+
+    # Re-match given a fundamental matrix (:model => :fundamental, the
+    # default) or homography (:model => :homography) mapping query
+    # keypoints to train keypoints.  Points are N x 2 matrices with one
+    # row per descriptor.  Only pairs within :tolerance pixels of the
+    # epipolar line / predicted point are compared.
+    def self.guided_matcher( query, query_points, train, train_points, model, opts = {} )
+      model_type = (opts[:model] == :homography) ? :GUIDED_HOMOGRAPHY : :GUIDED_FUNDAMENTAL
+      tolerance = opts[:tolerance] || 3.0
+      norm = NormTypes[ opts[:norm] || :NORM_L2 ]
+
+      args = [ query.to_CvMat, query_points.to_CvMat, train.to_CvMat, train_points.to_CvMat,
+               model.to_CvMat( :type => :CV_64F ), model_type, tolerance ]
+
+      pool = CVFFI::cvCreateMemStorage(0);
+      seq = if opts[:ratio]
+              guidedMatcherRatioTest( *args, pool, norm, opts[:ratio] )
+            else
+              guidedMatcherKnn( *args, pool, norm, opts[:knn] || 1 )
+            end
+
+      MatchResults.new( seq, pool );
+    end
+
+    # Spatial-prior matcher
+    #
+    attach_function :spatialMatcherKnn, [:pointer, :pointer, :pointer, :pointer, :pointer, :int, :int, :float, :float, :float], CvSeq.typed_pointer
+    attach_function :spatialMatcherRatioTest, [:pointer, :pointer, :pointer, :pointer, :pointer, :int, :float, :float, :float, :float], CvSeq.typed_pointer
+    attach_function :spatialMatcherKnnBuffer, [:pointer, :pointer, :pointer, :pointer, :pointer, :int, :int, :int, :float, :float, :float], :int
+    attach_function :spatialMatcherRatioTestBuffer, [:pointer, :pointer, :pointer, :pointer, :pointer, :int, :int, :float, :float, :float, :float], :int
+
+    # Matches each query only against train keypoints within :radius
+    # pixels of its position plus the predicted motion :motion => [dx,dy].
+    # Points are N x 2 matrices with one row per descriptor.
+    def self.spatial_matcher( query, query_points, train, train_points, opts = {} )
+      radius = opts[:radius] || 20.0
+      dx, dy = opts[:motion] || [0.0, 0.0]
+      norm = NormTypes[ opts[:norm] || :NORM_L2 ]
+
+      args = [ query.to_CvMat, query_points.to_CvMat, train.to_CvMat, train_points.to_CvMat ]
+
+      pool = CVFFI::cvCreateMemStorage(0);
+      seq = if opts[:ratio]
+              spatialMatcherRatioTest( *args, pool, norm, opts[:ratio], radius, dx, dy )
+            else
+              spatialMatcherKnn( *args, pool, norm, opts[:knn] || 1, radius, dx, dy )
+            end
+
+      MatchResults.new( seq, pool );
+    end
+
+    # As spatial_matcher, but returns a MatchBuffer
+    def self.spatial_matcher_flat( query, query_points, train, train_points, opts = {} )
+      radius = opts[:radius] || 20.0
+      dx, dy = opts[:motion] || [0.0, 0.0]
+      norm = NormTypes[ opts[:norm] || :NORM_L2 ]
+      knn = opts[:knn] || 1
+
+      args = [ query.to_CvMat, query_points.to_CvMat, train.to_CvMat, train_points.to_CvMat ]
+
+      match_into_buffer( matcherResultsBound( args[0], args[2], knn ) ) { |buffer, capacity|
+        if opts[:ratio]
+          spatialMatcherRatioTestBuffer( *args, buffer, capacity, norm, opts[:ratio], radius, dx, dy )
+        else
+          spatialMatcherKnnBuffer( *args, buffer, capacity, norm, knn, radius, dx, dy )
+        end
+      }
+    end
+
+    # GMS filter
+    #
+    attach_function :gmsFilter, [:pointer, :pointer, CvSize.by_value, :pointer, CvSize.by_value, :pointer, :int, :float], :int
+
+    # Grid-based motion statistics filter for a set of MatchResults.
+    # Points are N x 2 matrices indexed by queryIdx / trainIdx, sizes are
+    # the image sizes as CvSize or [width, height].  Returns an array of
+    # booleans, true for matches which pass.
+    def self.gms_filter( matches, query_points, query_size, train_points, train_size, opts = {} )
+      return [] if matches.length == 0
+      to_size = lambda { |s| s.is_a?(Array) ? CvSize.new( width: s[0], height: s[1] ) : s }
+
+      mask = CVFFI::cvCreateMat( 1, matches.length, :CV_8U )
+      gmsFilter( matches, query_points.to_CvMat, to_size.call( query_size ),
+                 train_points.to_CvMat, to_size.call( train_size ),
+                 mask, opts[:grid_size] || 0, opts[:alpha] || 0.0 )
+
+      Array.new( matches.length ) { |i| CVFFI::cvGetReal2D( mask, 0, i ) > 0 }
+    end
+
+    attach_function :ivfpqCreate, [:int, :int, :int], :pointer
+    attach_function :ivfpqRelease, [:pointer], :void
+    attach_function :ivfpqTrain, [:pointer, CvMat.typed_pointer], :void
+    attach_function :ivfpqAdd, [:pointer, CvMat.typed_pointer], :int
+    attach_function :ivfpqSize, [:pointer], :int
+    attach_function :ivfpqSearchKnn, [:pointer, CvMat.typed_pointer, :pointer, :int, :int], CvSeq.typed_pointer
+    attach_function :ivfpqSearchRatioTest, [:pointer, CvMat.typed_pointer, :pointer, :float, :int], CvSeq.typed_pointer
+
+    # Approximate nearest-neighbour index for large float descriptor
+    # sets.  Each descriptor is stored as :m bytes (:m must divide the
+    # descriptor length).
+    class IVFPQIndex
+      attr_accessor :nprobe
+
+      def initialize( dim, opts = {} )
+        @index = Matcher::ivfpqCreate( dim, opts[:nlist] || 64, opts[:m] || 16 )
+        @nprobe = opts[:nprobe] || 8
+      end
+
+      # Before adding any descriptors
+      def train( descriptors )
+        raise "Can't retrain an IVFPQIndex which already holds descriptors" if size > 0
+        Matcher::ivfpqTrain( @index, descriptors.to_CvMat )
+        self
+      end
+
+      # Returns the index of the first added descriptor
+      def add( descriptors )
+        Matcher::ivfpqAdd( @index, descriptors.to_CvMat )
+      end
+
+      def size
+        Matcher::ivfpqSize( @index )
+      end
+
+      def search( query, opts = {} )
+        nprobe = opts[:nprobe] || @nprobe
+
+        pool = CVFFI::cvCreateMemStorage(0);
+        seq = if opts[:ratio]
+                Matcher::ivfpqSearchRatioTest( @index, query.to_CvMat, pool, opts[:ratio], nprobe )
+              else
+                Matcher::ivfpqSearchKnn( @index, query.to_CvMat, pool, opts[:knn] || 1, nprobe )
+              end
+
+        MatchResults.new( seq, pool )
+      end
+
+      def release
+        ptr = FFI::MemoryPointer.new :pointer
+        ptr.put_pointer( 0, @index )
+        Matcher::ivfpqRelease( ptr )
+        @index = nil
+      end
+    end
+
+    HNSWDescriptorTypes = enum :hnsw_descriptor_types, [ :CV_8U, 0,
+                                                         :CV_32F, 5 ]
+
+    attach_function :hnswCreate, [:int, :hnsw_descriptor_types, :int, :int], :pointer
+    attach_function :hnswRelease, [:pointer], :void
+    attach_function :hnswSetEf, [:pointer, :int], :void
+    attach_function :hnswAdd, [:pointer, CvMat.typed_pointer], :int
+    attach_function :hnswSize, [:pointer], :int
+    attach_function :hnswSearchKnn, [:pointer, CvMat.typed_pointer, :pointer, :int], CvSeq.typed_pointer
+    attach_function :hnswSearchRatioTest, [:pointer, CvMat.typed_pointer, :pointer, :float], CvSeq.typed_pointer
+    attach_function :hnswSearchRadius, [:pointer, CvMat.typed_pointer, :pointer, :float], CvSeq.typed_pointer
+    attach_function :hnswSave, [:pointer, :string], :bool
+    attach_function :hnswLoad, [:string], :pointer
+
+    # Approximate nearest-neighbour graph index over :CV_32F or :CV_8U
+    # descriptors.  Descriptors can be added at any time.
+    class HNSWIndex
+      def initialize( dim, opts = {} )
+        @index = Matcher::hnswCreate( dim, opts[:type] || :CV_32F, opts[:m] || 16, opts[:ef_construction] || 200 )
+        self.ef = opts[:ef] if opts[:ef]
+      end
+
+      def self.load( filename )
+        ptr = Matcher::hnswLoad( filename )
+        raise "Couldn't load HNSW index from #{filename}" if ptr.null?
+
+        index = allocate
+        index.instance_variable_set( :@index, ptr )
+        index
+      end
+
+      def save( filename )
+        Matcher::hnswSave( @index, filename )
+      end
+
+      def ef=( ef )
+        Matcher::hnswSetEf( @index, ef )
+      end
+
+      # Returns the index of the first added descriptor
+      def add( descriptors )
+        Matcher::hnswAdd( @index, descriptors.to_CvMat )
+      end
+
+      def size
+        Matcher::hnswSize( @index )
+      end
+
+      def search( query, opts = {} )
+        pool = CVFFI::cvCreateMemStorage(0);
+        seq = if opts[:radius]
+                Matcher::hnswSearchRadius( @index, query.to_CvMat, pool, opts[:radius] )
+              elsif opts[:ratio]
+                Matcher::hnswSearchRatioTest( @index, query.to_CvMat, pool, opts[:ratio] )
+              else
+                Matcher::hnswSearchKnn( @index, query.to_CvMat, pool, opts[:knn] || 1 )
+              end
+
+        MatchResults.new( seq, pool )
+      end
+
+      def release
+        ptr = FFI::MemoryPointer.new :pointer
+        ptr.put_pointer( 0, @index )
+        Matcher::hnswRelease( ptr )
+        @index = nil
+      end
+    end
+
+    attach_function :pairMatcherCreate, [:int], :pointer
+    attach_function :pairMatcherRelease, [:pointer], :void
+    attach_function :pairMatcherAddImage, [:pointer, CvMat.typed_pointer], :int
+    attach_function :pairMatcherSize, [:pointer], :int
+    attach_function :pairMatcherMatch, [:pointer, :pointer, :int, :float], :int
+    attach_function :pairMatcherPair, [:pointer, :int, :pointer, :pointer], :void
+    attach_function :pairMatcherResultsBuffer, [:pointer, :int, :pointer, :int], :int
+
+    # Matches many pairs of images at once, e.g. every pair in a
+    # collection when building a match graph.  Each image's descriptors
+    # are copied in once with add;  match then does all the pairs
+    # natively, in parallel.
+    class PairMatcher
+      def initialize( opts = {} )
+        @matcher = Matcher::pairMatcherCreate( NormTypes[ opts[:norm] || :NORM_L2 ] )
+      end
+
+      # Returns the image's index, used to identify it in pairs
+      def add( descriptors )
+        Matcher::pairMatcherAddImage( @matcher, descriptors.to_CvMat )
+      end
+
+      def size
+        Matcher::pairMatcherSize( @matcher )
+      end
+
+      # Matches the given [query, train] pairs of image indices, or every
+      # pair [i,j] with i < j if pairs is nil.  Returns a Hash from each
+      # pair to its MatchBuffer, in which imgIdx is the train image.
+      def match( pairs = nil, opts = {} )
+        pairs_mat = if pairs
+                      Mat.build( pairs.length, 2, {type: :CV_32S} ) { |i,j| pairs[i][j] }.to_CvMat
+                    end
+        n = Matcher::pairMatcherMatch( @matcher, pairs_mat, opts[:knn] || 1, opts[:ratio] || 0.0 )
+
+        query = FFI::MemoryPointer.new :int
+        train = FFI::MemoryPointer.new :int
+        results = {}
+        n.times { |i|
+          Matcher::pairMatcherPair( @matcher, i, query, train )
+          count = Matcher::pairMatcherResultsBuffer( @matcher, i, nil, 0 )
+          results[ [query.read_int, train.read_int] ] = Matcher::match_into_buffer( count ) { |buffer, capacity|
+            Matcher::pairMatcherResultsBuffer( @matcher, i, buffer, capacity )
+          }
+        }
+        results
+      end
+
+      def release
+        ptr = FFI::MemoryPointer.new :pointer
+        ptr.put_pointer( 0, @matcher )
+        Matcher::pairMatcherRelease( ptr )
+        @matcher = nil
+      end
+    end
+
+    TrainCollectionTypes = enum :train_collection_types, [ :CV_8U, 0,
+                                                           :CV_32F, 5 ]
+
+    attach_function :trainCollectionCreate, [:train_collection_types, :int, :int], :pointer
+    attach_function :trainCollectionRelease, [:pointer], :void
+    attach_function :trainCollectionAdd, [:pointer, CvMat.typed_pointer], :int
+    attach_function :trainCollectionRemove, [:pointer, :int], :bool
+    attach_function :trainCollectionSize, [:pointer], :int
+    attach_function :trainCollectionDescriptorCount, [:pointer], :int
+    attach_function :trainCollectionMatchKnn, [:pointer, CvMat.typed_pointer, :pointer, :int], CvSeq.typed_pointer
+    attach_function :trainCollectionMatchRatioTest, [:pointer, CvMat.typed_pointer, :pointer, :float], CvSeq.typed_pointer
+
+    # Descriptors from several train images, matched against together.
+    # In the results imgIdx is the id add returned for the image, and
+    # trainIdx the row within that image.
+    class TrainCollection
+      def initialize( dim, opts = {} )
+        type = opts[:type] || :CV_32F
+        norm = opts[:norm] || (type == :CV_8U ? :NORM_HAMMING : :NORM_L2)
+        @collection = Matcher::trainCollectionCreate( type, dim, NormTypes[norm] )
+      end
+
+      # Returns the image's id
+      def add( descriptors )
+        Matcher::trainCollectionAdd( @collection, descriptors.to_CvMat )
+      end
+
+      def remove( id )
+        Matcher::trainCollectionRemove( @collection, id )
+      end
+
+      # Number of images
+      def size
+        Matcher::trainCollectionSize( @collection )
+      end
+
+      def descriptor_count
+        Matcher::trainCollectionDescriptorCount( @collection )
+      end
+
+      def match( query, opts = {} )
+        pool = CVFFI::cvCreateMemStorage(0);
+        seq = if opts[:ratio]
+                Matcher::trainCollectionMatchRatioTest( @collection, query.to_CvMat, pool, opts[:ratio] )
+              else
+                Matcher::trainCollectionMatchKnn( @collection, query.to_CvMat, pool, opts[:knn] || 1 )
+              end
+
+        MatchResults.new( seq, pool )
+      end
+
+      def release
+        ptr = FFI::MemoryPointer.new :pointer
+        ptr.put_pointer( 0, @collection )
+        Matcher::trainCollectionRelease( ptr )
+        @collection = nil
+      end
+    end
+
     # Match results
     #
     # A DMatch is strictly index based (doesn't store the actual X,Y 
@@ -127,6 +606,53 @@ module CVFFI
       sequence_class DMatch
     end
 
+    # A flat, contiguous array of DMatch written directly by the
+    # *Buffer matcher functions.  Elements are wrapped in place, no
+    # copying or CvSeq traversal.
+    class MatchBuffer
+      include Enumerable
+
+      attr_reader :buffer, :length
+
+      def initialize( buffer, length )
+        @buffer = buffer
+        @length = length
+      end
+      alias :size :length
+
+      def at(i)
+        return nil if i < 0 or i >= @length
+        DMatch.new( @buffer + i*DMatch.size )
+      end
+      alias :[] :at
+
+      def each
+        length.times { |i| yield at(i) }
+      end
+
+      def to_a
+        map { |m| m.to_a }
+      end
+    end
+
+    attach_function :matcherResultsBound, [:pointer, :pointer, :int], :int
+
+    # The *Buffer functions return the total number of matches, which
+    # may be more than will fit.  Start with "capacity" entries and retry
+    # once with a buffer of the right size if needed.
+    def self.match_into_buffer( capacity )
+      capacity = [capacity, 1].max
+      buffer = FFI::MemoryPointer.new( DMatch, capacity )
+      count = yield buffer, capacity
+
+      if count > capacity
+        buffer = FFI::MemoryPointer.new( DMatch, count )
+        count = yield buffer, count
+      end
+
+      MatchBuffer.new( buffer, count )
+    end
+
    #
     # Small abstraction breakage.  The data in Mogile is a serialization of
     # a CVFFI struct.   Why am I recreating the data in a different class
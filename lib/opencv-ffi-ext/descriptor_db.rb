@@ -0,0 +1,93 @@
+
+require 'nice-ffi'
+require 'opencv-ffi-wrappers'
+
+require 'opencv-ffi-ext/features2d/keypoint'
+
+module CVFFI
+
+  # Descriptors (and optionally their keypoints) stored in a binary file
+  # which is memory-mapped when opened.  The descriptors are available
+  # as a read-only CvMat which can be passed straight to the matchers.
+  module DescriptorDB
+    extend NiceFFI::Library
+
+    libs_dir = File.dirname(__FILE__) + "/../../ext/opencv-ffi/"
+    pathset = NiceFFI::PathSet::DEFAULT.prepend( libs_dir )
+    load_library("cvffi", pathset)
+
+    attach_function :descriptorDbWrite, [:string, CvMat.typed_pointer, :pointer], :bool
+    attach_function :descriptorDbOpen, [:string], :pointer
+    attach_function :descriptorDbClose, [:pointer], :void
+    attach_function :descriptorDbSize, [:pointer], :int
+    attach_function :descriptorDbDescriptors, [:pointer], CvMat.typed_pointer
+    attach_function :descriptorDbKeypoint, [:pointer, :int, :pointer], :bool
+    attach_function :descriptorDbKeypoints, [:pointer, :pointer], CvSeq.typed_pointer
+
+    # keypoints, if given, is an Array (or Keypoints) of CvKeyPoint, one
+    # per descriptor row.
+    def self.write( filename, descriptors, keypoints = nil )
+      descriptors = descriptors.to_CvMat
+      kp_ptr = nil
+
+      if keypoints
+        raise "Need one keypoint per descriptor (#{keypoints.length} != #{descriptors.height})" unless keypoints.length == descriptors.height
+
+        kp_ptr = FFI::MemoryPointer.new( Features2D::CvKeyPoint, keypoints.length )
+        keypoints.each_with_index { |kp,i|
+          kp_ptr.put_bytes( i*Features2D::CvKeyPoint.size, kp.pointer.get_bytes( 0, Features2D::CvKeyPoint.size ) )
+        }
+      end
+
+      descriptorDbWrite( filename, descriptors, kp_ptr )
+    end
+
+    def self.open( filename )
+      db = Database.new( filename )
+      return db unless block_given?
+
+      begin
+        yield db
+      ensure
+        db.close
+      end
+    end
+
+    class Database
+      def initialize( filename )
+        @db = DescriptorDB::descriptorDbOpen( filename )
+        raise "Couldn't open descriptor database #{filename}" if @db.null?
+      end
+
+      def size
+        DescriptorDB::descriptorDbSize( @db )
+      end
+      alias :length :size
+
+      # Only valid until the database is closed
+      def descriptors
+        DescriptorDB::descriptorDbDescriptors( @db )
+      end
+      alias :to_CvMat :descriptors
+
+      def keypoint( i )
+        kp = Features2D::CvKeyPoint.new( nil )
+        DescriptorDB::descriptorDbKeypoint( @db, i, kp.pointer ) ? kp : nil
+      end
+
+      def keypoints
+        pool = CVFFI::cvCreateMemStorage( 0 )
+        seq = DescriptorDB::descriptorDbKeypoints( @db, pool )
+        seq.nil? ? nil : Features2D::Keypoints.new( seq, pool )
+      end
+
+      def close
+        ptr = FFI::MemoryPointer.new :pointer
+        ptr.put_pointer( 0, @db )
+        DescriptorDB::descriptorDbClose( ptr )
+        @db = nil
+      end
+    end
+
+  end
+end
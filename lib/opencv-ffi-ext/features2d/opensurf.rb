@@ -3,6 +3,7 @@ require 'nice-ffi'
 require 'base64'
 
 require 'opencv-ffi-wrappers/features2d/surf'
+require 'opencv-ffi-ext/calib3d/matcher'
 
 module CVFFI
   module OpenSURF
@@ -91,6 +92,7 @@ module CVFFI
     attach_function :openSurfDetect, [ :pointer, :pointer, OpenSURFParams.by_value ], CvSeq.typed_pointer 
     attach_function :openSurfDescribe, [ :pointer, :pointer, OpenSURFParams.by_value ], CvSeq.typed_pointer 
     attach_function :createOpenSURFPointSequence, [:pointer ], CvSeq.typed_pointer
+    attach_function :openSurfMatch, [ :pointer, :pointer, :pointer, :float, :int ], CvSeq.typed_pointer
 
     class Results < SequenceArray
       sequence_class  OpenSURFPoint
@@ -158,5 +160,18 @@ module CVFFI
       points
     end
 
+    # Nearest-neighbour matching of described points, only comparing
+    # points with the same sign of Laplacian unless :laplacian => false.
+    # With :ratio, only matches whose second-best/best distance ratio
+    # exceeds it are kept.
+    def self.match( query, train, opts = {} )
+      use_laplacian = (opts[:laplacian] == false) ? 0 : 1
+
+      pool = CVFFI::cvCreateMemStorage( 0 )
+      seq = openSurfMatch( query.to_CvSeq, train.to_CvSeq, pool, opts[:ratio] || 0.0, use_laplacian )
+
+      Matcher::MatchResults.new( seq, pool )
+    end
+
   end
 end
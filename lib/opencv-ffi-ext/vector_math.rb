@@ -107,6 +107,88 @@ module CVFFI
 
       realL2distance_8u( a, b )
     end
+
+    VectorMetrics = enum :vector_metrics, [ :l2sqr, 0,
+                                            :l1, 1,
+                                            :dot, 2,
+                                            :cosine, 3,
+                                            :hamming, 4 ]
+
+    VectorTypes = enum :vector_types, [ :float32, 0,
+                                        :uint8, 1,
+                                        :int8, 2 ]
+
+    attach_function :vectorMathIsa, [], :string
+    attach_function :vectorDistance, [ :vector_metrics, :vector_types, :pointer, :pointer, :int ], :float
+    attach_function :vectorDistanceOneToMany, [ :vector_metrics, :vector_types, :pointer, :pointer, :int, :int, :pointer ], :int
+    attach_function :vectorDistanceManyToMany, [ :vector_metrics, :vector_types, :pointer, :int, :pointer, :int, :int, :pointer ], :int
+
+    # Instruction set the native kernels were chosen for, e.g. "avx2"
+    def self.isa
+      vectorMathIsa
+    end
+
+    # Packs an array (or an array of equal-length arrays) into native
+    # memory of the given type
+    def self.pack_vectors( rows, type )
+      rows = [rows] unless rows.first.is_a? Array
+      len = rows.first.length
+      raise "Vectors not all the same length" unless rows.all? { |r| r.length == len }
+
+      values = rows.flatten
+      ptr = case type
+            when :float32
+              FFI::MemoryPointer.new( :float, values.length ).tap { |p| p.write_array_of_float( values ) }
+            when :uint8
+              FFI::MemoryPointer.new( :uint8, values.length ).tap { |p| p.write_array_of_uint8( values ) }
+            when :int8
+              FFI::MemoryPointer.new( :int8, values.length ).tap { |p| p.write_array_of_int8( values ) }
+            else
+              raise "Don't know how to pack vectors of type #{type}"
+            end
+      [ptr, rows.length, len]
+    end
+
+    # Distance between two vectors.  metric is one of :l2sqr, :l1, :dot,
+    # :cosine or :hamming, type one of :float32, :uint8 or :int8.
+    def self.distance( a, b, opts = {} )
+      metric = opts[:metric] || :l2sqr
+      type = opts[:type] || :float32
+      raise "Arrays not same length" unless a.length == b.length
+
+      pa, _, len = pack_vectors( a, type )
+      pb, _, _ = pack_vectors( b, type )
+      vectorDistance( metric, type, pa, pb, len )
+    end
+
+    # Distances from one vector to each of an array of vectors
+    def self.distances( query, rows, opts = {} )
+      metric = opts[:metric] || :l2sqr
+      type = opts[:type] || :float32
+
+      pq, _, len = pack_vectors( query, type )
+      pr, count, rlen = pack_vectors( rows, type )
+      raise "Vectors not all the same length" unless len == rlen
+
+      out = FFI::MemoryPointer.new( :float, count )
+      vectorDistanceOneToMany( metric, type, pq, pr, count, len, out )
+      out.read_array_of_float( count )
+    end
+
+    # Matrix of distances between every vector of a and every vector of
+    # b, as an array of rows, one per vector of a
+    def self.distance_matrix( a, b, opts = {} )
+      metric = opts[:metric] || :l2sqr
+      type = opts[:type] || :float32
+
+      pa, na, len = pack_vectors( a, type )
+      pb, nb, blen = pack_vectors( b, type )
+      raise "Vectors not all the same length" unless len == blen
+
+      out = FFI::MemoryPointer.new( :float, na*nb )
+      vectorDistanceManyToMany( metric, type, pa, na, pb, nb, len, out )
+      out.read_array_of_float( na*nb ).each_slice( nb ).to_a
+    end
   end
 
 
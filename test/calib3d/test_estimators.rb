@@ -0,0 +1,336 @@
+
+require 'test/setup'
+require 'opencv-ffi-wrappers'
+require 'opencv-ffi-ext'
+
+class TestEstimators < Test::Unit::TestCase
+  include CVFFI
+
+  KNOWN_HOMOGRAPHY = Matrix.rows( [ [ 1.1, 0.05, 20.0 ],
+                                    [ -0.03, 0.95, -10.0 ],
+                                    [ 1e-4, 0.0, 1.0 ] ] )
+
+  # Correspondences under KNOWN_HOMOGRAPHY, the first inlier_count exact
+  # (or off by Gaussian noise of the given sigma) and the rest random,
+  # with quality scores which rank the inliers first, and whether each
+  # is one of those inliers
+  def make_correspondences( count, inlier_count, noise = 0.0 )
+    h = KNOWN_HOMOGRAPHY
+
+    srand( 42 )
+    points1, points2, quality = [], [], []
+    count.times { |i|
+      x, y = rand*640, rand*480
+      points1 << [x, y]
+      if i < inlier_count
+        p = h * Vector[ x, y, 1.0 ]
+        points2 << [ p[0]/p[2] + jitter( noise ), p[1]/p[2] + jitter( noise ) ]
+        quality << 1.0 + rand
+      else
+        points2 << [ rand*640, rand*480 ]
+        quality << rand
+      end
+    }
+
+    order = (0...count).to_a.shuffle
+    [ Matrix.rows( order.map { |i| points1[i] } ).to_CvMat,
+      Matrix.rows( order.map { |i| points2[i] } ).to_CvMat,
+      order.map { |i| quality[i] },
+      order.map { |i| i < inlier_count } ]
+  end
+
+  # Gaussian noise of the given sigma, by Box-Muller; draws nothing
+  # when sigma is zero so exact data sets don't change
+  def jitter( sigma )
+    return 0.0 if sigma == 0
+    sigma * Math::sqrt( -2*Math::log( 1 - rand ) ) * Math::cos( 2*Math::PI*rand )
+  end
+
+  def transfer( h, x, y )
+    p = h * Vector[ x, y, 1.0 ]
+    [ p[0]/p[2], p[1]/p[2] ]
+  end
+
+  # The estimate maps the image corners to within a fraction of a pixel
+  # of where KNOWN_HOMOGRAPHY does
+  def assert_known_homography( h, message = nil )
+    [ [0,0], [640,0], [0,480], [640,480] ].each { |x, y|
+      expected, actual = transfer( KNOWN_HOMOGRAPHY, x, y ), transfer( h.model_matrix, x, y )
+      2.times { |k| assert_in_delta expected[k], actual[k], 0.5, message }
+    }
+  end
+
+  # Every planted inlier is marked, and hardly any outlier (a random
+  # point can land within the threshold by chance)
+  def assert_recovers_inliers( planted, mask, message = nil )
+    planted.zip( mask ).each_with_index { |(p, m), i|
+      assert m, "#{message} correspondence #{i} is an inlier" if p
+    }
+    assert planted.zip( mask ).count { |p, m| m && !p } <= 2, message
+  end
+
+  # Two views of a scene in which the first plane_count points lie on
+  # one plane, the rest at random depths, of which the last
+  # outlier_count are replaced in the second view by random points
+  def make_two_view( count, plane_count, outlier_count = 0 )
+    srand( 42 )
+    c, s = Math::cos( 0.15 ), Math::sin( 0.15 )
+    points1, points2 = [], []
+    count.times { |i|
+      x, y = (rand-0.5)*8, (rand-0.5)*6
+      z = i < plane_count ? 10 + 0.3*x : 6 + rand*10
+      x2, y2, z2 = c*x + s*z + 1.0, y + 0.2, -s*x + c*z + 0.1
+      points1 << [ 800*x/z + 320, 800*y/z + 240 ]
+      points2 << if i < count - outlier_count
+                   [ 800*x2/z2 + 320, 800*y2/z2 + 240 ]
+                 else
+                   [ rand*640, rand*480 ]
+                 end
+    }
+    [ Matrix.rows( points1 ).to_CvMat, Matrix.rows( points2 ).to_CvMat ]
+  end
+
+  def test_prosac_homography
+    points1, points2, quality, planted = make_correspondences( 300, 100 )
+
+    ransac = Calib3d::estimateHomography( points1, points2, method: :CV_RANSAC, max_iters: 5000,
+                                         seed: 1234 )
+    prosac = Calib3d::estimateHomography( points1, points2, method: :CV_PROSAC, max_iters: 5000,
+                                         quality: quality, seed: 1234 )
+
+    assert_not_nil ransac
+    assert_not_nil prosac
+    assert prosac.num_iters < ransac.num_iters, "PROSAC took #{prosac.num_iters} iterations, RANSAC #{ransac.num_iters}"
+    assert_known_homography prosac
+    assert_recovers_inliers planted, prosac.inlier_mask
+  end
+
+  # With noisy inliers, the best-ranked few all agreeing with a rough
+  # model mustn't stop PROSAC before it has found a good one
+  def test_prosac_noisy_homography
+    points1, points2, quality, planted = make_correspondences( 500, 250, 0.5 )
+
+    (1..8).each { |seed|
+      prosac = Calib3d::estimateHomography( points1, points2, method: :CV_PROSAC, max_iters: 5000,
+                                           quality: quality, seed: seed )
+      assert_not_nil prosac
+
+      found = planted.zip( prosac.inlier_mask ).count { |p, m| p && m }
+      assert found >= 0.95*250, "seed #{seed}: PROSAC found #{found} of 250 inliers in #{prosac.num_iters} iterations"
+      assert planted.zip( prosac.inlier_mask ).count { |p, m| m && !p } <= 2
+    }
+  end
+
+  def test_prosac_without_quality
+    points1, points2, _ = make_correspondences( 300, 150 )
+
+    prosac = Calib3d::estimateHomography( points1, points2, method: :CV_PROSAC, max_iters: 5000 )
+    assert_not_nil prosac
+    assert !prosac.max_iters?
+  end
+
+  def test_sprt_homography
+    points1, points2, quality, planted = make_correspondences( 2000, 1000 )
+
+    [ :CV_RANSAC, :CV_PROSAC ].each { |method|
+      h = Calib3d::estimateHomography( points1, points2, method: method, sprt: true,
+                                      max_iters: 5000, quality: quality, seed: 1234 )
+      assert_not_nil h, "#{method} with SPRT found no homography"
+      assert !h.max_iters?
+      assert_known_homography h, "#{method} with SPRT"
+      assert_recovers_inliers planted, h.inlier_mask, "#{method} with SPRT"
+    }
+
+    # Half the correspondences are outliers, so most of RANSAC's
+    # hypotheses are wrong and the test should drop some of them early
+    plain = Calib3d::estimateHomography( points1, points2, method: :CV_RANSAC, max_iters: 5000, seed: 1234 )
+    sprt = Calib3d::estimateHomography( points1, points2, method: :CV_RANSAC, sprt: true,
+                                       max_iters: 5000, seed: 1234 )
+    assert_equal 0, plain.num_rejected
+    assert sprt.num_rejected > 0, "SPRT rejected no hypotheses in #{sprt.num_iters} iterations"
+  end
+
+  def test_degensac_dominant_plane
+    points1, points2 = make_two_view( 200, 180 )
+
+    f = Calib3d::estimateFundamental( points1, points2, method: :CV_DEGENSAC,
+                                     outlier_threshold: 1, max_iters: 5000, seed: 1234 )
+    assert_not_nil f
+    assert !f.max_iters?
+
+    # A fit to the plane alone would leave out the points off it
+    mask = f.inlier_mask
+    (180...200).each { |i| assert mask[i], "off-plane point #{i} is an outlier" }
+  end
+
+  # Correspondences x1, y1, x2, y2 from two views of random points, and
+  # the fundamental matrices the 7- and 8-point kernels gave for them
+  # before they were moved onto fixed-size Eigen solvers
+  SEVEN_POINTS = [ [ 764.54, 567.40, 1059.38, 621.96 ],
+                   [ 121.13, 360.54, 303.35, 368.23 ],
+                   [ 410.08, 163.63, 600.50, 175.63 ],
+                   [ 410.13, 291.40, 638.90, 313.59 ],
+                   [ 286.46, 201.37, 466.48, 213.53 ],
+                   [ 596.78, 428.53, 809.68, 454.12 ],
+                   [ 264.50, 65.07, 507.69, 92.42 ] ]
+  SEVEN_POINT_F = [ [ 1.886932320853802e-06, 6.312576055607922e-06, -0.01211629144123259,
+                      -1.567602675799079e-05, -9.000145904426455e-09, 0.05426445356295854,
+                      0.01315402579004844, -0.05258502902400673, 1 ],
+                    [ -4.255347163367117e-05, 0.000103012692985465, -0.02245545503294068,
+                      -0.0001206599754134923, 7.919844578250201e-05, 0.0425895075917381,
+                      0.06473713442599936, -0.09027563128947017, 1 ],
+                    [ -0.0001242547008943644, 0.0002807905194630673, -0.04146343650480903,
+                      -0.0003136671691953712, 0.0002248169623372278, 0.02112576395932308,
+                      0.1595698319180741, -0.1595677227793516, 1 ] ]
+
+  EIGHT_POINTS = [ [ 376.38, 323.18, 556.08, 336.05 ],
+                   [ 506.01, 315.64, 690.63, 329.69 ],
+                   [ 124.69, 229.31, 298.93, 239.69 ],
+                   [ 453.68, 509.81, 692.16, 538.88 ],
+                   [ 302.69, 133.64, 492.25, 147.70 ],
+                   [ 377.94, -46.15, 597.51, -29.20 ],
+                   [ 216.66, 386.33, 394.80, 395.65 ],
+                   [ 25.11, 433.07, 259.72, 443.07 ],
+                   [ 444.91, -57.76, 702.87, -36.13 ],
+                   [ 611.48, 68.98, 854.41, 80.06 ],
+                   [ 667.18, 441.01, 911.12, 474.18 ],
+                   [ 551.13, 254.73, 750.76, 268.59 ] ]
+  EIGHT_POINT_F = [ 1.89160842246999e-06, 6.309477881510012e-06, -0.0121328958780884,
+                    -1.569909979293652e-05, -3.015554469740304e-10, 0.05434973897782946,
+                    0.01317533068474913, -0.05266591066539051, 1 ]
+
+  def kernel_points( rows )
+    [ Matrix.rows( rows.map { |r| r[0,2] } ).to_Mat( :type => :CV_64F ).to_CvMat,
+      Matrix.rows( rows.map { |r| r[2,2] } ).to_Mat( :type => :CV_64F ).to_CvMat ]
+  end
+
+  def max_difference( f, expected )
+    f.model_matrix.to_a.flatten.zip( expected ).map { |a, b| (a - b).abs }.max
+  end
+
+  def test_fundamental_kernels
+    fs = Calib3d::fundamentalKernel( *kernel_points( SEVEN_POINTS ) )
+    assert_equal SEVEN_POINT_F.length, fs.length
+
+    # The roots of the cubic may come out in any order
+    SEVEN_POINT_F.each { |expected|
+      assert fs.map { |f| max_difference( f, expected ) }.min < 1e-9, "7-point F #{expected} not found"
+    }
+
+    f = Calib3d::fundamentalKernel( *kernel_points( EIGHT_POINTS ) )
+    assert_not_nil f
+    assert max_difference( f, EIGHT_POINT_F ) < 1e-9, "8-point F differs by #{max_difference( f, EIGHT_POINT_F )}"
+  end
+
+  # [t]x R for the motion make_two_view applies to the second view
+  def known_essential
+    c, s = Math::cos( 0.15 ), Math::sin( 0.15 )
+    tx = Matrix.rows( [ [ 0.0, -0.1, 0.2 ],
+                        [ 0.1, 0.0, -1.0 ],
+                        [ -0.2, 1.0, 0.0 ] ] )
+    tx * Matrix.rows( [ [ c, 0.0, s ], [ 0.0, 1.0, 0.0 ], [ -s, 0.0, c ] ] )
+  end
+
+  # Largest element difference once both are scaled to unit norm,
+  # taking whichever sign of e fits better
+  def essential_difference( e, expected )
+    a, b = [ e.model_matrix, expected ].map { |m|
+      v = m.to_a.flatten
+      norm = Math::sqrt( v.inject(0) { |sum, x| sum + x*x } )
+      v.map { |x| x/norm }
+    }
+    [ 1, -1 ].map { |sign| a.zip( b ).map { |x, y| (sign*x - y).abs }.max }.min
+  end
+
+  def test_essential_five_point
+    points1, points2 = make_two_view( 200, 0, 100 )
+    camera = Matrix.rows( [ [ 800.0, 0.0, 320.0 ],
+                            [ 0.0, 800.0, 240.0 ],
+                            [ 0.0, 0.0, 1.0 ] ] )
+    params = { method: :CV_RANSAC, outlier_threshold: 1, seed: 1234, max_iters: 5000 }
+
+    e = Calib3d::estimateEssential( points1, points2, camera, params )
+    f = Calib3d::estimateFundamental( points1, points2, params )
+
+    assert_not_nil e
+    assert !e.max_iters?
+    assert e.num_iters < f.num_iters, "five-point took #{e.num_iters} iterations, seven-point #{f.num_iters}"
+    assert essential_difference( e, known_essential ) < 1e-3, "E differs by #{essential_difference( e, known_essential )}"
+
+    # The last 100 are the random outliers
+    assert_recovers_inliers Array.new( 200 ) { |i| i < 100 }, e.inlier_mask
+
+    # Five points give up to ten solutions, one of them the true E
+    points1, points2 = make_two_view( 5, 0 )
+    es = Calib3d::estimateEssential( points1, points2, camera )
+    assert_kind_of Array, es
+    assert es.map { |s| essential_difference( s, known_essential ) }.min < 1e-5, "true E not among the #{es.length} solutions"
+  end
+
+  def test_parallel_ransac_is_repeatable
+    points1, points2, _ = make_correspondences( 500, 150 )
+
+    params = { method: :CV_RANSAC, parallel: true, seed: 1234, max_iters: 5000 }
+    first = Calib3d::estimateHomography( points1, points2, params )
+    second = Calib3d::estimateHomography( points1, points2, params )
+
+    assert_not_nil first
+    assert_equal first.num_iters, second.num_iters
+    assert_equal first.model_matrix, second.model_matrix
+    assert_equal first.inlier_mask, second.inlier_mask
+  end
+
+  def test_workspace_is_reused
+    workspace = Calib3d::EstimatorWorkspace.new( 100 )
+
+    # The second set is larger than the workspace was made for
+    [ [ 100, 60 ], [ 300, 150 ], [ 100, 60 ] ].each { |count, inlier_count|
+      points1, points2, _ = make_correspondences( count, inlier_count )
+      params = { method: :CV_RANSAC, seed: 1234, max_iters: 5000 }
+
+      with_workspace = Calib3d::estimateHomography( points1, points2, params.merge( workspace: workspace ) )
+      without = Calib3d::estimateHomography( points1, points2, params )
+
+      assert_not_nil with_workspace
+      assert_equal without.num_iters, with_workspace.num_iters
+    }
+
+    workspace.release
+  end
+
+  def test_homography_batch
+    sets = [ [ 300, 100 ], [ 200, 150 ], [ 500, 200 ] ].map { |count, inlier_count|
+      make_correspondences( count, inlier_count )
+    }
+    pairs = sets.map { |points1, points2, _| [ points1, points2 ] }
+    params = { method: :CV_RANSAC, seed: 1234, max_iters: 5000 }
+
+    batch = Calib3d::estimateHomographyBatch( pairs, params )
+    assert_equal pairs.length, batch.length
+
+    # Each pair gives what it would alone, seeded with seed + its index
+    pairs.each_with_index { |(points1, points2), i|
+      single = Calib3d::estimateHomography( points1, points2, params.merge( seed: 1234 + i ) )
+      assert_not_nil batch[i]
+      assert_equal single.num_iters, batch[i].num_iters
+    }
+  end
+
+  def test_lo_ransac_homography
+    points1, points2, _, planted = make_correspondences( 300, 100 )
+
+    [ :CV_RANSAC, :CV_PROSAC ].each { |method|
+      params = { method: method, max_iters: 5000, seed: 1234 }
+      plain = Calib3d::estimateHomography( points1, points2, params )
+      h = Calib3d::estimateHomography( points1, points2, params.merge( local_optimization: true ) )
+
+      assert_not_nil h, "#{method} with LO found no homography"
+      assert !h.max_iters?
+      assert h.inlier_mask.count(true) >= plain.inlier_mask.count(true),
+             "#{method} with LO found fewer inliers than without"
+      assert_known_homography h, "#{method} with LO"
+      assert_recovers_inliers planted, h.inlier_mask, "#{method} with LO"
+    }
+  end
+
+end
@@ -32,6 +32,26 @@ class TestOpenSURF < Test::Unit::TestCase
     puts "After description #{descriptors.length} points"
  end
 
+  def test_openSurfMatch
+    img = TestSetup::test_image
+    params = OpenSURF::Params.new
+
+    surf = OpenSURF::detect( img, params )
+    surf = OpenSURF::describe( img, surf, params )
+
+    # Matching a set against itself, every point should find itself,
+    # with or without the Laplacian partition.
+    [true, false].each { |laplacian|
+      matches = OpenSURF::match( surf, surf, laplacian: laplacian )
+      assert_equal surf.length, matches.length
+
+      matches.each { |m|
+        assert_equal m.queryIdx, m.trainIdx
+        assert_in_delta 0.0, m.distance, 1e-6
+      }
+    }
+  end
+
   def test_openSurf_serialization
     img = TestSetup::test_image
     params = OpenSURF::Params.new
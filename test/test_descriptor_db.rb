@@ -0,0 +1,60 @@
+
+require 'test/setup'
+require 'opencv-ffi-wrappers'
+require 'opencv-ffi-ext'
+
+class TestDescriptorDB < Test::Unit::TestCase
+  include CVFFI
+
+  def setup
+    @dlength = 128
+    @num_descriptors = 50
+
+    @descriptors = Array.new( @num_descriptors ) { Array.new( @dlength ) { rand } }
+    @dmat = Mat.build( @num_descriptors, @dlength, {type: :CV_32F} ) { |i,j| @descriptors[i][j] }
+
+    @keypoints = Array.new( @num_descriptors ) { |i|
+      Features2D::CvKeyPoint.new( x: i, y: 2*i, kp_size: 1.5, angle: 0.5, response: 0.01, octave: i % 4 )
+    }
+
+    @filename = "/tmp/test_descriptor_db.bin"
+  end
+
+  def teardown
+    File.unlink @filename if File.exist? @filename
+  end
+
+  def test_write_and_open
+    assert DescriptorDB::write( @filename, @dmat, @keypoints )
+
+    DescriptorDB::open( @filename ) { |db|
+      assert_equal @num_descriptors, db.size
+
+      mat = db.descriptors
+      assert_equal @num_descriptors, mat.height
+      assert_equal @dlength, mat.width
+
+      @num_descriptors.times { |i|
+        @dlength.times { |j|
+          assert_in_delta @descriptors[i][j], CVFFI::cvGetReal2D( mat, i, j ), 1e-6
+        }
+        assert_equal @keypoints[i], db.keypoint(i)
+      }
+      assert_nil db.keypoint( @num_descriptors )
+
+      # The mapped descriptors can go straight into a matcher
+      results = Matcher::brute_force_matcher( @dmat, db.descriptors )
+      results.each { |r| assert_equal r.queryIdx, r.trainIdx }
+    }
+  end
+
+  def test_without_keypoints
+    assert DescriptorDB::write( @filename, @dmat )
+
+    DescriptorDB::open( @filename ) { |db|
+      assert_equal @num_descriptors, db.size
+      assert_nil db.keypoint(0)
+      assert_nil db.keypoints
+    }
+  end
+end
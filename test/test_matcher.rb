@@ -40,6 +40,311 @@ class TestMatcher < Test::Unit::TestCase
     }
   end
 
+  def test_brute_force_matcher_flat
+    [1,3].each { |k|
+      opts = { norm: :NORM_L2 }
+      opts.merge!( knn: k ) if k > 1
+
+      seq = Matcher::brute_force_matcher( @dmat_one, @dmat_two, opts.clone )
+      flat = Matcher::brute_force_matcher_flat( @dmat_one, @dmat_two, opts.clone )
+
+      assert_equal seq.length, flat.length
+      flat.each_with_index { |m,i|
+        assert_equal seq[i].queryIdx, m.queryIdx
+        assert_equal seq[i].trainIdx, m.trainIdx
+        assert_in_delta seq[i].distance, m.distance, 1e-6
+      }
+    }
+  end
+
+  def test_flann_based_matcher_flat_radius
+    results = Matcher::flann_based_matcher_flat( @dmat_one, @dmat_two, radius: 100.0 )
+
+    assert_equal @num_descriptors, results.length
+    results.each { |result|
+      assert_equal (result.queryIdx + result.trainIdx), (@num_descriptors-1)
+    }
+  end
+
+  def test_hamming_matcher
+    # Independent random descriptors, and slightly perturbed copies
+    # of them.  After binarization each copy should still be nearest
+    # to its original.
+    train = Array.new( 20 ) { Array.new( @dlength ) { rand } }
+    query = train.map { |d| d.map { |x| x + 0.001*rand } }
+
+    train_mat = Mat.build( train.length, @dlength, {type: :CV_32F} ) { |i,j| train[i][j] }
+    query_mat = Mat.build( query.length, @dlength, {type: :CV_32F} ) { |i,j| query[i][j] }
+
+    [ {}, {bits: 256} ].each { |opts|
+      binarizer = Matcher::Binarizer.new( train_mat, opts )
+      train_codes = binarizer.binarize( train_mat )
+      query_codes = binarizer.binarize( query_mat )
+
+      results = Matcher::hamming_matcher( query_codes, train_codes, knn: 2 )
+      assert_equal train.length*2, results.length
+
+      results.each { |result|
+        assert_equal result.queryIdx, result.trainIdx if result.rank == 0
+      }
+    }
+  end
+
+  def test_quantized_matcher
+    # SIFT-like descriptors (integers 0..255) and signed SURF-like ones
+    sift = Array.new( 20 ) { Array.new( @dlength ) { rand(256).to_f } }
+    surf = Array.new( 20 ) { Array.new( 64 ) { 2*rand - 1 } }
+
+    [ [sift, :uint8], [sift, :fp16], [surf, :int8], [surf, :fp16] ].each { |descriptors, format|
+      mat = Mat.build( descriptors.length, descriptors.first.length, {type: :CV_32F} ) { |i,j| descriptors[i][j] }
+
+      quantized, scale = Matcher::quantize( mat, format )
+      results = Matcher::quantized_matcher( quantized, quantized, knn: 2, scale: scale )
+      assert_equal descriptors.length*2, results.length
+
+      float_results = Matcher::brute_force_matcher( mat, mat, knn: 2 )
+
+      results.zip( float_results.to_a ).each { |r,f|
+        assert_equal r.queryIdx, r.trainIdx if r.rank == 0
+
+        # Distances should be close to those from the float descriptors
+        assert_in_delta f.distance, r.distance, 0.05*f.distance + 1e-3 if r.trainIdx == f.trainIdx
+      }
+    }
+  end
+
+  def test_quantized_matcher_separate_sets
+    # The train set's largest component is bigger than any query's, so
+    # each would get its own int8 scale;  the queries must reuse the
+    # train set's
+    train = Array.new( 20 ) { Array.new( 64 ) { 2*rand - 1 } }
+    train[19][0] = 1.5
+    order = (0...10).to_a.shuffle
+    query = order.map { |i| train[i].map { |x| x + 0.2*(2*rand - 1) } }
+
+    train_mat = Mat.build( train.length, 64, {type: :CV_32F} ) { |i,j| train[i][j] }
+    query_mat = Mat.build( query.length, 64, {type: :CV_32F} ) { |i,j| query[i][j] }
+
+    quantized_train, scale = Matcher::quantize( train_mat, :int8 )
+    quantized_query, query_scale = Matcher::quantize( query_mat, :int8, scale: scale )
+    assert_equal scale, query_scale
+
+    results = Matcher::quantized_matcher( quantized_query, quantized_train, scale: scale )
+    float_results = Matcher::brute_force_matcher( query_mat, train_mat )
+    assert_equal query.length, results.length
+
+    results.zip( float_results.to_a ).each { |r,f|
+      assert_equal order[r.queryIdx], r.trainIdx
+      assert_in_delta f.distance, r.distance, 0.05*f.distance
+    }
+  end
+
+  def test_guided_matcher
+    # Two "views" of the same random points, the second shifted by
+    # (10,0).  Descriptors are random, with matches slightly perturbed.
+    num = 100
+    points = Array.new( num ) { [ 640*rand, 480*rand ] }
+    train = Array.new( num ) { Array.new( @dlength ) { rand } }
+    query = train.map { |d| d.map { |x| x + 0.001*rand } }
+
+    query_points = Mat.build( num, 2, {type: :CV_32F} ) { |i,j| points[i][j] }
+    train_points = Mat.build( num, 2, {type: :CV_32F} ) { |i,j| points[i][j] + (j == 0 ? 10 : 0) }
+    query_mat = Mat.build( num, @dlength, {type: :CV_32F} ) { |i,j| query[i][j] }
+    train_mat = Mat.build( num, @dlength, {type: :CV_32F} ) { |i,j| train[i][j] }
+
+    # A horizontal shift:  epipolar lines are y' = y
+    f = [ [0.0, 0.0, 0.0], [0.0, 0.0, -1.0], [0.0, 1.0, 0.0] ]
+    h = [ [1.0, 0.0, 10.0], [0.0, 1.0, 0.0], [0.0, 0.0, 1.0] ]
+    f, h = [f, h].map { |m| Mat.build( 3, 3, {type: :CV_64F} ) { |i,j| m[i][j] } }
+
+    [ [f, :fundamental], [h, :homography] ].each { |model, type|
+      results = Matcher::guided_matcher( query_mat, query_points, train_mat, train_points, model,
+                                         model: type, tolerance: 2.0 )
+      assert_equal num, results.length
+      results.each { |r| assert_equal r.queryIdx, r.trainIdx }
+    }
+  end
+
+  def test_spatial_matcher
+    # Keypoints which all move by (5,-3) between frames.  Descriptors
+    # are deliberately all identical, so only the spatial prior can
+    # find the right match.
+    num = 50
+    points = Array.new( num ) { |i| [ 20.0*(i % 10), 20.0*(i / 10) ] }
+
+    query_points = Mat.build( num, 2, {type: :CV_32F} ) { |i,j| points[i][j] }
+    train_points = Mat.build( num, 2, {type: :CV_32F} ) { |i,j| points[i][j] + (j == 0 ? 5 : -3) }
+    query_mat = Mat.build( num, @dlength, {type: :CV_32F} ) { |i,j| 0.5 }
+    train_mat = Mat.build( num, @dlength, {type: :CV_32F} ) { |i,j| 0.5 }
+
+    results = Matcher::spatial_matcher( query_mat, query_points, train_mat, train_points,
+                                        radius: 2.0, motion: [5.0, -3.0] )
+    assert_equal num, results.length
+    results.each { |r| assert_equal r.queryIdx, r.trainIdx }
+
+    flat = Matcher::spatial_matcher_flat( query_mat, query_points, train_mat, train_points,
+                                          radius: 2.0, motion: [5.0, -3.0] )
+    assert_equal results.map { |r| r.to_a }, flat.to_a
+
+    # Without the motion prior, nothing is close enough
+    results = Matcher::spatial_matcher( query_mat, query_points, train_mat, train_points, radius: 2.0 )
+    assert_equal 0, results.length
+  end
+
+  def test_gms_filter
+    # 2000 matches consistent with a shift of (64,48) across a 640x480
+    # image, and 500 whose train keypoints are scattered at random.
+    num_good, num_bad = 2000, 500
+    num = num_good + num_bad
+    dim = 8
+
+    points = Array.new( num ) { [ 640*rand, 480*rand ] }
+    train_points = Array.new( num ) { |i| (i < num_good) ? [ points[i][0] + 64, points[i][1] + 48 ] : [ 640*rand, 480*rand ] }
+
+    descriptors = Array.new( num ) { Array.new( dim ) { rand } }
+    dmat = Mat.build( num, dim, {type: :CV_32F} ) { |i,j| descriptors[i][j] }
+    query_mat = Mat.build( num, 2, {type: :CV_32F} ) { |i,j| points[i][j] }
+    train_mat = Mat.build( num, 2, {type: :CV_32F} ) { |i,j| train_points[i][j] }
+
+    # Identical descriptors, so every match is i -> i
+    matches = Matcher::brute_force_matcher( dmat, dmat )
+    assert_equal num, matches.length
+
+    mask = Matcher::gms_filter( matches, query_mat, [640,480], train_mat, [640,480] )
+    assert_equal num, mask.length
+
+    good = bad = 0
+    matches.each_with_index { |m,i|
+      next unless mask[i]
+      (m.queryIdx < num_good) ? good += 1 : bad += 1
+    }
+
+    # Good matches which leave the image are lost, so not all are kept
+    assert good > 0.7*num_good, "Only kept #{good} of #{num_good} good matches"
+    assert bad < 0.05*num_bad, "Kept #{bad} of #{num_bad} bad matches"
+  end
+
+  def test_ivfpq_index
+    dim = 16
+    train = Array.new( 300 ) { Array.new( dim ) { rand } }
+    train_mat = Mat.build( train.length, dim, {type: :CV_32F} ) { |i,j| train[i][j] }
+
+    index = Matcher::IVFPQIndex.new( dim, nlist: 4, m: 4, nprobe: 4 )
+    index.train( train_mat )
+    assert_equal 0, index.add( train_mat )
+    assert_equal train.length, index.size
+
+    # The stored codes belong to the centroids they were added under
+    assert_raise( RuntimeError ) { index.train( train_mat ) }
+
+    # The quantization is lossy, but with every list probed each
+    # descriptor should almost always find itself.
+    results = index.search( train_mat, knn: 2 )
+    assert_equal train.length*2, results.length
+
+    found = results.select { |r| r.rank == 0 and r.queryIdx == r.trainIdx }.length
+    assert found >= 0.9*train.length, "Only #{found} of #{train.length} descriptors found themselves"
+
+    index.release
+  end
+
+  def test_hnsw_index
+    dim = 16
+    train = Array.new( 200 ) { Array.new( dim ) { rand } }
+    train_mat = Mat.build( train.length, dim, {type: :CV_32F} ) { |i,j| train[i][j] }
+
+    index = Matcher::HNSWIndex.new( dim, m: 8, ef_construction: 50 )
+    assert_equal 0, index.add( train_mat )
+    assert_equal train.length, index.size
+
+    results = index.search( train_mat, knn: 2 )
+    assert_equal train.length*2, results.length
+    results.each { |result|
+      assert_equal result.queryIdx, result.trainIdx if result.rank == 0
+    }
+
+    # Reload the graph and check it gives the same answers
+    filename = "/tmp/test_hnsw_index.bin"
+    assert index.save( filename )
+    reloaded = Matcher::HNSWIndex.load( filename )
+    assert_equal train.length, reloaded.size
+
+    reloaded_results = reloaded.search( train_mat, knn: 2 )
+    assert_equal results.map { |r| r.to_a }, reloaded_results.map { |r| r.to_a }
+
+    index.release
+    reloaded.release
+    File.unlink filename
+  end
+
+  def test_pair_matcher
+    images = Array.new( 4 ) { |n|
+      Mat.build( 10 + 5*n, @dlength, {type: :CV_32F} ) { |i,j| (10*i)+rand }
+    }
+
+    matcher = Matcher::PairMatcher.new
+    images.each_with_index { |img, i| assert_equal i, matcher.add( img ) }
+    assert_equal images.length, matcher.size
+
+    # All pairs should give the same matches as matching each pair alone
+    results = matcher.match( nil, knn: 2 )
+    assert_equal 6, results.length
+    results.each { |(q,t), matches|
+      assert q < t
+      expected = Matcher::brute_force_matcher( images[q], images[t], knn: 2 )
+      assert_equal expected.length, matches.length
+
+      matches.zip( expected.to_a ).each { |m,e|
+        assert_equal t, m.imgIdx
+        assert_equal e.queryIdx, m.queryIdx
+        assert_equal e.trainIdx, m.trainIdx
+        assert_in_delta e.distance, m.distance, 1e-3
+      }
+    }
+
+    # Listed pairs, in either direction, with the ratio test
+    results = matcher.match( [ [3,0], [1,2] ], ratio: 1.1 )
+    assert_equal [ [3,0], [1,2] ], results.keys
+    # Image 3 has more rows than image 0;  those past the end of image 0
+    # all match its last row, and may pass the ratio test
+    results[ [3,0] ].each { |m|
+      assert_equal m.queryIdx, m.trainIdx if m.queryIdx < images[0].height
+    }
+
+    matcher.release
+  end
+
+  def test_train_collection
+    # Each "keyframe" holds descriptors 10*i + small noise for its own
+    # range of i, so every query has exactly one close match.
+    frames = Array.new( 5 ) { |f|
+      Mat.build( 10, @dlength, {type: :CV_32F} ) { |i,j| 10*(10*f + i) + 0.1*rand }
+    }
+
+    collection = Matcher::TrainCollection.new( @dlength )
+    ids = frames.map { |frame| collection.add( frame ) }
+    assert_equal [0,1,2,3,4], ids
+    assert_equal 50, collection.descriptor_count
+
+    assert collection.remove( 1 )
+    assert !collection.remove( 1 )
+    assert_equal 4, collection.size
+    assert_equal 40, collection.descriptor_count
+
+    query = Mat.build( 50, @dlength, {type: :CV_32F} ) { |i,j| 10*i + 0.1*rand }
+    results = collection.match( query )
+
+    assert_equal 50, results.length
+    results.each { |r|
+      assert_not_equal 1, r.imgIdx
+
+      # Queries from the removed frame have no right answer
+      assert_equal r.queryIdx, 10*r.imgIdx + r.trainIdx unless r.queryIdx / 10 == 1
+    }
+
+    collection.release
+  end
+
   # TODO:  BruteForceRadius doesn't appear to be working...
   def test_brute_force_ratio_test
     [2.0].each { |ratio|
@@ -77,6 +382,26 @@ class TestMatcher < Test::Unit::TestCase
     }
   end
 
+  # Ratio and radius matching abandon L2 distances early;  they should
+  # agree with the full knn results.
+  def test_brute_force_early_abandon
+    [ :NORM_L2, :NORM_L2SQR ].each { |norm|
+      all = Matcher::brute_force_matcher( @dmat_one, @dmat_two, norm: norm, knn: @num_descriptors ).to_a
+
+      # Halfway between two distances, clear of rounding differences
+      distances = all.map { |m| m.distance }.sort
+      radius = 0.5 * (distances[ all.length / 4 ] + distances[ all.length / 4 + 1 ])
+      results = Matcher::brute_force_matcher( @dmat_one, @dmat_two, norm: norm, radius: radius )
+      expected = all.select { |m| m.distance <= radius }
+      assert_equal expected.map { |m| [m.queryIdx, m.trainIdx] }.sort,
+                   results.map { |m| [m.queryIdx, m.trainIdx] }.sort
+
+      results = Matcher::brute_force_matcher( @dmat_one, @dmat_two, norm: norm, knn: 2, ratio: 1.0 )
+      best = all.select { |m| m.rank == 0 }
+      assert_equal best.map { |m| [m.queryIdx, m.trainIdx] }, results.map { |m| [m.queryIdx, m.trainIdx] }
+    }
+  end
+
   # TODO:  Currently, the matching API is focused on matching image pairs, not on training...
   def test_flann_based_matcher_knn
     [1,3,5].each { |k|
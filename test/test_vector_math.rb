@@ -61,6 +61,50 @@ class TestVectorMath < Test::Unit::TestCase
     end
   end
 
+  def test_distance_metrics
+    a = Array.new( 37 ) { rand - 0.5 }
+    b = Array.new( 37 ) { rand - 0.5 }
+
+    l2 = a.zip(b).inject(0.0) { |x,(f,g)| x + (f-g)**2 }
+    l1 = a.zip(b).inject(0.0) { |x,(f,g)| x + (f-g).abs }
+    dot = a.zip(b).inject(0.0) { |x,(f,g)| x + f*g }
+    norms = Math::sqrt( a.inject(0.0) { |x,f| x + f*f } * b.inject(0.0) { |x,f| x + f*f } )
+
+    assert_in_delta l2, CVFFI::VectorMath::distance( a, b, metric: :l2sqr ), 1e-4
+    assert_in_delta l1, CVFFI::VectorMath::distance( a, b, metric: :l1 ), 1e-4
+    assert_in_delta dot, CVFFI::VectorMath::distance( a, b, metric: :dot ), 1e-4
+    assert_in_delta 1.0 - dot/norms, CVFFI::VectorMath::distance( a, b, metric: :cosine ), 1e-4
+
+    ua = Array.new( 100 ) { rand(256) }
+    ub = Array.new( 100 ) { rand(256) }
+    assert_equal ua.zip(ub).inject(0) { |x,(f,g)| x + (f-g)**2 },
+                 CVFFI::VectorMath::distance( ua, ub, metric: :l2sqr, type: :uint8 )
+    assert_equal ua.zip(ub).inject(0) { |x,(f,g)| x + (f^g).to_s(2).count("1") },
+                 CVFFI::VectorMath::distance( ua, ub, metric: :hamming, type: :uint8 )
+
+    sa = ua.map { |f| f - 128 }
+    sb = ub.map { |f| f - 128 }
+    assert_equal sa.zip(sb).inject(0) { |x,(f,g)| x + (f-g).abs },
+                 CVFFI::VectorMath::distance( sa, sb, metric: :l1, type: :int8 )
+    assert_equal sa.zip(sb).inject(0) { |x,(f,g)| x + f*g },
+                 CVFFI::VectorMath::distance( sa, sb, metric: :dot, type: :int8 )
+  end
+
+  def test_batch_distances
+    rows = Array.new( 70 ) { Array.new( 33 ) { rand(256) } }
+    queries = rows.first(5)
+
+    matrix = CVFFI::VectorMath::distance_matrix( queries, rows, metric: :l1, type: :uint8 )
+    assert_equal 5, matrix.length
+    queries.each_with_index { |q,i|
+      assert_equal CVFFI::VectorMath::distances( q, rows, metric: :l1, type: :uint8 ), matrix[i]
+      assert_equal 0.0, matrix[i][i]
+      assert_equal CVFFI::VectorMath::distance( q, rows[42], metric: :l1, type: :uint8 ), matrix[i][42]
+    }
+
+    puts "Vector kernels chosen for #{CVFFI::VectorMath::isa}"
+  end
+
   class NativeUint8
     include CVFFI::VectorMath::NativeVectors
 